@@ -29,6 +29,8 @@
 
 #include <glib.h>
 
+#include <string.h>
+
 #include <ilib.h>
 
 #include "channel.h"
@@ -36,16 +38,242 @@
 #include "server.h"
 #include "user.h"
 
+#define MAKI_CHANNEL_NICKS_HISTORY 1024
+
+struct maki_channel_nick
+{
+	makiUser* user;
+	gchar* nick;
+	gchar* key;
+	guint prefix;
+};
+
+typedef struct maki_channel_nick makiChannelNick;
+
+struct maki_channel_nick_delta
+{
+	guint64 version;
+	gboolean add;
+	gchar* nick;
+	gchar prefix;
+};
+
+typedef struct maki_channel_nick_delta makiChannelNickDelta;
+
 struct maki_channel
 {
 	makiServer* server;
 	gchar* name;
 	gboolean joined;
 	GHashTable* users;
-	GHashTable* user_prefixes;
 	gchar* topic;
+	iCaseMapping case_mapping;
+
+	/* Monotonic times used by the away tracker.
+	 * They are written from the D-Bus thread, too, so they are protected by nicks.mutex. */
+	struct
+	{
+		gint64 updated;
+		gint64 requested;
+		gint64 last_active;
+	}
+	away;
+
+	/* The nick list is kept sorted by prefix rank and case-folded nick.
+	 * Every change bumps the version and is recorded in the history, so that clients can catch up using deltas. */
+	struct
+	{
+		GSequence* list;
+		GHashTable* iters;
+		GQueue* history;
+		guint64 version;
+		guint64 base;
+		GMutex mutex[1];
+	}
+	nicks;
 };
 
+static
+makiChannelNick*
+maki_channel_nick_new (makiChannel* chan, makiUser* user, gchar const* nick)
+{
+	makiChannelNick* cnick;
+
+	cnick = g_new(makiChannelNick, 1);
+	cnick->user = user;
+	cnick->nick = g_strdup(nick);
+	cnick->key = i_case_mapping_fold(chan->case_mapping, nick);
+	cnick->prefix = 0;
+
+	return cnick;
+}
+
+static
+void
+maki_channel_nick_free (gpointer data)
+{
+	makiChannelNick* cnick = data;
+
+	g_free(cnick->nick);
+	g_free(cnick->key);
+	g_free(cnick);
+}
+
+static
+void
+maki_channel_nick_delta_free (gpointer data)
+{
+	makiChannelNickDelta* delta = data;
+
+	g_free(delta->nick);
+	g_free(delta);
+}
+
+/* Returns the position of the highest prefix, or G_MAXINT if there is none. */
+static
+gint
+maki_channel_nick_rank (makiChannelNick const* cnick)
+{
+	gint pos;
+
+	if ((pos = g_bit_nth_lsf(cnick->prefix, -1)) < 0)
+	{
+		pos = G_MAXINT;
+	}
+
+	return pos;
+}
+
+static
+gint
+maki_channel_nick_compare (gconstpointer a, gconstpointer b, gpointer data)
+{
+	makiChannelNick const* cnick_a = a;
+	makiChannelNick const* cnick_b = b;
+	gint rank_a;
+	gint rank_b;
+
+	rank_a = maki_channel_nick_rank(cnick_a);
+	rank_b = maki_channel_nick_rank(cnick_b);
+
+	if (rank_a != rank_b)
+	{
+		return (rank_a < rank_b) ? -1 : 1;
+	}
+
+	return strcmp(cnick_a->key, cnick_b->key);
+}
+
+static
+gchar
+maki_channel_nick_prefix (makiSupport* support, makiChannelNick const* cnick)
+{
+	gint rank;
+
+	rank = maki_channel_nick_rank(cnick);
+
+	if (rank == G_MAXINT)
+	{
+		return '\0';
+	}
+
+	return maki_support_prefix(support, rank);
+}
+
+/* Must be called with nicks.mutex held. */
+static
+void
+maki_channel_nicks_record (makiChannel* chan, makiChannelNick const* cnick, gboolean add)
+{
+	makiChannelNickDelta* delta;
+
+	chan->nicks.version++;
+
+	delta = g_new(makiChannelNickDelta, 1);
+	delta->version = chan->nicks.version;
+	delta->add = add;
+	delta->nick = g_strdup(cnick->nick);
+	delta->prefix = '\0';
+
+	if (add)
+	{
+		makiSupport* support;
+
+		support = maki_server_support(chan->server);
+		delta->prefix = maki_channel_nick_prefix(support, cnick);
+		maki_server_support_unref(chan->server, support);
+	}
+
+	g_queue_push_tail(chan->nicks.history, delta);
+
+	while (g_queue_get_length(chan->nicks.history) > MAKI_CHANNEL_NICKS_HISTORY)
+	{
+		delta = g_queue_pop_head(chan->nicks.history);
+		chan->nicks.base = delta->version;
+		maki_channel_nick_delta_free(delta);
+	}
+}
+
+/* Must be called with nicks.mutex held. */
+static
+void
+maki_channel_nicks_reset (makiChannel* chan)
+{
+	GQueue* history = chan->nicks.history;
+	gpointer delta;
+
+	while ((delta = g_queue_pop_head(history)) != NULL)
+	{
+		maki_channel_nick_delta_free(delta);
+	}
+
+	g_hash_table_remove_all(chan->nicks.iters);
+
+	if (g_sequence_get_length(chan->nicks.list) > 0)
+	{
+		g_sequence_remove_range(g_sequence_get_begin_iter(chan->nicks.list), g_sequence_get_end_iter(chan->nicks.list));
+	}
+
+	chan->nicks.version++;
+	chan->nicks.base = chan->nicks.version;
+}
+
+static
+void
+maki_channel_nicks_update_prefix (makiChannel* chan, makiUser* user, guint prefix)
+{
+	GSequenceIter* iter;
+
+	g_mutex_lock(chan->nicks.mutex);
+
+	if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) != NULL)
+	{
+		makiChannelNick* cnick = g_sequence_get(iter);
+
+		if (cnick->prefix != prefix)
+		{
+			gchar old_prefix;
+			gchar new_prefix;
+			makiSupport* support;
+
+			support = maki_server_support(chan->server);
+			old_prefix = maki_channel_nick_prefix(support, cnick);
+			cnick->prefix = prefix;
+			new_prefix = maki_channel_nick_prefix(support, cnick);
+			maki_server_support_unref(chan->server, support);
+
+			g_sequence_sort_changed(iter, maki_channel_nick_compare, NULL);
+
+			if (new_prefix != old_prefix)
+			{
+				maki_channel_nicks_record(chan, cnick, TRUE);
+			}
+		}
+	}
+
+	g_mutex_unlock(chan->nicks.mutex);
+}
+
 static
 void
 maki_channel_set_defaults (makiChannel* chan)
@@ -74,10 +302,13 @@ maki_channel_remove_users (makiChannel* chan)
 	{
 		makiUser* user = value;
 
-		maki_server_remove_user(chan->server, maki_user_nick(user));
+		maki_server_remove_user(chan->server, user);
 	}
 
-	g_hash_table_remove_all(chan->user_prefixes);
+	g_mutex_lock(chan->nicks.mutex);
+	maki_channel_nicks_reset(chan);
+	g_mutex_unlock(chan->nicks.mutex);
+
 	g_hash_table_remove_all(chan->users);
 }
 
@@ -91,10 +322,22 @@ maki_channel_new (makiServer* serv, gchar const* name)
 	chan->server = serv;
 	chan->name = g_strdup(name);
 	chan->joined = FALSE;
-	chan->users = g_hash_table_new_full(i_ascii_str_case_hash, i_ascii_str_case_equal, g_free, NULL);
-	chan->user_prefixes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+	chan->case_mapping = maki_server_case_mapping(serv);
+	chan->users = g_hash_table_new_full(i_case_mapping_hash_func(chan->case_mapping), i_case_mapping_equal_func(chan->case_mapping), g_free, NULL);
 	chan->topic = NULL;
 
+	chan->away.updated = 0;
+	chan->away.requested = 0;
+	chan->away.last_active = 0;
+
+	chan->nicks.list = g_sequence_new(maki_channel_nick_free);
+	chan->nicks.iters = g_hash_table_new(g_direct_hash, g_direct_equal);
+	chan->nicks.history = g_queue_new();
+	/* Start at the current time, so that versions from an earlier incarnation of this channel are never mistaken for current ones. */
+	chan->nicks.version = g_get_real_time();
+	chan->nicks.base = chan->nicks.version;
+	g_mutex_init(chan->nicks.mutex);
+
 	maki_channel_set_defaults(chan);
 
 	return chan;
@@ -108,7 +351,11 @@ maki_channel_free (gpointer data)
 
 	maki_channel_remove_users(chan);
 
-	g_hash_table_destroy(chan->user_prefixes);
+	g_mutex_clear(chan->nicks.mutex);
+	g_queue_free(chan->nicks.history);
+	g_hash_table_destroy(chan->nicks.iters);
+	g_sequence_free(chan->nicks.list);
+
 	g_hash_table_destroy(chan->users);
 
 	g_free(chan->topic);
@@ -117,6 +364,172 @@ maki_channel_free (gpointer data)
 	g_free(chan);
 }
 
+/* Must be called with nicks.mutex held.
+ * Hands the nick list entry of user over to survivor, or drops it if survivor already has one. */
+static
+void
+maki_channel_nicks_replace_user (makiChannel* chan, makiUser* user, makiUser* survivor)
+{
+	GSequenceIter* iter;
+	makiChannelNick* cnick;
+
+	if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) == NULL)
+	{
+		return;
+	}
+
+	g_hash_table_remove(chan->nicks.iters, user);
+
+	if (g_hash_table_lookup(chan->nicks.iters, survivor) != NULL)
+	{
+		g_sequence_remove(iter);
+		return;
+	}
+
+	cnick = g_sequence_get(iter);
+	cnick->user = survivor;
+	g_free(cnick->nick);
+	cnick->nick = g_strdup(maki_user_nick(survivor));
+
+	g_hash_table_insert(chan->nicks.iters, survivor, iter);
+}
+
+/* Must be called with nicks.mutex held.
+ * Re-sorts the nick list, clients have to fetch a new snapshot afterwards. */
+static
+void
+maki_channel_nicks_resort (makiChannel* chan)
+{
+	GSequenceIter* iter;
+	gpointer delta;
+
+	for (iter = g_sequence_get_begin_iter(chan->nicks.list); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
+	{
+		makiChannelNick* cnick = g_sequence_get(iter);
+
+		g_free(cnick->key);
+		cnick->key = i_case_mapping_fold(chan->case_mapping, cnick->nick);
+	}
+
+	g_sequence_sort(chan->nicks.list, maki_channel_nick_compare, NULL);
+
+	while ((delta = g_queue_pop_head(chan->nicks.history)) != NULL)
+	{
+		maki_channel_nick_delta_free(delta);
+	}
+
+	chan->nicks.version++;
+	chan->nicks.base = chan->nicks.version;
+}
+
+/* This function gets called by the server when its casemapping changes.
+ * merged maps users that collided under the new casemapping to the users replacing them.
+ * Has to be called with the server's users locked. */
+void
+maki_channel_set_case_mapping (makiChannel* chan, iCaseMapping case_mapping, GHashTable* merged)
+{
+	GHashTable* users;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (chan->case_mapping == case_mapping)
+	{
+		return;
+	}
+
+	chan->case_mapping = case_mapping;
+
+	users = g_hash_table_new_full(i_case_mapping_hash_func(case_mapping), i_case_mapping_equal_func(case_mapping), g_free, NULL);
+	g_hash_table_iter_init(&iter, chan->users);
+
+	g_mutex_lock(chan->nicks.mutex);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		makiUser* user = value;
+		makiUser* survivor;
+
+		g_hash_table_iter_steal(&iter);
+
+		if ((survivor = g_hash_table_lookup(merged, user)) != NULL)
+		{
+			maki_user_ref(survivor);
+			maki_channel_nicks_replace_user(chan, user, survivor);
+			maki_user_unref(user);
+
+			g_free(key);
+			key = g_strdup(maki_user_nick(survivor));
+			user = survivor;
+		}
+
+		if (g_hash_table_lookup(users, key) != NULL)
+		{
+			/* Both nicks refer to the same user now. */
+			g_free(key);
+			maki_user_unref(user);
+			continue;
+		}
+
+		g_hash_table_insert(users, key, user);
+	}
+
+	maki_channel_nicks_resort(chan);
+
+	g_mutex_unlock(chan->nicks.mutex);
+
+	g_hash_table_destroy(chan->users);
+	chan->users = users;
+}
+
+/* This function gets called by the server when two channels collide under a new casemapping.
+ * Moves the users of other into chan, other is left empty and has to be freed by the caller.
+ * Has to be called with the server's users locked. */
+void
+maki_channel_merge (makiChannel* chan, makiChannel* other)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_mutex_lock(chan->nicks.mutex);
+	g_mutex_lock(other->nicks.mutex);
+
+	g_hash_table_iter_init(&iter, other->users);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		makiUser* user = value;
+		GSequenceIter* siter;
+
+		g_hash_table_iter_steal(&iter);
+
+		if (g_hash_table_lookup(chan->users, key) != NULL)
+		{
+			g_free(key);
+			maki_user_unref(user);
+			continue;
+		}
+
+		g_hash_table_insert(chan->users, key, user);
+
+		if ((siter = g_hash_table_lookup(other->nicks.iters, user)) != NULL)
+		{
+			makiChannelNick* cnick;
+
+			cnick = maki_channel_nick_new(chan, user, maki_user_nick(user));
+			cnick->prefix = ((makiChannelNick*)g_sequence_get(siter))->prefix;
+			g_hash_table_insert(chan->nicks.iters, user, g_sequence_append(chan->nicks.list, cnick));
+		}
+	}
+
+	maki_channel_nicks_reset(other);
+	maki_channel_nicks_resort(chan);
+
+	g_mutex_unlock(other->nicks.mutex);
+	g_mutex_unlock(chan->nicks.mutex);
+
+	chan->joined = (chan->joined || other->joined);
+}
+
 gboolean
 maki_channel_autojoin (makiChannel* chan)
 {
@@ -141,11 +554,77 @@ maki_channel_set_joined (makiChannel* chan, gboolean joined)
 	if (chan->joined != joined)
 	{
 		maki_channel_remove_users(chan);
+
+		g_mutex_lock(chan->nicks.mutex);
+		chan->away.updated = 0;
+		chan->away.requested = 0;
+		g_mutex_unlock(chan->nicks.mutex);
 	}
 
 	chan->joined = joined;
 }
 
+gint64
+maki_channel_away_updated (makiChannel* chan)
+{
+	gint64 updated;
+
+	g_mutex_lock(chan->nicks.mutex);
+	updated = chan->away.updated;
+	g_mutex_unlock(chan->nicks.mutex);
+
+	return updated;
+}
+
+void
+maki_channel_set_away_updated (makiChannel* chan, gint64 updated)
+{
+	g_mutex_lock(chan->nicks.mutex);
+	chan->away.updated = updated;
+	g_mutex_unlock(chan->nicks.mutex);
+}
+
+gint64
+maki_channel_away_requested (makiChannel* chan)
+{
+	gint64 requested;
+
+	g_mutex_lock(chan->nicks.mutex);
+	requested = chan->away.requested;
+	g_mutex_unlock(chan->nicks.mutex);
+
+	return requested;
+}
+
+void
+maki_channel_set_away_requested (makiChannel* chan, gint64 requested)
+{
+	g_mutex_lock(chan->nicks.mutex);
+	chan->away.requested = requested;
+	g_mutex_unlock(chan->nicks.mutex);
+}
+
+gint64
+maki_channel_last_active (makiChannel* chan)
+{
+	gint64 last_active;
+
+	g_mutex_lock(chan->nicks.mutex);
+	last_active = chan->away.last_active;
+	g_mutex_unlock(chan->nicks.mutex);
+
+	return last_active;
+}
+
+/* This function gets called when a client uses the channel, so that its away state is refreshed more often. */
+void
+maki_channel_set_last_active (makiChannel* chan, gint64 last_active)
+{
+	g_mutex_lock(chan->nicks.mutex);
+	chan->away.last_active = last_active;
+	g_mutex_unlock(chan->nicks.mutex);
+}
+
 gchar*
 maki_channel_key (makiChannel* chan)
 {
@@ -175,10 +654,28 @@ makiUser*
 maki_channel_add_user (makiChannel* chan, gchar const* name)
 {
 	makiUser* user;
+	makiChannelNick* cnick;
+	GSequenceIter* iter;
 
 	user = maki_server_add_user(chan->server, name);
 	g_hash_table_insert(chan->users, g_strdup(maki_user_nick(user)), user);
-	g_hash_table_insert(chan->user_prefixes, user, GUINT_TO_POINTER(0));
+
+	g_mutex_lock(chan->nicks.mutex);
+
+	if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) != NULL)
+	{
+		/* The user is already known, NAMES replies may list it again. */
+		maki_server_remove_user(chan->server, user);
+	}
+	else
+	{
+		cnick = maki_channel_nick_new(chan, user, maki_user_nick(user));
+		iter = g_sequence_insert_sorted(chan->nicks.list, cnick, maki_channel_nick_compare, NULL);
+		g_hash_table_insert(chan->nicks.iters, user, iter);
+		maki_channel_nicks_record(chan, cnick, TRUE);
+	}
+
+	g_mutex_unlock(chan->nicks.mutex);
 
 	return user;
 }
@@ -196,8 +693,29 @@ maki_channel_rename_user (makiChannel* chan, gchar const* old_nick, gchar const*
 
 	if ((user = g_hash_table_lookup(chan->users, old_nick)) != NULL)
 	{
+		GSequenceIter* iter;
+
 		g_hash_table_insert(chan->users, g_strdup(new_nick), user);
 		g_hash_table_remove(chan->users, old_nick);
+
+		g_mutex_lock(chan->nicks.mutex);
+
+		if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) != NULL)
+		{
+			makiChannelNick* cnick = g_sequence_get(iter);
+
+			maki_channel_nicks_record(chan, cnick, FALSE);
+
+			g_free(cnick->nick);
+			g_free(cnick->key);
+			cnick->nick = g_strdup(new_nick);
+			cnick->key = i_case_mapping_fold(chan->case_mapping, new_nick);
+			g_sequence_sort_changed(iter, maki_channel_nick_compare, NULL);
+
+			maki_channel_nicks_record(chan, cnick, TRUE);
+		}
+
+		g_mutex_unlock(chan->nicks.mutex);
 	}
 
 	return user;
@@ -210,9 +728,21 @@ maki_channel_remove_user (makiChannel* chan, gchar const* name)
 
 	if ((user = g_hash_table_lookup(chan->users, name)) != NULL)
 	{
-		g_hash_table_remove(chan->user_prefixes, user);
+		GSequenceIter* iter;
+
+		g_mutex_lock(chan->nicks.mutex);
+
+		if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) != NULL)
+		{
+			maki_channel_nicks_record(chan, g_sequence_get(iter), FALSE);
+			g_hash_table_remove(chan->nicks.iters, user);
+			g_sequence_remove(iter);
+		}
+
+		g_mutex_unlock(chan->nicks.mutex);
+
 		g_hash_table_remove(chan->users, name);
-		maki_server_remove_user(chan->server, maki_user_nick(user));
+		maki_server_remove_user(chan->server, user);
 	}
 }
 
@@ -231,48 +761,160 @@ maki_channel_users_iter (makiChannel* chan, GHashTableIter* iter)
 gboolean
 maki_channel_get_user_prefix (makiChannel* chan, makiUser* user, guint pos)
 {
-	gpointer v;
+	GSequenceIter* iter;
 	guint prefix = 0;
 
-	if (g_hash_table_lookup_extended(chan->user_prefixes, user, NULL, &v))
+	g_mutex_lock(chan->nicks.mutex);
+
+	if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) != NULL)
 	{
-		prefix = GPOINTER_TO_UINT(v);
+		makiChannelNick* cnick = g_sequence_get(iter);
+
+		prefix = cnick->prefix;
 	}
 
+	g_mutex_unlock(chan->nicks.mutex);
+
 	return (prefix & (1 << pos));
 }
 
 void
 maki_channel_set_user_prefix (makiChannel* chan, makiUser* user, guint pos, gboolean set)
 {
-	gpointer v;
+	GSequenceIter* iter;
+	guint prefix;
+
+	g_mutex_lock(chan->nicks.mutex);
 
-	if (g_hash_table_lookup_extended(chan->user_prefixes, user, NULL, &v))
+	if ((iter = g_hash_table_lookup(chan->nicks.iters, user)) == NULL)
 	{
-		guint prefix;
+		g_mutex_unlock(chan->nicks.mutex);
+		return;
+	}
 
-		prefix = GPOINTER_TO_UINT(v);
+	prefix = ((makiChannelNick*)g_sequence_get(iter))->prefix;
 
-		if (set)
-		{
-			prefix |= (1 << pos);
-		}
-		else
-		{
-			prefix &= ~(1 << pos);
-		}
+	g_mutex_unlock(chan->nicks.mutex);
 
-		g_hash_table_insert(chan->user_prefixes, user, GUINT_TO_POINTER(prefix));
+	if (set)
+	{
+		prefix |= (1 << pos);
 	}
+	else
+	{
+		prefix &= ~(1 << pos);
+	}
+
+	maki_channel_nicks_update_prefix(chan, user, prefix);
 }
 
 void
 maki_channel_set_user_prefix_override (makiChannel* chan, makiUser* user, guint prefix)
 {
-	gpointer v;
+	maki_channel_nicks_update_prefix(chan, user, prefix);
+}
 
-	if (g_hash_table_lookup_extended(chan->user_prefixes, user, NULL, &v))
+/* Returns a snapshot of the sorted nick list and the version it corresponds to. */
+void
+maki_channel_nicks (makiChannel* chan, gchar*** nicks, gchar*** prefixes, guint64* version)
+{
+	GSequenceIter* iter;
+	gchar** nick;
+	gchar** prefix;
+	makiSupport* support;
+
+	support = maki_server_support(chan->server);
+
+	g_mutex_lock(chan->nicks.mutex);
+
+	nick = *nicks = g_new(gchar*, g_sequence_get_length(chan->nicks.list) + 1);
+	prefix = *prefixes = g_new(gchar*, g_sequence_get_length(chan->nicks.list) + 1);
+
+	for (iter = g_sequence_get_begin_iter(chan->nicks.list); !g_sequence_iter_is_end(iter); iter = g_sequence_iter_next(iter))
+	{
+		makiChannelNick* cnick = g_sequence_get(iter);
+		gchar prefix_str[2];
+
+		prefix_str[0] = maki_channel_nick_prefix(support, cnick);
+		prefix_str[1] = '\0';
+
+		*nick = g_strdup(cnick->nick);
+		nick++;
+		*prefix = g_strdup(prefix_str);
+		prefix++;
+	}
+
+	*nick = NULL;
+	*prefix = NULL;
+
+	*version = chan->nicks.version;
+
+	g_mutex_unlock(chan->nicks.mutex);
+
+	maki_server_support_unref(chan->server, support);
+}
+
+/* Returns the changes since the given version.
+ * Each operation is either "+" (nick was added or its prefix changed) or "-" (nick was removed).
+ * If the version is no longer covered by the history, FALSE is returned and a snapshot has to be used instead. */
+gboolean
+maki_channel_nicks_delta (makiChannel* chan, guint64 since, gchar*** operations, gchar*** nicks, gchar*** prefixes, guint64* version)
+{
+	GList* list;
+	gchar** operation;
+	gchar** nick;
+	gchar** prefix;
+	guint length = 0;
+
+	g_mutex_lock(chan->nicks.mutex);
+
+	if (since < chan->nicks.base || since > chan->nicks.version)
+	{
+		g_mutex_unlock(chan->nicks.mutex);
+		return FALSE;
+	}
+
+	for (list = g_queue_peek_tail_link(chan->nicks.history); list != NULL; list = list->prev)
+	{
+		makiChannelNickDelta* delta = list->data;
+
+		if (delta->version <= since)
+		{
+			break;
+		}
+
+		length++;
+	}
+
+	list = (list != NULL) ? list->next : g_queue_peek_head_link(chan->nicks.history);
+
+	operation = *operations = g_new(gchar*, length + 1);
+	nick = *nicks = g_new(gchar*, length + 1);
+	prefix = *prefixes = g_new(gchar*, length + 1);
+
+	for (; list != NULL; list = list->next)
 	{
-		g_hash_table_insert(chan->user_prefixes, user, GUINT_TO_POINTER(prefix));
+		makiChannelNickDelta* delta = list->data;
+		gchar prefix_str[2];
+
+		prefix_str[0] = delta->prefix;
+		prefix_str[1] = '\0';
+
+		*operation = g_strdup((delta->add) ? "+" : "-");
+		operation++;
+		*nick = g_strdup(delta->nick);
+		nick++;
+		*prefix = g_strdup(prefix_str);
+		prefix++;
 	}
+
+	*operation = NULL;
+	*nick = NULL;
+	*prefix = NULL;
+
+	*version = chan->nicks.version;
+
+	g_mutex_unlock(chan->nicks.mutex);
+
+	return TRUE;
 }
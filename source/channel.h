@@ -34,18 +34,30 @@ typedef struct maki_channel makiChannel;
 
 #include <glib.h>
 
+#include <ilib.h>
+
 #include "server.h"
 #include "user.h"
 
 makiChannel* maki_channel_new (makiServer*, gchar const*);
 void maki_channel_free (gpointer);
 
+void maki_channel_set_case_mapping (makiChannel*, iCaseMapping, GHashTable*);
+void maki_channel_merge (makiChannel*, makiChannel*);
+
 gboolean maki_channel_autojoin (makiChannel*);
 void maki_channel_set_autojoin (makiChannel*, gboolean);
 
 gboolean maki_channel_joined (makiChannel*);
 void maki_channel_set_joined (makiChannel*, gboolean);
 
+gint64 maki_channel_away_updated (makiChannel*);
+void maki_channel_set_away_updated (makiChannel*, gint64);
+gint64 maki_channel_away_requested (makiChannel*);
+void maki_channel_set_away_requested (makiChannel*, gint64);
+gint64 maki_channel_last_active (makiChannel*);
+void maki_channel_set_last_active (makiChannel*, gint64);
+
 gchar* maki_channel_key (makiChannel*);
 void maki_channel_set_key (makiChannel*, gchar const*);
 
@@ -63,4 +75,7 @@ gboolean maki_channel_get_user_prefix (makiChannel*, makiUser*, guint);
 void maki_channel_set_user_prefix (makiChannel*, makiUser*, guint, gboolean);
 void maki_channel_set_user_prefix_override (makiChannel*, makiUser*, guint);
 
+void maki_channel_nicks (makiChannel*, gchar***, gchar***, guint64*);
+gboolean maki_channel_nicks_delta (makiChannel*, guint64, gchar***, gchar***, gchar***, guint64*);
+
 #endif
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "checksum.h"
+
+/* An incremental SHA-256.
+ * Unlike GChecksum, its state can be saved and restored, so that long transfers can continue hashing after a restart. */
+struct maki_checksum
+{
+	guint32 hash[8];
+	/* Number of bytes hashed so far. */
+	guint64 length;
+	/* Bytes that do not fill a whole block yet, there are length % 64 of them. */
+	guchar block[64];
+};
+
+static guint32 const maki_checksum_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static guint32 const maki_checksum_initial[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define MAKI_CHECKSUM_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static
+void
+maki_checksum_transform (guint32* hash, guchar const* block)
+{
+	guint i;
+	guint32 w[64];
+	guint32 a, b, c, d, e, f, g, h;
+
+	for (i = 0; i < 16; i++)
+	{
+		w[i] = ((guint32)block[i * 4] << 24) | ((guint32)block[i * 4 + 1] << 16) | ((guint32)block[i * 4 + 2] << 8) | (guint32)block[i * 4 + 3];
+	}
+
+	for (i = 16; i < 64; i++)
+	{
+		guint32 s0;
+		guint32 s1;
+
+		s0 = MAKI_CHECKSUM_ROTR(w[i - 15], 7) ^ MAKI_CHECKSUM_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		s1 = MAKI_CHECKSUM_ROTR(w[i - 2], 17) ^ MAKI_CHECKSUM_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	a = hash[0];
+	b = hash[1];
+	c = hash[2];
+	d = hash[3];
+	e = hash[4];
+	f = hash[5];
+	g = hash[6];
+	h = hash[7];
+
+	for (i = 0; i < 64; i++)
+	{
+		guint32 t1;
+		guint32 t2;
+
+		t1 = h + (MAKI_CHECKSUM_ROTR(e, 6) ^ MAKI_CHECKSUM_ROTR(e, 11) ^ MAKI_CHECKSUM_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + maki_checksum_k[i] + w[i];
+		t2 = (MAKI_CHECKSUM_ROTR(a, 2) ^ MAKI_CHECKSUM_ROTR(a, 13) ^ MAKI_CHECKSUM_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	hash[0] += a;
+	hash[1] += b;
+	hash[2] += c;
+	hash[3] += d;
+	hash[4] += e;
+	hash[5] += f;
+	hash[6] += g;
+	hash[7] += h;
+}
+
+static
+gchar*
+maki_checksum_hex (guchar const* data, gsize length)
+{
+	gsize i;
+	gchar* hex;
+	static gchar const digits[] = "0123456789abcdef";
+
+	hex = g_malloc(length * 2 + 1);
+
+	for (i = 0; i < length; i++)
+	{
+		hex[i * 2] = digits[data[i] >> 4];
+		hex[i * 2 + 1] = digits[data[i] & 0xf];
+	}
+
+	hex[length * 2] = '\0';
+
+	return hex;
+}
+
+static
+gboolean
+maki_checksum_unhex (gchar const* hex, guchar* data, gsize length)
+{
+	gsize i;
+
+	for (i = 0; i < length; i++)
+	{
+		gint high;
+		gint low;
+
+		if ((high = g_ascii_xdigit_value(hex[i * 2])) < 0 || (low = g_ascii_xdigit_value(hex[i * 2 + 1])) < 0)
+		{
+			return FALSE;
+		}
+
+		data[i] = (high << 4) | low;
+	}
+
+	return TRUE;
+}
+
+makiChecksum*
+maki_checksum_new (void)
+{
+	makiChecksum* checksum;
+
+	checksum = g_new(makiChecksum, 1);
+	memcpy(checksum->hash, maki_checksum_initial, sizeof(checksum->hash));
+	checksum->length = 0;
+
+	return checksum;
+}
+
+/* Restores a state returned by maki_checksum_get_state(), returns NULL if it is malformed. */
+makiChecksum*
+maki_checksum_new_from_state (gchar const* state)
+{
+	guint i;
+	gsize rest;
+	gchar* end;
+	guchar hash[32];
+	makiChecksum* checksum;
+
+	g_return_val_if_fail(state != NULL, NULL);
+
+	checksum = maki_checksum_new();
+	checksum->length = g_ascii_strtoull(state, &end, 10);
+	rest = checksum->length % 64;
+
+	if (end == state || *end != ':' || strlen(end + 1) != 64 + 1 + rest * 2 || end[1 + 64] != ':')
+	{
+		goto error;
+	}
+
+	if (!maki_checksum_unhex(end + 1, hash, 32) || !maki_checksum_unhex(end + 1 + 64 + 1, checksum->block, rest))
+	{
+		goto error;
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		checksum->hash[i] = ((guint32)hash[i * 4] << 24) | ((guint32)hash[i * 4 + 1] << 16) | ((guint32)hash[i * 4 + 2] << 8) | (guint32)hash[i * 4 + 3];
+	}
+
+	return checksum;
+
+error:
+	maki_checksum_free(checksum);
+
+	return NULL;
+}
+
+void
+maki_checksum_free (makiChecksum* checksum)
+{
+	g_return_if_fail(checksum != NULL);
+
+	g_free(checksum);
+}
+
+void
+maki_checksum_update (makiChecksum* checksum, guchar const* data, gsize length)
+{
+	gsize rest;
+
+	g_return_if_fail(checksum != NULL);
+
+	rest = checksum->length % 64;
+	checksum->length += length;
+
+	if (rest > 0)
+	{
+		gsize fill;
+
+		fill = MIN(64 - rest, length);
+		memcpy(checksum->block + rest, data, fill);
+
+		data += fill;
+		length -= fill;
+
+		if (rest + fill < 64)
+		{
+			return;
+		}
+
+		maki_checksum_transform(checksum->hash, checksum->block);
+	}
+
+	while (length >= 64)
+	{
+		maki_checksum_transform(checksum->hash, data);
+
+		data += 64;
+		length -= 64;
+	}
+
+	memcpy(checksum->block, data, length);
+}
+
+guint64
+maki_checksum_length (makiChecksum* checksum)
+{
+	g_return_val_if_fail(checksum != NULL, 0);
+
+	return checksum->length;
+}
+
+/* Returns the state as length:hash:block, with hash and block in hex. */
+gchar*
+maki_checksum_get_state (makiChecksum* checksum)
+{
+	guint i;
+	guchar hash[32];
+	gchar* hash_hex;
+	gchar* block_hex;
+	gchar* state;
+
+	g_return_val_if_fail(checksum != NULL, NULL);
+
+	for (i = 0; i < 8; i++)
+	{
+		hash[i * 4] = checksum->hash[i] >> 24;
+		hash[i * 4 + 1] = checksum->hash[i] >> 16;
+		hash[i * 4 + 2] = checksum->hash[i] >> 8;
+		hash[i * 4 + 3] = checksum->hash[i];
+	}
+
+	hash_hex = maki_checksum_hex(hash, 32);
+	block_hex = maki_checksum_hex(checksum->block, checksum->length % 64);
+	state = g_strdup_printf("%" G_GUINT64_FORMAT ":%s:%s", checksum->length, hash_hex, block_hex);
+
+	g_free(hash_hex);
+	g_free(block_hex);
+
+	return state;
+}
+
+/* Returns the digest of everything hashed so far, as a hex string. The checksum can still be updated afterwards. */
+gchar*
+maki_checksum_get_string (makiChecksum* checksum)
+{
+	guint i;
+	gsize rest;
+	guint32 hash[8];
+	guchar block[128];
+	guchar digest[32];
+	guint64 bits;
+	gsize padded;
+
+	g_return_val_if_fail(checksum != NULL, NULL);
+
+	memcpy(hash, checksum->hash, sizeof(hash));
+
+	rest = checksum->length % 64;
+	padded = (rest < 56) ? 64 : 128;
+
+	memcpy(block, checksum->block, rest);
+	memset(block + rest, 0, padded - rest);
+	block[rest] = 0x80;
+
+	bits = checksum->length * 8;
+
+	for (i = 0; i < 8; i++)
+	{
+		block[padded - 1 - i] = bits >> (i * 8);
+	}
+
+	maki_checksum_transform(hash, block);
+
+	if (padded == 128)
+	{
+		maki_checksum_transform(hash, block + 64);
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		digest[i * 4] = hash[i] >> 24;
+		digest[i * 4 + 1] = hash[i] >> 16;
+		digest[i * 4 + 2] = hash[i] >> 8;
+		digest[i * 4 + 3] = hash[i];
+	}
+
+	return maki_checksum_hex(digest, 32);
+}
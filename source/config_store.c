@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+#include <ilib.h>
+
+#include "config_store.h"
+
+/* Writes are delayed by this many milliseconds, so that bulk changes result in a single write. */
+#define MAKI_CONFIG_STORE_DELAY 250
+
+struct maki_config_store
+{
+	/* Maps key files to makiConfigStoreEntry. */
+	GHashTable* entries;
+
+	/* The pending write, if any. */
+	guint source;
+
+	GMainContext* main_context;
+	GMainLoop* main_loop;
+	GThread* thread;
+
+	struct
+	{
+		/* Protects entries and source. */
+		GMutex store[1];
+		/* Serializes writes and protects the entries' contents. */
+		GMutex write[1];
+	}
+	mutex;
+};
+
+struct maki_config_store_entry
+{
+	GKeyFile* key_file;
+	/* Protects key_file. */
+	GMutex* mutex;
+
+	gchar* path;
+	gboolean dirty;
+	/* Whether path changed since the last write. */
+	gboolean moved;
+
+	/* What is currently stored in path. */
+	gchar* contents;
+};
+
+typedef struct maki_config_store_entry makiConfigStoreEntry;
+
+struct maki_config_store_write
+{
+	makiConfigStoreEntry* entry;
+	gchar* path;
+	gboolean moved;
+};
+
+typedef struct maki_config_store_write makiConfigStoreWrite;
+
+static
+void
+maki_config_store_entry_free (gpointer data)
+{
+	makiConfigStoreEntry* entry = data;
+
+	g_free(entry->path);
+	g_free(entry->contents);
+	g_free(entry);
+}
+
+static
+gpointer
+maki_config_store_thread (gpointer data)
+{
+	makiConfigStore* store = data;
+
+	g_main_context_push_thread_default(store->main_context);
+	g_main_loop_run(store->main_loop);
+
+	return NULL;
+}
+
+/* Writes all dirty entries whose serialized contents have changed.
+ * The key files' mutexes are taken, so the caller must not hold any of them. */
+static
+void
+maki_config_store_write (makiConfigStore* store)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList* writes = NULL;
+	GSList* list;
+
+	g_mutex_lock(store->mutex.write);
+
+	g_mutex_lock(store->mutex.store);
+
+	g_hash_table_iter_init(&iter, store->entries);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		makiConfigStoreEntry* entry = value;
+		makiConfigStoreWrite* write;
+
+		if (!entry->dirty)
+		{
+			continue;
+		}
+
+		entry->dirty = FALSE;
+
+		write = g_new(makiConfigStoreWrite, 1);
+		write->entry = entry;
+		write->path = g_strdup(entry->path);
+		write->moved = entry->moved;
+
+		entry->moved = FALSE;
+
+		writes = g_slist_prepend(writes, write);
+	}
+
+	g_mutex_unlock(store->mutex.store);
+
+	/* Entries can only be removed while holding the write mutex. */
+	for (list = writes; list != NULL; list = list->next)
+	{
+		makiConfigStoreWrite* write = list->data;
+		makiConfigStoreEntry* entry = write->entry;
+		gchar* contents;
+		gsize length;
+
+		g_mutex_lock(entry->mutex);
+		contents = g_key_file_to_data(entry->key_file, &length, NULL);
+		g_mutex_unlock(entry->mutex);
+
+		/* The contents of a new path are unknown. */
+		if (write->moved)
+		{
+			g_free(entry->contents);
+			entry->contents = NULL;
+		}
+
+		if (entry->contents == NULL)
+		{
+			g_file_get_contents(write->path, &entry->contents, NULL, NULL);
+		}
+
+		if (contents != NULL && g_strcmp0(contents, entry->contents) != 0)
+		{
+			if (g_file_set_contents(write->path, contents, length, NULL))
+			{
+				g_free(entry->contents);
+				entry->contents = contents;
+				contents = NULL;
+			}
+		}
+
+		g_free(contents);
+		g_free(write->path);
+		g_free(write);
+	}
+
+	g_slist_free(writes);
+
+	g_mutex_unlock(store->mutex.write);
+}
+
+static
+gboolean
+maki_config_store_timeout (gpointer data)
+{
+	makiConfigStore* store = data;
+
+	g_mutex_lock(store->mutex.store);
+	store->source = 0;
+	g_mutex_unlock(store->mutex.store);
+
+	maki_config_store_write(store);
+
+	return FALSE;
+}
+
+makiConfigStore*
+maki_config_store_new (void)
+{
+	makiConfigStore* store;
+
+	store = g_new(makiConfigStore, 1);
+
+	store->entries = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, maki_config_store_entry_free);
+	store->source = 0;
+
+	g_mutex_init(store->mutex.store);
+	g_mutex_init(store->mutex.write);
+
+	store->main_context = g_main_context_new();
+	store->main_loop = g_main_loop_new(store->main_context, FALSE);
+	store->thread = g_thread_new("makiConfigStore", maki_config_store_thread, store);
+
+	return store;
+}
+
+/* Flushes all pending writes. */
+void
+maki_config_store_free (makiConfigStore* store)
+{
+	g_return_if_fail(store != NULL);
+
+	maki_config_store_flush(store);
+
+	g_main_loop_quit(store->main_loop);
+	g_thread_join(store->thread);
+
+	g_main_loop_unref(store->main_loop);
+	g_main_context_unref(store->main_context);
+
+	g_hash_table_destroy(store->entries);
+
+	g_mutex_clear(store->mutex.store);
+	g_mutex_clear(store->mutex.write);
+
+	g_free(store);
+}
+
+/* Marks key_file as changed, it will be written to path shortly.
+ * mutex protects key_file and may be held by the caller. */
+void
+maki_config_store_save (makiConfigStore* store, GKeyFile* key_file, GMutex* mutex, gchar const* path)
+{
+	makiConfigStoreEntry* entry;
+
+	g_return_if_fail(store != NULL);
+	g_return_if_fail(key_file != NULL);
+	g_return_if_fail(mutex != NULL);
+	g_return_if_fail(path != NULL);
+
+	g_mutex_lock(store->mutex.store);
+
+	if ((entry = g_hash_table_lookup(store->entries, key_file)) == NULL)
+	{
+		entry = g_new(makiConfigStoreEntry, 1);
+		entry->key_file = key_file;
+		entry->mutex = mutex;
+		entry->path = NULL;
+		entry->moved = FALSE;
+		entry->contents = NULL;
+
+		g_hash_table_insert(store->entries, key_file, entry);
+	}
+
+	if (g_strcmp0(entry->path, path) != 0)
+	{
+		g_free(entry->path);
+		entry->path = g_strdup(path);
+		entry->moved = TRUE;
+	}
+
+	entry->dirty = TRUE;
+
+	if (store->source == 0)
+	{
+		store->source = i_timeout_add(MAKI_CONFIG_STORE_DELAY, maki_config_store_timeout, store, store->main_context);
+	}
+
+	g_mutex_unlock(store->mutex.store);
+}
+
+/* Stops tracking key_file, writing pending changes first if flush is TRUE. */
+void
+maki_config_store_remove (makiConfigStore* store, GKeyFile* key_file, gboolean flush)
+{
+	g_return_if_fail(store != NULL);
+	g_return_if_fail(key_file != NULL);
+
+	if (flush)
+	{
+		maki_config_store_flush(store);
+	}
+
+	g_mutex_lock(store->mutex.write);
+	g_mutex_lock(store->mutex.store);
+	g_hash_table_remove(store->entries, key_file);
+	g_mutex_unlock(store->mutex.store);
+	g_mutex_unlock(store->mutex.write);
+}
+
+/* Writes all pending changes synchronously. */
+void
+maki_config_store_flush (makiConfigStore* store)
+{
+	g_return_if_fail(store != NULL);
+
+	g_mutex_lock(store->mutex.store);
+
+	if (store->source != 0)
+	{
+		i_source_remove(store->source, store->main_context);
+		store->source = 0;
+	}
+
+	g_mutex_unlock(store->mutex.store);
+
+	maki_config_store_write(store);
+}
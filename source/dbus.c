@@ -37,7 +37,10 @@
 
 #include "dbus.h"
 
+#include "dbus_batch.h"
+#include "dbus_filter.h"
 #include "dbus_server.h"
+#include "event.h"
 #include "instance.h"
 #include "maki.h"
 #include "misc.h"
@@ -52,8 +55,92 @@ struct maki_dbus
 	guint id;
 	GDBusConnection* connection;
 	GDBusNodeInfo* introspection;
+
+	/* Maps unique names of subscribed clients to makiDBusSubscriber. */
+	GHashTable* subscribers;
+	GMutex mutex[1];
+
+	/* Sends signals published by the server threads. */
+	makiEventConsumer* consumer;
+};
+
+/* A subscriber has a filter, a batch or both. */
+struct maki_dbus_subscriber
+{
+	makiDBusFilter* filter;
+	/* Only set if the client enabled the events capability. */
+	makiDBusBatch* batch;
+	guint watch;
 };
 
+typedef struct maki_dbus_subscriber makiDBusSubscriber;
+
+static void
+maki_dbus_subscriber_free (gpointer data)
+{
+	makiDBusSubscriber* subscriber = data;
+
+	if (subscriber->watch != 0)
+	{
+		g_bus_unwatch_name(subscriber->watch);
+	}
+
+	maki_dbus_filter_free(subscriber->filter);
+	maki_dbus_batch_free(subscriber->batch);
+	g_free(subscriber);
+}
+
+static void
+maki_dbus_on_subscriber_vanished (GDBusConnection* connection, const gchar* name, gpointer data)
+{
+	makiDBus* d = data;
+
+	g_mutex_lock(d->mutex);
+	g_hash_table_remove(d->subscribers, name);
+	g_mutex_unlock(d->mutex);
+}
+
+/* Has to be called with d->mutex locked. */
+static makiDBusSubscriber*
+maki_dbus_subscriber_get (makiDBus* d, const gchar* sender)
+{
+	makiDBusSubscriber* subscriber;
+
+	if ((subscriber = g_hash_table_lookup(d->subscribers, sender)) == NULL)
+	{
+		subscriber = g_new(makiDBusSubscriber, 1);
+		subscriber->filter = NULL;
+		subscriber->batch = NULL;
+		subscriber->watch = 0;
+
+		g_hash_table_insert(d->subscribers, g_strdup(sender), subscriber);
+	}
+
+	return subscriber;
+}
+
+/* Has to be called with d->mutex locked. */
+static void
+maki_dbus_subscriber_update (makiDBus* d, GDBusConnection* connection, const gchar* sender, makiDBusSubscriber* subscriber)
+{
+	if (subscriber->filter == NULL && subscriber->batch == NULL)
+	{
+		g_hash_table_remove(d->subscribers, sender);
+	}
+	else if (subscriber->watch == 0)
+	{
+		subscriber->watch = g_bus_watch_name_on_connection(connection, sender, G_BUS_NAME_WATCHER_FLAGS_NONE, NULL, maki_dbus_on_subscriber_vanished, d, NULL);
+	}
+}
+
+static void
+maki_dbus_consume (makiEvent const* event, gpointer data)
+{
+	makiDBus* d = data;
+
+	maki_dbus_emit(d, event->name, event->server, event->target, event->case_mapping, event->variant);
+}
+
 static void
 maki_dbus_on_bus_acquired (GDBusConnection* connection, const gchar* name, gpointer data)
 {
@@ -101,6 +188,13 @@ maki_dbus_new (void)
 				d, NULL);
 		d->connection = NULL;
 		d->introspection = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+		d->subscribers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, maki_dbus_subscriber_free);
+
+		g_mutex_init(d->mutex);
+
+		maki_dbus_server_check_interface(g_dbus_node_info_lookup_interface(d->introspection, SUSHI_DBUS_INTERFACE));
+
+		d->consumer = maki_event_bus_add_consumer(maki_instance_events(maki_instance_get_default()), "dbus", MAKI_EVENT_MASK(MAKI_EVENT_SIGNAL), maki_dbus_consume, d);
 
 		g_free(introspection_xml);
 	}
@@ -113,65 +207,275 @@ maki_dbus_new (void)
 void
 maki_dbus_free (makiDBus* d)
 {
+	/* Sends all pending signals. */
+	maki_event_bus_remove_consumer(maki_instance_events(maki_instance_get_default()), d->consumer);
+
 	g_bus_unown_name(d->id);
 
+	g_hash_table_destroy(d->subscribers);
 	g_dbus_node_info_unref(d->introspection);
 
+	g_mutex_clear(d->mutex);
+
 	g_free(d);
 }
 
+/* Replaces the filter of the client with the given unique name.
+ * An empty filter removes the subscription. */
+void
+maki_dbus_subscribe (makiDBus* d, GDBusConnection* connection, const gchar* sender, GVariant* filters)
+{
+	makiDBusFilter* filter;
+	makiDBusSubscriber* subscriber;
+
+	g_return_if_fail(d != NULL);
+	g_return_if_fail(sender != NULL);
+
+	filter = maki_dbus_filter_new(filters);
+
+	g_mutex_lock(d->mutex);
+
+	subscriber = maki_dbus_subscriber_get(d, sender);
+	maki_dbus_filter_free(subscriber->filter);
+	subscriber->filter = filter;
+	maki_dbus_subscriber_update(d, connection, sender, subscriber);
+
+	g_mutex_unlock(d->mutex);
+}
+
+/* Switches the client with the given unique name between separate signals and
+ * batched events signals addressed to it. */
+void
+maki_dbus_set_events (makiDBus* d, GDBusConnection* connection, const gchar* sender, gboolean events)
+{
+	makiDBusSubscriber* subscriber;
+
+	g_return_if_fail(d != NULL);
+	g_return_if_fail(sender != NULL);
+
+	g_mutex_lock(d->mutex);
+
+	subscriber = maki_dbus_subscriber_get(d, sender);
+
+	if (events && subscriber->batch == NULL)
+	{
+		subscriber->batch = maki_dbus_batch_new(connection, sender, NULL, NULL);
+	}
+	else if (!events && subscriber->batch != NULL)
+	{
+		maki_dbus_batch_free(subscriber->batch);
+		subscriber->batch = NULL;
+	}
+
+	maki_dbus_subscriber_update(d, connection, sender, subscriber);
+
+	g_mutex_unlock(d->mutex);
+}
+
+static gboolean
+maki_dbus_broadcast (void)
+{
+	gboolean ret;
+	makiInstance* inst = maki_instance_get_default();
+	makiInstanceConfig const* config;
+
+	config = maki_instance_config_snapshot(inst);
+	ret = config->dbus.broadcast;
+	maki_instance_config_snapshot_unref(inst, config);
+
+	return ret;
+}
+
+/* Returns whether the signal has to be sent on the session bus,
+ * either because signals are broadcast or because a subscriber wants it. */
+gboolean
+maki_dbus_wants (makiDBus* d, const gchar* name, const gchar* server, const gchar* target, iCaseMapping case_mapping)
+{
+	gboolean ret = FALSE;
+	GHashTableIter iter;
+	gpointer value;
+
+	g_return_val_if_fail(d != NULL, FALSE);
+
+	if (d->connection == NULL)
+	{
+		return FALSE;
+	}
+
+	if (maki_dbus_broadcast())
+	{
+		return TRUE;
+	}
+
+	g_mutex_lock(d->mutex);
+
+	g_hash_table_iter_init(&iter, d->subscribers);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		makiDBusSubscriber* subscriber = value;
+
+		if (maki_dbus_filter_match(subscriber->filter, name, server, target, case_mapping))
+		{
+			ret = TRUE;
+			break;
+		}
+	}
+
+	g_mutex_unlock(d->mutex);
+
+	return ret;
+}
+
+/* Signals are broadcast for legacy clients, unless dbus/broadcast is disabled.
+ * Subscribed clients get matching signals addressed to them,
+ * either separately or batched into events signals.
+ * They only match signals addressed to them, so they never see a broadcast copy. */
 void
-maki_dbus_emit (makiDBus* d, const gchar* name, GVariant* variant)
+maki_dbus_emit (makiDBus* d, const gchar* name, const gchar* server, const gchar* target, iCaseMapping case_mapping, GVariant* variant)
 {
 	g_return_if_fail(d != NULL);
 
 	if (d->connection != NULL)
 	{
-		g_dbus_connection_emit_signal(d->connection, NULL, SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name, variant, NULL);
+		GHashTableIter iter;
+		gpointer key, value;
+
+		if (maki_dbus_broadcast())
+		{
+			g_dbus_connection_emit_signal(d->connection, NULL, SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name, variant, NULL);
+		}
+
+		g_mutex_lock(d->mutex);
+
+		g_hash_table_iter_init(&iter, d->subscribers);
+
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			makiDBusSubscriber* subscriber = value;
+
+			if (!maki_dbus_filter_match(subscriber->filter, name, server, target, case_mapping))
+			{
+				continue;
+			}
+
+			if (subscriber->batch != NULL)
+			{
+				maki_dbus_batch_add(subscriber->batch, name, variant);
+			}
+			else
+			{
+				g_dbus_connection_emit_signal(d->connection, key, SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name, variant, NULL);
+			}
+		}
+
+		g_mutex_unlock(d->mutex);
+	}
+}
+
+/* Holds the server-time of the message that is currently handled by this thread, if any. */
+static GPrivate maki_dbus_timestamp_private = G_PRIVATE_INIT(g_free);
+
+/* Overrides the timestamp of all signals emitted by this thread.
+ * Passing 0 resets it to the current time. */
+void
+maki_dbus_set_timestamp (gint64 timestamp)
+{
+	gint64* tmp = NULL;
+
+	if (timestamp != 0)
+	{
+		tmp = g_new(gint64, 1);
+		*tmp = timestamp;
+	}
+
+	g_private_replace(&maki_dbus_timestamp_private, tmp);
+}
+
+static gint64
+maki_dbus_timestamp (void)
+{
+	GTimeVal timeval;
+	gint64* tmp;
+
+	if ((tmp = g_private_get(&maki_dbus_timestamp_private)) != NULL)
+	{
+		return *tmp;
+	}
+
+	g_get_current_time(&timeval);
+
+	return timeval.tv_sec;
+}
+
+/* Returns the case mapping used to compare the targets of server's signals.
+ * Signals emitted on a server's thread belong to that server.
+ * The thread must not wait for the instance, which joins it while removing the server. */
+static iCaseMapping
+maki_dbus_case_mapping (const gchar* server)
+{
+	makiServer* serv;
+
+	if (server == NULL)
+	{
+		return I_CASE_MAPPING_RFC1459;
+	}
+
+	if ((serv = maki_server_current()) != NULL)
+	{
+		return maki_server_case_mapping(serv);
 	}
+
+	return maki_instance_server_case_mapping(maki_instance_get_default(), server);
 }
 
+/* server and target are used for filtering, they may be NULL. */
 static void
-maki_dbus_emit_helper (const gchar* name, const gchar* format, ...)
+maki_dbus_emit_helper (const gchar* server, const gchar* target, const gchar* name, const gchar* format, ...)
 {
-	GVariant* variant;
-	gchar* tmp;
+	makiEvent* event;
+	iCaseMapping case_mapping;
 	va_list ap;
 
-	if (dbus == NULL && dbus_server == NULL)
+	case_mapping = maki_dbus_case_mapping(server);
+
+	/* Only build the signal if any client wants it. */
+	if ((dbus == NULL || !maki_dbus_wants(dbus, name, server, target, case_mapping))
+	    && (dbus_server == NULL || !maki_dbus_server_wants(dbus_server, name, server, target, case_mapping)))
 	{
 		return;
 	}
 
 	va_start(ap, format);
-	variant = g_variant_new_va(format, NULL, &ap);
 
-	tmp = g_variant_print(variant, TRUE);
-	maki_debug("SIGNAL %s: %s %s %s\n", SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name, tmp);
-	g_free(tmp);
+	event = maki_event_new(MAKI_EVENT_SIGNAL, server, target);
+	event->case_mapping = case_mapping;
+	event->name = g_strdup(name);
+	event->variant = g_variant_ref_sink(g_variant_new_va(format, NULL, &ap));
 
-	if (dbus != NULL)
-	{
-		maki_dbus_emit(dbus, name, variant);
-	}
+	va_end(ap);
 
-	if (dbus_server != NULL)
+	/* Extra check to avoid printing the signal when verbose is disabled. */
+	if (opt_verbose)
 	{
-		maki_dbus_server_emit(dbus_server, name, variant);
+		gchar* tmp;
+
+		tmp = g_variant_print(event->variant, TRUE);
+		maki_debug("SIGNAL %s: %s %s %s\n", SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name, tmp);
+		g_free(tmp);
 	}
 
-	va_end(ap);
+	/* Sending happens on the consumers' threads. */
+	maki_event_bus_publish(maki_instance_events(maki_instance_get_default()), event);
 }
 
 void maki_dbus_emit_action (const gchar* server, const gchar* nick, const gchar* target, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("action", "(xssss)",
+	maki_dbus_emit_helper(server, target, "action", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -181,26 +485,22 @@ void maki_dbus_emit_action (const gchar* server, const gchar* nick, const gchar*
 
 void maki_dbus_emit_away (const gchar* server)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("away", "(xs)",
+	maki_dbus_emit_helper(server, NULL, "away", "(xs)",
 		timestamp,
 		server);
 }
 
 void maki_dbus_emit_away_message (const gchar* server, const gchar* nick, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("away_message", "(xsss)",
+	maki_dbus_emit_helper(server, NULL, "away_message", "(xsss)",
 		timestamp,
 		server,
 		nick,
@@ -209,26 +509,22 @@ void maki_dbus_emit_away_message (const gchar* server, const gchar* nick, const
 
 void maki_dbus_emit_back (const gchar* server)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("back", "(xs)",
+	maki_dbus_emit_helper(server, NULL, "back", "(xs)",
 		timestamp,
 		server);
 }
 
 void maki_dbus_emit_banlist (const gchar* server, const gchar* channel, const gchar* mask, const gchar* who, gint64 when)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("banlist", "(xssssx)",
+	maki_dbus_emit_helper(server, channel, "banlist", "(xssssx)",
 		timestamp,
 		server,
 		channel,
@@ -239,13 +535,11 @@ void maki_dbus_emit_banlist (const gchar* server, const gchar* channel, const gc
 
 void maki_dbus_emit_cannot_join (const gchar* server, const gchar* channel, const gchar* reason)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("cannot_join", "(xsss)",
+	maki_dbus_emit_helper(server, channel, "cannot_join", "(xsss)",
 		timestamp,
 		server,
 		channel,
@@ -254,39 +548,33 @@ void maki_dbus_emit_cannot_join (const gchar* server, const gchar* channel, cons
 
 void maki_dbus_emit_connect (const gchar* server)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("connect", "(xs)",
+	maki_dbus_emit_helper(server, NULL, "connect", "(xs)",
 		timestamp,
 		server);
 }
 
 void maki_dbus_emit_connected (const gchar* server)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("connected", "(xs)",
+	maki_dbus_emit_helper(server, NULL, "connected", "(xs)",
 		timestamp,
 		server);
 }
 
 void maki_dbus_emit_ctcp (const gchar* server, const gchar* nick, const gchar* target, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("ctcp", "(xssss)",
+	maki_dbus_emit_helper(server, target, "ctcp", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -294,15 +582,41 @@ void maki_dbus_emit_ctcp (const gchar* server, const gchar* nick, const gchar* t
 		message);
 }
 
+void maki_dbus_emit_dcc_progress (GArray* ids, GArray* progresses, GArray* speeds, GArray* rates, GArray* etas)
+{
+	gint64 timestamp;
+	GVariantBuilder* builder[5];
+
+	timestamp = maki_dbus_timestamp();
+
+	builder[0] = maki_variant_builder_array_uint64(ids);
+	builder[1] = maki_variant_builder_array_uint64(progresses);
+	builder[2] = maki_variant_builder_array_uint64(speeds);
+	builder[3] = maki_variant_builder_array_uint64(rates);
+	builder[4] = maki_variant_builder_array_int64(etas);
+
+	maki_dbus_emit_helper("", NULL, "dcc_progress", "(xatatatatax)",
+		timestamp,
+		builder[0],
+		builder[1],
+		builder[2],
+		builder[3],
+		builder[4]);
+
+	g_variant_builder_unref(builder[0]);
+	g_variant_builder_unref(builder[1]);
+	g_variant_builder_unref(builder[2]);
+	g_variant_builder_unref(builder[3]);
+	g_variant_builder_unref(builder[4]);
+}
+
 void maki_dbus_emit_dcc_send (guint64 id, const gchar* server, const gchar* from, const gchar* filename, guint64 size, guint64 progress, guint64 speed, guint64 status)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("dcc_send", "(xtssstttt)",
+	maki_dbus_emit_helper(server, NULL, "dcc_send", "(xtssstttt)",
 		timestamp,
 		id,
 		server,
@@ -316,13 +630,11 @@ void maki_dbus_emit_dcc_send (guint64 id, const gchar* server, const gchar* from
 
 void maki_dbus_emit_error (const gchar* server, const gchar* domain, const gchar* reason, gchar** arguments)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("error", "(xsss^as)",
+	maki_dbus_emit_helper(server, NULL, "error", "(xsss^as)",
 		timestamp,
 		server,
 		domain,
@@ -332,13 +644,11 @@ void maki_dbus_emit_error (const gchar* server, const gchar* domain, const gchar
 
 void maki_dbus_emit_invite (const gchar* server, const gchar* nick, const gchar* channel, const gchar* who)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("invite", "(xssss)",
+	maki_dbus_emit_helper(server, channel, "invite", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -348,13 +658,11 @@ void maki_dbus_emit_invite (const gchar* server, const gchar* nick, const gchar*
 
 void maki_dbus_emit_join (const gchar* server, const gchar* nick, const gchar* channel)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("join", "(xsss)",
+	maki_dbus_emit_helper(server, channel, "join", "(xsss)",
 		timestamp,
 		server,
 		nick,
@@ -363,13 +671,11 @@ void maki_dbus_emit_join (const gchar* server, const gchar* nick, const gchar* c
 
 void maki_dbus_emit_kick (const gchar* server, const gchar* nick, const gchar* channel, const gchar* who, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("kick", "(xsssss)",
+	maki_dbus_emit_helper(server, channel, "kick", "(xsssss)",
 		timestamp,
 		server,
 		nick,
@@ -380,13 +686,11 @@ void maki_dbus_emit_kick (const gchar* server, const gchar* nick, const gchar* c
 
 void maki_dbus_emit_list (const gchar* server, const gchar* channel, gint64 users, const gchar* topic)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("list", "(xssxs)",
+	maki_dbus_emit_helper(server, channel, "list", "(xssxs)",
 		timestamp,
 		server,
 		channel,
@@ -396,13 +700,11 @@ void maki_dbus_emit_list (const gchar* server, const gchar* channel, gint64 user
 
 void maki_dbus_emit_message (const gchar* server, const gchar* nick, const gchar* target, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("message", "(xssss)",
+	maki_dbus_emit_helper(server, target, "message", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -412,13 +714,11 @@ void maki_dbus_emit_message (const gchar* server, const gchar* nick, const gchar
 
 void maki_dbus_emit_mode (const gchar* server, const gchar* nick, const gchar* target, const gchar* mode, const gchar* parameter)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("mode", "(xsssss)",
+	maki_dbus_emit_helper(server, target, "mode", "(xsssss)",
 		timestamp,
 		server,
 		nick,
@@ -429,13 +729,11 @@ void maki_dbus_emit_mode (const gchar* server, const gchar* nick, const gchar* t
 
 void maki_dbus_emit_motd (const gchar* server, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("motd", "(xss)",
+	maki_dbus_emit_helper(server, NULL, "motd", "(xss)",
 		timestamp,
 		server,
 		message);
@@ -443,13 +741,11 @@ void maki_dbus_emit_motd (const gchar* server, const gchar* message)
 
 void maki_dbus_emit_names (const gchar* server, const gchar* channel, gchar** nicks, gchar** prefixes)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("names", "(xss^as^as)",
+	maki_dbus_emit_helper(server, channel, "names", "(xss^as^as)",
 		timestamp,
 		server,
 		channel,
@@ -459,13 +755,11 @@ void maki_dbus_emit_names (const gchar* server, const gchar* channel, gchar** ni
 
 void maki_dbus_emit_nick (const gchar* server, const gchar* nick, const gchar* new_nick)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("nick", "(xsss)",
+	maki_dbus_emit_helper(server, NULL, "nick", "(xsss)",
 		timestamp,
 		server,
 		nick,
@@ -474,13 +768,11 @@ void maki_dbus_emit_nick (const gchar* server, const gchar* nick, const gchar* n
 
 void maki_dbus_emit_no_such (const gchar* server, const gchar* target, const gchar* type)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("no_such", "(xsss)",
+	maki_dbus_emit_helper(server, target, "no_such", "(xsss)",
 		timestamp,
 		server,
 		target,
@@ -489,13 +781,11 @@ void maki_dbus_emit_no_such (const gchar* server, const gchar* target, const gch
 
 void maki_dbus_emit_notice (const gchar* server, const gchar* nick, const gchar* target, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("notice", "(xssss)",
+	maki_dbus_emit_helper(server, target, "notice", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -505,26 +795,22 @@ void maki_dbus_emit_notice (const gchar* server, const gchar* nick, const gchar*
 
 void maki_dbus_emit_oper (const gchar* server)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("oper", "(xs)",
+	maki_dbus_emit_helper(server, NULL, "oper", "(xs)",
 		timestamp,
 		server);
 }
 
 void maki_dbus_emit_part (const gchar* server, const gchar* nick, const gchar* channel, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("part", "(xssss)",
+	maki_dbus_emit_helper(server, channel, "part", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -534,13 +820,11 @@ void maki_dbus_emit_part (const gchar* server, const gchar* nick, const gchar* c
 
 void maki_dbus_emit_quit (const gchar* server, const gchar* nick, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("quit", "(xsss)",
+	maki_dbus_emit_helper(server, NULL, "quit", "(xsss)",
 		timestamp,
 		server,
 		nick,
@@ -549,25 +833,21 @@ void maki_dbus_emit_quit (const gchar* server, const gchar* nick, const gchar* m
 
 void maki_dbus_emit_shutdown (void)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("shutdown", "(x)",
+	maki_dbus_emit_helper(NULL, NULL, "shutdown", "(x)",
 		timestamp);
 }
 
 void maki_dbus_emit_topic (const gchar* server, const gchar* nick, const gchar* channel, const gchar* topic)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("topic", "(xssss)",
+	maki_dbus_emit_helper(server, channel, "topic", "(xssss)",
 		timestamp,
 		server,
 		nick,
@@ -577,13 +857,11 @@ void maki_dbus_emit_topic (const gchar* server, const gchar* nick, const gchar*
 
 void maki_dbus_emit_user_away (const gchar* server, const gchar* from, gboolean away)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("user_away", "(xssb)",
+	maki_dbus_emit_helper(server, NULL, "user_away", "(xssb)",
 		timestamp,
 		server,
 		from,
@@ -592,13 +870,11 @@ void maki_dbus_emit_user_away (const gchar* server, const gchar* from, gboolean
 
 void maki_dbus_emit_whois (const gchar* server, const gchar* nick, const gchar* message)
 {
-	GTimeVal timeval;
 	gint64 timestamp;
 
-	g_get_current_time(&timeval);
-	timestamp = timeval.tv_sec;
+	timestamp = maki_dbus_timestamp();
 
-	maki_dbus_emit_helper("whois", "(xsss)",
+	maki_dbus_emit_helper(server, NULL, "whois", "(xsss)",
 		timestamp,
 		server,
 		nick,
@@ -619,9 +895,12 @@ gboolean maki_dbus_action (const gchar* server, const gchar* channel, const gcha
 
 		maki_server_send_printf(serv, "PRIVMSG %s :\001ACTION %s\001", channel, tmp);
 
-		maki_server_log(serv, channel, "%s %s", maki_user_nick(maki_server_user(serv)), tmp);
+		if (!maki_server_cap_enabled(serv, "echo-message"))
+		{
+			maki_server_log(serv, channel, "%s %s", maki_user_nick(maki_server_user(serv)), tmp);
 
-		maki_dbus_emit_action(server, maki_user_from(maki_server_user(serv)), channel, tmp);
+			maki_dbus_emit_action(server, maki_user_from(maki_server_user(serv)), channel, tmp);
+		}
 
 		g_free(tmp);
 	}
@@ -670,50 +949,50 @@ gboolean maki_dbus_channel_nicks (const gchar* server, const gchar* channel, gch
 
 		if ((chan = maki_server_get_channel(serv, channel)) != NULL)
 		{
-			gchar** nick;
-			gchar** prefix;
-			const gchar* prefix_prefixes;
-			gchar prefix_str[2];
-			gsize length;
-			GHashTableIter iter;
-			gpointer key, value;
-
-			nick = *nicks = g_new(gchar*, maki_channel_users_count(chan) + 1);
-			prefix = *prefixes = g_new(gchar*, maki_channel_users_count(chan) + 1);
-			maki_channel_users_iter(chan, &iter);
-
-			prefix_prefixes = maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_PREFIXES);
-			length = strlen(prefix_prefixes);
-			prefix_str[1] = '\0';
-
-			while (g_hash_table_iter_next(&iter, &key, &value))
-			{
-				guint pos;
-				makiUser* user = value;
+			guint64 version;
 
-				*nick = g_strdup(maki_user_nick(user));
-				nick++;
+			maki_channel_set_last_active(chan, g_get_monotonic_time());
+			maki_channel_nicks(chan, nicks, prefixes, &version);
+		}
+	}
 
-				prefix_str[0] = '\0';
+	maki_ensure_string_array(nicks);
+	maki_ensure_string_array(prefixes);
 
-				for (pos = 0; pos < length; pos++)
-				{
-					if (maki_channel_get_user_prefix(chan, user, pos))
-					{
-						prefix_str[0] = prefix_prefixes[pos];
-						break;
-					}
-				}
+	return TRUE;
+}
 
-				*prefix = g_strdup(prefix_str);
-				prefix++;
-			}
+gboolean maki_dbus_channel_nicks_delta (const gchar* server, const gchar* channel, guint64 since, guint64* version, gboolean* snapshot, gchar*** operations, gchar*** nicks, gchar*** prefixes, GError** error)
+{
+	makiServer* serv;
+	makiInstance* inst = maki_instance_get_default();
+
+	*version = 0;
+	*snapshot = TRUE;
+	*operations = NULL;
+	*nicks = NULL;
+	*prefixes = NULL;
+
+	if ((serv = maki_instance_get_server(inst, server)) != NULL)
+	{
+		makiChannel* chan;
 
-			*nick = NULL;
-			*prefix = NULL;
+		if ((chan = maki_server_get_channel(serv, channel)) != NULL)
+		{
+			maki_channel_set_last_active(chan, g_get_monotonic_time());
+
+			if (maki_channel_nicks_delta(chan, since, operations, nicks, prefixes, version))
+			{
+				*snapshot = FALSE;
+			}
+			else
+			{
+				maki_channel_nicks(chan, nicks, prefixes, version);
+			}
 		}
 	}
 
+	maki_ensure_string_array(operations);
 	maki_ensure_string_array(nicks);
 	maki_ensure_string_array(prefixes);
 
@@ -834,8 +1113,11 @@ gboolean maki_dbus_ctcp (const gchar* server, const gchar* target, const gchar*
 	{
 		maki_server_send_printf(serv, "PRIVMSG %s :\001%s\001", target, message);
 
-		maki_dbus_emit_ctcp(server, maki_user_from(maki_server_user(serv)), target, message);
-		maki_server_log(serv, target, "=%s= %s", maki_user_nick(maki_server_user(serv)), message);
+		if (!maki_server_cap_enabled(serv, "echo-message"))
+		{
+			maki_dbus_emit_ctcp(server, maki_user_from(maki_server_user(serv)), target, message);
+			maki_server_log(serv, target, "=%s= %s", maki_user_nick(maki_server_user(serv)), message);
+		}
 	}
 
 	return TRUE;
@@ -858,7 +1140,7 @@ gboolean maki_dbus_dcc_send (const gchar* server, const gchar* target, const gch
 			maki_instance_add_dcc_send(inst, dcc);
 		}
 
-		maki_server_remove_user(serv, maki_user_nick(user));
+		maki_server_remove_user(serv, user);
 	}
 
 	return TRUE;
@@ -866,24 +1148,8 @@ gboolean maki_dbus_dcc_send (const gchar* server, const gchar* target, const gch
 
 gboolean maki_dbus_dcc_sends (GArray** ids, gchar*** servers, gchar*** froms, gchar*** filenames, GArray** sizes, GArray** progresses, GArray** speeds, GArray** statuses, GError** error)
 {
-	guint len;
 	makiInstance* inst = maki_instance_get_default();
 
-	len = maki_instance_dcc_sends_count(inst);
-
-	*ids = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
-	*servers = g_new(gchar*, len + 1);
-	*froms = g_new(gchar*, len + 1);
-	*filenames = g_new(gchar*, len + 1);
-	*sizes = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
-	*progresses = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
-	*speeds = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
-	*statuses = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
-
-	(*servers)[len] = NULL;
-	(*froms)[len] = NULL;
-	(*filenames)[len] = NULL;
-
 	maki_instance_dcc_sends_xxx(inst, ids, servers, froms, filenames, sizes, progresses, speeds, statuses);
 
 	return TRUE;
@@ -1316,8 +1582,11 @@ gboolean maki_dbus_notice (const gchar* server, const gchar* target, const gchar
 	{
 		maki_server_send_printf(serv, "NOTICE %s :%s", target, message);
 
-		maki_dbus_emit_notice(maki_server_name(serv), maki_user_from(maki_server_user(serv)), target, message);
-		maki_server_log(serv, target, "-%s- %s", maki_user_nick(maki_server_user(serv)), message);
+		if (!maki_server_cap_enabled(serv, "echo-message"))
+		{
+			maki_dbus_emit_notice(maki_server_name(serv), maki_user_from(maki_server_user(serv)), target, message);
+			maki_server_log(serv, target, "-%s- %s", maki_user_nick(maki_server_user(serv)), message);
+		}
 	}
 
 	return TRUE;
@@ -1489,6 +1758,8 @@ gboolean maki_dbus_server_remove (const gchar* server, const gchar* group, const
 			gchar* path;
 
 			maki_instance_remove_server(inst, server);
+			/* Make sure no pending write recreates the file. */
+			maki_config_store_flush(maki_instance_config_store(inst));
 
 			path = g_build_filename(maki_instance_directory(inst, "servers"), server, NULL);
 			g_unlink(path);
@@ -1511,6 +1782,7 @@ gboolean maki_dbus_server_rename (const gchar* old, const gchar* new, GError** e
 		old_path = g_build_filename(maki_instance_directory(inst, "servers"), old, NULL);
 		new_path = g_build_filename(maki_instance_directory(inst, "servers"), new, NULL);
 
+		maki_config_store_flush(maki_instance_config_store(inst));
 		g_rename(old_path, new_path);
 
 		g_free(old_path);
@@ -1612,7 +1884,11 @@ gboolean maki_dbus_support_chantypes (const gchar* server, gchar** chantypes, GE
 
 	if ((serv = maki_instance_get_server(inst, server)) != NULL)
 	{
-		*chantypes = g_strdup(maki_server_support(serv, MAKI_SERVER_SUPPORT_CHANTYPES));
+		makiSupport* support = maki_server_support(serv);
+
+		*chantypes = g_strdup(maki_support_chantypes(support));
+
+		maki_server_support_unref(serv, support);
 	}
 
 	maki_ensure_string(chantypes);
@@ -1629,10 +1905,14 @@ gboolean maki_dbus_support_prefix (const gchar* server, gchar*** prefix, GError*
 
 	if ((serv = maki_instance_get_server(inst, server)) != NULL)
 	{
+		makiSupport* support = maki_server_support(serv);
+
 		*prefix = g_new(gchar*, 3);
-		(*prefix)[0] = g_strdup(maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_MODES));
-		(*prefix)[1] = g_strdup(maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_PREFIXES));
+		(*prefix)[0] = g_strdup(maki_support_prefix_modes(support));
+		(*prefix)[1] = g_strdup(maki_support_prefix_prefixes(support));
 		(*prefix)[2] = NULL;
+
+		maki_server_support_unref(serv, support);
 	}
 
 	maki_ensure_string_array(prefix);
@@ -1640,6 +1920,29 @@ gboolean maki_dbus_support_prefix (const gchar* server, gchar*** prefix, GError*
 	return TRUE;
 }
 
+gboolean maki_dbus_support_tokens (const gchar* server, gchar*** names, gchar*** values, GError** error)
+{
+	makiServer* serv;
+	makiInstance* inst = maki_instance_get_default();
+
+	*names = NULL;
+	*values = NULL;
+
+	if ((serv = maki_instance_get_server(inst, server)) != NULL)
+	{
+		makiSupport* support = maki_server_support(serv);
+
+		maki_support_tokens(support, names, values);
+
+		maki_server_support_unref(serv, support);
+	}
+
+	maki_ensure_string_array(names);
+	maki_ensure_string_array(values);
+
+	return TRUE;
+}
+
 gboolean maki_dbus_topic (const gchar* server, const gchar* channel, const gchar* topic, GError** error)
 {
 	makiServer* serv;
@@ -1776,8 +2079,10 @@ gboolean maki_dbus_user_channel_mode (const gchar* server, const gchar* channel,
 				gint pos;
 				gint length;
 				gchar tmp = '\0';
+				makiSupport* support;
 
-				prefix_modes = maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_MODES);
+				support = maki_server_support(serv);
+				prefix_modes = maki_support_prefix_modes(support);
 				length = strlen(prefix_modes);
 
 				for (pos = 0; pos < length; pos++)
@@ -1789,6 +2094,8 @@ gboolean maki_dbus_user_channel_mode (const gchar* server, const gchar* channel,
 					}
 				}
 
+				maki_server_support_unref(serv, support);
+
 				if (tmp)
 				{
 					*mode = g_new(gchar, 2);
@@ -1830,8 +2137,10 @@ gboolean maki_dbus_user_channel_prefix (const gchar* server, const gchar* channe
 				gint pos;
 				gint length;
 				gchar tmp = '\0';
+				makiSupport* support;
 
-				prefix_prefixes = maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_PREFIXES);
+				support = maki_server_support(serv);
+				prefix_prefixes = maki_support_prefix_prefixes(support);
 				length = strlen(prefix_prefixes);
 
 				for (pos = 0; pos < length; pos++)
@@ -1843,6 +2152,8 @@ gboolean maki_dbus_user_channel_prefix (const gchar* server, const gchar* channe
 					}
 				}
 
+				maki_server_support_unref(serv, support);
+
 				if (tmp)
 				{
 					*prefix = g_new(gchar, 2);
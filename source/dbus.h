@@ -36,12 +36,19 @@ struct maki_dbus;
 
 typedef struct maki_dbus makiDBus;
 
-#include <glib.h>
+#include <gio/gio.h>
+
+#include <ilib.h>
 
 makiDBus* maki_dbus_new (void);
 void maki_dbus_free (makiDBus*);
 
-void maki_dbus_emit (makiDBus*, const gchar*, GVariant*);
+void maki_dbus_subscribe (makiDBus*, GDBusConnection*, const gchar*, GVariant*);
+void maki_dbus_set_events (makiDBus*, GDBusConnection*, const gchar*, gboolean);
+gboolean maki_dbus_wants (makiDBus*, const gchar*, const gchar*, const gchar*, iCaseMapping);
+void maki_dbus_emit (makiDBus*, const gchar*, const gchar*, const gchar*, iCaseMapping, GVariant*);
+
+void maki_dbus_set_timestamp (gint64);
 
 void maki_dbus_emit_action (const gchar*, const gchar*, const gchar*, const gchar*);
 void maki_dbus_emit_away (const gchar*);
@@ -52,6 +59,7 @@ void maki_dbus_emit_cannot_join (const gchar*, const gchar*, const gchar*);
 void maki_dbus_emit_connect (const gchar*);
 void maki_dbus_emit_connected (const gchar*);
 void maki_dbus_emit_ctcp (const gchar*, const gchar*, const gchar*, const gchar*);
+void maki_dbus_emit_dcc_progress (GArray*, GArray*, GArray*, GArray*, GArray*);
 void maki_dbus_emit_dcc_send (guint64, const gchar*, const gchar*, const gchar*, guint64, guint64, guint64, guint64);
 void maki_dbus_emit_error (const gchar*, const gchar*, const gchar*, gchar**);
 void maki_dbus_emit_invite (const gchar*, const gchar*, const gchar*, const gchar*);
@@ -77,6 +85,7 @@ gboolean maki_dbus_action (const gchar*, const gchar*, const gchar*, GError**);
 gboolean maki_dbus_away (const gchar*, const gchar*, GError**);
 gboolean maki_dbus_back (const gchar*, GError**);
 gboolean maki_dbus_channel_nicks (const gchar*, const gchar*, gchar***, gchar***, GError**);
+gboolean maki_dbus_channel_nicks_delta (const gchar*, const gchar*, guint64, guint64*, gboolean*, gchar***, gchar***, gchar***, GError**);
 gboolean maki_dbus_channel_topic (const gchar*, const gchar*, gchar**, GError**);
 gboolean maki_dbus_channels (const gchar*, gchar***, GError**);
 gboolean maki_dbus_config_get (const gchar*, const gchar*, gchar**, GError**);
@@ -118,6 +127,7 @@ gboolean maki_dbus_servers (gchar***, GError**);
 gboolean maki_dbus_shutdown (const gchar*, GError**);
 gboolean maki_dbus_support_chantypes (const gchar*, gchar**, GError**);
 gboolean maki_dbus_support_prefix (const gchar*, gchar***, GError**);
+gboolean maki_dbus_support_tokens (const gchar*, gchar***, gchar***, GError**);
 gboolean maki_dbus_topic (const gchar*, const gchar*, const gchar*, GError**);
 gboolean maki_dbus_unignore (const gchar*, const gchar*, GError**);
 gboolean maki_dbus_user_away (const gchar*, const gchar*, gboolean*, GError**);
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <string.h>
+
+#include <ilib.h>
+
+#include "dbus_batch.h"
+
+#include "dbus.h"
+
+/* Bounds of the coalescing window in milliseconds. */
+#define MAKI_DBUS_BATCH_WINDOW_MIN 5
+#define MAKI_DBUS_BATCH_WINDOW_MAX 20
+
+/* A batch is flushed early once it grows beyond these. */
+#define MAKI_DBUS_BATCH_EVENTS 512
+#define MAKI_DBUS_BATCH_SIZE (64 * 1024)
+
+/* Collects signals into a single events signal for one client.
+ * The batch is shared with its flush timer, therefore it is reference counted. */
+struct maki_dbus_batch
+{
+	gint ref_count;
+
+	GDBusConnection* connection;
+	/* Unique name on the session bus, NULL for peer-to-peer connections. */
+	gchar* destination;
+
+	/* Used instead of sending directly on peer-to-peer connections, if set. */
+	makiDBusBatchSendFunc send_func;
+	gpointer send_data;
+
+	/* Set once the owner is gone. */
+	gboolean closed;
+
+	GVariantBuilder* events;
+	guint length;
+	gsize size;
+
+	/* Current coalescing window in milliseconds, 0 while the load is light. */
+	guint window;
+	gint64 last_flush;
+	guint source;
+
+	GMutex mutex[1];
+};
+
+static
+makiDBusBatch*
+maki_dbus_batch_ref (makiDBusBatch* batch)
+{
+	g_atomic_int_inc(&batch->ref_count);
+
+	return batch;
+}
+
+static
+void
+maki_dbus_batch_unref (makiDBusBatch* batch)
+{
+	if (!g_atomic_int_dec_and_test(&batch->ref_count))
+	{
+		return;
+	}
+
+	if (batch->events != NULL)
+	{
+		g_variant_builder_unref(batch->events);
+	}
+
+	g_object_unref(batch->connection);
+	g_free(batch->destination);
+
+	g_mutex_clear(batch->mutex);
+
+	g_free(batch);
+}
+
+/* Has to be called with the batch locked. */
+static
+void
+maki_dbus_batch_flush (makiDBusBatch* batch)
+{
+	GVariant* events;
+	gsize size;
+
+	if (batch->events == NULL)
+	{
+		return;
+	}
+
+	events = g_variant_new("(a(sv))", batch->events);
+	g_variant_builder_unref(batch->events);
+	size = batch->size;
+
+	batch->events = NULL;
+	batch->length = 0;
+	batch->size = 0;
+	batch->last_flush = g_get_monotonic_time();
+
+	if (batch->closed)
+	{
+		g_variant_unref(g_variant_ref_sink(events));
+		return;
+	}
+
+	if (batch->destination != NULL)
+	{
+		g_dbus_connection_emit_signal(batch->connection, batch->destination, SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, "events", events, NULL);
+	}
+	else
+	{
+		GDBusMessage* message;
+
+		message = g_dbus_message_new_signal(SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, "events");
+		g_dbus_message_set_sender(message, SUSHI_DBUS_SERVICE);
+		g_dbus_message_set_body(message, events);
+
+		if (batch->send_func != NULL)
+		{
+			batch->send_func(message, size, batch->send_data);
+		}
+		else
+		{
+			g_dbus_connection_send_message(batch->connection, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+		}
+
+		g_object_unref(message);
+	}
+}
+
+static
+gboolean
+maki_dbus_batch_timeout (gpointer data)
+{
+	makiDBusBatch* batch = data;
+
+	g_mutex_lock(batch->mutex);
+
+	/* Shrink the window again if the burst is over. */
+	if (batch->length <= 1)
+	{
+		batch->window /= 2;
+	}
+
+	maki_dbus_batch_flush(batch);
+	batch->source = 0;
+
+	g_mutex_unlock(batch->mutex);
+
+	maki_dbus_batch_unref(batch);
+
+	return FALSE;
+}
+
+/* Creates a batch sending to connection.
+ * destination is the client's unique name on the session bus and NULL otherwise.
+ * send_func is only used for peer-to-peer connections and is not called after the batch has been freed. */
+makiDBusBatch*
+maki_dbus_batch_new (GDBusConnection* connection, gchar const* destination, makiDBusBatchSendFunc send_func, gpointer send_data)
+{
+	makiDBusBatch* batch;
+
+	g_return_val_if_fail(connection != NULL, NULL);
+
+	batch = g_new(makiDBusBatch, 1);
+	batch->ref_count = 1;
+	batch->connection = g_object_ref(connection);
+	batch->destination = g_strdup(destination);
+	batch->send_func = send_func;
+	batch->send_data = send_data;
+	batch->closed = FALSE;
+	batch->events = NULL;
+	batch->length = 0;
+	batch->size = 0;
+	batch->window = 0;
+	batch->last_flush = 0;
+	batch->source = 0;
+
+	g_mutex_init(batch->mutex);
+
+	return batch;
+}
+
+/* Drops pending events; a running flush timer keeps the batch alive until it fires. */
+void
+maki_dbus_batch_free (gpointer data)
+{
+	makiDBusBatch* batch = data;
+
+	if (batch == NULL)
+	{
+		return;
+	}
+
+	g_mutex_lock(batch->mutex);
+	batch->closed = TRUE;
+	g_mutex_unlock(batch->mutex);
+
+	maki_dbus_batch_unref(batch);
+}
+
+/* Queues a signal.
+ * Under light load it is sent immediately, during bursts it is held back for a window
+ * that grows up to MAKI_DBUS_BATCH_WINDOW_MAX milliseconds. */
+void
+maki_dbus_batch_add (makiDBusBatch* batch, gchar const* name, GVariant* variant)
+{
+	gint64 now;
+
+	g_return_if_fail(batch != NULL);
+	g_return_if_fail(name != NULL);
+	g_return_if_fail(variant != NULL);
+
+	now = g_get_monotonic_time();
+
+	g_mutex_lock(batch->mutex);
+
+	if (batch->events == NULL)
+	{
+		batch->events = g_variant_builder_new(G_VARIANT_TYPE("a(sv)"));
+	}
+
+	g_variant_builder_add(batch->events, "(sv)", name, variant);
+	batch->length++;
+	batch->size += strlen(name) + g_variant_get_size(variant);
+
+	if (batch->length >= MAKI_DBUS_BATCH_EVENTS || batch->size >= MAKI_DBUS_BATCH_SIZE)
+	{
+		/* The pending timer will find an empty batch. */
+		maki_dbus_batch_flush(batch);
+	}
+	else if (batch->source == 0)
+	{
+		if (now - batch->last_flush >= MAKI_DBUS_BATCH_WINDOW_MAX * G_TIME_SPAN_MILLISECOND)
+		{
+			batch->window = 0;
+			maki_dbus_batch_flush(batch);
+		}
+		else
+		{
+			batch->window = CLAMP(batch->window * 2, MAKI_DBUS_BATCH_WINDOW_MIN, MAKI_DBUS_BATCH_WINDOW_MAX);
+			batch->source = i_timeout_add(batch->window, maki_dbus_batch_timeout, maki_dbus_batch_ref(batch), NULL);
+		}
+	}
+
+	g_mutex_unlock(batch->mutex);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+#include <ilib.h>
+
+#include "dbus_filter.h"
+
+/* NULL fields match everything. */
+struct maki_dbus_filter_rule
+{
+	gchar* server;
+	gchar* target;
+	gchar* event;
+};
+
+typedef struct maki_dbus_filter_rule makiDBusFilterRule;
+
+/* A signal matches a filter if it matches any of its rules. */
+struct maki_dbus_filter
+{
+	makiDBusFilterRule* rules;
+	guint length;
+};
+
+static
+gchar*
+maki_dbus_filter_field (gchar const* value)
+{
+	return (value[0] != '\0') ? g_strdup(value) : NULL;
+}
+
+/* Creates a filter from an a(sss) array of server, target and event rules.
+ * Returns NULL for an empty array, which means that nothing is filtered. */
+makiDBusFilter*
+maki_dbus_filter_new (GVariant* rules)
+{
+	GVariantIter iter;
+	gchar const* server;
+	gchar const* target;
+	gchar const* event;
+	guint i;
+	makiDBusFilter* filter;
+
+	g_return_val_if_fail(rules != NULL, NULL);
+
+	if (g_variant_n_children(rules) == 0)
+	{
+		return NULL;
+	}
+
+	filter = g_new(makiDBusFilter, 1);
+	filter->length = g_variant_n_children(rules);
+	filter->rules = g_new(makiDBusFilterRule, filter->length);
+
+	g_variant_iter_init(&iter, rules);
+
+	for (i = 0; g_variant_iter_next(&iter, "(&s&s&s)", &server, &target, &event); i++)
+	{
+		filter->rules[i].server = maki_dbus_filter_field(server);
+		filter->rules[i].target = maki_dbus_filter_field(target);
+		filter->rules[i].event = maki_dbus_filter_field(event);
+	}
+
+	return filter;
+}
+
+void
+maki_dbus_filter_free (gpointer data)
+{
+	makiDBusFilter* filter = data;
+	guint i;
+
+	if (filter == NULL)
+	{
+		return;
+	}
+
+	for (i = 0; i < filter->length; i++)
+	{
+		g_free(filter->rules[i].server);
+		g_free(filter->rules[i].target);
+		g_free(filter->rules[i].event);
+	}
+
+	g_free(filter->rules);
+	g_free(filter);
+}
+
+/* Checks whether a signal is wanted.
+ * server and target may be NULL for signals that do not have one.
+ * Targets are compared using case_mapping, which should be the one of server.
+ * A NULL filter matches everything. */
+gboolean
+maki_dbus_filter_match (makiDBusFilter const* filter, gchar const* event, gchar const* server, gchar const* target, iCaseMapping case_mapping)
+{
+	guint i;
+	GEqualFunc target_equal;
+
+	if (filter == NULL)
+	{
+		return TRUE;
+	}
+
+	for (i = 0; i < filter->length; i++)
+	{
+		if (filter->rules[i].event != NULL && strcmp(filter->rules[i].event, event) != 0)
+		{
+			continue;
+		}
+
+		if (filter->rules[i].server != NULL && (server == NULL || strcmp(filter->rules[i].server, server) != 0))
+		{
+			continue;
+		}
+
+		if (filter->rules[i].target != NULL)
+		{
+			if (target == NULL)
+			{
+				continue;
+			}
+
+			target_equal = i_case_mapping_equal_func(case_mapping);
+
+			if (!target_equal(filter->rules[i].target, target))
+			{
+				continue;
+			}
+		}
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <string.h>
+
+#include <ilib.h>
+
+#include "dbus_queue.h"
+
+#include "dbus.h"
+
+/* Rough size of a signal's header, added to the size of its body. */
+#define MAKI_DBUS_QUEUE_HEADER_SIZE 128
+
+/* Signals that only answer queries or refresh state the client can ask for again. */
+static gchar const* maki_dbus_queue_nonessential[] = {
+	"away_message",
+	"banlist",
+	"dcc_progress",
+	"dcc_send",
+	"list",
+	"motd",
+	"names",
+	"no_such",
+	"user_away",
+	"whois",
+	NULL
+};
+
+/* Accounts for messages handed to GDBus that have not been written yet.
+ * GDBus buffers without limit, so slow clients are detected by flushing
+ * the connection and subtracting what has been written in the meantime. */
+struct maki_dbus_queue
+{
+	gint ref_count;
+
+	GDBusConnection* connection;
+
+	/* Set once the owner is gone or the connection is being closed. */
+	gboolean closed;
+
+	/* Bytes handed to GDBus and not yet known to be written. */
+	gsize queued;
+	/* Bytes covered by the running flush. */
+	gsize flushing;
+	/* Whether a flush is scheduled or running. */
+	gboolean flush;
+
+	gsize limit;
+	/* Set while events are dropped until the client catches up. */
+	gboolean resync;
+	guint64 dropped;
+
+	GMutex mutex[1];
+};
+
+static
+makiDBusQueue*
+maki_dbus_queue_ref (makiDBusQueue* queue)
+{
+	g_atomic_int_inc(&queue->ref_count);
+
+	return queue;
+}
+
+static
+void
+maki_dbus_queue_unref (makiDBusQueue* queue)
+{
+	if (!g_atomic_int_dec_and_test(&queue->ref_count))
+	{
+		return;
+	}
+
+	g_object_unref(queue->connection);
+
+	g_mutex_clear(queue->mutex);
+
+	g_free(queue);
+}
+
+static
+gboolean
+maki_dbus_queue_is_essential (gchar const* name)
+{
+	guint i;
+
+	for (i = 0; maki_dbus_queue_nonessential[i] != NULL; i++)
+	{
+		if (strcmp(maki_dbus_queue_nonessential[i], name) == 0)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Has to be called with the queue locked. */
+static
+void
+maki_dbus_queue_send_unlocked (makiDBusQueue* queue, GDBusMessage* message, gsize size)
+{
+	GDBusSendMessageFlags flags = G_DBUS_SEND_MESSAGE_FLAGS_NONE;
+
+	queue->queued += size + MAKI_DBUS_QUEUE_HEADER_SIZE;
+
+	/* Locked messages are shared between connections and already have a serial. */
+	if (g_dbus_message_get_locked(message))
+	{
+		flags = G_DBUS_SEND_MESSAGE_FLAGS_PRESERVE_SERIAL;
+	}
+
+	g_dbus_connection_send_message(queue->connection, message, flags, NULL, NULL);
+}
+
+/* Has to be called with the queue locked. */
+static
+void
+maki_dbus_queue_send_resync (makiDBusQueue* queue)
+{
+	GDBusMessage* message;
+	GTimeVal timeval;
+
+	g_get_current_time(&timeval);
+
+	message = g_dbus_message_new_signal(SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, "resync");
+	g_dbus_message_set_sender(message, SUSHI_DBUS_SERVICE);
+	g_dbus_message_set_body(message, g_variant_new("(xt)", (gint64)timeval.tv_sec, queue->dropped));
+
+	maki_dbus_queue_send_unlocked(queue, message, 0);
+
+	g_object_unref(message);
+
+	queue->resync = FALSE;
+}
+
+static void maki_dbus_queue_flush (makiDBusQueue*);
+
+static
+void
+maki_dbus_queue_flushed_cb (GObject* object, GAsyncResult* result, gpointer data)
+{
+	makiDBusQueue* queue = data;
+
+	g_dbus_connection_flush_finish(queue->connection, result, NULL);
+
+	g_mutex_lock(queue->mutex);
+
+	queue->queued -= MIN(queue->queued, queue->flushing);
+	queue->flushing = 0;
+
+	/* Let the client know once it has caught up. */
+	if (queue->resync && !queue->closed && queue->queued <= queue->limit / 2)
+	{
+		maki_dbus_queue_send_resync(queue);
+	}
+
+	if (queue->queued > 0 && !queue->closed)
+	{
+		g_mutex_unlock(queue->mutex);
+		maki_dbus_queue_flush(queue);
+		return;
+	}
+
+	queue->flush = FALSE;
+
+	g_mutex_unlock(queue->mutex);
+
+	maki_dbus_queue_unref(queue);
+}
+
+/* Takes over the reference held by the flush. */
+static
+void
+maki_dbus_queue_flush (makiDBusQueue* queue)
+{
+	g_mutex_lock(queue->mutex);
+	queue->flushing = queue->queued;
+	g_mutex_unlock(queue->mutex);
+
+	g_dbus_connection_flush(queue->connection, NULL, maki_dbus_queue_flushed_cb, queue);
+}
+
+/* Flushes are started from the default main context, whose loop is always running. */
+static
+gboolean
+maki_dbus_queue_flush_idle (gpointer data)
+{
+	maki_dbus_queue_flush(data);
+
+	return FALSE;
+}
+
+makiDBusQueuePolicy
+maki_dbus_queue_policy (gchar const* policy)
+{
+	if (g_strcmp0(policy, "resync") == 0)
+	{
+		return MAKI_DBUS_QUEUE_POLICY_RESYNC;
+	}
+	else if (g_strcmp0(policy, "disconnect") == 0)
+	{
+		return MAKI_DBUS_QUEUE_POLICY_DISCONNECT;
+	}
+
+	return MAKI_DBUS_QUEUE_POLICY_DROP;
+}
+
+makiDBusQueue*
+maki_dbus_queue_new (GDBusConnection* connection)
+{
+	makiDBusQueue* queue;
+
+	g_return_val_if_fail(connection != NULL, NULL);
+
+	queue = g_new(makiDBusQueue, 1);
+	queue->ref_count = 1;
+	queue->connection = g_object_ref(connection);
+	queue->closed = FALSE;
+	queue->queued = 0;
+	queue->flushing = 0;
+	queue->flush = FALSE;
+	queue->limit = 0;
+	queue->resync = FALSE;
+	queue->dropped = 0;
+
+	g_mutex_init(queue->mutex);
+
+	return queue;
+}
+
+/* A running flush keeps the queue alive until it finishes. */
+void
+maki_dbus_queue_free (makiDBusQueue* queue)
+{
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	g_mutex_lock(queue->mutex);
+	queue->closed = TRUE;
+	g_mutex_unlock(queue->mutex);
+
+	maki_dbus_queue_unref(queue);
+}
+
+/* Decides whether the signal name may be queued.
+ * Once more than limit bytes are outstanding, policy determines what happens.
+ * A limit of 0 disables the check. */
+gboolean
+maki_dbus_queue_admit (makiDBusQueue* queue, gchar const* name, gsize limit, makiDBusQueuePolicy policy)
+{
+	gboolean ret = TRUE;
+	gboolean disconnect = FALSE;
+
+	g_return_val_if_fail(queue != NULL, FALSE);
+
+	g_mutex_lock(queue->mutex);
+
+	queue->limit = limit;
+
+	if (queue->closed)
+	{
+		ret = FALSE;
+	}
+	else if (queue->resync)
+	{
+		/* The client has to resynchronize anyway. */
+		queue->dropped++;
+		ret = FALSE;
+	}
+	else if (limit > 0 && queue->queued >= limit)
+	{
+		switch (policy)
+		{
+			case MAKI_DBUS_QUEUE_POLICY_DROP:
+				if (!maki_dbus_queue_is_essential(name))
+				{
+					queue->dropped++;
+					ret = FALSE;
+				}
+				break;
+			case MAKI_DBUS_QUEUE_POLICY_RESYNC:
+				queue->resync = TRUE;
+				queue->dropped++;
+				ret = FALSE;
+				break;
+			case MAKI_DBUS_QUEUE_POLICY_DISCONNECT:
+				queue->closed = TRUE;
+				queue->dropped++;
+				disconnect = TRUE;
+				ret = FALSE;
+				break;
+			default:
+				g_warn_if_reached();
+		}
+	}
+
+	g_mutex_unlock(queue->mutex);
+
+	if (disconnect)
+	{
+		g_dbus_connection_close(queue->connection, NULL, NULL, NULL);
+	}
+
+	return ret;
+}
+
+/* Sends message, size is the size of its body. */
+void
+maki_dbus_queue_send (makiDBusQueue* queue, GDBusMessage* message, gsize size)
+{
+	g_return_if_fail(queue != NULL);
+	g_return_if_fail(message != NULL);
+
+	g_mutex_lock(queue->mutex);
+
+	if (queue->closed)
+	{
+		g_mutex_unlock(queue->mutex);
+		return;
+	}
+
+	maki_dbus_queue_send_unlocked(queue, message, size);
+
+	if (!queue->flush)
+	{
+		queue->flush = TRUE;
+		i_idle_add(maki_dbus_queue_flush_idle, maki_dbus_queue_ref(queue), NULL);
+	}
+
+	g_mutex_unlock(queue->mutex);
+}
+
+void
+maki_dbus_queue_stats (makiDBusQueue* queue, guint64* queued, guint64* dropped)
+{
+	g_return_if_fail(queue != NULL);
+
+	g_mutex_lock(queue->mutex);
+	*queued = queue->queued;
+	*dropped = queue->dropped;
+	g_mutex_unlock(queue->mutex);
+}
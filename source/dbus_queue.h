@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef H_DBUS_QUEUE
+#define H_DBUS_QUEUE
+
+struct maki_dbus_queue;
+
+typedef struct maki_dbus_queue makiDBusQueue;
+
+enum maki_dbus_queue_policy
+{
+	MAKI_DBUS_QUEUE_POLICY_DROP,
+	MAKI_DBUS_QUEUE_POLICY_RESYNC,
+	MAKI_DBUS_QUEUE_POLICY_DISCONNECT
+};
+
+typedef enum maki_dbus_queue_policy makiDBusQueuePolicy;
+
+#include <glib.h>
+#include <gio/gio.h>
+
+makiDBusQueuePolicy maki_dbus_queue_policy (gchar const*);
+
+makiDBusQueue* maki_dbus_queue_new (GDBusConnection*);
+void maki_dbus_queue_free (makiDBusQueue*);
+
+gboolean maki_dbus_queue_admit (makiDBusQueue*, gchar const*, gsize, makiDBusQueuePolicy);
+void maki_dbus_queue_send (makiDBusQueue*, GDBusMessage*, gsize);
+
+void maki_dbus_queue_stats (makiDBusQueue*, guint64*, guint64*);
+
+#endif
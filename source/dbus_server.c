@@ -30,10 +30,19 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+#include <string.h>
+
 #include "dbus_server.h"
 
 #include "dbus.h"
+#include "dbus_batch.h"
+#include "dbus_filter.h"
+#include "dbus_queue.h"
+#include "event.h"
+#include "instance.h"
+#include "maki.h"
 #include "misc.h"
+#include "stats.h"
 
 makiDBusServer* dbus_server = NULL;
 
@@ -42,659 +51,1621 @@ struct maki_dbus_server
 	GDBusServer* server;
 	GDBusNodeInfo* introspection;
 
+	/* List of makiDBusServerConnection. */
 	GSList* connections;
+	guint64 connections_id;
+	GMutex mutex[1];
+
+	/* Serial of the last shared signal, see maki_dbus_server_emit.
+	 * A shared message is sent unchanged to every connection, so it has to carry its own serial instead of one assigned by the connection.
+	 * Each GDBus connection numbers its outgoing messages (mostly method replies) from 1 upwards, so the shared serials start at G_MAXINT32 / 2
+	 * and wrap back to it before reaching G_MAXINT32. This assumes that no connection sends more than G_MAXINT32 / 2 messages of its own,
+	 * otherwise a client could see a reply and a signal with the same serial.
+	 * Protected by mutex. */
+	guint32 serial;
+
+	/* Maps signal names to makiDBusServerSignalStats, protected by mutex. */
+	GHashTable* signals;
+
+	/* Sends signals published by the server threads. */
+	makiEventConsumer* consumer;
 };
 
-void
-maki_dbus_server_message_handler (GDBusConnection* connection, const gchar* sender, const gchar* path, const gchar* interface, const gchar* method, GVariant* parameters, GDBusMethodInvocation* invocation, gpointer data)
+struct maki_dbus_server_connection
 {
-	gchar* tmp;
+	guint64 id;
+	GDBusConnection* connection;
+	makiDBusQueue* queue;
+	makiDBusFilter* filter;
+	/* Only set if the client enabled the events capability. */
+	makiDBusBatch* batch;
+};
 
-	tmp = g_variant_print(parameters, TRUE);
-	maki_debug("METHOD %s: %s %s %s\n", path, interface, method, tmp);
-	g_free(tmp);
+typedef struct maki_dbus_server_connection makiDBusServerConnection;
 
-#if 0
-	if (g_strcmp0(path, "/org/freedesktop/DBus") == 0
-	    && g_strcmp0(interface, "org.freedesktop.DBus") == 0)
+/* Counters of the work maki_dbus_server_emit does per signal. */
+struct maki_dbus_server_signal_stats
+{
+	/* Messages allocated, at most one per emitted signal. */
+	guint64 messages;
+	/* Copies handed to GDBus, which serializes the message once for each of them. */
+	guint64 serializations;
+	/* Body bytes of all copies. */
+	guint64 bytes;
+	/* Signals added to event batches instead. */
+	guint64 batched;
+};
+
+typedef struct maki_dbus_server_signal_stats makiDBusServerSignalStats;
+
+typedef void (*makiDBusServerMethodFunc) (GDBusConnection*, const gchar*, GVariant*, GDBusMethodInvocation*);
+
+/* Methods are dispatched by name, parameters have to match signature. */
+struct maki_dbus_server_method
+{
+	const gchar* name;
+	const gchar* signature;
+	makiDBusServerMethodFunc func;
+};
+
+typedef struct maki_dbus_server_method makiDBusServerMethod;
+
+static void
+maki_dbus_server_connection_free (makiDBusServerConnection* conn)
+{
+	maki_dbus_filter_free(conn->filter);
+	/* The batch sends through the queue. */
+	maki_dbus_batch_free(conn->batch);
+	maki_dbus_queue_free(conn->queue);
+	g_free(conn);
+}
+
+static void
+maki_dbus_server_connection_send (GDBusMessage* message, gsize size, gpointer data)
+{
+	makiDBusServerConnection* conn = data;
+
+	maki_dbus_queue_send(conn->queue, message, size);
+}
+
+static makiDBusServerConnection*
+maki_dbus_server_find_connection (makiDBusServer* dserv, GDBusConnection* connection)
+{
+	GSList* list;
+
+	for (list = dserv->connections; list != NULL; list = list->next)
 	{
-		if (g_strcmp0(method, "AddMatch"))
-		{
-			const gchar* rule;
+		makiDBusServerConnection* conn = list->data;
 
-			g_variant_get(parameters, "(&s)", &rule);
-			g_dbus_method_invocation_return_value(invocation, NULL);
-		}
-		else if (g_strcmp0(method, "Hello"))
+		if (conn->connection == connection)
 		{
-			const gchar* id = "dummy";
-
-			g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", id));
+			return conn;
 		}
+	}
 
+	return NULL;
+}
+
+static void
+maki_dbus_server_method_action (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &message);
+
+	if (!maki_dbus_action(server, channel, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
 		return;
 	}
 
-	if (g_strcmp0(interface, SUSHI_DBUS_INTERFACE) != 0)
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_away (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s)", &server, &message);
+
+	if (!maki_dbus_away(server, message, &error))
 	{
+		g_dbus_method_invocation_take_error(invocation, error);
 		return;
 	}
-#endif
 
-	if (g_strcmp0(method, "action") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* message;
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &message);
-		maki_dbus_action(server, channel, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "away") == 0)
+static void
+maki_dbus_server_method_back (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_back(server, &error))
 	{
-		const gchar* server;
-		const gchar* message;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		g_variant_get(parameters, "(&s&s)", &server, &message);
-		maki_dbus_away(server, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_capabilities (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	const gchar** capabilities;
+	const gchar* enabled[2] = { NULL, NULL };
+	gboolean events = FALSE;
+	guint i;
+
+	g_variant_get(parameters, "(^a&s)", &capabilities);
+
+	for (i = 0; capabilities[i] != NULL; i++)
+	{
+		if (g_strcmp0(capabilities[i], "events") == 0)
+		{
+			events = TRUE;
+		}
 	}
-	else if (g_strcmp0(method, "back") == 0)
+
+	if (events)
 	{
-		const gchar* server;
+		enabled[0] = "events";
+	}
 
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_back(server, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	/* sender is only set on the session bus. */
+	if (sender != NULL)
+	{
+		maki_dbus_set_events(dbus, connection, sender, events);
 	}
-	else if (g_strcmp0(method, "channel_nicks") == 0)
+	else
 	{
-		const gchar* server;
-		const gchar* channel;
+		maki_dbus_server_set_events(dbus_server, connection, events);
+	}
 
-		gchar** nicks;
-		gchar** prefixes;
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", enabled));
 
-		g_variant_get(parameters, "(&s&s)", &server, &channel);
-		maki_dbus_channel_nicks(server, channel, &nicks, &prefixes, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as^as)", nicks, prefixes));
+	g_free(capabilities);
+}
 
-		g_strfreev(nicks);
-		g_strfreev(prefixes);
-	}
-	else if (g_strcmp0(method, "channel_topic") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
+static void
+maki_dbus_server_method_channel_nicks (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		gchar* topic;
+	const gchar* server;
+	const gchar* channel;
 
-		g_variant_get(parameters, "(&s&s)", &server, &channel);
-		maki_dbus_channel_topic(server, channel, &topic, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", topic));
+	gchar** nicks;
+	gchar** prefixes;
 
-		g_free(topic);
-	}
-	else if (g_strcmp0(method, "channels") == 0)
+	g_variant_get(parameters, "(&s&s)", &server, &channel);
+
+	if (!maki_dbus_channel_nicks(server, channel, &nicks, &prefixes, &error))
 	{
-		const gchar* server;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		gchar** channels;
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as^as)", nicks, prefixes));
 
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_channels(server, &channels, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", channels));
+	g_strfreev(nicks);
+	g_strfreev(prefixes);
+}
 
-		g_strfreev(channels);
-	}
-	else if (g_strcmp0(method, "config_get") == 0)
-	{
-		const gchar* group;
-		const gchar* key;
+static void
+maki_dbus_server_method_channel_nicks_delta (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		gchar* value;
+	const gchar* server;
+	const gchar* channel;
+	guint64 since;
 
-		g_variant_get(parameters, "(&s&s)", &group, &key);
-		maki_dbus_config_get(group, key, &value, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", value));
+	guint64 version;
+	gboolean snapshot;
+	gchar** operations;
+	gchar** nicks;
+	gchar** prefixes;
 
-		g_free(value);
-	}
-	else if (g_strcmp0(method, "config_set") == 0)
-	{
-		const gchar* group;
-		const gchar* key;
-		const gchar* value;
+	g_variant_get(parameters, "(&s&st)", &server, &channel, &since);
 
-		g_variant_get(parameters, "(&s&s&s)", &group, &key, &value);
-		maki_dbus_config_set(group, key, value, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "connect") == 0)
+	if (!maki_dbus_channel_nicks_delta(server, channel, since, &version, &snapshot, &operations, &nicks, &prefixes, &error))
 	{
-		const gchar* server;
-
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_connect(server, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "ctcp") == 0)
-	{
-		const gchar* server;
-		const gchar* target;
-		const gchar* message;
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &target, &message);
-		maki_dbus_ctcp(server, target, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "dcc_send") == 0)
-	{
-		const gchar* server;
-		const gchar* target;
-		const gchar* path_;
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(tb^as^as^as)", version, snapshot, operations, nicks, prefixes));
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &target, &path_);
-		maki_dbus_dcc_send(server, target, path_, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "dcc_sends") == 0)
-	{
-		GVariantBuilder* builder[5];
-
-		GArray* ids;
-		gchar** servers;
-		gchar** froms;
-		gchar** filenames;
-		GArray* sizes;
-		GArray* progresses;
-		GArray* speeds;
-		GArray* statuses;
-
-		maki_dbus_dcc_sends(&ids, &servers, &froms, &filenames, &sizes, &progresses, &speeds, &statuses, NULL);
-		builder[0] = maki_variant_builder_array_uint64(ids);
-		builder[1] = maki_variant_builder_array_uint64(sizes);
-		builder[2] = maki_variant_builder_array_uint64(progresses);
-		builder[3] = maki_variant_builder_array_uint64(speeds);
-		builder[4] = maki_variant_builder_array_uint64(statuses);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(at^as^as^asatatatat)", builder[0], servers, froms, filenames, builder[1], builder[2], builder[3], builder[4]));
-		g_variant_builder_unref(builder[0]);
-		g_variant_builder_unref(builder[1]);
-		g_variant_builder_unref(builder[2]);
-		g_variant_builder_unref(builder[3]);
-		g_variant_builder_unref(builder[4]);
-
-		g_array_free(ids, TRUE);
-		g_strfreev(servers);
-		g_strfreev(froms);
-		g_strfreev(filenames);
-		g_array_free(sizes, TRUE);
-		g_array_free(progresses, TRUE);
-		g_array_free(speeds, TRUE);
-		g_array_free(statuses, TRUE);
-	}
-	else if (g_strcmp0(method, "dcc_send_accept") == 0)
-	{
-		guint64 id;
-
-		g_variant_get(parameters, "(t)", &id);
-		maki_dbus_dcc_send_accept(id, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "dcc_send_get") == 0)
-	{
-		guint64 id;
-		const gchar* key;
+	g_strfreev(operations);
+	g_strfreev(nicks);
+	g_strfreev(prefixes);
+}
 
-		gchar* value;
+static void
+maki_dbus_server_method_channel_topic (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		g_variant_get(parameters, "(t&s)", &id, &key);
-		maki_dbus_dcc_send_get(id, key, &value, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", value));
+	const gchar* server;
+	const gchar* channel;
 
-		g_free(value);
-	}
-	else if (g_strcmp0(method, "dcc_send_remove") == 0)
-	{
-		guint64 id;
+	gchar* topic;
 
-		g_variant_get(parameters, "(t)", &id);
-		maki_dbus_dcc_send_remove(id, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "dcc_send_resume") == 0)
-	{
-		guint64 id;
+	g_variant_get(parameters, "(&s&s)", &server, &channel);
 
-		g_variant_get(parameters, "(t)", &id);
-		maki_dbus_dcc_send_resume(id, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "dcc_send_set") == 0)
+	if (!maki_dbus_channel_topic(server, channel, &topic, &error))
 	{
-		guint64 id;
-		const gchar* key;
-		const gchar* value;
-
-		g_variant_get(parameters, "(t&s&s)", &id, &key, &value);
-		maki_dbus_dcc_send_set(id, key, value, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "ignore") == 0)
-	{
-		const gchar* server;
-		const gchar* pattern;
 
-		g_variant_get(parameters, "(&s&s)", &server, &pattern);
-		maki_dbus_ignore(server, pattern, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "ignores") == 0)
-	{
-		const gchar* server;
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", topic));
 
-		gchar** ignores;
+	g_free(topic);
+}
 
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_ignores(server, &ignores, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", ignores));
+static void
+maki_dbus_server_method_channels (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		g_strfreev(ignores);
-	}
-	else if (g_strcmp0(method, "invite") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* who;
+	const gchar* server;
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &who);
-		maki_dbus_invite(server, channel, who, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	gchar** channels;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_channels(server, &channels, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "join") == 0)
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", channels));
+
+	g_strfreev(channels);
+}
+
+static void
+maki_dbus_server_method_clients (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GVariantBuilder* builder[3];
+
+	GArray* ids;
+	GArray* queued;
+	GArray* dropped;
+
+	maki_dbus_server_clients(dbus_server, &ids, &queued, &dropped);
+	builder[0] = maki_variant_builder_array_uint64(ids);
+	builder[1] = maki_variant_builder_array_uint64(queued);
+	builder[2] = maki_variant_builder_array_uint64(dropped);
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(atatat)", builder[0], builder[1], builder[2]));
+	g_variant_builder_unref(builder[0]);
+	g_variant_builder_unref(builder[1]);
+	g_variant_builder_unref(builder[2]);
+
+	g_array_free(ids, TRUE);
+	g_array_free(queued, TRUE);
+	g_array_free(dropped, TRUE);
+}
+
+static void
+maki_dbus_server_method_config_get (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* group;
+	const gchar* key;
+
+	gchar* value;
+
+	g_variant_get(parameters, "(&s&s)", &group, &key);
+
+	if (!maki_dbus_config_get(group, key, &value, &error))
 	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* key;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &key);
-		maki_dbus_join(server, channel, key, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", value));
+
+	g_free(value);
+}
+
+static void
+maki_dbus_server_method_config_set (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* group;
+	const gchar* key;
+	const gchar* value;
+
+	g_variant_get(parameters, "(&s&s&s)", &group, &key, &value);
+
+	if (!maki_dbus_config_set(group, key, value, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "kick") == 0)
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_connect (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_connect(server, &error))
 	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* who;
-		const gchar* message;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		g_variant_get(parameters, "(&s&s&s&s)", &server, &channel, &who, &message);
-		maki_dbus_kick(server, channel, who, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_ctcp (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* target;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &target, &message);
+
+	if (!maki_dbus_ctcp(server, target, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "list") == 0)
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_dcc_send (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* target;
+	const gchar* path_;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &target, &path_);
+
+	if (!maki_dbus_dcc_send(server, target, path_, &error))
 	{
-		const gchar* server;
-		const gchar* channel;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		g_variant_get(parameters, "(&s&s)", &server, &channel);
-		maki_dbus_list(server, channel, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_dcc_send_accept (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	guint64 id;
+
+	g_variant_get(parameters, "(t)", &id);
+
+	if (!maki_dbus_dcc_send_accept(id, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "log") == 0)
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_dcc_send_get (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	guint64 id;
+	const gchar* key;
+
+	gchar* value;
+
+	g_variant_get(parameters, "(t&s)", &id, &key);
+
+	if (!maki_dbus_dcc_send_get(id, key, &value, &error))
 	{
-		const gchar* server;
-		const gchar* target;
-		guint64 lines;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", value));
+
+	g_free(value);
+}
+
+static void
+maki_dbus_server_method_dcc_send_remove (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		gchar** log;
+	guint64 id;
 
-		g_variant_get(parameters, "(&s&st)", &server, &target, &lines);
-		maki_dbus_log(server, target, lines, &log, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", log));
+	g_variant_get(parameters, "(t)", &id);
 
-		g_strfreev(log);
+	if (!maki_dbus_dcc_send_remove(id, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "message") == 0)
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_dcc_send_resume (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	guint64 id;
+
+	g_variant_get(parameters, "(t)", &id);
+
+	if (!maki_dbus_dcc_send_resume(id, &error))
 	{
-		const gchar* server;
-		const gchar* target;
-		const gchar* message;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &target, &message);
-		maki_dbus_message(server, target, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_dcc_send_set (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	guint64 id;
+	const gchar* key;
+	const gchar* value;
+
+	g_variant_get(parameters, "(t&s&s)", &id, &key, &value);
+
+	if (!maki_dbus_dcc_send_set(id, key, value, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "mode") == 0)
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_dcc_sends (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	GVariantBuilder* builder[5];
+
+	GArray* ids;
+	gchar** servers;
+	gchar** froms;
+	gchar** filenames;
+	GArray* sizes;
+	GArray* progresses;
+	GArray* speeds;
+	GArray* statuses;
+
+	if (!maki_dbus_dcc_sends(&ids, &servers, &froms, &filenames, &sizes, &progresses, &speeds, &statuses, &error))
 	{
-		const gchar* server;
-		const gchar* target;
-		const gchar* mode;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	builder[0] = maki_variant_builder_array_uint64(ids);
+	builder[1] = maki_variant_builder_array_uint64(sizes);
+	builder[2] = maki_variant_builder_array_uint64(progresses);
+	builder[3] = maki_variant_builder_array_uint64(speeds);
+	builder[4] = maki_variant_builder_array_uint64(statuses);
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(at^as^as^asatatatat)", builder[0], servers, froms, filenames, builder[1], builder[2], builder[3], builder[4]));
+	g_variant_builder_unref(builder[0]);
+	g_variant_builder_unref(builder[1]);
+	g_variant_builder_unref(builder[2]);
+	g_variant_builder_unref(builder[3]);
+	g_variant_builder_unref(builder[4]);
+
+	g_array_free(ids, TRUE);
+	g_strfreev(servers);
+	g_strfreev(froms);
+	g_strfreev(filenames);
+	g_array_free(sizes, TRUE);
+	g_array_free(progresses, TRUE);
+	g_array_free(speeds, TRUE);
+	g_array_free(statuses, TRUE);
+}
+
+static void
+maki_dbus_server_method_event_queues (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GVariantBuilder* builder[3];
+
+	gchar** names;
+	GArray* depths;
+	GArray* max_depths;
+	GArray* processed;
+
+	maki_event_bus_stats(maki_instance_events(maki_instance_get_default()), &names, &depths, &max_depths, &processed);
+	builder[0] = maki_variant_builder_array_uint64(depths);
+	builder[1] = maki_variant_builder_array_uint64(max_depths);
+	builder[2] = maki_variant_builder_array_uint64(processed);
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^asatatat)", names, builder[0], builder[1], builder[2]));
+	g_variant_builder_unref(builder[0]);
+	g_variant_builder_unref(builder[1]);
+	g_variant_builder_unref(builder[2]);
+
+	g_strfreev(names);
+	g_array_free(depths, TRUE);
+	g_array_free(max_depths, TRUE);
+	g_array_free(processed, TRUE);
+}
+
+static void
+maki_dbus_server_method_ignore (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* pattern;
+
+	g_variant_get(parameters, "(&s&s)", &server, &pattern);
+
+	if (!maki_dbus_ignore(server, pattern, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_ignores (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	gchar** ignores;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_ignores(server, &ignores, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", ignores));
+
+	g_strfreev(ignores);
+}
+
+static void
+maki_dbus_server_method_invite (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* who;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &who);
+
+	if (!maki_dbus_invite(server, channel, who, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_join (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* key;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &key);
+
+	if (!maki_dbus_join(server, channel, key, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_kick (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* who;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s&s&s)", &server, &channel, &who, &message);
+
+	if (!maki_dbus_kick(server, channel, who, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_list (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+
+	g_variant_get(parameters, "(&s&s)", &server, &channel);
+
+	if (!maki_dbus_list(server, channel, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_log (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* target;
+	guint64 lines;
+
+	gchar** log;
+
+	g_variant_get(parameters, "(&s&st)", &server, &target, &lines);
+
+	if (!maki_dbus_log(server, target, lines, &log, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", log));
+
+	g_strfreev(log);
+}
+
+static void
+maki_dbus_server_method_message (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* target;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &target, &message);
+
+	if (!maki_dbus_message(server, target, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_mode (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* target;
+	const gchar* mode;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &target, &mode);
+
+	if (!maki_dbus_mode(server, target, mode, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_names (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+
+	g_variant_get(parameters, "(&s&s)", &server, &channel);
+
+	if (!maki_dbus_names(server, channel, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_nick (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* nick;
+
+	g_variant_get(parameters, "(&s&s)", &server, &nick);
+
+	if (!maki_dbus_nick(server, nick, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_nickserv (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_nickserv(server, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_notice (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* target;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &target, &message);
+
+	if (!maki_dbus_notice(server, target, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_oper (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* name;
+	const gchar* password;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &name, &password);
+
+	if (!maki_dbus_oper(server, name, password, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_part (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &message);
+
+	if (!maki_dbus_part(server, channel, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_quit (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s&s)", &server, &message);
+
+	if (!maki_dbus_quit(server, message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_raw (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* command;
+
+	g_variant_get(parameters, "(&s&s)", &server, &command);
+
+	if (!maki_dbus_raw(server, command, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_server_get (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* group;
+	const gchar* key;
+
+	gchar* value;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &group, &key);
+
+	if (!maki_dbus_server_get(server, group, key, &value, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", value));
+
+	g_free(value);
+}
+
+static void
+maki_dbus_server_method_server_get_list (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* group;
+	const gchar* key;
+
+	gchar** list;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &group, &key);
+
+	if (!maki_dbus_server_get_list(server, group, key, &list, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", list));
+
+	g_strfreev(list);
+}
+
+static void
+maki_dbus_server_method_server_list (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* group;
+
+	gchar** result;
+
+	g_variant_get(parameters, "(&s&s)", &server, &group);
+
+	if (!maki_dbus_server_list(server, group, &result, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", result));
+
+	g_strfreev(result);
+}
+
+static void
+maki_dbus_server_method_server_remove (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* group;
+	const gchar* key;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &group, &key);
+
+	if (!maki_dbus_server_remove(server, group, key, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_server_rename (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* old;
+	const gchar* new;
+
+	g_variant_get(parameters, "(&s&s)", &old, &new);
+
+	if (!maki_dbus_server_rename(old, new, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_server_set (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* group;
+	const gchar* key;
+	const gchar* value;
+
+	g_variant_get(parameters, "(&s&s&s&s)", &server, &group, &key, &value);
+
+	if (!maki_dbus_server_set(server, group, key, value, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_server_set_list (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* group;
+	const gchar* key;
+	gchar** list;
+
+	g_variant_get(parameters, "(&s&s&s^a&s)", &server, &group, &key, &list);
+
+	if (!maki_dbus_server_set_list(server, group, key, list, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+	}
+	else
+	{
+		g_dbus_method_invocation_return_value(invocation, NULL);
+	}
+
+	g_free(list);
+}
+
+static void
+maki_dbus_server_method_servers (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	gchar** servers;
+
+	if (!maki_dbus_servers(&servers, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", servers));
+
+	g_strfreev(servers);
+}
+
+static void
+maki_dbus_server_method_shutdown (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* message;
+
+	g_variant_get(parameters, "(&s)", &message);
+
+	if (!maki_dbus_shutdown(message, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_stats (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	g_dbus_method_invocation_return_value(invocation, maki_stats_collect(maki_instance_get_default()));
+}
+
+static void
+maki_dbus_server_method_subscribe (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GVariant* filters;
+
+	g_variant_get(parameters, "(@a(sss))", &filters);
+
+	/* sender is only set on the session bus. */
+	if (sender != NULL)
+	{
+		maki_dbus_subscribe(dbus, connection, sender, filters);
+	}
+	else
+	{
+		maki_dbus_server_subscribe(dbus_server, connection, filters);
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+
+	g_variant_unref(filters);
+}
+
+static void
+maki_dbus_server_method_support_chantypes (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	gchar* chantypes;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_support_chantypes(server, &chantypes, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", chantypes));
+
+	g_free(chantypes);
+}
+
+static void
+maki_dbus_server_method_support_prefix (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	gchar** prefix;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_support_prefix(server, &prefix, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", prefix));
+
+	g_strfreev(prefix);
+}
+
+static void
+maki_dbus_server_method_support_tokens (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+
+	gchar** names;
+	gchar** values;
+
+	g_variant_get(parameters, "(&s)", &server);
+
+	if (!maki_dbus_support_tokens(server, &names, &values, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as^as)", names, values));
+
+	g_strfreev(names);
+	g_strfreev(values);
+}
+
+static void
+maki_dbus_server_method_topic (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* topic;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &topic);
+
+	if (!maki_dbus_topic(server, channel, topic, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_unignore (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* pattern;
+
+	g_variant_get(parameters, "(&s&s)", &server, &pattern);
+
+	if (!maki_dbus_unignore(server, pattern, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void
+maki_dbus_server_method_user_away (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* nick;
+
+	gboolean away;
+
+	g_variant_get(parameters, "(&s&s)", &server, &nick);
+
+	if (!maki_dbus_user_away(server, nick, &away, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(b)", away));
+}
+
+static void
+maki_dbus_server_method_user_channel_mode (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* nick;
+
+	gchar* mode;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &nick);
+
+	if (!maki_dbus_user_channel_mode(server, channel, nick, &mode, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", mode));
+
+	g_free(mode);
+}
+
+static void
+maki_dbus_server_method_user_channel_prefix (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
+
+	const gchar* server;
+	const gchar* channel;
+	const gchar* nick;
+
+	gchar* prefix;
+
+	g_variant_get(parameters, "(&s&s&s)", &server, &channel, &nick);
+
+	if (!maki_dbus_user_channel_prefix(server, channel, nick, &prefix, &error))
+	{
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
+
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", prefix));
+
+	g_free(prefix);
+}
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &target, &mode);
-		maki_dbus_mode(server, target, mode, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "names") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
+static void
+maki_dbus_server_method_user_from (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		g_variant_get(parameters, "(&s&s)", &server, &channel);
-		maki_dbus_names(server, channel, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "nick") == 0)
-	{
-		const gchar* server;
-		const gchar* nick;
+	const gchar* server;
+	const gchar* nick;
 
-		g_variant_get(parameters, "(&s&s)", &server, &nick);
-		maki_dbus_nick(server, nick, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "nickserv") == 0)
-	{
-		const gchar* server;
+	gchar* from;
 
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_nickserv(server, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "notice") == 0)
-	{
-		const gchar* server;
-		const gchar* target;
-		const gchar* message;
+	g_variant_get(parameters, "(&s&s)", &server, &nick);
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &target, &message);
-		maki_dbus_notice(server, target, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "oper") == 0)
+	if (!maki_dbus_user_from(server, nick, &from, &error))
 	{
-		const gchar* server;
-		const gchar* name;
-		const gchar* password;
-
-		g_variant_get(parameters, "(&s&s&s)", &server, &name, &password);
-		maki_dbus_oper(server, name, password, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "part") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* message;
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &message);
-		maki_dbus_part(server, channel, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "quit") == 0)
-	{
-		const gchar* server;
-		const gchar* message;
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", from));
 
-		g_variant_get(parameters, "(&s&s)", &server, &message);
-		maki_dbus_quit(server, message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "raw") == 0)
-	{
-		const gchar* server;
-		const gchar* command;
+	g_free(from);
+}
 
-		g_variant_get(parameters, "(&s&s)", &server, &command);
-		maki_dbus_raw(server, command, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "server_get") == 0)
-	{
-		const gchar* server;
-		const gchar* group;
-		const gchar* key;
+static void
+maki_dbus_server_method_version (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		gchar* value;
+	GVariantBuilder* builder;
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &group, &key);
-		maki_dbus_server_get(server, group, key, &value, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", value));
+	GArray* version;
 
-		g_free(value);
-	}
-	else if (g_strcmp0(method, "server_get_list") == 0)
+	if (!maki_dbus_version(&version, &error))
 	{
-		const gchar* server;
-		const gchar* group;
-		const gchar* key;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		gchar** list;
+	builder = maki_variant_builder_array_uint64(version);
+	g_dbus_method_invocation_return_value(invocation, g_variant_new("(at)", builder));
+	g_variant_builder_unref(builder);
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &group, &key);
-		maki_dbus_server_get_list(server, group, key, &list, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", list));
+	g_array_free(version, TRUE);
+}
 
-		g_strfreev(list);
-	}
-	else if (g_strcmp0(method, "server_list") == 0)
-	{
-		const gchar* server;
-		const gchar* group;
+static void
+maki_dbus_server_method_who (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		gchar** result;
+	const gchar* server;
+	const gchar* mask;
+	gboolean operators_only;
 
-		g_variant_get(parameters, "(&s&s)", &server, &group);
-		maki_dbus_server_list(server, group, &result, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", result));
+	g_variant_get(parameters, "(&s&sb)", &server, &mask, &operators_only);
 
-		g_strfreev(result);
-	}
-	else if (g_strcmp0(method, "server_remove") == 0)
+	if (!maki_dbus_who(server, mask, operators_only, &error))
 	{
-		const gchar* server;
-		const gchar* group;
-		const gchar* key;
-
-		g_variant_get(parameters, "(&s&s&s)", &server, &group, &key);
-		maki_dbus_server_remove(server, group, key, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
 	}
-	else if (g_strcmp0(method, "server_rename") == 0)
-	{
-		const gchar* old;
-		const gchar* new;
 
-		g_variant_get(parameters, "(&s&s)", &old, &new);
-		maki_dbus_server_rename(old, new, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "server_set") == 0)
-	{
-		const gchar* server;
-		const gchar* group;
-		const gchar* key;
-		const gchar* value;
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
 
-		g_variant_get(parameters, "(&s&s&s&s)", &server, &group, &key, &value);
-		maki_dbus_server_set(server, group, key, value, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "server_set_list") == 0)
-	{
-		const gchar* server;
-		const gchar* group;
-		const gchar* key;
-		gchar** list;
+static void
+maki_dbus_server_method_whois (GDBusConnection* connection, const gchar* sender, GVariant* parameters, GDBusMethodInvocation* invocation)
+{
+	GError* error = NULL;
 
-		g_variant_get(parameters, "(&s&s&s^a&s)", &server, &group, &key, &list);
-		maki_dbus_server_set_list(server, group, key, list, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	const gchar* server;
+	const gchar* mask;
 
-		g_free(list);
-	}
-	else if (g_strcmp0(method, "servers") == 0)
+	g_variant_get(parameters, "(&s&s)", &server, &mask);
+
+	if (!maki_dbus_whois(server, mask, &error))
 	{
-		gchar** servers;
+		g_dbus_method_invocation_take_error(invocation, error);
+		return;
+	}
 
-		maki_dbus_servers(&servers, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", servers));
+	g_dbus_method_invocation_return_value(invocation, NULL);
+}
 
-		g_strfreev(servers);
-	}
-	else if (g_strcmp0(method, "shutdown") == 0)
-	{
-		const gchar* message;
+static const makiDBusServerMethod maki_dbus_server_methods[] = {
+	{ "action", "(sss)", maki_dbus_server_method_action },
+	{ "away", "(ss)", maki_dbus_server_method_away },
+	{ "back", "(s)", maki_dbus_server_method_back },
+	{ "capabilities", "(as)", maki_dbus_server_method_capabilities },
+	{ "channel_nicks", "(ss)", maki_dbus_server_method_channel_nicks },
+	{ "channel_nicks_delta", "(sst)", maki_dbus_server_method_channel_nicks_delta },
+	{ "channel_topic", "(ss)", maki_dbus_server_method_channel_topic },
+	{ "channels", "(s)", maki_dbus_server_method_channels },
+	{ "clients", "()", maki_dbus_server_method_clients },
+	{ "config_get", "(ss)", maki_dbus_server_method_config_get },
+	{ "config_set", "(sss)", maki_dbus_server_method_config_set },
+	{ "connect", "(s)", maki_dbus_server_method_connect },
+	{ "ctcp", "(sss)", maki_dbus_server_method_ctcp },
+	{ "dcc_send", "(sss)", maki_dbus_server_method_dcc_send },
+	{ "dcc_send_accept", "(t)", maki_dbus_server_method_dcc_send_accept },
+	{ "dcc_send_get", "(ts)", maki_dbus_server_method_dcc_send_get },
+	{ "dcc_send_remove", "(t)", maki_dbus_server_method_dcc_send_remove },
+	{ "dcc_send_resume", "(t)", maki_dbus_server_method_dcc_send_resume },
+	{ "dcc_send_set", "(tss)", maki_dbus_server_method_dcc_send_set },
+	{ "dcc_sends", "()", maki_dbus_server_method_dcc_sends },
+	{ "event_queues", "()", maki_dbus_server_method_event_queues },
+	{ "ignore", "(ss)", maki_dbus_server_method_ignore },
+	{ "ignores", "(s)", maki_dbus_server_method_ignores },
+	{ "invite", "(sss)", maki_dbus_server_method_invite },
+	{ "join", "(sss)", maki_dbus_server_method_join },
+	{ "kick", "(ssss)", maki_dbus_server_method_kick },
+	{ "list", "(ss)", maki_dbus_server_method_list },
+	{ "log", "(sst)", maki_dbus_server_method_log },
+	{ "message", "(sss)", maki_dbus_server_method_message },
+	{ "mode", "(sss)", maki_dbus_server_method_mode },
+	{ "names", "(ss)", maki_dbus_server_method_names },
+	{ "nick", "(ss)", maki_dbus_server_method_nick },
+	{ "nickserv", "(s)", maki_dbus_server_method_nickserv },
+	{ "notice", "(sss)", maki_dbus_server_method_notice },
+	{ "oper", "(sss)", maki_dbus_server_method_oper },
+	{ "part", "(sss)", maki_dbus_server_method_part },
+	{ "quit", "(ss)", maki_dbus_server_method_quit },
+	{ "raw", "(ss)", maki_dbus_server_method_raw },
+	{ "server_get", "(sss)", maki_dbus_server_method_server_get },
+	{ "server_get_list", "(sss)", maki_dbus_server_method_server_get_list },
+	{ "server_list", "(ss)", maki_dbus_server_method_server_list },
+	{ "server_remove", "(sss)", maki_dbus_server_method_server_remove },
+	{ "server_rename", "(ss)", maki_dbus_server_method_server_rename },
+	{ "server_set", "(ssss)", maki_dbus_server_method_server_set },
+	{ "server_set_list", "(sssas)", maki_dbus_server_method_server_set_list },
+	{ "servers", "()", maki_dbus_server_method_servers },
+	{ "shutdown", "(s)", maki_dbus_server_method_shutdown },
+	{ "stats", "()", maki_dbus_server_method_stats },
+	{ "subscribe", "(a(sss))", maki_dbus_server_method_subscribe },
+	{ "support_chantypes", "(s)", maki_dbus_server_method_support_chantypes },
+	{ "support_prefix", "(s)", maki_dbus_server_method_support_prefix },
+	{ "support_tokens", "(s)", maki_dbus_server_method_support_tokens },
+	{ "topic", "(sss)", maki_dbus_server_method_topic },
+	{ "unignore", "(ss)", maki_dbus_server_method_unignore },
+	{ "user_away", "(ss)", maki_dbus_server_method_user_away },
+	{ "user_channel_mode", "(sss)", maki_dbus_server_method_user_channel_mode },
+	{ "user_channel_prefix", "(sss)", maki_dbus_server_method_user_channel_prefix },
+	{ "user_from", "(ss)", maki_dbus_server_method_user_from },
+	{ "version", "()", maki_dbus_server_method_version },
+	{ "who", "(ssb)", maki_dbus_server_method_who },
+	{ "whois", "(ss)", maki_dbus_server_method_whois },
+};
 
-		g_variant_get(parameters, "(&s)", &message);
-		maki_dbus_shutdown(message, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "support_chantypes") == 0)
-	{
-		const gchar* server;
+static GHashTable* maki_dbus_server_methods_table = NULL;
 
-		gchar* chantypes;
+static gpointer
+maki_dbus_server_methods_init (gpointer data)
+{
+	guint i;
 
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_support_chantypes(server, &chantypes, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", chantypes));
+	maki_dbus_server_methods_table = g_hash_table_new(g_str_hash, g_str_equal);
 
-		g_free(chantypes);
-	}
-	else if (g_strcmp0(method, "support_prefix") == 0)
+	for (i = 0; i < G_N_ELEMENTS(maki_dbus_server_methods); i++)
 	{
-		const gchar* server;
+		g_hash_table_insert(maki_dbus_server_methods_table, (gpointer)maki_dbus_server_methods[i].name, (gpointer)&maki_dbus_server_methods[i]);
+	}
 
-		gchar** prefix;
+	return NULL;
+}
 
-		g_variant_get(parameters, "(&s)", &server);
-		maki_dbus_support_prefix(server, &prefix, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(^as)", prefix));
+static const makiDBusServerMethod*
+maki_dbus_server_method_lookup (const gchar* name)
+{
+	static GOnce once = G_ONCE_INIT;
 
-		g_strfreev(prefix);
-	}
-	else if (g_strcmp0(method, "topic") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* topic;
+	g_once(&once, maki_dbus_server_methods_init, NULL);
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &topic);
-		maki_dbus_topic(server, channel, topic, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "unignore") == 0)
-	{
-		const gchar* server;
-		const gchar* pattern;
+	return g_hash_table_lookup(maki_dbus_server_methods_table, name);
+}
 
-		g_variant_get(parameters, "(&s&s)", &server, &pattern);
-		maki_dbus_unignore(server, pattern, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "user_away") == 0)
-	{
-		const gchar* server;
-		const gchar* nick;
+/* Warns about methods of the interface that are missing from the dispatch table
+ * or whose arguments differ from it. */
+void
+maki_dbus_server_check_interface (GDBusInterfaceInfo* info)
+{
+	guint i;
 
-		gboolean away;
+	g_return_if_fail(info != NULL);
 
-		g_variant_get(parameters, "(&s&s)", &server, &nick);
-		maki_dbus_user_away(server, nick, &away, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(b)", away));
-	}
-	else if (g_strcmp0(method, "user_channel_mode") == 0)
+	for (i = 0; info->methods != NULL && info->methods[i] != NULL; i++)
 	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* nick;
+		GDBusMethodInfo* method_info = info->methods[i];
+		GString* signature;
+		guint j;
+		const makiDBusServerMethod* method;
 
-		gchar* mode;
+		if ((method = maki_dbus_server_method_lookup(method_info->name)) == NULL)
+		{
+			g_warning("Method %s is not implemented.", method_info->name);
+			continue;
+		}
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &nick);
-		maki_dbus_user_channel_mode(server, channel, nick, &mode, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", mode));
+		signature = g_string_new("(");
 
-		g_free(mode);
-	}
-	else if (g_strcmp0(method, "user_channel_prefix") == 0)
-	{
-		const gchar* server;
-		const gchar* channel;
-		const gchar* nick;
+		for (j = 0; method_info->in_args != NULL && method_info->in_args[j] != NULL; j++)
+		{
+			g_string_append(signature, method_info->in_args[j]->signature);
+		}
 
-		gchar* prefix;
+		g_string_append_c(signature, ')');
 
-		g_variant_get(parameters, "(&s&s&s)", &server, &channel, &nick);
-		maki_dbus_user_channel_prefix(server, channel, nick, &prefix, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", prefix));
+		if (strcmp(signature->str, method->signature) != 0)
+		{
+			g_warning("Method %s expects %s instead of %s.", method_info->name, method->signature, signature->str);
+		}
 
-		g_free(prefix);
+		g_string_free(signature, TRUE);
 	}
-	else if (g_strcmp0(method, "user_from") == 0)
-	{
-		const gchar* server;
-		const gchar* nick;
+}
 
-		gchar* from;
+void
+maki_dbus_server_message_handler (GDBusConnection* connection, const gchar* sender, const gchar* path, const gchar* interface, const gchar* method, GVariant* parameters, GDBusMethodInvocation* invocation, gpointer data)
+{
+	const makiDBusServerMethod* m;
 
-		g_variant_get(parameters, "(&s&s)", &server, &nick);
-		maki_dbus_user_from(server, nick, &from, NULL);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", from));
+	/* Extra check to avoid printing parameters when verbose is disabled. */
+	if (opt_verbose)
+	{
+		gchar* tmp;
 
-		g_free(from);
+		tmp = g_variant_print(parameters, TRUE);
+		maki_debug("METHOD %s: %s %s %s\n", path, interface, method, tmp);
+		g_free(tmp);
 	}
-	else if (g_strcmp0(method, "version") == 0)
+
+#if 0
+	if (g_strcmp0(path, "/org/freedesktop/DBus") == 0
+	    && g_strcmp0(interface, "org.freedesktop.DBus") == 0)
 	{
-		GVariantBuilder* builder;
+		if (g_strcmp0(method, "AddMatch"))
+		{
+			const gchar* rule;
 
-		GArray* version;
+			g_variant_get(parameters, "(&s)", &rule);
+			g_dbus_method_invocation_return_value(invocation, NULL);
+		}
+		else if (g_strcmp0(method, "Hello"))
+		{
+			const gchar* id = "dummy";
 
-		maki_dbus_version(&version, NULL);
-		builder = maki_variant_builder_array_uint64(version);
-		g_dbus_method_invocation_return_value(invocation, g_variant_new("(at)", builder));
-		g_variant_builder_unref(builder);
+			g_dbus_method_invocation_return_value(invocation, g_variant_new("(s)", id));
+		}
 
-		g_array_free(version, TRUE);
+		return;
 	}
-	else if (g_strcmp0(method, "who") == 0)
-	{
-		const gchar* server;
-		const gchar* mask;
-		gboolean operators_only;
 
-		g_variant_get(parameters, "(&s&sb)", &server, &mask, &operators_only);
-		maki_dbus_who(server, mask, operators_only, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
-	else if (g_strcmp0(method, "whois") == 0)
+	if (g_strcmp0(interface, SUSHI_DBUS_INTERFACE) != 0)
 	{
-		const gchar* server;
-		const gchar* mask;
+		return;
+	}
+#endif
 
-		g_variant_get(parameters, "(&s&s)", &server, &mask);
-		maki_dbus_whois(server, mask, NULL);
-		g_dbus_method_invocation_return_value(invocation, NULL);
+	if ((m = maki_dbus_server_method_lookup(method)) == NULL)
+	{
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "No such method %s.", method);
+		return;
 	}
-	else
+
+	if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE(m->signature)))
 	{
-		g_dbus_method_invocation_return_dbus_error(invocation, "de.sushi.ikkoku.error", "No such method.");
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Method %s expects %s, got %s.", method, m->signature, g_variant_get_type_string(parameters));
+		return;
 	}
+
+	m->func(connection, sender, parameters, invocation);
 }
 
 static void
 maki_dbus_server_connection_closed_cb (GDBusConnection* connection, gboolean peer_vanished, GError* error, gpointer data)
 {
 	makiDBusServer* dserv = data;
+	makiDBusServerConnection* conn;
 
 	maki_debug("disconnected %p\n", (gpointer)connection);
 
-	dserv->connections = g_slist_remove(dserv->connections, connection);
+	g_mutex_lock(dserv->mutex);
+
+	if ((conn = maki_dbus_server_find_connection(dserv, connection)) != NULL)
+	{
+		dserv->connections = g_slist_remove(dserv->connections, conn);
+		maki_dbus_server_connection_free(conn);
+	}
+
+	g_mutex_unlock(dserv->mutex);
+
 	g_object_unref(connection);
 }
 
+static void
+maki_dbus_server_consume (makiEvent const* event, gpointer data)
+{
+	makiDBusServer* dserv = data;
+
+	maki_dbus_server_emit(dserv, event->name, event->server, event->target, event->case_mapping, event->variant);
+}
+
 static gboolean
 maki_dbus_server_new_connection_cb (GDBusServer* server, GDBusConnection* connection, gpointer data)
 {
@@ -705,6 +1676,7 @@ maki_dbus_server_new_connection_cb (GDBusServer* server, GDBusConnection* connec
 	};
 
 	makiDBusServer* dserv = data;
+	makiDBusServerConnection* conn;
 
 	maki_debug("new connection %p\n", (gpointer)connection);
 
@@ -715,7 +1687,16 @@ maki_dbus_server_new_connection_cb (GDBusServer* server, GDBusConnection* connec
 	g_dbus_connection_register_object(connection, "/org/freedesktop/DBus", dserv->introspection->interfaces[0], &vtable, dserv, NULL, NULL);
 #endif
 
-	dserv->connections = g_slist_prepend(dserv->connections, connection);
+	conn = g_new(makiDBusServerConnection, 1);
+	conn->connection = connection;
+	conn->queue = maki_dbus_queue_new(connection);
+	conn->filter = NULL;
+	conn->batch = NULL;
+
+	g_mutex_lock(dserv->mutex);
+	conn->id = ++dserv->connections_id;
+	dserv->connections = g_slist_prepend(dserv->connections, conn);
+	g_mutex_unlock(dserv->mutex);
 
 	g_signal_connect(connection, "closed", G_CALLBACK(maki_dbus_server_connection_closed_cb), dserv);
 
@@ -744,6 +1725,15 @@ maki_dbus_server_new (void)
 		dserv->server = server;
 		dserv->introspection = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
 		dserv->connections = NULL;
+		dserv->connections_id = 0;
+		dserv->serial = G_MAXINT32 / 2;
+		dserv->signals = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+		g_mutex_init(dserv->mutex);
+
+		maki_dbus_server_check_interface(g_dbus_node_info_lookup_interface(dserv->introspection, SUSHI_DBUS_INTERFACE));
+
+		dserv->consumer = maki_event_bus_add_consumer(maki_instance_events(maki_instance_get_default()), "dbus_server", MAKI_EVENT_MASK(MAKI_EVENT_SIGNAL), maki_dbus_server_consume, dserv);
 
 		g_free(introspection_xml);
 
@@ -762,13 +1752,37 @@ maki_dbus_server_new (void)
 void
 maki_dbus_server_free (makiDBusServer* dserv)
 {
+	GSList* connections = NULL;
 	GSList* list;
 
+	/* Sends all pending signals. */
+	maki_event_bus_remove_consumer(maki_instance_events(maki_instance_get_default()), dserv->consumer);
+
+	g_mutex_lock(dserv->mutex);
+
 	for (list = dserv->connections; list != NULL; list = list->next)
+	{
+		makiDBusServerConnection* conn = list->data;
+
+		connections = g_slist_prepend(connections, g_object_ref(conn->connection));
+	}
+
+	g_mutex_unlock(dserv->mutex);
+
+	/* The closed callback modifies dserv->connections. */
+	for (list = connections; list != NULL; list = list->next)
 	{
 		GDBusConnection* connection = list->data;
 
 		g_dbus_connection_close_sync(connection, NULL, NULL);
+		g_object_unref(connection);
+	}
+
+	g_slist_free(connections);
+
+	for (list = dserv->connections; list != NULL; list = list->next)
+	{
+		maki_dbus_server_connection_free(list->data);
 	}
 
 	g_slist_free(dserv->connections);
@@ -778,6 +1792,9 @@ maki_dbus_server_free (makiDBusServer* dserv)
 
 	g_dbus_node_info_unref(dserv->introspection);
 
+	g_hash_table_destroy(dserv->signals);
+	g_mutex_clear(dserv->mutex);
+
 	g_free(dserv);
 }
 
@@ -787,22 +1804,234 @@ maki_dbus_server_address (makiDBusServer* dserv)
 	return g_dbus_server_get_client_address(dserv->server);
 }
 
+/* Replaces the filter of the given connection.
+ * An empty filter makes the connection receive all signals again. */
+void
+maki_dbus_server_subscribe (makiDBusServer* dserv, GDBusConnection* connection, GVariant* filters)
+{
+	makiDBusFilter* filter;
+	makiDBusServerConnection* conn;
+
+	g_return_if_fail(dserv != NULL);
+
+	filter = maki_dbus_filter_new(filters);
+
+	g_mutex_lock(dserv->mutex);
+
+	if ((conn = maki_dbus_server_find_connection(dserv, connection)) != NULL)
+	{
+		maki_dbus_filter_free(conn->filter);
+		conn->filter = filter;
+		filter = NULL;
+	}
+
+	g_mutex_unlock(dserv->mutex);
+
+	maki_dbus_filter_free(filter);
+}
+
+/* Switches the given connection between separate signals and batched events signals. */
 void
-maki_dbus_server_emit (makiDBusServer* dserv, const gchar* name, GVariant* variant)
+maki_dbus_server_set_events (makiDBusServer* dserv, GDBusConnection* connection, gboolean events)
+{
+	makiDBusServerConnection* conn;
+
+	g_return_if_fail(dserv != NULL);
+
+	g_mutex_lock(dserv->mutex);
+
+	if ((conn = maki_dbus_server_find_connection(dserv, connection)) != NULL)
+	{
+		if (events && conn->batch == NULL)
+		{
+			conn->batch = maki_dbus_batch_new(connection, NULL, maki_dbus_server_connection_send, conn);
+		}
+		else if (!events && conn->batch != NULL)
+		{
+			maki_dbus_batch_free(conn->batch);
+			conn->batch = NULL;
+		}
+	}
+
+	g_mutex_unlock(dserv->mutex);
+}
+
+/* Returns whether any connection wants the given signal. */
+gboolean
+maki_dbus_server_wants (makiDBusServer* dserv, const gchar* name, const gchar* server, const gchar* target, iCaseMapping case_mapping)
 {
-	GDBusMessage* message;
+	gboolean ret = FALSE;
 	GSList* list;
 
-	message = g_dbus_message_new_signal(SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name);
-	g_dbus_message_set_sender(message, SUSHI_DBUS_SERVICE);
-	g_dbus_message_set_body(message, variant);
+	g_return_val_if_fail(dserv != NULL, FALSE);
+
+	g_mutex_lock(dserv->mutex);
 
 	for (list = dserv->connections; list != NULL; list = list->next)
 	{
-		GDBusConnection* connection = list->data;
+		makiDBusServerConnection* conn = list->data;
+
+		if (maki_dbus_filter_match(conn->filter, name, server, target, case_mapping))
+		{
+			ret = TRUE;
+			break;
+		}
+	}
+
+	g_mutex_unlock(dserv->mutex);
+
+	return ret;
+}
+
+/* Returns the outbound counters of all connections. */
+void
+maki_dbus_server_clients (makiDBusServer* dserv, GArray** ids, GArray** queued, GArray** dropped)
+{
+	GSList* list;
+
+	*ids = g_array_new(FALSE, FALSE, sizeof(guint64));
+	*queued = g_array_new(FALSE, FALSE, sizeof(guint64));
+	*dropped = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+	if (dserv == NULL)
+	{
+		return;
+	}
+
+	g_mutex_lock(dserv->mutex);
+
+	for (list = dserv->connections; list != NULL; list = list->next)
+	{
+		makiDBusServerConnection* conn = list->data;
+		guint64 conn_queued;
+		guint64 conn_dropped;
+
+		maki_dbus_queue_stats(conn->queue, &conn_queued, &conn_dropped);
+
+		g_array_append_val(*ids, conn->id);
+		g_array_append_val(*queued, conn_queued);
+		g_array_append_val(*dropped, conn_dropped);
+	}
+
+	g_mutex_unlock(dserv->mutex);
+}
+
+/* Returns a floating a{sa{st}} mapping signal names to the counters of maki_dbus_server_emit.
+ * dserv may be NULL, in which case the dictionary is empty. */
+GVariant*
+maki_dbus_server_signal_stats (makiDBusServer* dserv)
+{
+	GHashTableIter iter;
+	GVariantBuilder builder;
+	gpointer key, value;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa{st}}"));
+
+	if (dserv == NULL)
+	{
+		return g_variant_builder_end(&builder);
+	}
+
+	g_mutex_lock(dserv->mutex);
+
+	g_hash_table_iter_init(&iter, dserv->signals);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		GVariantBuilder counters;
+		makiDBusServerSignalStats* stats = value;
+
+		g_variant_builder_init(&counters, G_VARIANT_TYPE("a{st}"));
+		g_variant_builder_add(&counters, "{st}", "batched", stats->batched);
+		g_variant_builder_add(&counters, "{st}", "bytes", stats->bytes);
+		g_variant_builder_add(&counters, "{st}", "messages", stats->messages);
+		g_variant_builder_add(&counters, "{st}", "serializations", stats->serializations);
+
+		g_variant_builder_add(&builder, "{s@a{st}}", key, g_variant_builder_end(&counters));
+	}
+
+	g_mutex_unlock(dserv->mutex);
+
+	return g_variant_builder_end(&builder);
+}
 
-		g_dbus_connection_send_message(connection, message, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+void
+maki_dbus_server_emit (makiDBusServer* dserv, const gchar* name, const gchar* server, const gchar* target, iCaseMapping case_mapping, GVariant* variant)
+{
+	GDBusMessage* message = NULL;
+	GSList* list;
+	gsize limit;
+	makiDBusServerSignalStats* stats = NULL;
+	makiDBusQueuePolicy policy;
+	makiInstanceConfig const* config;
+
+	config = maki_instance_config_snapshot(maki_instance_get_default());
+	limit = (gsize)MAX(config->dbus.queue_limit, 0) * 1024;
+	policy = maki_dbus_queue_policy(config->dbus.queue_policy);
+	maki_instance_config_snapshot_unref(maki_instance_get_default(), config);
+
+	g_mutex_lock(dserv->mutex);
+
+	for (list = dserv->connections; list != NULL; list = list->next)
+	{
+		makiDBusServerConnection* conn = list->data;
+
+		if (!maki_dbus_filter_match(conn->filter, name, server, target, case_mapping))
+		{
+			continue;
+		}
+
+		if (!maki_dbus_queue_admit(conn->queue, name, limit, policy))
+		{
+			continue;
+		}
+
+		if (stats == NULL && (stats = g_hash_table_lookup(dserv->signals, name)) == NULL)
+		{
+			stats = g_new0(makiDBusServerSignalStats, 1);
+			g_hash_table_insert(dserv->signals, g_strdup(name), stats);
+		}
+
+		if (conn->batch != NULL)
+		{
+			maki_dbus_batch_add(conn->batch, name, variant);
+			stats->batched++;
+			continue;
+		}
+
+		/* Only build the message once a connection wants it.
+		 * It is locked and shared by all connections, therefore it needs its own serial. */
+		if (message == NULL)
+		{
+			guint32 serial;
+
+			/* Wraps around before reaching the serials of method replies again. */
+			if (dserv->serial >= G_MAXINT32)
+			{
+				dserv->serial = G_MAXINT32 / 2;
+			}
+
+			serial = ++dserv->serial;
+
+			message = g_dbus_message_new_signal(SUSHI_DBUS_PATH, SUSHI_DBUS_INTERFACE, name);
+			g_dbus_message_set_sender(message, SUSHI_DBUS_SERVICE);
+			g_dbus_message_set_body(message, variant);
+			g_dbus_message_set_serial(message, serial);
+			g_dbus_message_lock(message);
+
+			stats->messages++;
+		}
+
+		maki_dbus_queue_send(conn->queue, message, g_variant_get_size(variant));
+
+		stats->serializations++;
+		stats->bytes += g_variant_get_size(variant);
 	}
 
-	g_object_unref(message);
+	g_mutex_unlock(dserv->mutex);
+
+	if (message != NULL)
+	{
+		g_object_unref(message);
+	}
 }
@@ -36,13 +36,21 @@ typedef struct maki_dbus_server makiDBusServer;
 
 #include <gio/gio.h>
 
+#include <ilib.h>
+
 makiDBusServer* maki_dbus_server_new (void);
 void maki_dbus_server_free (makiDBusServer*);
 
 const gchar* maki_dbus_server_address (makiDBusServer*);
 
-void maki_dbus_server_emit (makiDBusServer*, const gchar*, GVariant*);
+void maki_dbus_server_subscribe (makiDBusServer*, GDBusConnection*, GVariant*);
+void maki_dbus_server_set_events (makiDBusServer*, GDBusConnection*, gboolean);
+gboolean maki_dbus_server_wants (makiDBusServer*, const gchar*, const gchar*, const gchar*, iCaseMapping);
+void maki_dbus_server_clients (makiDBusServer*, GArray**, GArray**, GArray**);
+GVariant* maki_dbus_server_signal_stats (makiDBusServer*);
+void maki_dbus_server_emit (makiDBusServer*, const gchar*, const gchar*, const gchar*, iCaseMapping, GVariant*);
 
+void maki_dbus_server_check_interface (GDBusInterfaceInfo*);
 void maki_dbus_server_message_handler (GDBusConnection*, const gchar*, const gchar*, const gchar*, const gchar*, GVariant*, GDBusMethodInvocation*, gpointer);
 
 extern makiDBusServer* dbus_server;
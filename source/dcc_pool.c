@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <ilib.h>
+
+#include "dcc_pool.h"
+
+struct maki_dcc_pool_worker
+{
+	GMainContext* main_context;
+	GMainLoop* main_loop;
+	GThread* thread;
+};
+
+typedef struct maki_dcc_pool_worker makiDCCPoolWorker;
+
+/* A fixed number of threads that run DCC transfers, each with its own main context.
+ * Transfers are spread over them in turn and stay on their thread until they are freed. */
+struct maki_dcc_pool
+{
+	makiDCCPoolWorker* workers;
+	guint count;
+
+	/* The worker to hand out next. */
+	gint next;
+};
+
+static
+gpointer
+maki_dcc_pool_thread (gpointer data)
+{
+	makiDCCPoolWorker* worker = data;
+
+	g_main_context_push_thread_default(worker->main_context);
+	g_main_loop_run(worker->main_loop);
+	g_main_context_pop_thread_default(worker->main_context);
+
+	return NULL;
+}
+
+/* Runs after the idle callbacks queued before it, so transfers that are being freed are gone when the thread ends. */
+static
+gboolean
+maki_dcc_pool_quit (gpointer data)
+{
+	makiDCCPoolWorker* worker = data;
+
+	g_main_loop_quit(worker->main_loop);
+
+	return FALSE;
+}
+
+makiDCCPool*
+maki_dcc_pool_new (guint count)
+{
+	guint i;
+	makiDCCPool* pool;
+
+	pool = g_new(makiDCCPool, 1);
+	pool->count = MAX(count, 1);
+	pool->workers = g_new(makiDCCPoolWorker, pool->count);
+	pool->next = 0;
+
+	for (i = 0; i < pool->count; i++)
+	{
+		gchar* name;
+		makiDCCPoolWorker* worker = &(pool->workers[i]);
+
+		name = g_strdup_printf("makiDCC-%u", i);
+
+		worker->main_context = g_main_context_new();
+		worker->main_loop = g_main_loop_new(worker->main_context, FALSE);
+		worker->thread = g_thread_new(name, maki_dcc_pool_thread, worker);
+
+		g_free(name);
+	}
+
+	return pool;
+}
+
+void
+maki_dcc_pool_free (makiDCCPool* pool)
+{
+	guint i;
+
+	g_return_if_fail(pool != NULL);
+
+	for (i = 0; i < pool->count; i++)
+	{
+		i_idle_add(maki_dcc_pool_quit, &(pool->workers[i]), pool->workers[i].main_context);
+	}
+
+	for (i = 0; i < pool->count; i++)
+	{
+		makiDCCPoolWorker* worker = &(pool->workers[i]);
+
+		g_thread_join(worker->thread);
+
+		g_main_loop_unref(worker->main_loop);
+		g_main_context_unref(worker->main_context);
+	}
+
+	g_free(pool->workers);
+	g_free(pool);
+}
+
+GMainContext*
+maki_dcc_pool_context (makiDCCPool* pool)
+{
+	guint i;
+
+	g_return_val_if_fail(pool != NULL, NULL);
+
+	i = (guint)g_atomic_int_add(&(pool->next), 1) % pool->count;
+
+	return pool->workers[i].main_context;
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <ilib.h>
+
+#include "dcc_ports.h"
+
+#include "network.h"
+
+/* Hands out listening ports for outgoing transfers from the configured range.
+ * Released ports are handed out again first, so that their UPnP mappings can be reused.
+ * The mappings are only removed when the range changes or the allocator is freed.
+ * Ports that drop out of the range while a transfer still uses them keep their mapping until they are released. */
+struct maki_dcc_ports
+{
+	makiInstance* instance;
+
+	/* Configuration generation the range was last checked against. */
+	guint64 generation;
+
+	guint first;
+	guint last;
+
+	/* One bit per port in the range. */
+	guint32* used;
+	guint32* mapped;
+	/* Ports that were in use or mapped before the range changed.
+	 * They come back through free, so next skips them. */
+	guint32* carried;
+	/* Mapped ports outside of the range that are still in use. */
+	GHashTable* stale;
+
+	/* Released ports, most recently released first. */
+	GQueue* free;
+	/* Ports that could not be bound, they are only tried again if nothing else is left. */
+	GQueue* busy;
+	/* Ports from here to last have never been handed out. */
+	guint next;
+
+	GMutex mutex[1];
+};
+
+static
+gboolean
+maki_dcc_ports_test (guint32 const* bits, guint index)
+{
+	return (bits[index / 32] & (1U << (index % 32))) != 0;
+}
+
+static
+void
+maki_dcc_ports_set (guint32* bits, guint index, gboolean value)
+{
+	if (value)
+	{
+		bits[index / 32] |= (1U << (index % 32));
+	}
+	else
+	{
+		bits[index / 32] &= ~(1U << (index % 32));
+	}
+}
+
+static
+gboolean
+maki_dcc_ports_contains (makiDCCPorts* ports, guint port)
+{
+	return (ports->used != NULL && port >= ports->first && port <= ports->last);
+}
+
+/* Must be called with the allocator lock held.
+ * Ports that are still in use keep their bits if they are part of the new range, otherwise they become stale. */
+static
+void
+maki_dcc_ports_reset (makiDCCPorts* ports, guint first, guint last)
+{
+	guint port;
+	gpointer key;
+	GHashTableIter iter;
+	guint32* used = NULL;
+	guint32* mapped = NULL;
+	guint32* carried = NULL;
+	makiNetwork* net = maki_instance_network(ports->instance);
+
+	if (first <= last)
+	{
+		used = g_new0(guint32, (last - first) / 32 + 1);
+		mapped = g_new0(guint32, (last - first) / 32 + 1);
+		carried = g_new0(guint32, (last - first) / 32 + 1);
+	}
+
+	g_queue_clear(ports->free);
+	g_queue_clear(ports->busy);
+
+	g_hash_table_iter_init(&iter, ports->stale);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		port = GPOINTER_TO_UINT(key);
+
+		if (used != NULL && port >= first && port <= last)
+		{
+			maki_dcc_ports_set(used, port - first, TRUE);
+			maki_dcc_ports_set(mapped, port - first, TRUE);
+			maki_dcc_ports_set(carried, port - first, TRUE);
+
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	if (ports->used != NULL)
+	{
+		for (port = ports->first; port <= ports->last; port++)
+		{
+			guint index = port - ports->first;
+
+			if (used != NULL && port >= first && port <= last)
+			{
+				maki_dcc_ports_set(used, port - first, maki_dcc_ports_test(ports->used, index));
+				maki_dcc_ports_set(mapped, port - first, maki_dcc_ports_test(ports->mapped, index));
+				maki_dcc_ports_set(carried, port - first, maki_dcc_ports_test(ports->used, index) || maki_dcc_ports_test(ports->mapped, index));
+
+				if (maki_dcc_ports_test(ports->mapped, index) && !maki_dcc_ports_test(ports->used, index))
+				{
+					g_queue_push_tail(ports->free, GUINT_TO_POINTER(port));
+				}
+			}
+			else if (maki_dcc_ports_test(ports->mapped, index))
+			{
+				if (maki_dcc_ports_test(ports->used, index))
+				{
+					g_hash_table_add(ports->stale, GUINT_TO_POINTER(port));
+				}
+				else
+				{
+					maki_network_upnp_remove_port(net, port);
+				}
+			}
+		}
+
+		g_free(ports->used);
+		g_free(ports->mapped);
+		g_free(ports->carried);
+	}
+
+	ports->first = first;
+	ports->last = last;
+	ports->used = used;
+	ports->mapped = mapped;
+	ports->carried = carried;
+	ports->next = first;
+}
+
+makiDCCPorts*
+maki_dcc_ports_new (makiInstance* instance)
+{
+	makiDCCPorts* ports;
+
+	g_return_val_if_fail(instance != NULL, NULL);
+
+	ports = g_new(makiDCCPorts, 1);
+	ports->instance = instance;
+	ports->generation = 0;
+	ports->first = 1;
+	ports->last = 0;
+	ports->used = NULL;
+	ports->mapped = NULL;
+	ports->carried = NULL;
+	ports->stale = g_hash_table_new(g_direct_hash, g_direct_equal);
+	ports->free = g_queue_new();
+	ports->busy = g_queue_new();
+	ports->next = 1;
+
+	g_mutex_init(ports->mutex);
+
+	return ports;
+}
+
+/* Removes all remaining UPnP mappings. */
+void
+maki_dcc_ports_free (makiDCCPorts* ports)
+{
+	gpointer key;
+	GHashTableIter iter;
+
+	g_return_if_fail(ports != NULL);
+
+	maki_dcc_ports_reset(ports, 1, 0);
+
+	g_hash_table_iter_init(&iter, ports->stale);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		maki_network_upnp_remove_port(maki_instance_network(ports->instance), GPOINTER_TO_UINT(key));
+	}
+
+	g_hash_table_destroy(ports->stale);
+	g_queue_free(ports->free);
+	g_queue_free(ports->busy);
+
+	g_mutex_clear(ports->mutex);
+
+	g_free(ports);
+}
+
+/* Returns a channel listening on a free port and stores the port, or returns NULL if the range is exhausted. */
+GIOChannel*
+maki_dcc_ports_listen (makiDCCPorts* ports, guint16* port)
+{
+	guint candidate = 0;
+	guint retries;
+	gboolean map = FALSE;
+	GIOChannel* channel = NULL;
+	makiInstanceConfig const* config;
+
+	g_return_val_if_fail(ports != NULL, NULL);
+	g_return_val_if_fail(port != NULL, NULL);
+
+	config = maki_instance_config_snapshot(ports->instance);
+
+	g_mutex_lock(ports->mutex);
+
+	if (ports->generation != config->generation)
+	{
+		guint first;
+		guint last;
+
+		first = CLAMP(config->dcc.port_first, 1, G_MAXUINT16);
+		last = CLAMP(config->dcc.port_last, 0, G_MAXUINT16);
+
+		if (ports->used == NULL || first != ports->first || last != ports->last)
+		{
+			maki_dcc_ports_reset(ports, first, last);
+		}
+
+		ports->generation = config->generation;
+	}
+
+	maki_instance_config_snapshot_unref(ports->instance, config);
+
+	retries = g_queue_get_length(ports->busy);
+
+	while (channel == NULL)
+	{
+		if (!g_queue_is_empty(ports->free))
+		{
+			candidate = GPOINTER_TO_UINT(g_queue_pop_head(ports->free));
+		}
+		else if (ports->used != NULL && ports->next <= ports->last)
+		{
+			candidate = ports->next++;
+
+			/* Carried over from before the range changed, so it is either in use or handed out through free. */
+			if (maki_dcc_ports_test(ports->carried, candidate - ports->first))
+			{
+				continue;
+			}
+		}
+		else if (retries > 0)
+		{
+			candidate = GPOINTER_TO_UINT(g_queue_pop_head(ports->busy));
+			retries--;
+		}
+		else
+		{
+			break;
+		}
+
+		if ((channel = i_io_channel_unix_new_listen(NULL, candidate, TRUE)) == NULL)
+		{
+			g_queue_push_tail(ports->busy, GUINT_TO_POINTER(candidate));
+		}
+	}
+
+	if (channel != NULL)
+	{
+		maki_dcc_ports_set(ports->used, candidate - ports->first, TRUE);
+
+		if (!maki_dcc_ports_test(ports->mapped, candidate - ports->first))
+		{
+			maki_dcc_ports_set(ports->mapped, candidate - ports->first, TRUE);
+			map = TRUE;
+		}
+	}
+
+	g_mutex_unlock(ports->mutex);
+
+	/* Adding a mapping may block, so it happens without the lock. */
+	if (map && !maki_network_upnp_add_port(maki_instance_network(ports->instance), candidate, "maki DCC Send"))
+	{
+		g_mutex_lock(ports->mutex);
+
+		if (maki_dcc_ports_contains(ports, candidate))
+		{
+			maki_dcc_ports_set(ports->mapped, candidate - ports->first, FALSE);
+		}
+
+		g_mutex_unlock(ports->mutex);
+	}
+
+	*port = candidate;
+
+	return channel;
+}
+
+/* Makes the port available again, its UPnP mapping is kept for the next transfer unless the port has left the range. */
+void
+maki_dcc_ports_release (makiDCCPorts* ports, guint16 port)
+{
+	gboolean unmap = FALSE;
+
+	g_return_if_fail(ports != NULL);
+
+	g_mutex_lock(ports->mutex);
+
+	if (maki_dcc_ports_contains(ports, port) && maki_dcc_ports_test(ports->used, port - ports->first))
+	{
+		maki_dcc_ports_set(ports->used, port - ports->first, FALSE);
+		g_queue_push_head(ports->free, GUINT_TO_POINTER((guint)port));
+	}
+	else
+	{
+		unmap = g_hash_table_remove(ports->stale, GUINT_TO_POINTER((guint)port));
+	}
+
+	g_mutex_unlock(ports->mutex);
+
+	/* The range changed while the port was in use. */
+	if (unmap)
+	{
+		maki_network_upnp_remove_port(maki_instance_network(ports->instance), port);
+	}
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <ilib.h>
+
+#include "dcc_scheduler.h"
+
+/* A transfer may wait until at least this many bytes are allowed, so that it does not send tiny chunks. */
+#define MAKI_DCC_SCHEDULER_CHUNK 4096
+
+/* Hands out slots for running transfers and limits their bandwidth.
+ * The limits are read from the configuration, so they can be changed at runtime. */
+struct maki_dcc_scheduler
+{
+	makiInstance* instance;
+
+	/* Number of slots that are currently running. */
+	guint active;
+	/* Slots waiting for a free place, sorted by priority and then by arrival. */
+	GQueue* waiting;
+
+	/* Configuration generation the waiting slots were last checked against. */
+	guint64 generation;
+
+	GMutex mutex[1];
+};
+
+struct maki_dcc_scheduler_slot
+{
+	makiDCCScheduler* scheduler;
+
+	/* The start function is called on this context. */
+	GMainContext* main_context;
+	makiDCCSchedulerStartFunc start;
+	gpointer data;
+	/* Idle source that is about to call the start function. */
+	guint source;
+
+	gint priority;
+
+	gboolean active;
+	gboolean waiting;
+
+	/* Token bucket, in bytes. */
+	gdouble tokens;
+	gint64 time;
+};
+
+/* Must be called with the scheduler lock held. */
+static
+void
+maki_dcc_scheduler_enqueue (makiDCCScheduler* scheduler, makiDCCSchedulerSlot* slot)
+{
+	GList* link;
+
+	for (link = scheduler->waiting->head; link != NULL; link = link->next)
+	{
+		makiDCCSchedulerSlot* other = link->data;
+
+		if (other->priority < slot->priority)
+		{
+			break;
+		}
+	}
+
+	if (link != NULL)
+	{
+		g_queue_insert_before(scheduler->waiting, link, slot);
+	}
+	else
+	{
+		g_queue_push_tail(scheduler->waiting, slot);
+	}
+
+	slot->waiting = TRUE;
+}
+
+static
+gboolean
+maki_dcc_scheduler_slot_start (gpointer data)
+{
+	gboolean active;
+	makiDCCSchedulerSlot* slot = data;
+
+	g_mutex_lock(slot->scheduler->mutex);
+	slot->source = 0;
+	active = slot->active;
+	g_mutex_unlock(slot->scheduler->mutex);
+
+	if (active)
+	{
+		slot->start(slot->data);
+	}
+
+	return FALSE;
+}
+
+/* Must be called with the scheduler lock held.
+ * Promoted slots are only marked as active, they are started from an idle on their own context.
+ * The idle is added under the lock, so that releasing the slot can still remove it. */
+static
+void
+maki_dcc_scheduler_promote (makiDCCScheduler* scheduler, makiInstanceConfig const* config)
+{
+	scheduler->generation = config->generation;
+
+	while (!g_queue_is_empty(scheduler->waiting) && (config->dcc.max_active <= 0 || scheduler->active < (guint)config->dcc.max_active))
+	{
+		makiDCCSchedulerSlot* slot;
+
+		slot = g_queue_pop_head(scheduler->waiting);
+		slot->waiting = FALSE;
+		slot->active = TRUE;
+		slot->tokens = 0;
+		slot->time = g_get_monotonic_time();
+
+		scheduler->active++;
+
+		slot->source = i_idle_add(maki_dcc_scheduler_slot_start, slot, slot->main_context);
+	}
+}
+
+makiDCCScheduler*
+maki_dcc_scheduler_new (makiInstance* inst)
+{
+	makiDCCScheduler* scheduler;
+
+	scheduler = g_new(makiDCCScheduler, 1);
+	scheduler->instance = inst;
+	scheduler->active = 0;
+	scheduler->waiting = g_queue_new();
+	scheduler->generation = 0;
+
+	g_mutex_init(scheduler->mutex);
+
+	return scheduler;
+}
+
+void
+maki_dcc_scheduler_free (makiDCCScheduler* scheduler)
+{
+	g_return_if_fail(scheduler != NULL);
+
+	g_queue_free(scheduler->waiting);
+
+	g_mutex_clear(scheduler->mutex);
+
+	g_free(scheduler);
+}
+
+makiDCCSchedulerSlot*
+maki_dcc_scheduler_slot_new (makiDCCScheduler* scheduler, GMainContext* main_context, makiDCCSchedulerStartFunc start, gpointer data)
+{
+	makiDCCSchedulerSlot* slot;
+
+	g_return_val_if_fail(scheduler != NULL, NULL);
+	g_return_val_if_fail(main_context != NULL, NULL);
+
+	slot = g_new(makiDCCSchedulerSlot, 1);
+	slot->scheduler = scheduler;
+	slot->main_context = g_main_context_ref(main_context);
+	slot->start = start;
+	slot->data = data;
+	slot->source = 0;
+	slot->priority = 0;
+	slot->active = FALSE;
+	slot->waiting = FALSE;
+	slot->tokens = 0;
+	slot->time = 0;
+
+	return slot;
+}
+
+void
+maki_dcc_scheduler_slot_free (makiDCCSchedulerSlot* slot)
+{
+	g_return_if_fail(slot != NULL);
+
+	maki_dcc_scheduler_slot_release(slot);
+
+	g_main_context_unref(slot->main_context);
+
+	g_free(slot);
+}
+
+/* Returns TRUE if the slot may run right away.
+ * Otherwise, it is queued and its start function is called once a place becomes free. */
+gboolean
+maki_dcc_scheduler_slot_request (makiDCCSchedulerSlot* slot)
+{
+	gboolean ret = FALSE;
+	makiInstanceConfig const* config;
+	makiDCCScheduler* scheduler;
+
+	g_return_val_if_fail(slot != NULL, FALSE);
+
+	scheduler = slot->scheduler;
+	config = maki_instance_config_snapshot(scheduler->instance);
+
+	g_mutex_lock(scheduler->mutex);
+
+	if (slot->active || slot->waiting)
+	{
+		ret = slot->active;
+	}
+	else if (g_queue_is_empty(scheduler->waiting) && (config->dcc.max_active <= 0 || scheduler->active < (guint)config->dcc.max_active))
+	{
+		slot->active = TRUE;
+		slot->tokens = 0;
+		slot->time = g_get_monotonic_time();
+
+		scheduler->active++;
+
+		ret = TRUE;
+	}
+	else
+	{
+		maki_dcc_scheduler_enqueue(scheduler, slot);
+	}
+
+	g_mutex_unlock(scheduler->mutex);
+
+	maki_instance_config_snapshot_unref(scheduler->instance, config);
+
+	return ret;
+}
+
+void
+maki_dcc_scheduler_slot_release (makiDCCSchedulerSlot* slot)
+{
+	makiInstanceConfig const* config;
+	makiDCCScheduler* scheduler;
+
+	g_return_if_fail(slot != NULL);
+
+	scheduler = slot->scheduler;
+	config = maki_instance_config_snapshot(scheduler->instance);
+
+	g_mutex_lock(scheduler->mutex);
+
+	if (slot->waiting)
+	{
+		g_queue_remove(scheduler->waiting, slot);
+		slot->waiting = FALSE;
+	}
+	else if (slot->active)
+	{
+		if (slot->source != 0)
+		{
+			i_source_remove(slot->source, slot->main_context);
+			slot->source = 0;
+		}
+
+		slot->active = FALSE;
+		scheduler->active--;
+
+		maki_dcc_scheduler_promote(scheduler, config);
+	}
+
+	g_mutex_unlock(scheduler->mutex);
+
+	maki_instance_config_snapshot_unref(scheduler->instance, config);
+}
+
+/* Returns how many bytes the slot may transfer now, G_MAXSIZE if it is not limited.
+ * If it returns 0, delay is set to the number of milliseconds to wait before asking again.
+ * Running transfers share the global limit equally, each of them is also held to the per-transfer limit. */
+gsize
+maki_dcc_scheduler_slot_available (makiDCCSchedulerSlot* slot, guint* delay)
+{
+	gsize ret;
+	gint64 now;
+	gdouble rate = 0;
+	gdouble burst;
+	gdouble chunk;
+	makiInstanceConfig const* config;
+	makiDCCScheduler* scheduler;
+
+	g_return_val_if_fail(slot != NULL, 0);
+
+	scheduler = slot->scheduler;
+	config = maki_instance_config_snapshot(scheduler->instance);
+
+	g_mutex_lock(scheduler->mutex);
+
+	/* The limits might have been raised. */
+	if (scheduler->generation != config->generation)
+	{
+		maki_dcc_scheduler_promote(scheduler, config);
+	}
+
+	if (config->dcc.rate_limit > 0)
+	{
+		rate = (gdouble)config->dcc.rate_limit * 1024 / MAX(scheduler->active, 1);
+	}
+
+	if (config->dcc.transfer_rate_limit > 0)
+	{
+		gdouble transfer_rate = (gdouble)config->dcc.transfer_rate_limit * 1024;
+
+		rate = (rate > 0) ? MIN(rate, transfer_rate) : transfer_rate;
+	}
+
+	if (rate <= 0)
+	{
+		slot->tokens = 0;
+		ret = G_MAXSIZE;
+	}
+	else
+	{
+		/* Allow bursts of a quarter of a second. */
+		burst = MAX(rate / 4, MAKI_DCC_SCHEDULER_CHUNK);
+		chunk = MIN(burst, MAKI_DCC_SCHEDULER_CHUNK);
+
+		now = g_get_monotonic_time();
+		slot->tokens = MIN(slot->tokens + (now - slot->time) * rate / G_USEC_PER_SEC, burst);
+		slot->time = now;
+
+		if (slot->tokens < chunk)
+		{
+			ret = 0;
+
+			if (delay != NULL)
+			{
+				*delay = MAX((chunk - slot->tokens) * 1000 / rate, 1);
+			}
+		}
+		else
+		{
+			ret = slot->tokens;
+		}
+	}
+
+	g_mutex_unlock(scheduler->mutex);
+
+	maki_instance_config_snapshot_unref(scheduler->instance, config);
+
+	return ret;
+}
+
+void
+maki_dcc_scheduler_slot_consume (makiDCCSchedulerSlot* slot, gsize bytes)
+{
+	g_return_if_fail(slot != NULL);
+
+	g_mutex_lock(slot->scheduler->mutex);
+	slot->tokens = MAX(slot->tokens - bytes, 0);
+	g_mutex_unlock(slot->scheduler->mutex);
+}
+
+gint
+maki_dcc_scheduler_slot_priority (makiDCCSchedulerSlot* slot)
+{
+	gint priority;
+
+	g_return_val_if_fail(slot != NULL, 0);
+
+	g_mutex_lock(slot->scheduler->mutex);
+	priority = slot->priority;
+	g_mutex_unlock(slot->scheduler->mutex);
+
+	return priority;
+}
+
+void
+maki_dcc_scheduler_slot_set_priority (makiDCCSchedulerSlot* slot, gint priority)
+{
+	makiDCCScheduler* scheduler;
+
+	g_return_if_fail(slot != NULL);
+
+	scheduler = slot->scheduler;
+
+	g_mutex_lock(scheduler->mutex);
+
+	slot->priority = priority;
+
+	/* Move it to its new place in the queue. */
+	if (slot->waiting)
+	{
+		g_queue_remove(scheduler->waiting, slot);
+		maki_dcc_scheduler_enqueue(scheduler, slot);
+	}
+
+	g_mutex_unlock(scheduler->mutex);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef H_DCC_SCHEDULER
+#define H_DCC_SCHEDULER
+
+struct maki_dcc_scheduler;
+struct maki_dcc_scheduler_slot;
+
+typedef struct maki_dcc_scheduler makiDCCScheduler;
+typedef struct maki_dcc_scheduler_slot makiDCCSchedulerSlot;
+
+/* Called from an idle on the slot's main context, without the scheduler lock held. */
+typedef void (*makiDCCSchedulerStartFunc) (gpointer);
+
+#include <glib.h>
+
+#include "instance.h"
+
+makiDCCScheduler* maki_dcc_scheduler_new (makiInstance*);
+void maki_dcc_scheduler_free (makiDCCScheduler*);
+
+makiDCCSchedulerSlot* maki_dcc_scheduler_slot_new (makiDCCScheduler*, GMainContext*, makiDCCSchedulerStartFunc, gpointer);
+void maki_dcc_scheduler_slot_free (makiDCCSchedulerSlot*);
+
+gboolean maki_dcc_scheduler_slot_request (makiDCCSchedulerSlot*);
+void maki_dcc_scheduler_slot_release (makiDCCSchedulerSlot*);
+
+gsize maki_dcc_scheduler_slot_available (makiDCCSchedulerSlot*, guint*);
+void maki_dcc_scheduler_slot_consume (makiDCCSchedulerSlot*, gsize);
+
+gint maki_dcc_scheduler_slot_priority (makiDCCSchedulerSlot*);
+void maki_dcc_scheduler_slot_set_priority (makiDCCSchedulerSlot*, gint);
+
+#endif
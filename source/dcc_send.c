@@ -25,6 +25,7 @@
  * SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 
 #include "config.h"
@@ -39,15 +40,25 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #include <ilib.h>
 
 #include "dcc_send.h"
 
+#include "checksum.h"
 #include "dbus.h"
+#include "dcc_pool.h"
+#include "dcc_ports.h"
+#include "dcc_scheduler.h"
 #include "instance.h"
 #include "network.h"
 #include "server.h"
@@ -59,13 +70,31 @@ enum
 	s_resumable = (1 << 2),
 	s_resumed = (1 << 3),
 	s_running = (1 << 4),
-	s_error = (1 << 5)
+	s_error = (1 << 5),
+	s_turbo = (1 << 6),
+	s_waiting = (1 << 7)
+};
+
+enum
+{
+	s_in_buffer_min = 64 * 1024,
+	s_in_buffer_max = 1024 * 1024,
+	/* Bytes between two checkpoints of the checksum. */
+	s_in_checkpoint = 64 * 1024 * 1024
+};
+
+enum
+{
+	s_out_chunk = 1024 * 1024,
+	s_out_map = 8 * 1024 * 1024
 };
 
 enum
 {
 	s_in_read,
 	s_in_write,
+	s_in_wait,
+	s_in_stats,
 	s_in_num
 };
 
@@ -74,6 +103,8 @@ enum
 	s_out_listen,
 	s_out_read,
 	s_out_write,
+	s_out_wait,
+	s_out_stats,
 	s_out_num
 };
 
@@ -105,7 +136,37 @@ struct maki_dcc_send
 
 	guint64 status;
 
-	GTimeVal start_time;
+	/* Throughput, sampled once per window on the transfer's thread. */
+	struct
+	{
+		gint64 time;
+		goffset progress;
+		/* Last time the progress changed. */
+		gint64 activity;
+		gdouble speed;
+		gboolean sampled;
+	}
+	stats;
+
+	makiDCCSchedulerSlot* slot;
+
+	/* The transfer's thread, all of its sources are attached here. */
+	GMainContext* main_context;
+
+	/* Copy of the progress for other threads, published by the transfer's thread. */
+	struct
+	{
+		goffset progress;
+		guint64 status;
+		/* Bytes per second during the last window and the moving average. */
+		guint64 rate;
+		guint64 speed;
+		/* Set once an incoming transfer is complete. */
+		gchar* checksum;
+	}
+	shared;
+
+	GMutex mutex[1];
 
 	union
 	{
@@ -114,6 +175,24 @@ struct maki_dcc_send
 			gboolean accept;
 			gboolean resume;
 
+			/* Received data is collected here and written to the file in large chunks. */
+			struct
+			{
+				gchar* data;
+				gsize size;
+				gsize length;
+			}
+			buffer;
+
+			/* SHA-256 of everything written to the file so far. */
+			struct
+			{
+				makiChecksum* checksum;
+				/* Position of the last checkpoint. */
+				goffset position;
+			}
+			checksum;
+
 			guint sources[s_in_num];
 		}
 		in;
@@ -122,7 +201,7 @@ struct maki_dcc_send
 		{
 			struct
 			{
-				guint32 position;
+				goffset position;
 				guint32 buffer;
 				gsize offset;
 			}
@@ -130,24 +209,214 @@ struct maki_dcc_send
 
 			gboolean wait;
 
+			/* Falls back to the mapped path if sendfile() is not supported for this file. */
+			gboolean sendfile;
+
+			struct
+			{
+				gchar* data;
+				goffset offset;
+				gsize length;
+			}
+			map;
+
 			guint sources[s_out_num];
 
-			gboolean upnp;
+			/* The port belongs to the allocator and has to be released. */
+			gboolean port;
 		}
 		out;
 	}
 	d;
 };
 
+/* Hands a resume request over to the transfer's thread. */
+struct makiDCCSendResumeOperation
+{
+	makiDCCSend* dcc;
+	goffset position;
+};
+
+typedef struct makiDCCSendResumeOperation makiDCCSendResumeOperation;
+
+static void maki_dcc_send_start (gpointer);
+static gboolean maki_dcc_send_wait (gpointer);
+
+static goffset maki_dcc_send_current (makiDCCSend* dcc)
+{
+	/* Turbo receivers do not acknowledge anything, so the position sent is all there is. */
+	return (dcc->status & (s_incoming | s_turbo)) ? dcc->position : dcc->d.out.ack.position;
+}
+
+static void maki_dcc_send_publish (makiDCCSend* dcc)
+{
+	g_mutex_lock(dcc->mutex);
+
+	dcc->shared.progress = maki_dcc_send_current(dcc);
+	dcc->shared.status = dcc->status;
+
+	g_mutex_unlock(dcc->mutex);
+}
+
+static void maki_dcc_send_remove_sources (makiDCCSend* dcc)
+{
+	guint i;
+	guint count;
+	guint* sources;
+
+	if (dcc->status & s_incoming)
+	{
+		sources = dcc->d.in.sources;
+		count = s_in_num;
+	}
+	else
+	{
+		sources = dcc->d.out.sources;
+		count = s_out_num;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (sources[i] != 0)
+		{
+			i_source_remove(sources[i], dcc->main_context);
+			sources[i] = 0;
+		}
+	}
+}
+
+static gchar* maki_dcc_send_checkpoint_path (makiDCCSend* dcc)
+{
+	return g_strconcat(dcc->path, ".checkpoint", NULL);
+}
+
+/* Saves the checksum's state beside the file, so that a resumed transfer can continue hashing without reading the whole file. */
+static void maki_dcc_send_checkpoint_save (makiDCCSend* dcc)
+{
+	gchar* path;
+	gchar* state;
+	GKeyFile* key_file;
+
+	if (dcc->d.in.checksum.checksum == NULL)
+	{
+		return;
+	}
+
+	path = maki_dcc_send_checkpoint_path(dcc);
+	state = maki_checksum_get_state(dcc->d.in.checksum.checksum);
+
+	key_file = g_key_file_new();
+	g_key_file_set_uint64(key_file, "checkpoint", "offset", maki_checksum_length(dcc->d.in.checksum.checksum));
+	g_key_file_set_string(key_file, "checkpoint", "sha256", state);
+	i_key_file_to_file(key_file, path, NULL, NULL);
+	g_key_file_free(key_file);
+
+	dcc->d.in.checksum.position = maki_checksum_length(dcc->d.in.checksum.checksum);
+
+	g_free(state);
+	g_free(path);
+}
+
+/* Restores the checksum for a resumed transfer. Data written after the checkpoint is read and hashed again.
+ * Without a usable checkpoint, no checksum is computed. */
+static void maki_dcc_send_checkpoint_load (makiDCCSend* dcc)
+{
+	gint fd;
+	gchar* path;
+	gchar* state;
+	guint64 offset;
+	GKeyFile* key_file;
+	makiChecksum* checksum = NULL;
+
+	path = maki_dcc_send_checkpoint_path(dcc);
+	key_file = g_key_file_new();
+
+	if (g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL)
+	    && (state = g_key_file_get_string(key_file, "checkpoint", "sha256", NULL)) != NULL)
+	{
+		checksum = maki_checksum_new_from_state(state);
+		g_free(state);
+	}
+
+	g_key_file_free(key_file);
+	g_free(path);
+
+	if (checksum == NULL)
+	{
+		return;
+	}
+
+	offset = maki_checksum_length(checksum);
+	fd = g_io_channel_unix_get_fd(dcc->channel.file);
+
+	while ((goffset)offset < dcc->position)
+	{
+		gchar buffer[64 * 1024];
+		ssize_t bytes_read;
+
+		bytes_read = pread(fd, buffer, MIN(sizeof(buffer), (gsize)(dcc->position - offset)), offset);
+
+		if (bytes_read < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (bytes_read <= 0)
+		{
+			break;
+		}
+
+		maki_checksum_update(checksum, (guchar*)buffer, bytes_read);
+		offset += bytes_read;
+	}
+
+	if ((goffset)offset != dcc->position)
+	{
+		maki_checksum_free(checksum);
+		return;
+	}
+
+	dcc->d.in.checksum.checksum = checksum;
+	dcc->d.in.checksum.position = offset;
+}
+
+/* Publishes the final checksum of a complete transfer. */
+static void maki_dcc_send_checksum_finish (makiDCCSend* dcc)
+{
+	gchar* path;
+	gchar* checksum;
+
+	if (dcc->d.in.checksum.checksum == NULL)
+	{
+		return;
+	}
+
+	checksum = maki_checksum_get_string(dcc->d.in.checksum.checksum);
+
+	maki_checksum_free(dcc->d.in.checksum.checksum);
+	dcc->d.in.checksum.checksum = NULL;
+
+	path = maki_dcc_send_checkpoint_path(dcc);
+	g_unlink(path);
+	g_free(path);
+
+	g_mutex_lock(dcc->mutex);
+	g_free(dcc->shared.checksum);
+	dcc->shared.checksum = checksum;
+	g_mutex_unlock(dcc->mutex);
+}
+
 static void maki_dcc_send_close (makiDCCSend* dcc)
 {
-	if (!(dcc->status & s_incoming) && dcc->d.out.upnp)
+	maki_dcc_scheduler_slot_release(dcc->slot);
+	dcc->status &= ~s_waiting;
+
+	if (!(dcc->status & s_incoming) && dcc->d.out.port)
 	{
 		makiInstance* inst = maki_instance_get_default();
-		makiNetwork* net = maki_instance_network(inst);
 
-		maki_network_upnp_remove_port(net, dcc->port);
-		dcc->d.out.upnp = FALSE;
+		maki_dcc_ports_release(maki_instance_dcc_ports(inst), dcc->port);
+		dcc->d.out.port = FALSE;
 	}
 
 	if (dcc->channel.connection != NULL)
@@ -161,40 +430,205 @@ static void maki_dcc_send_close (makiDCCSend* dcc)
 		g_io_channel_unref(dcc->channel.file);
 		dcc->channel.file = NULL;
 	}
+
+	if (dcc->status & s_incoming)
+	{
+		/* The transfer did not complete, so remember how far it got. */
+		if (dcc->d.in.checksum.checksum != NULL)
+		{
+			maki_dcc_send_checkpoint_save(dcc);
+			maki_checksum_free(dcc->d.in.checksum.checksum);
+			dcc->d.in.checksum.checksum = NULL;
+		}
+
+		g_free(dcc->d.in.buffer.data);
+		dcc->d.in.buffer.data = NULL;
+		dcc->d.in.buffer.size = 0;
+		dcc->d.in.buffer.length = 0;
+	}
+	else if (dcc->d.out.map.data != NULL)
+	{
+		munmap(dcc->d.out.map.data, dcc->d.out.map.length);
+		dcc->d.out.map.data = NULL;
+		dcc->d.out.map.offset = 0;
+		dcc->d.out.map.length = 0;
+	}
+}
+
+static gboolean maki_dcc_send_in_flush (makiDCCSend* dcc)
+{
+	gint fd;
+	gsize offset = 0;
+
+	if (dcc->d.in.buffer.length == 0)
+	{
+		return TRUE;
+	}
+
+	fd = g_io_channel_unix_get_fd(dcc->channel.file);
+
+	while (offset < dcc->d.in.buffer.length)
+	{
+		ssize_t bytes_written;
+
+		bytes_written = write(fd, dcc->d.in.buffer.data + offset, dcc->d.in.buffer.length - offset);
+
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		if (dcc->d.in.checksum.checksum != NULL)
+		{
+			maki_checksum_update(dcc->d.in.checksum.checksum, (guchar*)dcc->d.in.buffer.data + offset, bytes_written);
+		}
+
+		offset += bytes_written;
+	}
+
+	dcc->d.in.buffer.length = 0;
+
+	if (dcc->d.in.checksum.checksum != NULL && dcc->position - dcc->d.in.checksum.position >= s_in_checkpoint)
+	{
+		maki_dcc_send_checkpoint_save(dcc);
+	}
+
+	return TRUE;
 }
 
 static gboolean maki_dcc_send_in_read (GIOChannel* source, GIOCondition condition, gpointer data)
 {
-	gchar buffer[1024];
-	gsize bytes_read;
-	GIOStatus status;
+	gint fd;
+	gsize batch = 0;
+	gsize available = 0;
+	guint delay = 0;
+	guint32 pos;
 	makiDCCSend* dcc = data;
 
-	if (condition & (G_IO_HUP | G_IO_ERR))
+	if (condition & G_IO_ERR)
 	{
 		goto error;
 	}
 
-	while ((status = g_io_channel_read_chars(source, buffer, 1024, &bytes_read, NULL)) == G_IO_STATUS_NORMAL)
+	fd = g_io_channel_unix_get_fd(source);
+
+	/* Drain the socket before acknowledging, so only the latest position is sent.
+	 * Reading stops after s_in_buffer_max bytes, so that a fast sender cannot keep this callback busy forever. */
+	while (batch < s_in_buffer_max)
 	{
-		guint32 pos;
+		gsize space;
+		ssize_t bytes_read;
 
-		dcc->position += bytes_read;
-		pos = htonl(dcc->position);
+		if (available == 0 && (available = maki_dcc_scheduler_slot_available(dcc->slot, &delay)) == 0)
+		{
+			break;
+		}
 
-		i_io_channel_write_chars(dcc->channel.file, buffer, bytes_read, NULL, NULL);
-		g_io_channel_flush(dcc->channel.file, NULL);
+		space = MIN(dcc->d.in.buffer.size - dcc->d.in.buffer.length, available);
 
-		i_io_channel_write_chars(source, (gchar*)&pos, sizeof(pos), NULL, NULL);
-		g_io_channel_flush(source, NULL);
+		if (dcc->size > 0 && (goffset)space > dcc->size - dcc->position)
+		{
+			space = dcc->size - dcc->position;
+		}
+
+		bytes_read = read(fd, dcc->d.in.buffer.data + dcc->d.in.buffer.length, space);
+
+		if (bytes_read < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+
+			goto error;
+		}
+
+		if (bytes_read == 0)
+		{
+			if (dcc->size > 0 && dcc->position < dcc->size)
+			{
+				goto error;
+			}
+
+			goto finish;
+		}
+
+		dcc->position += bytes_read;
+		dcc->d.in.buffer.length += bytes_read;
+		batch += bytes_read;
+
+		if (available != G_MAXSIZE)
+		{
+			available -= bytes_read;
+			maki_dcc_scheduler_slot_consume(dcc->slot, bytes_read);
+		}
 
 		if (dcc->size > 0 && dcc->position >= dcc->size)
 		{
 			goto finish;
 		}
+
+		if (dcc->d.in.buffer.length == dcc->d.in.buffer.size)
+		{
+			if (!maki_dcc_send_in_flush(dcc))
+			{
+				goto error;
+			}
+
+			/* The socket keeps filling the buffer, so grow it. */
+			if (dcc->d.in.buffer.size < s_in_buffer_max)
+			{
+				dcc->d.in.buffer.size *= 2;
+				g_free(dcc->d.in.buffer.data);
+				dcc->d.in.buffer.data = g_malloc(dcc->d.in.buffer.size);
+			}
+		}
 	}
 
-	if (status == G_IO_STATUS_ERROR)
+	if (!maki_dcc_send_in_flush(dcc))
+	{
+		goto error;
+	}
+
+	if (batch < dcc->d.in.buffer.size / 4 && dcc->d.in.buffer.size > s_in_buffer_min)
+	{
+		dcc->d.in.buffer.size /= 2;
+		g_free(dcc->d.in.buffer.data);
+		dcc->d.in.buffer.data = g_malloc(dcc->d.in.buffer.size);
+	}
+
+	/* Acknowledgements only carry the lower 32 bits of the position. */
+	if (batch > 0 && !(dcc->status & s_turbo))
+	{
+		pos = htonl((guint32)dcc->position);
+
+		i_io_channel_write_chars(source, (gchar*)&pos, sizeof(pos), NULL, NULL);
+		g_io_channel_flush(source, NULL);
+	}
+
+	maki_dcc_send_publish(dcc);
+
+	/* Over the rate limit, so stop reading for a while. */
+	if (available == 0)
+	{
+		dcc->d.in.sources[s_in_read] = 0;
+		dcc->d.in.sources[s_in_wait] = i_timeout_add(delay, maki_dcc_send_wait, dcc, dcc->main_context);
+
+		return FALSE;
+	}
+
+	/* Data might still be waiting if the batch was cut off. */
+	if ((condition & G_IO_HUP) && batch < s_in_buffer_max)
 	{
 		goto error;
 	}
@@ -206,6 +640,24 @@ error:
 finish:
 	dcc->status &= ~s_running;
 
+	if (!maki_dcc_send_in_flush(dcc))
+	{
+		dcc->status |= s_error;
+	}
+
+	if (!(dcc->status & s_error))
+	{
+		maki_dcc_send_checksum_finish(dcc);
+	}
+
+	if (!(dcc->status & (s_error | s_turbo)))
+	{
+		pos = htonl((guint32)dcc->position);
+
+		i_io_channel_write_chars(source, (gchar*)&pos, sizeof(pos), NULL, NULL);
+		g_io_channel_flush(source, NULL);
+	}
+
 	maki_dcc_send_close(dcc);
 
 	dcc->d.in.sources[s_in_read] = 0;
@@ -215,6 +667,17 @@ finish:
 	return FALSE;
 }
 
+static void maki_dcc_send_in_allocate (makiDCCSend* dcc)
+{
+#ifdef HAVE_FALLOCATE
+	/* Keep the apparent size, so that partial files can still be resumed. */
+	if (dcc->size > dcc->position)
+	{
+		fallocate(g_io_channel_unix_get_fd(dcc->channel.file), FALLOC_FL_KEEP_SIZE, dcc->position, dcc->size - dcc->position);
+	}
+#endif
+}
+
 static gboolean maki_dcc_send_in_write (GIOChannel* source, GIOCondition condition, gpointer data)
 {
 	gint val;
@@ -232,14 +695,18 @@ static gboolean maki_dcc_send_in_write (GIOChannel* source, GIOCondition conditi
 		goto error;
 	}
 
-	g_get_current_time(&dcc->start_time);
-
-	dcc->status |= s_running;
-
 	dcc->d.in.sources[s_in_write] = 0;
-	dcc->d.in.sources[s_in_read] = g_io_add_watch(source, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_in_read, dcc);
 
-	maki_dcc_send_emit(dcc);
+	if (maki_dcc_scheduler_slot_request(dcc->slot))
+	{
+		maki_dcc_send_start(dcc);
+	}
+	else
+	{
+		dcc->status |= s_waiting;
+
+		maki_dcc_send_emit(dcc);
+	}
 
 	return FALSE;
 
@@ -256,9 +723,165 @@ error:
 	return FALSE;
 }
 
+/* Returns the number of bytes sent, 0 at the end of the file and -1 on errors. */
+static gssize maki_dcc_send_out_send (makiDCCSend* dcc, gint fd, gsize length)
+{
+	gint file_fd;
+	gssize bytes_written;
+
+	file_fd = g_io_channel_unix_get_fd(dcc->channel.file);
+
+#ifdef HAVE_SENDFILE
+	if (dcc->d.out.sendfile)
+	{
+		off_t offset = dcc->position;
+
+		if ((bytes_written = sendfile(fd, file_fd, &offset, length)) >= 0)
+		{
+			return bytes_written;
+		}
+
+		if (errno != EINVAL && errno != ENOSYS)
+		{
+			return -1;
+		}
+
+		dcc->d.out.sendfile = FALSE;
+	}
+#endif
+
+	if (dcc->d.out.map.data == NULL
+	    || dcc->position < dcc->d.out.map.offset
+	    || dcc->position >= dcc->d.out.map.offset + (goffset)dcc->d.out.map.length)
+	{
+		goffset offset;
+		gsize map_length;
+		gpointer map_data;
+		struct stat stbuf;
+
+		if (dcc->d.out.map.data != NULL)
+		{
+			munmap(dcc->d.out.map.data, dcc->d.out.map.length);
+			dcc->d.out.map.data = NULL;
+		}
+
+		/* The file might have been truncated since it was offered, and accessing a mapping beyond its end raises SIGBUS. */
+		if (fstat(file_fd, &stbuf) != 0 || stbuf.st_size <= dcc->position)
+		{
+			return -1;
+		}
+
+		offset = dcc->position - (dcc->position % sysconf(_SC_PAGESIZE));
+		map_length = MIN(s_out_map, MIN(dcc->size, stbuf.st_size) - offset);
+
+		if ((map_data = mmap(NULL, map_length, PROT_READ, MAP_SHARED, file_fd, offset)) == MAP_FAILED)
+		{
+			return -1;
+		}
+
+		dcc->d.out.map.data = map_data;
+		dcc->d.out.map.offset = offset;
+		dcc->d.out.map.length = map_length;
+	}
+
+	length = MIN(length, dcc->d.out.map.offset + dcc->d.out.map.length - dcc->position);
+
+	return write(fd, dcc->d.out.map.data + (dcc->position - dcc->d.out.map.offset), length);
+}
+
 static gboolean maki_dcc_send_out_write (GIOChannel* source, GIOCondition condition, gpointer data)
 {
-	gchar buffer[1024];
+	gint fd;
+	gssize bytes_written;
+	makiDCCSend* dcc = data;
+
+	if (condition & (G_IO_HUP | G_IO_ERR))
+	{
+		goto error;
+	}
+
+	fd = g_io_channel_unix_get_fd(source);
+
+	if (dcc->position < dcc->size)
+	{
+		gsize available;
+		guint delay = 0;
+
+		/* Over the rate limit, so stop writing for a while. */
+		if ((available = maki_dcc_scheduler_slot_available(dcc->slot, &delay)) == 0)
+		{
+			dcc->d.out.sources[s_out_write] = 0;
+			dcc->d.out.sources[s_out_wait] = i_timeout_add(delay, maki_dcc_send_wait, dcc, dcc->main_context);
+
+			return FALSE;
+		}
+
+		if ((bytes_written = maki_dcc_send_out_send(dcc, fd, MIN(MIN(s_out_chunk, dcc->size - dcc->position), available))) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				return TRUE;
+			}
+
+			goto error;
+		}
+
+		dcc->position += bytes_written;
+
+		if (available != G_MAXSIZE)
+		{
+			maki_dcc_scheduler_slot_consume(dcc->slot, bytes_written);
+		}
+
+		if (bytes_written > 0 && dcc->position < dcc->size)
+		{
+			maki_dcc_send_publish(dcc);
+
+			return TRUE;
+		}
+	}
+
+	if (!(dcc->status & s_turbo) && dcc->d.out.ack.position < dcc->size)
+	{
+		dcc->d.out.wait = TRUE;
+	}
+
+	goto finish;
+
+error:
+	dcc->status |= s_error;
+finish:
+	if (!dcc->d.out.wait)
+	{
+		dcc->status &= ~s_running;
+
+		maki_dcc_send_close(dcc);
+
+		maki_dcc_send_emit(dcc);
+	}
+
+	dcc->d.out.sources[s_out_write] = 0;
+
+	return FALSE;
+}
+
+/* Acknowledgements wrap around at 4 GiB, so they are extended using the position sent so far. */
+static goffset maki_dcc_send_out_ack (makiDCCSend* dcc, guint32 ack)
+{
+	goffset position;
+
+	position = (dcc->position & ~G_GINT64_CONSTANT(0xFFFFFFFF)) | ack;
+
+	if (position > dcc->position)
+	{
+		position -= G_GINT64_CONSTANT(0x100000000);
+	}
+
+	return MAX(position, dcc->d.out.ack.position);
+}
+
+static gboolean maki_dcc_send_out_read (GIOChannel* source, GIOCondition condition, gpointer data)
+{
 	gsize bytes_read;
 	GIOStatus status;
 	makiDCCSend* dcc = data;
@@ -268,100 +891,229 @@ static gboolean maki_dcc_send_out_write (GIOChannel* source, GIOCondition condit
 		goto error;
 	}
 
-	if ((status = g_io_channel_read_chars(dcc->channel.file, buffer, 1024, &bytes_read, NULL)) != G_IO_STATUS_ERROR)
-	{
-		if (bytes_read > 0)
-		{
-			dcc->position += bytes_read;
+	while ((status = g_io_channel_read_chars(source, ((gchar*)&dcc->d.out.ack.buffer) + dcc->d.out.ack.offset, sizeof(dcc->d.out.ack.buffer) - dcc->d.out.ack.offset, &bytes_read, NULL)) == G_IO_STATUS_NORMAL)
+	{
+		dcc->d.out.ack.offset += bytes_read;
+
+		if (dcc->d.out.ack.offset != sizeof(dcc->d.out.ack.buffer))
+		{
+			continue;
+		}
+
+		dcc->d.out.ack.position = maki_dcc_send_out_ack(dcc, ntohl(dcc->d.out.ack.buffer));
+		dcc->d.out.ack.offset = 0;
+
+		if (dcc->d.out.ack.position >= dcc->size)
+		{
+			goto finish;
+		}
+	}
+
+	if (status == G_IO_STATUS_ERROR)
+	{
+		goto error;
+	}
+
+	maki_dcc_send_publish(dcc);
+
+	return TRUE;
+
+error:
+	dcc->status |= s_error;
+finish:
+	if (dcc->d.out.wait)
+	{
+		dcc->status &= ~s_running;
+
+		maki_dcc_send_close(dcc);
+
+		maki_dcc_send_emit(dcc);
+	}
+
+	dcc->d.out.sources[s_out_read] = 0;
+
+	return FALSE;
+}
+
+/* Samples the throughput once per window and aborts transfers that stopped making progress. */
+static gboolean maki_dcc_send_sample (gpointer data)
+{
+	gint64 now;
+	gint64 elapsed;
+	gdouble rate;
+	goffset progress;
+	gboolean stalled;
+	makiDCCSend* dcc = data;
+	makiInstance* inst = maki_instance_get_default();
+	makiInstanceConfig const* config;
+
+	if (!(dcc->status & s_running))
+	{
+		goto stop;
+	}
+
+	config = maki_instance_config_snapshot(inst);
+
+	now = g_get_monotonic_time();
+	elapsed = MAX(now - dcc->stats.time, 1);
+	progress = maki_dcc_send_current(dcc);
+
+	rate = (gdouble)(progress - dcc->stats.progress) * G_USEC_PER_SEC / elapsed;
+
+	if (dcc->stats.sampled)
+	{
+		gdouble average;
+
+		/* Approximates an exponential decay with the configured time constant. */
+		average = (gdouble)MAX(config->dcc.speed_average, 1) * G_USEC_PER_SEC;
+		dcc->stats.speed += (rate - dcc->stats.speed) * elapsed / (elapsed + average);
+	}
+	else
+	{
+		dcc->stats.speed = rate;
+		dcc->stats.sampled = TRUE;
+	}
+
+	if (progress != dcc->stats.progress)
+	{
+		dcc->stats.activity = now;
+	}
+
+	dcc->stats.time = now;
+	dcc->stats.progress = progress;
 
-			i_io_channel_write_chars(source, buffer, bytes_read, NULL, NULL);
-			g_io_channel_flush(source, NULL);
-		}
+	g_mutex_lock(dcc->mutex);
+	dcc->shared.rate = rate;
+	dcc->shared.speed = dcc->stats.speed;
+	g_mutex_unlock(dcc->mutex);
 
-		if (dcc->position >= dcc->size || status == G_IO_STATUS_EOF)
-		{
-			if (dcc->d.out.ack.position < dcc->size)
-			{
-				dcc->d.out.wait = TRUE;
-			}
+	stalled = (config->dcc.stall_timeout > 0 && now - dcc->stats.activity >= (gint64)config->dcc.stall_timeout * G_USEC_PER_SEC);
 
-			goto finish;
-		}
-	}
+	maki_instance_config_snapshot_unref(inst, config);
 
-	if (status == G_IO_STATUS_ERROR)
+	if (stalled)
 	{
-		goto error;
-	}
+		/* This source is removed by returning. */
+		if (dcc->status & s_incoming)
+		{
+			dcc->d.in.sources[s_in_stats] = 0;
+		}
+		else
+		{
+			dcc->d.out.sources[s_out_stats] = 0;
+		}
 
-	return TRUE;
+		maki_dcc_send_remove_sources(dcc);
 
-error:
-	dcc->status |= s_error;
-finish:
-	if (!dcc->d.out.wait)
-	{
+		dcc->status |= s_error;
 		dcc->status &= ~s_running;
 
+		if (dcc->status & s_incoming)
+		{
+			maki_dcc_send_in_flush(dcc);
+		}
+
 		maki_dcc_send_close(dcc);
 
 		maki_dcc_send_emit(dcc);
+
+		return FALSE;
 	}
 
-	dcc->d.out.sources[s_out_write] = 0;
+	return TRUE;
+
+stop:
+	if (dcc->status & s_incoming)
+	{
+		dcc->d.in.sources[s_in_stats] = 0;
+	}
+	else
+	{
+		dcc->d.out.sources[s_out_stats] = 0;
+	}
 
 	return FALSE;
 }
 
-static gboolean maki_dcc_send_out_read (GIOChannel* source, GIOCondition condition, gpointer data)
+static void maki_dcc_send_sample_start (makiDCCSend* dcc)
 {
-	gsize bytes_read;
-	GIOStatus status;
-	makiDCCSend* dcc = data;
+	guint source;
+	guint window;
+	makiInstance* inst = maki_instance_get_default();
+	makiInstanceConfig const* config;
 
-	if (condition & (G_IO_HUP | G_IO_ERR))
+	config = maki_instance_config_snapshot(inst);
+	window = MAX(config->dcc.speed_window, 1);
+	maki_instance_config_snapshot_unref(inst, config);
+
+	dcc->stats.time = g_get_monotonic_time();
+	dcc->stats.progress = maki_dcc_send_current(dcc);
+	dcc->stats.activity = dcc->stats.time;
+	dcc->stats.speed = 0;
+	dcc->stats.sampled = FALSE;
+
+	/* The window is only read when the transfer starts. */
+	source = i_timeout_add(window * 1000, maki_dcc_send_sample, dcc, dcc->main_context);
+
+	if (dcc->status & s_incoming)
 	{
-		goto error;
+		dcc->d.in.sources[s_in_stats] = source;
 	}
-
-	while ((status = g_io_channel_read_chars(source, ((gchar*)&dcc->d.out.ack.buffer) + dcc->d.out.ack.offset, sizeof(dcc->d.out.ack.buffer) - dcc->d.out.ack.offset, &bytes_read, NULL)) == G_IO_STATUS_NORMAL)
+	else
 	{
-		dcc->d.out.ack.offset += bytes_read;
+		dcc->d.out.sources[s_out_stats] = source;
+	}
+}
 
-		if (dcc->d.out.ack.offset != sizeof(dcc->d.out.ack.buffer))
-		{
-			continue;
-		}
+/* Called once the scheduler lets the transfer run. */
+static void maki_dcc_send_start (gpointer data)
+{
+	makiDCCSend* dcc = data;
 
-		dcc->d.out.ack.position = ntohl(dcc->d.out.ack.buffer);
-		dcc->d.out.ack.offset = 0;
+	dcc->status &= ~s_waiting;
+	dcc->status |= s_running;
 
-		if (dcc->d.out.ack.position >= dcc->size)
-		{
-			goto finish;
-		}
-	}
+	maki_dcc_send_sample_start(dcc);
 
-	if (status == G_IO_STATUS_ERROR)
+	if (dcc->status & s_incoming)
 	{
-		goto error;
-	}
+		dcc->d.in.buffer.size = s_in_buffer_min;
+		dcc->d.in.buffer.data = g_malloc(dcc->d.in.buffer.size);
+		dcc->d.in.buffer.length = 0;
 
-	return TRUE;
+		maki_dcc_send_in_allocate(dcc);
 
-error:
-	dcc->status |= s_error;
-finish:
-	if (dcc->d.out.wait)
+		dcc->d.in.sources[s_in_read] = i_io_add_watch(dcc->channel.connection, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_in_read, dcc, dcc->main_context);
+	}
+	else
 	{
-		dcc->status &= ~s_running;
-
-		maki_dcc_send_close(dcc);
+		/* Turbo receivers do not send acknowledgements. */
+		if (!(dcc->status & s_turbo))
+		{
+			dcc->d.out.sources[s_out_read] = i_io_add_watch(dcc->channel.connection, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_read, dcc, dcc->main_context);
+		}
 
-		maki_dcc_send_emit(dcc);
+		dcc->d.out.sources[s_out_write] = i_io_add_watch(dcc->channel.connection, G_IO_OUT | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_write, dcc, dcc->main_context);
 	}
 
-	dcc->d.out.sources[s_out_read] = 0;
+	maki_dcc_send_emit(dcc);
+}
+
+/* Called once a throttled transfer may continue. */
+static gboolean maki_dcc_send_wait (gpointer data)
+{
+	makiDCCSend* dcc = data;
+
+	if (dcc->status & s_incoming)
+	{
+		dcc->d.in.sources[s_in_wait] = 0;
+		dcc->d.in.sources[s_in_read] = i_io_add_watch(dcc->channel.connection, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_in_read, dcc, dcc->main_context);
+	}
+	else
+	{
+		dcc->d.out.sources[s_out_wait] = 0;
+		dcc->d.out.sources[s_out_write] = i_io_add_watch(dcc->channel.connection, G_IO_OUT | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_write, dcc, dcc->main_context);
+	}
 
 	return FALSE;
 }
@@ -387,17 +1139,20 @@ static gboolean maki_dcc_send_out_listen (GIOChannel* source, GIOCondition condi
 	g_io_channel_set_close_on_unref(dcc->channel.connection, TRUE);
 	g_io_channel_set_encoding(dcc->channel.connection, NULL, NULL);
 
-	g_get_current_time(&dcc->start_time);
-
-	dcc->status |= s_running;
-
 	dcc->d.out.sources[s_out_listen] = 0;
-	dcc->d.out.sources[s_out_read] = g_io_add_watch(dcc->channel.connection, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_read, dcc);
-	dcc->d.out.sources[s_out_write] = g_io_add_watch(dcc->channel.connection, G_IO_OUT | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_write, dcc);
 
 	g_io_channel_unref(source);
 
-	maki_dcc_send_emit(dcc);
+	if (maki_dcc_scheduler_slot_request(dcc->slot))
+	{
+		maki_dcc_send_start(dcc);
+	}
+	else
+	{
+		dcc->status |= s_waiting;
+
+		maki_dcc_send_emit(dcc);
+	}
 
 	return FALSE;
 
@@ -468,9 +1223,48 @@ gchar* maki_dcc_send_get_file_name (const gchar* string, gsize* length)
 	return file_name;
 }
 
-makiDCCSend* maki_dcc_send_new_in (makiServer* serv, makiUser* user, const gchar* file_name, guint32 address, guint16 port, goffset file_size, guint32 token)
+/* Sources are attached by the transfer's thread, so that storing their ids cannot race with their callbacks. */
+static gboolean maki_dcc_send_in_write_idle (gpointer data)
+{
+	makiDCCSend* dcc = data;
+
+	dcc->d.in.sources[s_in_write] = i_io_add_watch(dcc->channel.connection, G_IO_OUT | G_IO_HUP | G_IO_ERR, maki_dcc_send_in_write, dcc, dcc->main_context);
+
+	return FALSE;
+}
+
+static gboolean maki_dcc_send_out_listen_idle (gpointer data)
+{
+	makiDCCSend* dcc = data;
+
+	dcc->d.out.sources[s_out_listen] = i_io_add_watch(dcc->channel.connection, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_listen, dcc, dcc->main_context);
+
+	return FALSE;
+}
+
+static gboolean maki_dcc_send_resume_accept_idle (gpointer data)
+{
+	makiDCCSendResumeOperation* op = data;
+	makiDCCSend* dcc = op->dcc;
+
+	dcc->position = op->position;
+	dcc->resume = op->position;
+	dcc->d.out.ack.position = op->position;
+
+	dcc->status &= ~s_resumable;
+	dcc->status |= s_resumed;
+
+	maki_dcc_send_emit(dcc);
+
+	g_free(op);
+
+	return FALSE;
+}
+
+makiDCCSend* maki_dcc_send_new_in (makiServer* serv, makiUser* user, const gchar* file_name, guint32 address, guint16 port, goffset file_size, guint32 token, gboolean turbo)
 {
 	guint i;
+	gboolean accept;
 	gchar* downloads_dir;
 	struct stat stbuf;
 	makiInstance* inst = maki_instance_get_default();
@@ -480,7 +1274,7 @@ makiDCCSend* maki_dcc_send_new_in (makiServer* serv, makiUser* user, const gchar
 
 	dcc = g_new(makiDCCSend, 1);
 
-	dcc->server = serv;
+	dcc->server = maki_server_ref(serv);
 	dcc->id = maki_instance_get_dcc_send_id(inst);
 
 	dcc->user = maki_user_ref(user);
@@ -488,6 +1282,16 @@ makiDCCSend* maki_dcc_send_new_in (makiServer* serv, makiUser* user, const gchar
 	dcc->channel.file = NULL;
 	dcc->channel.connection = NULL;
 
+	dcc->main_context = g_main_context_ref(maki_dcc_pool_context(maki_instance_dcc_pool(inst)));
+
+	dcc->shared.progress = 0;
+	dcc->shared.status = 0;
+	dcc->shared.rate = 0;
+	dcc->shared.speed = 0;
+	dcc->shared.checksum = NULL;
+
+	g_mutex_init(dcc->mutex);
+
 	dcc->path = g_build_filename(downloads_dir, maki_server_name(dcc->server), maki_user_nick(dcc->user), file_name, NULL);
 	dcc->position = 0;
 	dcc->size = file_size;
@@ -500,9 +1304,23 @@ makiDCCSend* maki_dcc_send_new_in (makiServer* serv, makiUser* user, const gchar
 
 	dcc->status = s_new | s_incoming;
 
+	dcc->slot = maki_dcc_scheduler_slot_new(maki_instance_dcc_scheduler(inst), dcc->main_context, maki_dcc_send_start, dcc);
+
+	if (turbo)
+	{
+		dcc->status |= s_turbo;
+	}
+
 	dcc->d.in.accept = FALSE;
 	dcc->d.in.resume = FALSE;
 
+	dcc->d.in.buffer.data = NULL;
+	dcc->d.in.buffer.size = 0;
+	dcc->d.in.buffer.length = 0;
+
+	dcc->d.in.checksum.checksum = NULL;
+	dcc->d.in.checksum.position = 0;
+
 	for (i = 0; i < s_in_num; i++)
 	{
 		dcc->d.in.sources[i] = 0;
@@ -515,29 +1333,30 @@ makiDCCSend* maki_dcc_send_new_in (makiServer* serv, makiUser* user, const gchar
 		dcc->status |= s_resumable;
 	}
 
-	if (dcc->status & s_resumable)
+	accept = maki_instance_config_get_boolean(inst, "dcc", (dcc->status & s_resumable) ? "accept_resume" : "accept_send");
+
+	if (accept)
 	{
-		if (maki_instance_config_get_boolean(inst, "dcc", "accept_resume"))
-		{
-			dcc->status &= ~s_new;
+		dcc->status &= ~s_new;
+	}
+
+	/* Accepting hands the transfer over to its own thread, so everything else has to be done before. */
+	maki_dcc_send_emit(dcc);
+
+	dcc->status &= ~s_new;
 
+	if (accept)
+	{
+		if (dcc->status & s_resumable)
+		{
 			maki_dcc_send_resume(dcc);
 		}
-	}
-	else
-	{
-		if (maki_instance_config_get_boolean(inst, "dcc", "accept_send"))
+		else
 		{
-			dcc->status &= ~s_new;
-
 			maki_dcc_send_accept(dcc);
 		}
 	}
 
-	maki_dcc_send_emit(dcc);
-
-	dcc->status &= ~s_new;
-
 	return dcc;
 }
 
@@ -545,6 +1364,7 @@ makiDCCSend* maki_dcc_send_new_out (makiServer* serv, makiUser* user, const gcha
 {
 	guint i;
 	gchar* basename;
+	gchar const* command;
 	GInetAddress* inet_address;
 	struct stat stbuf;
 	makiInstance* inst = maki_instance_get_default();
@@ -553,7 +1373,7 @@ makiDCCSend* maki_dcc_send_new_out (makiServer* serv, makiUser* user, const gcha
 
 	dcc = g_new(makiDCCSend, 1);
 
-	dcc->server = serv;
+	dcc->server = maki_server_ref(serv);
 	dcc->id = maki_instance_get_dcc_send_id(inst);
 
 	dcc->user = maki_user_ref(user);
@@ -561,6 +1381,16 @@ makiDCCSend* maki_dcc_send_new_out (makiServer* serv, makiUser* user, const gcha
 	dcc->channel.file = NULL;
 	dcc->channel.connection = NULL;
 
+	dcc->main_context = g_main_context_ref(maki_dcc_pool_context(maki_instance_dcc_pool(inst)));
+
+	dcc->shared.progress = 0;
+	dcc->shared.status = 0;
+	dcc->shared.rate = 0;
+	dcc->shared.speed = 0;
+	dcc->shared.checksum = NULL;
+
+	g_mutex_init(dcc->mutex);
+
 	dcc->path = g_strdup(path);
 	dcc->position = 0;
 	dcc->size = 0;
@@ -573,17 +1403,34 @@ makiDCCSend* maki_dcc_send_new_out (makiServer* serv, makiUser* user, const gcha
 
 	dcc->status = 0;
 
+	dcc->slot = maki_dcc_scheduler_slot_new(maki_instance_dcc_scheduler(inst), dcc->main_context, maki_dcc_send_start, dcc);
+
+	if (maki_instance_config_get_boolean(inst, "dcc", "turbo"))
+	{
+		dcc->status |= s_turbo;
+	}
+
 	dcc->d.out.ack.position = 0;
 	dcc->d.out.ack.offset = 0;
 
 	dcc->d.out.wait = FALSE;
 
+#ifdef HAVE_SENDFILE
+	dcc->d.out.sendfile = TRUE;
+#else
+	dcc->d.out.sendfile = FALSE;
+#endif
+
+	dcc->d.out.map.data = NULL;
+	dcc->d.out.map.offset = 0;
+	dcc->d.out.map.length = 0;
+
 	for (i = 0; i < s_out_num; i++)
 	{
 		dcc->d.out.sources[i] = 0;
 	}
 
-	dcc->d.out.upnp = FALSE;
+	dcc->d.out.port = FALSE;
 
 	if (stat(dcc->path, &stbuf) != 0)
 	{
@@ -592,19 +1439,13 @@ makiDCCSend* maki_dcc_send_new_out (makiServer* serv, makiUser* user, const gcha
 
 	dcc->size = stbuf.st_size;
 
-	for (dcc->port = maki_instance_config_get_integer(inst, "dcc", "port_first"); dcc->port <= maki_instance_config_get_integer(inst, "dcc", "port_last"); dcc->port++)
-	{
-		if ((dcc->channel.connection = i_io_channel_unix_new_listen(NULL, dcc->port, TRUE)) != NULL)
-		{
-			break;
-		}
-	}
-
-	if (dcc->channel.connection == NULL)
+	if ((dcc->channel.connection = maki_dcc_ports_listen(maki_instance_dcc_ports(inst), &(dcc->port))) == NULL)
 	{
 		goto error;
 	}
 
+	dcc->d.out.port = TRUE;
+
 	g_io_channel_set_close_on_unref(dcc->channel.connection, TRUE);
 	g_io_channel_set_encoding(dcc->channel.connection, NULL, NULL);
 
@@ -635,25 +1476,24 @@ makiDCCSend* maki_dcc_send_new_out (makiServer* serv, makiUser* user, const gcha
 	g_io_channel_set_encoding(dcc->channel.file, NULL, NULL);
 	g_io_channel_set_buffered(dcc->channel.file, FALSE);
 
-	dcc->d.out.upnp = maki_network_upnp_add_port(net, dcc->port, "maki DCC Send");
-
 	basename = g_path_get_basename(dcc->path);
+	command = (dcc->status & s_turbo) ? "TSEND" : "SEND";
 
 	if (strstr(basename, " ") == NULL)
 	{
-		maki_server_send_printf(serv, "PRIVMSG %s :\001DCC SEND %s %" G_GUINT32_FORMAT " %" G_GUINT16_FORMAT " %" G_GUINT64_FORMAT "\001", maki_user_nick(dcc->user), basename, dcc->address, dcc->port, dcc->size);
+		maki_server_send_printf(serv, "PRIVMSG %s :\001DCC %s %s %" G_GUINT32_FORMAT " %" G_GUINT16_FORMAT " %" G_GUINT64_FORMAT "\001", maki_user_nick(dcc->user), command, basename, dcc->address, dcc->port, dcc->size);
 	}
 	else
 	{
-		maki_server_send_printf(serv, "PRIVMSG %s :\001DCC SEND \"%s\" %" G_GUINT32_FORMAT " %" G_GUINT16_FORMAT " %" G_GUINT64_FORMAT "\001", maki_user_nick(dcc->user), basename, dcc->address, dcc->port, dcc->size);
+		maki_server_send_printf(serv, "PRIVMSG %s :\001DCC %s \"%s\" %" G_GUINT32_FORMAT " %" G_GUINT16_FORMAT " %" G_GUINT64_FORMAT "\001", maki_user_nick(dcc->user), command, basename, dcc->address, dcc->port, dcc->size);
 	}
 
 	g_free(basename);
 
-	dcc->d.out.sources[s_out_listen] = g_io_add_watch(dcc->channel.connection, G_IO_IN | G_IO_HUP | G_IO_ERR, maki_dcc_send_out_listen, dcc);
-
 	maki_dcc_send_emit(dcc);
 
+	i_idle_add(maki_dcc_send_out_listen_idle, dcc, dcc->main_context);
+
 	return dcc;
 
 error:
@@ -662,39 +1502,36 @@ error:
 	return NULL;
 }
 
-void maki_dcc_send_free (makiDCCSend* dcc)
+static gboolean maki_dcc_send_free_idle (gpointer data)
 {
-	if (dcc->status & s_incoming)
-	{
-		guint i;
+	makiDCCSend* dcc = data;
 
-		for (i = 0; i < s_in_num; i++)
-		{
-			if (dcc->d.in.sources[i] != 0)
-			{
-				g_source_remove(dcc->d.in.sources[i]);
-			}
-		}
-	}
-	else
-	{
-		guint i;
+	/* Afterwards, the scheduler can no longer start the transfer. */
+	maki_dcc_scheduler_slot_release(dcc->slot);
 
-		for (i = 0; i < s_out_num; i++)
-		{
-			if (dcc->d.out.sources[i] != 0)
-			{
-				g_source_remove(dcc->d.out.sources[i]);
-			}
-		}
-	}
+	maki_dcc_send_remove_sources(dcc);
 
 	maki_dcc_send_close(dcc);
+	maki_dcc_scheduler_slot_free(dcc->slot);
+
+	maki_server_remove_user(dcc->server, dcc->user);
+	maki_server_unref(dcc->server);
 
-	maki_server_remove_user(dcc->server, maki_user_nick(dcc->user));
+	g_main_context_unref(dcc->main_context);
+	g_mutex_clear(dcc->mutex);
+
+	g_free(dcc->shared.checksum);
 
 	g_free(dcc->path);
 	g_free(dcc);
+
+	return FALSE;
+}
+
+/* Transfers are freed on their own thread, so that none of their callbacks can be running. */
+void maki_dcc_send_free (makiDCCSend* dcc)
+{
+	i_idle_add(maki_dcc_send_free_idle, dcc, dcc->main_context);
 }
 
 gboolean maki_dcc_send_accept (makiDCCSend* dcc)
@@ -742,13 +1579,16 @@ gboolean maki_dcc_send_accept (makiDCCSend* dcc)
 				return FALSE;
 			}
 
+			dcc->d.in.checksum.checksum = maki_checksum_new();
+			dcc->d.in.checksum.position = 0;
+
 			g_io_channel_set_close_on_unref(dcc->channel.file, TRUE);
 			g_io_channel_set_encoding(dcc->channel.file, NULL, NULL);
 			g_io_channel_set_buffered(dcc->channel.file, FALSE);
 		}
 
 		dcc->d.in.accept = TRUE;
-		dcc->d.in.sources[s_in_write] = g_io_add_watch(dcc->channel.connection, G_IO_OUT | G_IO_HUP | G_IO_ERR, maki_dcc_send_in_write, dcc);
+		i_idle_add(maki_dcc_send_in_write_idle, dcc, dcc->main_context);
 
 		return TRUE;
 	}
@@ -851,6 +1691,8 @@ gboolean maki_dcc_send_resume_accept (makiDCCSend* dcc, const gchar* filename, g
 		dcc->position = position;
 		dcc->resume = position;
 
+		maki_dcc_send_checkpoint_load(dcc);
+
 		dcc->status &= ~s_resumable;
 		dcc->status |= s_resumed;
 
@@ -861,6 +1703,7 @@ gboolean maki_dcc_send_resume_accept (makiDCCSend* dcc, const gchar* filename, g
 	else
 	{
 		gchar* basename;
+		makiDCCSendResumeOperation* op;
 
 		if (is_incoming)
 		{
@@ -882,19 +1725,17 @@ gboolean maki_dcc_send_resume_accept (makiDCCSend* dcc, const gchar* filename, g
 			return FALSE;
 		}
 
-		if (g_io_channel_seek_position(dcc->channel.file, position, G_SEEK_SET, NULL) != G_IO_STATUS_NORMAL)
+		if (position < 0 || position > dcc->size)
 		{
 			return FALSE;
 		}
 
-		dcc->position = position;
-		dcc->resume = position;
-		dcc->d.out.ack.position = position;
-
-		dcc->status &= ~s_resumable;
-		dcc->status |= s_resumed;
+		/* The transfer's thread may already be listening, so only it may change its state. */
+		op = g_new(makiDCCSendResumeOperation, 1);
+		op->dcc = dcc;
+		op->position = position;
 
-		maki_dcc_send_emit(dcc);
+		i_idle_add(maki_dcc_send_resume_accept_idle, op, dcc->main_context);
 	}
 
 	return TRUE;
@@ -912,37 +1753,103 @@ goffset maki_dcc_send_size (makiDCCSend* dcc)
 
 goffset maki_dcc_send_progress (makiDCCSend* dcc)
 {
-	if (dcc->status & s_incoming)
-	{
-		return dcc->position;
-	}
-	else
-	{
-		return dcc->d.out.ack.position;
-	}
+	goffset progress;
+
+	g_mutex_lock(dcc->mutex);
+	progress = dcc->shared.progress;
+	g_mutex_unlock(dcc->mutex);
+
+	return progress;
 }
 
+/* Returns the moving average of the throughput in bytes per second. */
 guint64 maki_dcc_send_speed (makiDCCSend* dcc)
 {
 	guint64 speed = 0;
 
-	if (dcc->status & s_running)
+	g_mutex_lock(dcc->mutex);
+
+	if (dcc->shared.status & s_running)
+	{
+		speed = dcc->shared.speed;
+	}
+
+	g_mutex_unlock(dcc->mutex);
+
+	return speed;
+}
+
+/* Returns the throughput during the last window in bytes per second. */
+guint64 maki_dcc_send_rate (makiDCCSend* dcc)
+{
+	guint64 rate = 0;
+
+	g_mutex_lock(dcc->mutex);
+
+	if (dcc->shared.status & s_running)
 	{
-		glong duration;
-		GTimeVal timeval;
+		rate = dcc->shared.rate;
+	}
+
+	g_mutex_unlock(dcc->mutex);
+
+	return rate;
+}
+
+/* Returns the estimated seconds until the transfer completes, or -1 if unknown. */
+gint64 maki_dcc_send_eta (makiDCCSend* dcc)
+{
+	gint64 eta = -1;
 
-		g_get_current_time(&timeval);
+	g_mutex_lock(dcc->mutex);
 
-		duration = MAX(timeval.tv_sec - dcc->start_time.tv_sec, 1);
-		speed = (maki_dcc_send_progress(dcc) - dcc->resume) / duration;
+	if ((dcc->shared.status & s_running) && dcc->size > 0)
+	{
+		if (dcc->shared.progress >= dcc->size)
+		{
+			eta = 0;
+		}
+		else if (dcc->shared.speed > 0)
+		{
+			eta = (dcc->size - dcc->shared.progress + dcc->shared.speed - 1) / dcc->shared.speed;
+		}
 	}
 
-	return speed;
+	g_mutex_unlock(dcc->mutex);
+
+	return eta;
 }
 
 guint maki_dcc_send_status (makiDCCSend* dcc)
 {
-	return dcc->status;
+	guint status;
+
+	g_mutex_lock(dcc->mutex);
+	status = dcc->shared.status;
+	g_mutex_unlock(dcc->mutex);
+
+	return status;
+}
+
+gchar* maki_dcc_send_checksum (makiDCCSend* dcc)
+{
+	gchar* checksum;
+
+	g_mutex_lock(dcc->mutex);
+	checksum = g_strdup(dcc->shared.checksum);
+	g_mutex_unlock(dcc->mutex);
+
+	return checksum;
+}
+
+gint maki_dcc_send_priority (makiDCCSend* dcc)
+{
+	return maki_dcc_scheduler_slot_priority(dcc->slot);
+}
+
+void maki_dcc_send_set_priority (makiDCCSend* dcc, gint priority)
+{
+	maki_dcc_scheduler_slot_set_priority(dcc->slot, priority);
 }
 
 makiServer* maki_dcc_send_server (makiDCCSend* dcc)
@@ -1000,9 +1907,11 @@ void maki_dcc_send_emit (makiDCCSend* dcc)
 {
 	gchar* filename;
 
+	maki_dcc_send_publish(dcc);
+
 	filename = maki_dcc_send_filename(dcc);
 
-	maki_dbus_emit_dcc_send(dcc->id, maki_server_name(dcc->server), maki_user_from(dcc->user), filename, dcc->size, maki_dcc_send_progress(dcc), maki_dcc_send_speed(dcc), dcc->status);
+	maki_dbus_emit_dcc_send(dcc->id, maki_server_name(dcc->server), maki_user_from(dcc->user), filename, dcc->size, maki_dcc_send_progress(dcc), maki_dcc_send_speed(dcc), maki_dcc_send_status(dcc));
 
 	g_free(filename);
 }
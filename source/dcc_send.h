@@ -39,7 +39,7 @@ typedef struct maki_dcc_send makiDCCSend;
 
 gchar* maki_dcc_send_get_file_name (const gchar*, gsize*);
 
-makiDCCSend* maki_dcc_send_new_in (makiServer*, makiUser*, const gchar*, guint32, guint16, goffset, guint32);
+makiDCCSend* maki_dcc_send_new_in (makiServer*, makiUser*, const gchar*, guint32, guint16, goffset, guint32, gboolean);
 makiDCCSend* maki_dcc_send_new_out (makiServer*, makiUser*, const gchar*);
 void maki_dcc_send_free (makiDCCSend*);
 
@@ -51,7 +51,12 @@ guint64 maki_dcc_send_id (makiDCCSend*);
 goffset maki_dcc_send_size (makiDCCSend*);
 goffset maki_dcc_send_progress (makiDCCSend*);
 guint64 maki_dcc_send_speed (makiDCCSend*);
+guint64 maki_dcc_send_rate (makiDCCSend*);
+gint64 maki_dcc_send_eta (makiDCCSend*);
 guint maki_dcc_send_status (makiDCCSend*);
+gchar* maki_dcc_send_checksum (makiDCCSend*);
+gint maki_dcc_send_priority (makiDCCSend*);
+void maki_dcc_send_set_priority (makiDCCSend*, gint);
 makiServer* maki_dcc_send_server (makiDCCSend*);
 makiUser* maki_dcc_send_user (makiDCCSend*);
 const gchar* maki_dcc_send_path (makiDCCSend*);
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "event.h"
+
+#include "rcu.h"
+
+/* Each consumer has its own queue and thread, so slow consumers only delay themselves.
+ * Publishers find the consumers without taking a lock, see rcu.c. */
+struct maki_event_bus
+{
+	/* Publishes a NULL-terminated array of makiEventConsumer. */
+	makiRcu* consumers;
+
+	/* Serializes changes to the consumers. */
+	GMutex mutex[1];
+};
+
+struct maki_event_consumer
+{
+	gint ref_count;
+
+	gchar* name;
+	/* Types of events the consumer wants, see MAKI_EVENT_MASK. */
+	guint mask;
+
+	makiEventFunc func;
+	gpointer data;
+
+	GAsyncQueue* queue;
+	GThread* thread;
+
+	struct
+	{
+		gint max_depth;
+		guint64 processed;
+		GMutex mutex[1];
+	}
+	stats;
+};
+
+/* Tells a consumer's thread to stop. */
+static makiEvent maki_event_stop;
+
+static
+makiEventConsumer*
+maki_event_consumer_ref (makiEventConsumer* consumer)
+{
+	g_atomic_int_inc(&consumer->ref_count);
+
+	return consumer;
+}
+
+static
+void
+maki_event_consumer_unref (makiEventConsumer* consumer)
+{
+	makiEvent* event;
+
+	if (!g_atomic_int_dec_and_test(&consumer->ref_count))
+	{
+		return;
+	}
+
+	/* Events published after the consumer was removed. */
+	while ((event = g_async_queue_try_pop(consumer->queue)) != NULL)
+	{
+		if (event != &maki_event_stop)
+		{
+			maki_event_unref(event);
+		}
+	}
+
+	g_async_queue_unref(consumer->queue);
+
+	g_mutex_clear(consumer->stats.mutex);
+
+	g_free(consumer->name);
+	g_free(consumer);
+}
+
+static
+void
+maki_event_consumers_free (gpointer data)
+{
+	makiEventConsumer** consumers = data;
+	guint i;
+
+	for (i = 0; consumers[i] != NULL; i++)
+	{
+		maki_event_consumer_unref(consumers[i]);
+	}
+
+	g_free(consumers);
+}
+
+static
+gpointer
+maki_event_consumer_thread (gpointer data)
+{
+	makiEventConsumer* consumer = data;
+	makiEvent* event;
+
+	while ((event = g_async_queue_pop(consumer->queue)) != &maki_event_stop)
+	{
+		consumer->func(event, consumer->data);
+		maki_event_unref(event);
+
+		g_mutex_lock(consumer->stats.mutex);
+		consumer->stats.processed++;
+		g_mutex_unlock(consumer->stats.mutex);
+	}
+
+	return NULL;
+}
+
+/* Has to be called with the bus locked.
+ * Publishes the current consumers without remove and with add, if given. */
+static
+void
+maki_event_bus_update (makiEventBus* bus, makiEventConsumer* add, makiEventConsumer* remove)
+{
+	guint i;
+	guint length = 0;
+	makiEventConsumer** consumers;
+	makiEventConsumer** current;
+
+	current = maki_rcu_get(bus->consumers);
+
+	while (current[length] != NULL)
+	{
+		length++;
+	}
+
+	consumers = g_new(makiEventConsumer*, length + 2);
+	length = 0;
+
+	for (i = 0; current[i] != NULL; i++)
+	{
+		if (current[i] != remove)
+		{
+			consumers[length++] = maki_event_consumer_ref(current[i]);
+		}
+	}
+
+	if (add != NULL)
+	{
+		consumers[length++] = maki_event_consumer_ref(add);
+	}
+
+	consumers[length] = NULL;
+
+	maki_rcu_unref(bus->consumers, current);
+	maki_rcu_publish(bus->consumers, consumers);
+}
+
+/* Creates an event with a reference count of one.
+ * server and target may be NULL. */
+makiEvent*
+maki_event_new (makiEventType type, gchar const* server, gchar const* target)
+{
+	makiEvent* event;
+
+	event = g_new(makiEvent, 1);
+	event->ref_count = 1;
+	event->type = type;
+	event->time = g_get_real_time();
+	event->server = g_strdup(server);
+	event->target = g_strdup(target);
+	event->case_mapping = I_CASE_MAPPING_RFC1459;
+	event->message = NULL;
+	event->name = NULL;
+	event->variant = NULL;
+
+	return event;
+}
+
+makiEvent*
+maki_event_ref (makiEvent* event)
+{
+	g_return_val_if_fail(event != NULL, NULL);
+
+	g_atomic_int_inc(&event->ref_count);
+
+	return event;
+}
+
+void
+maki_event_unref (makiEvent* event)
+{
+	g_return_if_fail(event != NULL);
+
+	if (!g_atomic_int_dec_and_test(&event->ref_count))
+	{
+		return;
+	}
+
+	if (event->variant != NULL)
+	{
+		g_variant_unref(event->variant);
+	}
+
+	g_free(event->server);
+	g_free(event->target);
+	g_free(event->message);
+	g_free(event->name);
+	g_free(event);
+}
+
+makiEventBus*
+maki_event_bus_new (void)
+{
+	makiEventBus* bus;
+
+	bus = g_new(makiEventBus, 1);
+	bus->consumers = maki_rcu_new(g_new0(makiEventConsumer*, 1), maki_event_consumers_free);
+
+	g_mutex_init(bus->mutex);
+
+	return bus;
+}
+
+/* Removes all remaining consumers, delivering their pending events first. */
+void
+maki_event_bus_free (makiEventBus* bus)
+{
+	makiEventConsumer** consumers;
+	makiEventConsumer* consumer;
+
+	g_return_if_fail(bus != NULL);
+
+	g_mutex_lock(bus->mutex);
+
+	for (;;)
+	{
+		consumers = maki_rcu_get(bus->consumers);
+		consumer = (consumers[0] != NULL) ? maki_event_consumer_ref(consumers[0]) : NULL;
+		maki_rcu_unref(bus->consumers, consumers);
+
+		if (consumer == NULL)
+		{
+			break;
+		}
+
+		g_mutex_unlock(bus->mutex);
+		maki_event_bus_remove_consumer(bus, consumer);
+		maki_event_consumer_unref(consumer);
+		g_mutex_lock(bus->mutex);
+	}
+
+	g_mutex_unlock(bus->mutex);
+
+	maki_rcu_free(bus->consumers);
+
+	g_mutex_clear(bus->mutex);
+
+	g_free(bus);
+}
+
+/* Starts a thread that calls func for all events whose type is in mask.
+ * The returned consumer is owned by the bus and stays valid until it is removed. */
+makiEventConsumer*
+maki_event_bus_add_consumer (makiEventBus* bus, gchar const* name, guint mask, makiEventFunc func, gpointer data)
+{
+	gchar* thread_name;
+	makiEventConsumer* consumer;
+
+	g_return_val_if_fail(bus != NULL, NULL);
+	g_return_val_if_fail(name != NULL, NULL);
+	g_return_val_if_fail(func != NULL, NULL);
+
+	consumer = g_new(makiEventConsumer, 1);
+	consumer->ref_count = 1;
+	consumer->name = g_strdup(name);
+	consumer->mask = mask;
+	consumer->func = func;
+	consumer->data = data;
+	consumer->queue = g_async_queue_new();
+	consumer->stats.max_depth = 0;
+	consumer->stats.processed = 0;
+
+	g_mutex_init(consumer->stats.mutex);
+
+	thread_name = g_strconcat("makiEvent-", name, NULL);
+	consumer->thread = g_thread_new(thread_name, maki_event_consumer_thread, consumer);
+	g_free(thread_name);
+
+	g_mutex_lock(bus->mutex);
+	maki_event_bus_update(bus, consumer, NULL);
+	g_mutex_unlock(bus->mutex);
+
+	return consumer;
+}
+
+/* Stops consumer after it has handled all pending events. */
+void
+maki_event_bus_remove_consumer (makiEventBus* bus, makiEventConsumer* consumer)
+{
+	g_return_if_fail(bus != NULL);
+	g_return_if_fail(consumer != NULL);
+
+	g_mutex_lock(bus->mutex);
+	maki_event_bus_update(bus, NULL, consumer);
+	g_mutex_unlock(bus->mutex);
+
+	g_async_queue_push(consumer->queue, &maki_event_stop);
+	g_thread_join(consumer->thread);
+
+	maki_event_consumer_unref(consumer);
+}
+
+/* Hands event to all interested consumers, takes over the reference. */
+void
+maki_event_bus_publish (makiEventBus* bus, makiEvent* event)
+{
+	guint i;
+	makiEventConsumer** consumers;
+
+	g_return_if_fail(bus != NULL);
+	g_return_if_fail(event != NULL);
+
+	consumers = maki_rcu_get(bus->consumers);
+
+	for (i = 0; consumers[i] != NULL; i++)
+	{
+		gint depth;
+		gint max_depth;
+
+		if (!(consumers[i]->mask & MAKI_EVENT_MASK(event->type)))
+		{
+			continue;
+		}
+
+		g_async_queue_push(consumers[i]->queue, maki_event_ref(event));
+
+		depth = g_async_queue_length(consumers[i]->queue);
+		max_depth = g_atomic_int_get(&consumers[i]->stats.max_depth);
+
+		while (depth > max_depth && !g_atomic_int_compare_and_exchange(&consumers[i]->stats.max_depth, max_depth, depth))
+		{
+			max_depth = g_atomic_int_get(&consumers[i]->stats.max_depth);
+		}
+	}
+
+	maki_rcu_unref(bus->consumers, consumers);
+
+	maki_event_unref(event);
+}
+
+/* Returns the name, current and maximum queue depth and number of handled events per consumer. */
+void
+maki_event_bus_stats (makiEventBus* bus, gchar*** names, GArray** depths, GArray** max_depths, GArray** processed)
+{
+	guint i;
+	guint length = 0;
+	makiEventConsumer** consumers;
+
+	g_return_if_fail(bus != NULL);
+
+	g_mutex_lock(bus->mutex);
+
+	consumers = maki_rcu_get(bus->consumers);
+
+	while (consumers[length] != NULL)
+	{
+		length++;
+	}
+
+	*names = g_new(gchar*, length + 1);
+	*depths = g_array_sized_new(FALSE, FALSE, sizeof(guint64), length);
+	*max_depths = g_array_sized_new(FALSE, FALSE, sizeof(guint64), length);
+	*processed = g_array_sized_new(FALSE, FALSE, sizeof(guint64), length);
+
+	for (i = 0; consumers[i] != NULL; i++)
+	{
+		guint64 value;
+
+		(*names)[i] = g_strdup(consumers[i]->name);
+
+		value = MAX(g_async_queue_length(consumers[i]->queue), 0);
+		g_array_append_val(*depths, value);
+
+		value = g_atomic_int_get(&consumers[i]->stats.max_depth);
+		g_array_append_val(*max_depths, value);
+
+		g_mutex_lock(consumers[i]->stats.mutex);
+		value = consumers[i]->stats.processed;
+		g_mutex_unlock(consumers[i]->stats.mutex);
+
+		g_array_append_val(*processed, value);
+	}
+
+	(*names)[i] = NULL;
+
+	maki_rcu_unref(bus->consumers, consumers);
+
+	g_mutex_unlock(bus->mutex);
+}
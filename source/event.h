@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef H_EVENT
+#define H_EVENT
+
+struct maki_event_bus;
+struct maki_event_consumer;
+
+typedef struct maki_event_bus makiEventBus;
+typedef struct maki_event_consumer makiEventConsumer;
+
+enum maki_event_type
+{
+	/* A line for the log of target on server. */
+	MAKI_EVENT_LOG,
+	/* All logs of server should be closed. */
+	MAKI_EVENT_LOG_CLOSE,
+	/* The D-Bus signal name with arguments variant. */
+	MAKI_EVENT_SIGNAL
+};
+
+typedef enum maki_event_type makiEventType;
+
+#define MAKI_EVENT_MASK(type) (1 << (type))
+
+#include <glib.h>
+
+#include <ilib.h>
+
+/* Events are immutable once published and shared between all consumers. */
+struct maki_event
+{
+	gint ref_count;
+
+	makiEventType type;
+	/* Real time of creation in microseconds. */
+	gint64 time;
+
+	/* May be NULL for signals that are not related to a server or target. */
+	gchar* server;
+	gchar* target;
+	/* Case mapping of server at the time of publishing, used to compare targets.
+	 * Consumers must not look the server up themselves, it might already be gone. */
+	iCaseMapping case_mapping;
+
+	/* MAKI_EVENT_LOG */
+	gchar* message;
+
+	/* MAKI_EVENT_SIGNAL */
+	gchar* name;
+	GVariant* variant;
+};
+
+typedef struct maki_event makiEvent;
+
+typedef void (*makiEventFunc) (makiEvent const*, gpointer);
+
+makiEvent* maki_event_new (makiEventType, gchar const*, gchar const*);
+makiEvent* maki_event_ref (makiEvent*);
+void maki_event_unref (makiEvent*);
+
+makiEventBus* maki_event_bus_new (void);
+void maki_event_bus_free (makiEventBus*);
+
+makiEventConsumer* maki_event_bus_add_consumer (makiEventBus*, gchar const*, guint, makiEventFunc, gpointer);
+void maki_event_bus_remove_consumer (makiEventBus*, makiEventConsumer*);
+
+void maki_event_bus_publish (makiEventBus*, makiEvent*);
+
+void maki_event_bus_stats (makiEventBus*, gchar***, GArray**, GArray**, GArray**);
+
+#endif
@@ -120,6 +120,22 @@ i_idle_add (GSourceFunc function, gpointer data, GMainContext* context)
 	return id;
 }
 
+guint
+i_timeout_add (guint interval, GSourceFunc function, gpointer data, GMainContext* context)
+{
+	GSource* source;
+	guint id;
+
+	g_return_val_if_fail(function != NULL, 0);
+
+	source = g_timeout_source_new(interval);
+	g_source_set_callback(source, function, data, NULL);
+	id = g_source_attach(source, context);
+	g_source_unref(source);
+
+	return id;
+}
+
 guint
 i_timeout_add_seconds (guint interval, GSourceFunc function, gpointer data, GMainContext* context)
 {
@@ -136,6 +152,23 @@ i_timeout_add_seconds (guint interval, GSourceFunc function, gpointer data, GMai
 	return id;
 }
 
+guint
+i_io_add_watch (GIOChannel* channel, GIOCondition condition, GIOFunc function, gpointer data, GMainContext* context)
+{
+	GSource* source;
+	guint id;
+
+	g_return_val_if_fail(channel != NULL, 0);
+	g_return_val_if_fail(function != NULL, 0);
+
+	source = g_io_create_watch(channel, condition);
+	g_source_set_callback(source, (GSourceFunc)function, data, NULL);
+	id = g_source_attach(source, context);
+	g_source_unref(source);
+
+	return id;
+}
+
 gboolean
 i_source_remove (guint tag, GMainContext* context)
 {
@@ -412,21 +445,230 @@ i_strreplace (gchar const* string, gchar const* search, gchar const* replace, gu
 	return result;
 }
 
+/* Case folding for the IRC casemappings.
+ * All of them map the range from 'A' to a mapping-specific upper bound onto the lowercase range by adding 0x20:
+ * ascii folds A-Z, strict-rfc1459 additionally folds []\ and rfc1459 additionally folds []\^. */
+#define I_CASE_FOLD(c, last) ((guchar)(((c) >= 'A' && (c) <= (last)) ? (c) + 0x20 : (c)))
+#define I_CASE_FOLD_4(c, last) I_CASE_FOLD((c), last), I_CASE_FOLD((c) + 1, last), I_CASE_FOLD((c) + 2, last), I_CASE_FOLD((c) + 3, last)
+#define I_CASE_FOLD_16(c, last) I_CASE_FOLD_4((c), last), I_CASE_FOLD_4((c) + 4, last), I_CASE_FOLD_4((c) + 8, last), I_CASE_FOLD_4((c) + 12, last)
+#define I_CASE_FOLD_64(c, last) I_CASE_FOLD_16((c), last), I_CASE_FOLD_16((c) + 16, last), I_CASE_FOLD_16((c) + 32, last), I_CASE_FOLD_16((c) + 48, last)
+#define I_CASE_FOLD_256(last) { I_CASE_FOLD_64(0, last), I_CASE_FOLD_64(64, last), I_CASE_FOLD_64(128, last), I_CASE_FOLD_64(192, last) }
+
+#define I_CASE_LAST_ASCII '\x5a'
+#define I_CASE_LAST_STRICT_RFC1459 '\x5d'
+#define I_CASE_LAST_RFC1459 '\x5e'
+
+static guchar const i_case_table_ascii[256] = I_CASE_FOLD_256(I_CASE_LAST_ASCII);
+static guchar const i_case_table_strict_rfc1459[256] = I_CASE_FOLD_256(I_CASE_LAST_STRICT_RFC1459);
+static guchar const i_case_table_rfc1459[256] = I_CASE_FOLD_256(I_CASE_LAST_RFC1459);
+
+#define I_WORD_ONES G_GUINT64_CONSTANT(0x0101010101010101)
+#define I_WORD_HIGHS G_GUINT64_CONSTANT(0x8080808080808080)
+
+/* Folds all eight bytes of a word at once, equivalent to looking up every byte in the table above. */
+static inline
+guint64
+i_word_case_fold (guint64 w, guchar last)
+{
+	guint64 low;
+	guint64 above_first;
+	guint64 above_last;
+
+	low = w & ~I_WORD_HIGHS;
+	above_first = low + I_WORD_ONES * (0x80 - 'A');
+	above_last = low + I_WORD_ONES * (0x7f - last);
+
+	return w | (((above_first & ~above_last & ~w) & I_WORD_HIGHS) >> 2);
+}
+
+static inline
+gboolean
+i_str_case_equal (guchar const* a, guchar const* b, guchar const* table, guchar last)
+{
+	gsize length;
+
+	if (a == b)
+	{
+		return TRUE;
+	}
+
+	/* Folding never changes the length, so strings of different lengths cannot be equal.
+	 * Knowing the length also keeps the word loads below inside both strings. */
+	length = strlen((gchar const*)a);
+
+	if (strlen((gchar const*)b) != length)
+	{
+		return FALSE;
+	}
+
+	for (; length >= sizeof(guint64); length -= sizeof(guint64))
+	{
+		guint64 wa;
+		guint64 wb;
+
+		memcpy(&wa, a, sizeof(wa));
+		memcpy(&wb, b, sizeof(wb));
+
+		if (wa != wb && i_word_case_fold(wa, last) != i_word_case_fold(wb, last))
+		{
+			return FALSE;
+		}
+
+		a += sizeof(guint64);
+		b += sizeof(guint64);
+	}
+
+	for (; length > 0; length--, a++, b++)
+	{
+		if (table[*a] != table[*b])
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Folds eight bytes at a time into a word and mixes once per word instead of once per byte. */
+static inline
+guint
+i_str_case_hash (guchar const* s, guchar const* table)
+{
+	guint64 h = G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+	guint64 w = 0;
+	guint n = 0;
+	guint length = 0;
+
+	for (; *s != '\0'; s++)
+	{
+		w = (w << 8) | table[*s];
+
+		if (++n == sizeof(guint64))
+		{
+			h = (h ^ w) * G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+			h ^= h >> 32;
+			length += n;
+			w = 0;
+			n = 0;
+		}
+	}
+
+	length += n;
+	h = (h ^ w ^ length) * G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+	h ^= h >> 29;
+
+	return (guint)h;
+}
+
 gboolean
 i_ascii_str_case_equal (gconstpointer v1, gconstpointer v2)
 {
-	return (g_ascii_strcasecmp(v1, v2) == 0);
+	return i_str_case_equal(v1, v2, i_case_table_ascii, I_CASE_LAST_ASCII);
 }
 
 guint
 i_ascii_str_case_hash (gconstpointer key)
 {
-	guint ret;
-	gchar* tmp;
+	return i_str_case_hash(key, i_case_table_ascii);
+}
+
+gboolean
+i_rfc1459_str_case_equal (gconstpointer v1, gconstpointer v2)
+{
+	return i_str_case_equal(v1, v2, i_case_table_rfc1459, I_CASE_LAST_RFC1459);
+}
+
+guint
+i_rfc1459_str_case_hash (gconstpointer key)
+{
+	return i_str_case_hash(key, i_case_table_rfc1459);
+}
+
+gboolean
+i_strict_rfc1459_str_case_equal (gconstpointer v1, gconstpointer v2)
+{
+	return i_str_case_equal(v1, v2, i_case_table_strict_rfc1459, I_CASE_LAST_STRICT_RFC1459);
+}
+
+guint
+i_strict_rfc1459_str_case_hash (gconstpointer key)
+{
+	return i_str_case_hash(key, i_case_table_strict_rfc1459);
+}
+
+/* Unknown casemappings (like rfc7613) fall back to ascii, which is folded by all of them. */
+iCaseMapping
+i_case_mapping_from_string (gchar const* name)
+{
+	if (g_strcmp0(name, "rfc1459") == 0)
+	{
+		return I_CASE_MAPPING_RFC1459;
+	}
+	else if (g_strcmp0(name, "strict-rfc1459") == 0)
+	{
+		return I_CASE_MAPPING_STRICT_RFC1459;
+	}
+
+	return I_CASE_MAPPING_ASCII;
+}
+
+GHashFunc
+i_case_mapping_hash_func (iCaseMapping mapping)
+{
+	switch (mapping)
+	{
+		case I_CASE_MAPPING_ASCII:
+			return i_ascii_str_case_hash;
+		case I_CASE_MAPPING_STRICT_RFC1459:
+			return i_strict_rfc1459_str_case_hash;
+		case I_CASE_MAPPING_RFC1459:
+		default:
+			return i_rfc1459_str_case_hash;
+	}
+}
+
+GEqualFunc
+i_case_mapping_equal_func (iCaseMapping mapping)
+{
+	switch (mapping)
+	{
+		case I_CASE_MAPPING_ASCII:
+			return i_ascii_str_case_equal;
+		case I_CASE_MAPPING_STRICT_RFC1459:
+			return i_strict_rfc1459_str_case_equal;
+		case I_CASE_MAPPING_RFC1459:
+		default:
+			return i_rfc1459_str_case_equal;
+	}
+}
+
+gchar*
+i_case_mapping_fold (iCaseMapping mapping, gchar const* string)
+{
+	guchar const* table;
+	gchar* ret;
+	gchar* p;
 
-	tmp = g_ascii_strdown(key, -1);
-	ret = g_str_hash(tmp);
-	g_free(tmp);
+	switch (mapping)
+	{
+		case I_CASE_MAPPING_ASCII:
+			table = i_case_table_ascii;
+			break;
+		case I_CASE_MAPPING_STRICT_RFC1459:
+			table = i_case_table_strict_rfc1459;
+			break;
+		case I_CASE_MAPPING_RFC1459:
+		default:
+			table = i_case_table_rfc1459;
+			break;
+	}
+
+	ret = g_strdup(string);
+
+	for (p = ret; *p != '\0'; p++)
+	{
+		*p = table[(guchar)*p];
+	}
 
 	return ret;
 }
@@ -33,13 +33,24 @@
 struct i_lock;
 
 typedef struct i_lock iLock;
+
+enum i_case_mapping
+{
+	I_CASE_MAPPING_ASCII,
+	I_CASE_MAPPING_RFC1459,
+	I_CASE_MAPPING_STRICT_RFC1459
+};
+
+typedef enum i_case_mapping iCaseMapping;
 typedef gchar* (*IStrvNewFunc) (gchar const*);
 
 gboolean i_daemon (gboolean, gboolean);
 
 guint i_idle_add (GSourceFunc, gpointer, GMainContext*);
+guint i_timeout_add (guint, GSourceFunc, gpointer, GMainContext*);
 guint i_timeout_add_seconds (guint, GSourceFunc, gpointer, GMainContext*);
 gboolean i_source_remove (guint, GMainContext*);
+guint i_io_add_watch (GIOChannel*, GIOCondition, GIOFunc, gpointer, GMainContext*);
 
 GIOChannel* i_io_channel_unix_new_address (gchar const*, guint, gboolean);
 GIOChannel* i_io_channel_unix_new_listen (gchar const*, guint, gboolean);
@@ -52,6 +63,15 @@ gchar* i_strreplace (gchar const*, gchar const*, gchar const*, guint);
 
 gboolean i_ascii_str_case_equal (gconstpointer, gconstpointer);
 guint i_ascii_str_case_hash (gconstpointer);
+gboolean i_rfc1459_str_case_equal (gconstpointer, gconstpointer);
+guint i_rfc1459_str_case_hash (gconstpointer);
+gboolean i_strict_rfc1459_str_case_equal (gconstpointer, gconstpointer);
+guint i_strict_rfc1459_str_case_hash (gconstpointer);
+
+iCaseMapping i_case_mapping_from_string (gchar const*);
+GHashFunc i_case_mapping_hash_func (iCaseMapping);
+GEqualFunc i_case_mapping_equal_func (iCaseMapping);
+gchar* i_case_mapping_fold (iCaseMapping, gchar const*);
 
 gchar* i_get_current_time_string (gchar const*);
 
@@ -45,6 +45,84 @@
 #include "misc.h"
 #include "out.h"
 #include "server.h"
+#include "stats.h"
+
+/* The maximum length of a JOIN line, excluding CR-LF. */
+#define MAKI_JOIN_LENGTH 510
+/* The number of JOIN lines sent before the flood queue is used. */
+#define MAKI_JOIN_BURST 4
+
+/* Handlers whose latency is recorded, see maki_in_handlers. */
+enum
+{
+	s_handler_account,
+	s_handler_authenticate,
+	s_handler_away,
+	s_handler_batch,
+	s_handler_cap,
+	s_handler_err_cannot_join,
+	s_handler_err_chanoprivsneeded,
+	s_handler_err_nosuch,
+	s_handler_err_toomanychannels,
+	s_handler_invite,
+	s_handler_join,
+	s_handler_kick,
+	s_handler_message,
+	s_handler_mode,
+	s_handler_nick,
+	s_handler_notice,
+	s_handler_part,
+	s_handler_privmsg,
+	s_handler_quit,
+	s_handler_rpl_away,
+	s_handler_rpl_banlist,
+	s_handler_rpl_isupport,
+	s_handler_rpl_list,
+	s_handler_rpl_loggedin,
+	s_handler_rpl_motd,
+	s_handler_rpl_namreply,
+	s_handler_rpl_whois,
+	s_handler_rpl_whoreply,
+	s_handler_topic,
+	s_handler_last
+};
+
+static gchar const* maki_in_handler_names[] =
+{
+	"account",
+	"authenticate",
+	"away",
+	"batch",
+	"cap",
+	"err_cannot_join",
+	"err_chanoprivsneeded",
+	"err_nosuch",
+	"err_toomanychannels",
+	"invite",
+	"join",
+	"kick",
+	"message",
+	"mode",
+	"nick",
+	"notice",
+	"part",
+	"privmsg",
+	"quit",
+	"rpl_away",
+	"rpl_banlist",
+	"rpl_isupport",
+	"rpl_list",
+	"rpl_loggedin",
+	"rpl_motd",
+	"rpl_namreply",
+	"rpl_whois",
+	"rpl_whoreply",
+	"topic",
+	NULL
+};
+
+G_STATIC_ASSERT(G_N_ELEMENTS(maki_in_handler_names) == s_handler_last + 1);
+G_STATIC_ASSERT(s_handler_last <= MAKI_STATS_HISTOGRAMS);
 
 /* A convenience function to remove a colon before an argument.
  * It also checks for NULL. */
@@ -59,82 +137,159 @@ static gchar* maki_remove_colon (gchar* string)
 }
 
 static gboolean
-maki_mode_has_parameter (makiServer* serv, gchar sign, gchar mode)
+maki_is_channel(makiServer* serv, const gchar* target)
+{
+	gboolean ret;
+	makiSupport* support;
+
+	support = maki_server_support(serv);
+	ret = maki_support_is_channel(support, target);
+	maki_server_support_unref(serv, support);
+
+	return ret;
+}
+
+/* Returns the maximum number of targets for the given command as announced by TARGMAX.
+ * 0 means that there is no limit. */
+static guint maki_targmax (makiServer* serv, const gchar* command)
+{
+	guint ret = 0;
+	gsize length;
+	const gchar* targmax;
+	gchar** tmp;
+	gchar** p;
+	makiSupport* support;
+
+	support = maki_server_support(serv);
+
+	if ((targmax = maki_support_get(support, "TARGMAX")) == NULL)
+	{
+		maki_server_support_unref(serv, support);
+		return 0;
+	}
+
+	length = strlen(command);
+	tmp = g_strsplit(targmax, ",", 0);
+
+	maki_server_support_unref(serv, support);
+
+	for (p = tmp; *p != NULL; p++)
+	{
+		if (g_ascii_strncasecmp(*p, command, length) == 0 && (*p)[length] == ':')
+		{
+			ret = strtoul(*p + length + 1, NULL, 10);
+			break;
+		}
+	}
+
+	g_strfreev(tmp);
+
+	return ret;
+}
+
+/* Parses CHANLIMIT into a limit per channel prefix.
+ * Prefixes sharing a limit are mapped to the same group. */
+static void maki_chanlimit (makiServer* serv, guint* limits, guchar* groups)
 {
-	guint type;
-	const gchar* chanmodes;
+	guint i;
+	const gchar* chanlimit;
+	gchar** tmp;
+	gchar** p;
+	makiSupport* support;
 
-	if (strchr(maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_MODES), mode) != NULL)
+	for (i = 0; i < 256; i++)
 	{
-		return TRUE;
+		limits[i] = G_MAXUINT;
+		groups[i] = i;
 	}
 
-	if ((chanmodes = maki_server_support(serv, MAKI_SERVER_SUPPORT_CHANMODES)) == NULL)
+	support = maki_server_support(serv);
+
+	if ((chanlimit = maki_support_get(support, "CHANLIMIT")) == NULL)
 	{
-		return FALSE;
+		maki_server_support_unref(serv, support);
+		return;
 	}
 
-	for (type = 0; *chanmodes != '\0'; chanmodes++)
+	tmp = g_strsplit(chanlimit, ",", 0);
+
+	maki_server_support_unref(serv, support);
+
+	for (p = tmp; *p != NULL; p++)
 	{
-		if (*chanmodes == ',')
+		gchar* colon;
+		gchar* prefix;
+		guint limit;
+
+		if ((colon = strchr(*p, ':')) == NULL || colon == *p)
 		{
-			type++;
 			continue;
 		}
 
-		if (*chanmodes == mode)
+		limit = (colon[1] != '\0') ? strtoul(colon + 1, NULL, 10) : G_MAXUINT;
+
+		for (prefix = *p; prefix < colon; prefix++)
 		{
-			if (type == 0 || type == 1)
-			{
-				return TRUE;
-			}
-			else if (type == 2)
-			{
-				return (sign == '+');
-			}
-			else if (type == 3)
-			{
-				return FALSE;
-			}
+			limits[(guchar)*prefix] = limit;
+			groups[(guchar)*prefix] = (guchar)(*p)[0];
 		}
 	}
 
-	return FALSE;
-}
-
-static gboolean
-maki_is_channel(makiServer* serv, const gchar* target)
-{
-	return (strchr(maki_server_support(serv, MAKI_SERVER_SUPPORT_CHANTYPES), target[0]) != NULL);
+	g_strfreev(tmp);
 }
 
-static gint
-maki_prefix_position (makiServer* serv, gboolean is_prefix, gchar prefix)
+/* Sends a packed JOIN line.
+ * The first few lines are sent right away, the rest goes through the flood queue. */
+static void maki_join_flush (makiServer* serv, GString* channels, GString* keys, guint* lines)
 {
-	guint pos = 0;
-	const gchar* str = (is_prefix) ? maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_PREFIXES) : maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_MODES);
+	gchar* buffer;
 
-	while (str[pos] != '\0')
+	if (channels->len == 0)
 	{
-		if (str[pos] == prefix)
-		{
-			return pos;
-		}
+		return;
+	}
 
-		pos++;
+	if (keys->len > 0)
+	{
+		buffer = g_strdup_printf("JOIN %s %s", channels->str, keys->str);
+	}
+	else
+	{
+		buffer = g_strdup_printf("JOIN %s", channels->str);
 	}
 
-	return -1;
+	maki_server_queue(serv, buffer, (*lines >= MAKI_JOIN_BURST));
+	(*lines)++;
+
+	g_free(buffer);
+
+	g_string_truncate(channels, 0);
+	g_string_truncate(keys, 0);
 }
 
 /* This function gets called after a successful login.
- * It joins all configured channels. */
+ * It joins all configured channels, packing as many as possible into each line. */
 static gboolean maki_join (gpointer data)
 {
 	GHashTableIter iter;
 	gpointer key, value;
+	GPtrArray* names;
+	GPtrArray* keys;
+	GString* line_channels;
+	GString* line_keys;
+	guint limits[256];
+	guchar groups[256];
+	guint counts[256];
+	guint lines = 0;
+	guint targets = 0;
+	guint targmax;
+	guint pass;
+	guint i;
 	makiServer* serv = data;
 
+	names = g_ptr_array_new_with_free_func(g_free);
+	keys = g_ptr_array_new_with_free_func(g_free);
+
 	maki_server_channels_iter(serv, &iter);
 
 	while (g_hash_table_iter_next(&iter, &key, &value))
@@ -147,11 +302,95 @@ static gboolean maki_join (gpointer data)
 			gchar* channel_key;
 
 			channel_key = maki_channel_key(chan);
-			maki_out_join(serv, chan_name, channel_key);
-			g_free(channel_key);
+
+			if (channel_key != NULL && channel_key[0] == '\0')
+			{
+				g_free(channel_key);
+				channel_key = NULL;
+			}
+
+			g_ptr_array_add(names, g_strdup(chan_name));
+			g_ptr_array_add(keys, channel_key);
+		}
+	}
+
+	targmax = maki_targmax(serv, "JOIN");
+	maki_chanlimit(serv, limits, groups);
+	memset(counts, 0, sizeof(counts));
+
+	line_channels = g_string_new(NULL);
+	line_keys = g_string_new(NULL);
+
+	/* Keys are matched by position, so channels with keys have to come first. */
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (i = 0; i < names->len; i++)
+		{
+			const gchar* chan_name = g_ptr_array_index(names, i);
+			const gchar* channel_key = g_ptr_array_index(keys, i);
+			guchar prefix = chan_name[0];
+			gsize length;
+
+			if ((pass == 0) != (channel_key != NULL))
+			{
+				continue;
+			}
+
+			if (counts[groups[prefix]] >= limits[prefix])
+			{
+				maki_debug("WARN: Channel limit reached, not joining '%s'\n", chan_name);
+				continue;
+			}
+
+			counts[groups[prefix]]++;
+
+			/* JOIN channels,channel keys,key */
+			length = 5 + line_channels->len + 1 + strlen(chan_name);
+
+			if (channel_key != NULL)
+			{
+				length += 1 + line_keys->len + 1 + strlen(channel_key);
+			}
+			else if (line_keys->len > 0)
+			{
+				length += 1 + line_keys->len;
+			}
+
+			if (length > MAKI_JOIN_LENGTH || (targmax > 0 && targets >= targmax))
+			{
+				maki_join_flush(serv, line_channels, line_keys, &lines);
+				targets = 0;
+			}
+
+			if (line_channels->len > 0)
+			{
+				g_string_append_c(line_channels, ',');
+			}
+
+			g_string_append(line_channels, chan_name);
+
+			if (channel_key != NULL)
+			{
+				if (line_keys->len > 0)
+				{
+					g_string_append_c(line_keys, ',');
+				}
+
+				g_string_append(line_keys, channel_key);
+			}
+
+			targets++;
+			maki_server_metrics_autojoin(serv, chan_name);
 		}
 	}
 
+	maki_join_flush(serv, line_channels, line_keys, &lines);
+
+	g_string_free(line_keys, TRUE);
+	g_string_free(line_channels, TRUE);
+	g_ptr_array_free(keys, TRUE);
+	g_ptr_array_free(names, TRUE);
+
 	return FALSE;
 }
 
@@ -177,7 +416,7 @@ static void maki_commands (makiServer* serv)
 	g_strfreev(commands);
 }
 
-static void maki_in_dcc_send (makiServer* serv, makiUser* user, gchar* remaining)
+static void maki_in_dcc_send (makiServer* serv, makiUser* user, gchar* remaining, gboolean turbo)
 {
 	gchar* file_name;
 	gsize file_name_len;
@@ -217,7 +456,7 @@ static void maki_in_dcc_send (makiServer* serv, makiUser* user, gchar* remaining
 				token = g_ascii_strtoull(args[3], NULL, 10);
 			}
 
-			dcc = maki_dcc_send_new_in(serv, user, file_name, address, port, file_size, token);
+			dcc = maki_dcc_send_new_in(serv, user, file_name, address, port, file_size, token, turbo);
 
 			maki_instance_add_dcc_send(inst, dcc);
 		}
@@ -285,21 +524,28 @@ static void maki_in_dcc_resume_accept (makiServer* serv, makiUser* user, gchar*
 
 static void maki_in_privmsg (makiServer* serv, makiUser* user, gchar* remaining)
 {
+	gboolean own;
 	gchar** tmp;
 	gchar* target;
 	gchar* message;
+	gchar const* query;
 
 	if (!remaining)
 	{
 		return;
 	}
 
+	/* With echo-message, our own messages are sent back to us. */
+	own = (g_ascii_strcasecmp(maki_user_nick(user), maki_user_nick(maki_server_user(serv))) == 0);
+
 	tmp = g_strsplit(remaining, " ", 2);
 	target = tmp[0];
 	message = maki_remove_colon(tmp[1]);
 
 	if (target != NULL && message != NULL)
 	{
+		query = (own) ? target : maki_user_nick(user);
+
 		if (message[0] == '\001')
 		{
 			++message;
@@ -317,14 +563,14 @@ static void maki_in_privmsg (makiServer* serv, makiUser* user, gchar* remaining)
 				}
 				else
 				{
-					maki_server_log(serv, maki_user_nick(user), "%s %s", maki_user_nick(user), message + 7);
+					maki_server_log(serv, query, "%s %s", maki_user_nick(user), message + 7);
 				}
 
 				maki_dbus_emit_action(maki_server_name(serv), maki_user_from(user), target, message + 7);
 			}
 			else
 			{
-				if (g_ascii_strcasecmp(target, maki_user_nick(maki_server_user(serv))) == 0)
+				if (!own && g_ascii_strcasecmp(target, maki_user_nick(maki_server_user(serv))) == 0)
 				{
 					if (strncmp(message, "VERSION", 7) == 0)
 					{
@@ -336,7 +582,11 @@ static void maki_in_privmsg (makiServer* serv, makiUser* user, gchar* remaining)
 					}
 					else if (strncmp(message, "DCC SEND ", 9) == 0)
 					{
-						maki_in_dcc_send(serv, user, message + 9);
+						maki_in_dcc_send(serv, user, message + 9, FALSE);
+					}
+					else if (strncmp(message, "DCC TSEND ", 10) == 0)
+					{
+						maki_in_dcc_send(serv, user, message + 10, TRUE);
 					}
 					else if (strncmp(message, "DCC RESUME ", 11) == 0)
 					{
@@ -354,7 +604,7 @@ static void maki_in_privmsg (makiServer* serv, makiUser* user, gchar* remaining)
 				}
 				else
 				{
-					maki_server_log(serv, maki_user_nick(user), "=%s= %s", maki_user_nick(user), message);
+					maki_server_log(serv, query, "=%s= %s", maki_user_nick(user), message);
 				}
 
 				maki_dbus_emit_ctcp(maki_server_name(serv), maki_user_from(user), target, message);
@@ -368,7 +618,7 @@ static void maki_in_privmsg (makiServer* serv, makiUser* user, gchar* remaining)
 			}
 			else
 			{
-				maki_server_log(serv, maki_user_nick(user), "<%s> %s", maki_user_nick(user), message);
+				maki_server_log(serv, query, "<%s> %s", maki_user_nick(user), message);
 			}
 
 			maki_dbus_emit_message(maki_server_name(serv), maki_user_from(user), target, message);
@@ -389,6 +639,22 @@ static void maki_in_join (makiServer* serv, makiUser* user, gchar* remaining)
 	}
 
 	channel = maki_remove_colon(remaining);
+
+	/* With extended-join, the channel is followed by the account and the real name. */
+	if (maki_server_cap_enabled(serv, "extended-join"))
+	{
+		gchar** tmp;
+
+		tmp = g_strsplit(channel, " ", 3);
+
+		if (g_strv_length(tmp) >= 2)
+		{
+			maki_user_set_account(user, tmp[1]);
+		}
+
+		g_strfreev(tmp);
+	}
+
 	/* XXX */
 	g_strdelimit(channel, " ", '\0');
 
@@ -408,6 +674,7 @@ static void maki_in_join (makiServer* serv, makiUser* user, gchar* remaining)
 			maki_server_add_channel(serv, channel, chan);
 		}
 
+		maki_server_metrics_joined(serv, channel);
 		maki_server_log(serv, channel, _("» You join."));
 	}
 	else
@@ -502,10 +769,22 @@ static void maki_in_part (makiServer* serv, makiUser* user, gchar* remaining)
 	g_strfreev(tmp);
 }
 
-static void maki_in_quit (makiServer* serv, makiUser* user, gchar* remaining)
+/* batch is the reference of the batch the message belongs to, if any.
+ * Quits caused by a netsplit are logged together once their batch ends. */
+static void maki_in_quit (makiServer* serv, makiUser* user, gchar* remaining, const gchar* batch)
 {
 	GHashTableIter iter;
 	gpointer key, value;
+	gboolean netsplit = FALSE;
+
+	if (batch != NULL)
+	{
+		gchar* type;
+
+		type = maki_server_batch_type(serv, batch);
+		netsplit = (g_strcmp0(type, "netsplit") == 0);
+		g_free(type);
+	}
 
 	maki_server_channels_iter(serv, &iter);
 
@@ -521,7 +800,11 @@ static void maki_in_quit (makiServer* serv, makiUser* user, gchar* remaining)
 
 		if (maki_channel_get_user(chan, maki_user_nick(user)) != NULL)
 		{
-			if (remaining)
+			if (netsplit)
+			{
+				maki_server_batch_add_nick(serv, batch, chan_name, maki_user_nick(user));
+			}
+			else if (remaining)
 			{
 				maki_server_log(serv, chan_name, _("« %s quits (%s)."), maki_user_nick(user), maki_remove_colon(remaining));
 			}
@@ -688,6 +971,7 @@ static void maki_in_nick (makiServer* serv, makiUser* user, gchar* remaining)
 
 static void maki_in_notice (makiServer* serv, makiUser* user, gchar* remaining)
 {
+	gboolean own;
 	gchar** tmp;
 	gchar* target;
 	gchar* message;
@@ -697,6 +981,9 @@ static void maki_in_notice (makiServer* serv, makiUser* user, gchar* remaining)
 		return;
 	}
 
+	/* With echo-message, our own notices are sent back to us. */
+	own = (g_ascii_strcasecmp(maki_user_nick(user), maki_user_nick(maki_server_user(serv))) == 0);
+
 	tmp = g_strsplit(remaining, " ", 2);
 	target = tmp[0];
 	message = maki_remove_colon(tmp[1]);
@@ -709,7 +996,7 @@ static void maki_in_notice (makiServer* serv, makiUser* user, gchar* remaining)
 		}
 		else
 		{
-			maki_server_log(serv, maki_user_nick(user), "-%s- %s", maki_user_nick(user), message);
+			maki_server_log(serv, (own) ? target : maki_user_nick(user), "-%s- %s", maki_user_nick(user), message);
 		}
 
 		maki_dbus_emit_notice(maki_server_name(serv), maki_user_from(user), target, message);
@@ -750,6 +1037,7 @@ static void maki_in_mode (makiServer* serv, makiUser* user, gchar* remaining, gb
 		gchar sign = '+';
 		gchar buffer[3];
 		gchar* mode;
+		makiSupport* support = maki_server_support(serv);
 
 		length = g_strv_length(modes);
 
@@ -765,11 +1053,11 @@ static void maki_in_mode (makiServer* serv, makiUser* user, gchar* remaining, gb
 			buffer[1] = *mode;
 			buffer[2] = '\0';
 
-			if (maki_mode_has_parameter(serv, sign, *mode) && i < length)
+			if (maki_support_mode_has_parameter(support, sign, *mode) && i < length)
 			{
 				gint pos;
 
-				if ((pos = maki_prefix_position(serv, FALSE, *mode)) >= 0)
+				if ((pos = maki_support_mode_rank(support, *mode)) >= 0)
 				{
 					makiChannel* chan;
 					makiUser* muser;
@@ -826,6 +1114,8 @@ static void maki_in_mode (makiServer* serv, makiUser* user, gchar* remaining, gb
 				}
 			}
 		}
+
+		maki_server_support_unref(serv, support);
 	}
 
 	g_strfreev(tmp);
@@ -965,6 +1255,7 @@ static void maki_in_rpl_namreply (makiServer* serv, gchar* remaining, gboolean i
 		{
 			guint i;
 			guint j;
+			makiSupport* support = maki_server_support(serv);
 
 			nicks = g_new(gchar*, length - 1);
 			prefixes = g_new(gchar*, length - 1);
@@ -974,6 +1265,7 @@ static void maki_in_rpl_namreply (makiServer* serv, gchar* remaining, gboolean i
 			for (i = 2, j = 0; i < length; i++, j++)
 			{
 				gchar* nick = maki_remove_colon(tmp[i]);
+				gchar* host;
 				gchar prefix_str[2];
 				guint prefix = 0;
 				gint pos;
@@ -982,20 +1274,39 @@ static void maki_in_rpl_namreply (makiServer* serv, gchar* remaining, gboolean i
 				prefix_str[0] = '\0';
 				prefix_str[1] = '\0';
 
-				while ((pos = maki_prefix_position(serv, TRUE, *nick)) >= 0)
+				while ((pos = maki_support_prefix_rank(support, *nick)) >= 0)
 				{
 					if (prefix_str[0] == '\0')
 					{
-						prefix_str[0] = maki_server_support(serv, MAKI_SERVER_SUPPORT_PREFIX_PREFIXES)[pos];
+						prefix_str[0] = *nick;
 					}
 
 					prefix |= (1 << pos);
 					nick++;
 				}
 
+				/* With userhost-in-names, nicks are followed by !user@host. */
+				if ((host = strchr(nick, '!')) != NULL)
+				{
+					*host = '\0';
+					host++;
+				}
+
 				user = maki_channel_add_user(chan, nick);
 				maki_channel_set_user_prefix_override(chan, user, prefix);
 
+				if (host != NULL)
+				{
+					gchar* at;
+
+					if ((at = strchr(host, '@')) != NULL)
+					{
+						*at = '\0';
+						maki_user_set_user(user, host);
+						maki_user_set_host(user, at + 1);
+					}
+				}
+
 				nicks[j] = nick;
 				prefixes[j] = g_strdup(prefix_str);
 			}
@@ -1004,6 +1315,8 @@ static void maki_in_rpl_namreply (makiServer* serv, gchar* remaining, gboolean i
 
 			g_strfreev(prefixes);
 			g_free(nicks);
+
+			maki_server_support_unref(serv, support);
 		}
 	}
 
@@ -1026,6 +1339,13 @@ static void maki_in_rpl_whoreply (makiServer* serv, gchar* remaining, gboolean i
 
 	if (is_end)
 	{
+		makiChannel* chan;
+
+		if (length >= 1 && (chan = maki_server_get_channel(serv, tmp[0])) != NULL)
+		{
+			maki_channel_set_away_updated(chan, g_get_monotonic_time());
+			maki_channel_set_away_requested(chan, 0);
+		}
 	}
 	else
 	{
@@ -1055,6 +1375,23 @@ static void maki_in_rpl_whoreply (makiServer* serv, gchar* remaining, gboolean i
 	g_strfreev(tmp);
 }
 
+/* Sent by servers supporting away-notify whenever a user in a common channel changes its away state. */
+static void maki_in_away (makiServer* serv, makiUser* user, gchar* remaining)
+{
+	gboolean away;
+
+	away = (remaining != NULL && *maki_remove_colon(remaining) != '\0');
+
+	if (maki_user_away(user) != away)
+	{
+		maki_user_set_away(user, away);
+
+		maki_dbus_emit_user_away(maki_server_name(serv), maki_user_from(user), maki_user_away(user));
+	}
+
+	maki_user_set_away_message(user, (away) ? maki_remove_colon(remaining) : NULL);
+}
+
 static void maki_in_rpl_away (makiServer* serv, gchar* remaining)
 {
 	gchar** tmp;
@@ -1077,7 +1414,6 @@ static void maki_in_rpl_away (makiServer* serv, gchar* remaining)
 static void maki_in_rpl_isupport (makiServer* serv, gchar* remaining)
 {
 	guint i;
-	guint length;
 	gchar** tmp;
 
 	if (!remaining)
@@ -1086,50 +1422,32 @@ static void maki_in_rpl_isupport (makiServer* serv, gchar* remaining)
 	}
 
 	tmp = g_strsplit(remaining, " ", 0);
-	length = g_strv_length(tmp);
 
-	for (i = 0; i < length; ++i)
+	for (i = 0; tmp[i] != NULL; ++i)
 	{
-		gchar** support;
-
+		/* The trailing "are supported by this server". */
 		if (tmp[i][0] == ':')
 		{
-			break;
-		}
+			g_free(tmp[i]);
+			tmp[i] = NULL;
 
-		support = g_strsplit(tmp[i], "=", 2);
+			while (tmp[++i] != NULL)
+			{
+				g_free(tmp[i]);
+				tmp[i] = NULL;
+			}
 
-		if (g_strv_length(support) < 2)
-		{
-			g_strfreev(support);
-			continue;
+			break;
 		}
 
-		if (strncmp(support[0], "CHANMODES", 9) == 0)
-		{
-			maki_server_set_support(serv, MAKI_SERVER_SUPPORT_CHANMODES, support[1]);
-		}
-		else if (strncmp(support[0], "CHANTYPES", 9) == 0)
-		{
-			maki_server_set_support(serv, MAKI_SERVER_SUPPORT_CHANTYPES, support[1]);
-		}
-		else if (strncmp(support[0], "PREFIX", 6) == 0)
+		if (strncmp(tmp[i], "CASEMAPPING=", 12) == 0)
 		{
-			gchar* paren;
-
-			paren = strchr(support[1], ')');
-
-			if (support[1][0] == '(' && paren != NULL)
-			{
-				*paren = '\0';
-				maki_server_set_support(serv, MAKI_SERVER_SUPPORT_PREFIX_MODES, support[1] + 1);
-				maki_server_set_support(serv, MAKI_SERVER_SUPPORT_PREFIX_PREFIXES, paren + 1);
-			}
+			maki_server_set_case_mapping(serv, i_case_mapping_from_string(tmp[i] + 12));
 		}
-
-		g_strfreev(support);
 	}
 
+	maki_server_update_support(serv, tmp);
+
 	g_strfreev(tmp);
 }
 
@@ -1274,6 +1592,7 @@ static void maki_in_err_nosuch (makiServer* serv, gchar* remaining, gint numeric
 		case 403:
 			reason = "channel";
 			type = "c";
+			maki_server_metrics_join_failed(serv, tmp[0]);
 			break;
 		default:
 			g_warn_if_reached();
@@ -1337,6 +1656,8 @@ static void maki_in_err_cannot_join (makiServer* serv, gchar* remaining, gint nu
 			break;
 	}
 
+	maki_server_metrics_join_failed(serv, tmp[0]);
+
 	arguments = i_strv_new(NULL, tmp[0], NULL);
 
 	maki_dbus_emit_error(maki_server_name(serv), "cannot_join", reason, arguments);
@@ -1347,6 +1668,30 @@ static void maki_in_err_cannot_join (makiServer* serv, gchar* remaining, gint nu
 	g_strfreev(tmp);
 }
 
+/* ERR_TOOMANYCHANNELS */
+static void maki_in_err_toomanychannels (makiServer* serv, gchar* remaining)
+{
+	gchar** tmp;
+
+	if (!remaining)
+	{
+		return;
+	}
+
+	tmp = g_strsplit(remaining, " ", 2);
+
+	if (g_strv_length(tmp) < 1)
+	{
+		g_strfreev(tmp);
+		return;
+	}
+
+	maki_debug("WARN: Too many channels, cannot join '%s'\n", tmp[0]);
+	maki_server_metrics_join_failed(serv, tmp[0]);
+
+	g_strfreev(tmp);
+}
+
 static void maki_in_err_chanoprivsneeded (makiServer* serv, gchar* remaining)
 {
 	gchar** arguments;
@@ -1374,95 +1719,534 @@ static void maki_in_err_chanoprivsneeded (makiServer* serv, gchar* remaining)
 	g_strfreev(tmp);
 }
 
-/* This function receives and handles all messages from sashimi. */
-void maki_in_callback (const gchar* message, gpointer data)
+/* The capabilities maki requests if the server offers them. */
+static const gchar* maki_in_caps[] = {
+	"account-notify",
+	"away-notify",
+	"batch",
+	"echo-message",
+	"extended-join",
+	"multi-prefix",
+	"server-time",
+	"userhost-in-names",
+	NULL
+};
+
+/* Returns the configured SASL mechanism if the server supports it, NULL otherwise. */
+static const gchar* maki_in_sasl_mechanism (makiServer* serv)
 {
-	makiServer* serv = data;
+	const gchar* ret = NULL;
+	gchar* mechanism;
+	gchar* mechanisms;
 
-	/* Check for valid UTF-8, because strange crashes can occur otherwise. */
-	if (!g_utf8_validate(message, -1, NULL))
+	if (!maki_server_cap_available(serv, "sasl"))
 	{
-		gchar* tmp;
-
-		/* If the message is not in UTF-8 we will just assume that it is in ISO-8859-1. */
-		if ((tmp = g_convert_with_fallback(message, -1, "UTF-8", "ISO-8859-1", NULL, NULL, NULL, NULL)) == NULL)
-		{
-			return;
-		}
-
-		maki_in_callback(tmp, serv);
-		g_free(tmp);
-		return;
+		return NULL;
 	}
 
-	/* Extra check to avoid string operations when verbose is disabled. */
-	if (opt_verbose)
-	{
-		gchar* time_str;
-
-		if ((time_str = i_get_current_time_string("%Y-%m-%d %H:%M:%S")) != NULL)
-		{
-			maki_debug("IN: [%s/%s] %s\n", time_str, maki_server_name(serv), message);
-			g_free(time_str);
-		}
-		else
-		{
-			maki_debug("IN: [%s] %s\n", maki_server_name(serv), message);
-		}
-	}
+	mechanism = maki_server_config_get_string(serv, "server", "sasl");
+	mechanisms = maki_server_cap_value(serv, "sasl");
 
-	if (G_LIKELY(message[0] == ':'))
+	if (mechanism != NULL && (g_ascii_strcasecmp(mechanism, "PLAIN") == 0 || g_ascii_strcasecmp(mechanism, "EXTERNAL") == 0))
 	{
-		gchar** parts;
-		gchar** from;
-		gchar** ignores;
-		gchar* type;
-		gchar* remaining;
-		guint from_length;
-		makiUser* user;
-
-		parts = g_strsplit(message + 1, " ", 3);
-
-		if (g_strv_length(parts) < 2)
-		{
-			g_strfreev(parts);
-			return;
-		}
-
-		/* FIXME */
-		ignores = maki_server_config_get_string_list(serv, "server", "ignores");
+		ret = (g_ascii_strcasecmp(mechanism, "PLAIN") == 0) ? "PLAIN" : "EXTERNAL";
 
-		if (ignores != NULL)
+		/* With CAP LS 302, the server announces its mechanisms. */
+		if (!maki_config_is_empty(mechanisms))
 		{
+			gchar** tmp;
 			guint i;
-			guint length;
+			gboolean found = FALSE;
 
-			length = g_strv_length(ignores);
+			tmp = g_strsplit(mechanisms, ",", 0);
 
-			for (i = 0; i < length; ++i)
+			for (i = 0; tmp[i] != NULL; i++)
 			{
-				if (g_pattern_match_simple(ignores[i], parts[0]))
+				if (strcmp(tmp[i], ret) == 0)
 				{
-					g_strfreev(parts);
-					g_strfreev(ignores);
-					return;
+					found = TRUE;
 				}
 			}
-		}
-
-		g_strfreev(ignores);
 
-		from = g_strsplit_set(parts[0], "!@", 3);
-		from_length = g_strv_length(from);
+			g_strfreev(tmp);
 
-		if (from_length < 1)
-		{
-			g_strfreev(parts);
-			g_strfreev(from);
-			return;
+			if (!found)
+			{
+				ret = NULL;
+			}
 		}
+	}
 
-		type = parts[1];
+	g_free(mechanism);
+	g_free(mechanisms);
+
+	return ret;
+}
+
+/* Requests all wanted capabilities that are available but not enabled yet.
+ * Returns FALSE if there was nothing to request. */
+static gboolean maki_in_cap_request (makiServer* serv)
+{
+	GString* request;
+	guint i;
+	gboolean ret = FALSE;
+
+	request = g_string_new(NULL);
+
+	for (i = 0; maki_in_caps[i] != NULL; i++)
+	{
+		if (maki_server_cap_available(serv, maki_in_caps[i]) && !maki_server_cap_enabled(serv, maki_in_caps[i]))
+		{
+			if (request->len > 0)
+			{
+				g_string_append_c(request, ' ');
+			}
+
+			g_string_append(request, maki_in_caps[i]);
+		}
+	}
+
+	if (!maki_server_cap_enabled(serv, "sasl") && maki_in_sasl_mechanism(serv) != NULL)
+	{
+		if (request->len > 0)
+		{
+			g_string_append_c(request, ' ');
+		}
+
+		g_string_append(request, "sasl");
+	}
+
+	if (request->len > 0)
+	{
+		maki_server_send_printf(serv, "CAP REQ :%s", request->str);
+		ret = TRUE;
+	}
+
+	g_string_free(request, TRUE);
+
+	return ret;
+}
+
+static void maki_in_cap_end (makiServer* serv)
+{
+	if (!maki_server_logged_in(serv))
+	{
+		maki_server_send(serv, "CAP END");
+	}
+}
+
+static void maki_in_cap (makiServer* serv, gchar* remaining)
+{
+	gchar** tmp;
+	gchar** caps;
+	gchar* subcommand;
+	gchar* list;
+	gboolean more = FALSE;
+	guint i;
+
+	if (!remaining)
+	{
+		return;
+	}
+
+	tmp = g_strsplit(remaining, " ", 3);
+
+	if (g_strv_length(tmp) < 3)
+	{
+		g_strfreev(tmp);
+		return;
+	}
+
+	subcommand = tmp[1];
+	list = tmp[2];
+
+	/* CAP LS 302 may span multiple lines, all but the last one are marked with an asterisk. */
+	if (list[0] == '*' && list[1] == ' ')
+	{
+		more = TRUE;
+		list += 2;
+	}
+
+	caps = g_strsplit(maki_remove_colon(list), " ", 0);
+
+	if (strcmp(subcommand, "LS") == 0 || strcmp(subcommand, "NEW") == 0)
+	{
+		for (i = 0; caps[i] != NULL; i++)
+		{
+			gchar* value;
+
+			if (caps[i][0] == '\0')
+			{
+				continue;
+			}
+
+			if ((value = strchr(caps[i], '=')) != NULL)
+			{
+				*value = '\0';
+				value++;
+			}
+
+			maki_server_cap_set_available(serv, caps[i], value);
+		}
+
+		if (!more && !maki_in_cap_request(serv) && strcmp(subcommand, "LS") == 0)
+		{
+			maki_in_cap_end(serv);
+		}
+	}
+	else if (strcmp(subcommand, "ACK") == 0)
+	{
+		const gchar* sasl = NULL;
+
+		for (i = 0; caps[i] != NULL; i++)
+		{
+			gboolean enabled = TRUE;
+			gchar* name = caps[i];
+
+			if (name[0] == '-')
+			{
+				enabled = FALSE;
+				name++;
+			}
+
+			if (name[0] == '\0')
+			{
+				continue;
+			}
+
+			maki_server_cap_set_enabled(serv, name, enabled);
+
+			if (strcmp(name, "away-notify") == 0)
+			{
+				maki_server_set_away_notify(serv, enabled);
+			}
+			else if (strcmp(name, "sasl") == 0 && enabled && !maki_server_logged_in(serv))
+			{
+				sasl = maki_in_sasl_mechanism(serv);
+			}
+		}
+
+		/* Registration is finished once the SASL exchange is over. */
+		if (sasl != NULL)
+		{
+			maki_server_send_printf(serv, "AUTHENTICATE %s", sasl);
+		}
+		else
+		{
+			maki_in_cap_end(serv);
+		}
+	}
+	else if (strcmp(subcommand, "NAK") == 0)
+	{
+		maki_in_cap_end(serv);
+	}
+	else if (strcmp(subcommand, "DEL") == 0)
+	{
+		for (i = 0; caps[i] != NULL; i++)
+		{
+			maki_server_cap_remove(serv, caps[i]);
+
+			if (strcmp(caps[i], "away-notify") == 0)
+			{
+				maki_server_set_away_notify(serv, FALSE);
+			}
+		}
+	}
+
+	g_strfreev(caps);
+	g_strfreev(tmp);
+}
+
+static void maki_in_authenticate (makiServer* serv, const gchar* remaining)
+{
+	const gchar* mechanism;
+
+	if (!remaining || strcmp(remaining, "+") != 0)
+	{
+		return;
+	}
+
+	if ((mechanism = maki_in_sasl_mechanism(serv)) == NULL)
+	{
+		maki_server_send(serv, "AUTHENTICATE *");
+		return;
+	}
+
+	if (strcmp(mechanism, "PLAIN") == 0)
+	{
+		gchar* user;
+		gchar* password;
+		gchar* plain;
+		gchar* encoded;
+		gsize user_length;
+		gsize password_length;
+		gsize plain_length;
+		gsize length;
+		gsize i;
+
+		user = maki_server_config_get_string(serv, "server", "sasl_user");
+		password = maki_server_config_get_string(serv, "server", "sasl_password");
+
+		if (maki_config_is_empty(user))
+		{
+			g_free(user);
+			user = maki_server_config_get_string(serv, "server", "nick");
+		}
+
+		if (user == NULL)
+		{
+			user = g_strdup("");
+		}
+
+		if (password == NULL)
+		{
+			password = g_strdup("");
+		}
+
+		/* authzid \0 authcid \0 password */
+		user_length = strlen(user);
+		password_length = strlen(password);
+		plain_length = 2 * user_length + password_length + 2;
+
+		plain = g_malloc(plain_length);
+		memcpy(plain, user, user_length);
+		plain[user_length] = '\0';
+		memcpy(plain + user_length + 1, user, user_length);
+		plain[2 * user_length + 1] = '\0';
+		memcpy(plain + 2 * user_length + 2, password, password_length);
+
+		encoded = g_base64_encode((const guchar*)plain, plain_length);
+		length = strlen(encoded);
+
+		/* The response is sent in chunks of 400 bytes, a full last chunk is followed by an empty one. */
+		for (i = 0; i < length; i += 400)
+		{
+			maki_server_send_printf(serv, "AUTHENTICATE %.400s", encoded + i);
+		}
+
+		if (length % 400 == 0)
+		{
+			maki_server_send(serv, "AUTHENTICATE +");
+		}
+
+		memset(plain, 0, plain_length);
+		g_free(plain);
+		g_free(encoded);
+		g_free(password);
+		g_free(user);
+	}
+	else
+	{
+		/* EXTERNAL uses the client certificate. */
+		maki_server_send(serv, "AUTHENTICATE +");
+	}
+}
+
+/* RPL_LOGGEDIN */
+static void maki_in_rpl_loggedin (makiServer* serv, gchar* remaining)
+{
+	gchar** tmp;
+
+	if (!remaining)
+	{
+		return;
+	}
+
+	tmp = g_strsplit(remaining, " ", 3);
+
+	if (g_strv_length(tmp) >= 2)
+	{
+		maki_user_set_account(maki_server_user(serv), tmp[1]);
+	}
+
+	g_strfreev(tmp);
+}
+
+static void maki_in_batch (makiServer* serv, gchar* remaining)
+{
+	gchar** tmp;
+
+	if (!remaining)
+	{
+		return;
+	}
+
+	tmp = g_strsplit(remaining, " ", 3);
+
+	if (tmp[0] != NULL)
+	{
+		if (tmp[0][0] == '+' && tmp[1] != NULL)
+		{
+			maki_server_batch_start(serv, tmp[0] + 1, tmp[1], tmp[2]);
+		}
+		else if (tmp[0][0] == '-')
+		{
+			gchar* type = NULL;
+			gchar* parameters = NULL;
+			GHashTable* nicks;
+
+			if ((nicks = maki_server_batch_end(serv, tmp[0] + 1, &type, &parameters)) != NULL)
+			{
+				GHashTableIter iter;
+				gpointer key, value;
+
+				/* The parameters of a netsplit batch are the two servers that split. */
+				g_hash_table_iter_init(&iter, nicks);
+
+				while (g_hash_table_iter_next(&iter, &key, &value))
+				{
+					maki_server_log(serv, key, _("« Netsplit (%s): %s quit."), parameters, (gchar const*)value);
+				}
+
+				g_hash_table_destroy(nicks);
+			}
+
+			g_free(type);
+			g_free(parameters);
+		}
+	}
+
+	g_strfreev(tmp);
+}
+
+/* Sent by servers supporting account-notify whenever a user in a common channel logs in or out. */
+static void maki_in_account (makiServer* serv, makiUser* user, gchar* remaining)
+{
+	if (!remaining)
+	{
+		return;
+	}
+
+	maki_user_set_account(user, maki_remove_colon(remaining));
+}
+
+/* Parses IRCv3 message tags, unescaping their values. */
+static GHashTable* maki_in_tags (const gchar* tags)
+{
+	GHashTable* ret;
+	gchar** tmp;
+	guint i;
+
+	ret = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	tmp = g_strsplit(tags, ";", 0);
+
+	for (i = 0; tmp[i] != NULL; i++)
+	{
+		gchar* value;
+		GString* unescaped;
+
+		if (tmp[i][0] == '\0')
+		{
+			continue;
+		}
+
+		unescaped = g_string_new(NULL);
+
+		if ((value = strchr(tmp[i], '=')) != NULL)
+		{
+			*value = '\0';
+
+			for (value++; *value != '\0'; value++)
+			{
+				if (*value != '\\')
+				{
+					g_string_append_c(unescaped, *value);
+					continue;
+				}
+
+				value++;
+
+				switch (*value)
+				{
+					case ':':
+						g_string_append_c(unescaped, ';');
+						break;
+					case 's':
+						g_string_append_c(unescaped, ' ');
+						break;
+					case 'r':
+						g_string_append_c(unescaped, '\r');
+						break;
+					case 'n':
+						g_string_append_c(unescaped, '\n');
+						break;
+					case '\0':
+						value--;
+						break;
+					default:
+						g_string_append_c(unescaped, *value);
+						break;
+				}
+			}
+		}
+
+		g_hash_table_insert(ret, g_strdup(tmp[i]), g_string_free(unescaped, FALSE));
+	}
+
+	g_strfreev(tmp);
+
+	return ret;
+}
+
+/* Handles a single message without its tags. */
+/* batch is the reference of the batch the message belongs to, if any. */
+static void maki_in_message (makiServer* serv, const gchar* message, const gchar* batch)
+{
+	gint64 start;
+	guint handler = s_handler_message;
+
+	start = g_get_monotonic_time();
+
+	if (G_LIKELY(message[0] == ':'))
+	{
+		gchar** parts;
+		gchar** from;
+		GPatternSpec* const* ignores;
+		gboolean ignored = FALSE;
+		gchar* type;
+		gchar* remaining;
+		guint from_length;
+		makiUser* user;
+		makiServerConfig const* config;
+
+		parts = g_strsplit(message + 1, " ", 3);
+
+		if (g_strv_length(parts) < 2)
+		{
+			g_strfreev(parts);
+			return;
+		}
+
+		config = maki_server_config_snapshot(serv);
+
+		for (ignores = config->ignores.specs; *ignores != NULL; ignores++)
+		{
+			if (g_pattern_match_string(*ignores, parts[0]))
+			{
+				ignored = TRUE;
+				break;
+			}
+		}
+
+		maki_server_config_snapshot_unref(serv, config);
+
+		if (ignored)
+		{
+			g_strfreev(parts);
+			return;
+		}
+
+		from = g_strsplit_set(parts[0], "!@", 3);
+		from_length = g_strv_length(from);
+
+		if (from_length < 1)
+		{
+			g_strfreev(parts);
+			g_strfreev(from);
+			return;
+		}
+
+		type = parts[1];
 		remaining = parts[2];
 
 		user = maki_server_add_user(serv, from[0]);
@@ -1494,22 +2278,26 @@ void maki_in_callback (const gchar* message, gpointer data)
 			{
 				/* RPL_CHANNELMODEIS */
 				case 324:
+					handler = s_handler_mode;
 					maki_in_mode(serv, user, remaining, TRUE);
 					break;
 				/* RPL_INVITING */
 				case 341:
+					handler = s_handler_invite;
 					maki_in_invite(serv, user, remaining, TRUE);
 					break;
 				/* RPL_NAMREPLY */
 				case 353:
 				/* RPL_ENDOFNAMES */
 				case 366:
+					handler = s_handler_rpl_namreply;
 					maki_in_rpl_namreply(serv, remaining, (numeric == 366));
 					break;
 				/* RPL_WHOREPLY */
 				case 352:
 				/* RPL_ENDOFWHO */
 				case 315:
+					handler = s_handler_rpl_whoreply;
 					maki_in_rpl_whoreply(serv, remaining, (numeric == 315));
 					break;
 				/* RPL_UNAWAY */
@@ -1527,15 +2315,50 @@ void maki_in_callback (const gchar* message, gpointer data)
 					break;
 				/* RPL_AWAY */
 				case 301:
+					handler = s_handler_rpl_away;
 					maki_in_rpl_away(serv, remaining);
 					break;
+				/* RPL_LOGGEDIN */
+				case 900:
+					handler = s_handler_rpl_loggedin;
+					maki_in_rpl_loggedin(serv, remaining);
+					break;
+				/* RPL_SASLSUCCESS */
+				case 903:
+				/* ERR_NICKLOCKED */
+				case 902:
+				/* ERR_SASLFAIL */
+				case 904:
+				/* ERR_SASLTOOLONG */
+				case 905:
+				/* ERR_SASLABORTED */
+				case 906:
+				/* ERR_SASLALREADY */
+				case 907:
+					if (numeric != 903)
+					{
+						maki_debug("WARN: SASL authentication failed (%d)\n", numeric);
+					}
+
+					handler = s_handler_cap;
+					maki_in_cap_end(serv);
+					break;
 				/* RPL_ENDOFMOTD */
 				case 376:
 				/* ERR_NOMOTD */
 				case 422:
 					maki_server_set_logged_in(serv, TRUE);
-					maki_out_nickserv(serv);
-					g_timeout_add_seconds(3, maki_join, serv);
+
+					/* Without SASL, give NickServ some time to cloak us before joining. */
+					if (maki_out_nickserv(serv))
+					{
+						i_timeout_add_seconds(3, maki_join, serv, maki_server_main_context(serv));
+					}
+					else
+					{
+						maki_join(serv);
+					}
+
 					maki_commands(serv);
 
 					if (maki_user_away(maki_server_user(serv)) && maki_user_away_message(maki_server_user(serv)) != NULL)
@@ -1543,6 +2366,7 @@ void maki_in_callback (const gchar* message, gpointer data)
 						maki_out_away(serv, maki_user_away_message(maki_server_user(serv)));
 					}
 
+					handler = s_handler_rpl_motd;
 					maki_in_rpl_motd(serv, remaining, TRUE);
 					break;
 				/* ERR_NICKNAMEINUSE */
@@ -1569,14 +2393,22 @@ void maki_in_callback (const gchar* message, gpointer data)
 				case 402:
 				/* ERR_NOSUCHCHANNEL */
 				case 403:
+					handler = s_handler_err_nosuch;
 					maki_in_err_nosuch(serv, remaining, numeric);
 					break;
+				/* ERR_TOOMANYCHANNELS */
+				case 405:
+					handler = s_handler_err_toomanychannels;
+					maki_in_err_toomanychannels(serv, remaining);
+					break;
 				/* RPL_MOTD */
 				case 372:
+					handler = s_handler_rpl_motd;
 					maki_in_rpl_motd(serv, remaining, FALSE);
 					break;
 				/* RPL_TOPIC */
 				case 332:
+					handler = s_handler_topic;
 					maki_in_topic(serv, user, remaining, TRUE);
 					break;
 				/* RPL_WHOISUSER */
@@ -1591,22 +2423,26 @@ void maki_in_callback (const gchar* message, gpointer data)
 				case 318:
 				/* RPL_WHOISCHANNELS */
 				case 319:
+					handler = s_handler_rpl_whois;
 					maki_in_rpl_whois(serv, remaining, (numeric == 318));
 					break;
 				/* RPL_ISUPPORT */
 				case 5:
+					handler = s_handler_rpl_isupport;
 					maki_in_rpl_isupport(serv, remaining);
 					break;
 				/* RPL_LIST */
 				case 322:
 				/* RPL_LISTEND */
 				case 323:
+					handler = s_handler_rpl_list;
 					maki_in_rpl_list(serv, remaining, (numeric == 323));
 					break;
 				/* RPL_BANLIST */
 				case 367:
 				/* RPL_ENDOFBANLIST */
 				case 368:
+					handler = s_handler_rpl_banlist;
 					maki_in_rpl_banlist(serv, remaining, (numeric == 368));
 					break;
 				/* RPL_YOUREOPER */
@@ -1621,9 +2457,11 @@ void maki_in_callback (const gchar* message, gpointer data)
 				case 474:
 				/* ERR_BADCHANNELKEY */
 				case 475:
+					handler = s_handler_err_cannot_join;
 					maki_in_err_cannot_join(serv, remaining, numeric);
 					break;
 				case 482:
+					handler = s_handler_err_chanoprivsneeded;
 					maki_in_err_chanoprivsneeded(serv, remaining);
 					break;
 
@@ -1636,53 +2474,193 @@ void maki_in_callback (const gchar* message, gpointer data)
 		{
 			if (strncmp(type, "PRIVMSG", 7) == 0)
 			{
+				handler = s_handler_privmsg;
 				maki_in_privmsg(serv, user, remaining);
 			}
 			else if (strncmp(type, "JOIN", 4) == 0)
 			{
+				handler = s_handler_join;
 				maki_in_join(serv, user, remaining);
 			}
 			else if (strncmp(type, "PART", 4) == 0)
 			{
+				handler = s_handler_part;
 				maki_in_part(serv, user, remaining);
 			}
 			else if (strncmp(type, "QUIT", 4) == 0)
 			{
-				maki_in_quit(serv, user, remaining);
+				handler = s_handler_quit;
+				maki_in_quit(serv, user, remaining, batch);
 			}
 			else if (strncmp(type, "KICK", 4) == 0)
 			{
+				handler = s_handler_kick;
 				maki_in_kick(serv, user, remaining);
 			}
 			else if (strncmp(type, "NICK", 4) == 0)
 			{
+				handler = s_handler_nick;
 				maki_in_nick(serv, user, remaining);
 			}
 			else if (strncmp(type, "NOTICE", 6) == 0)
 			{
+				handler = s_handler_notice;
 				maki_in_notice(serv, user, remaining);
 			}
 			else if (strncmp(type, "MODE", 4) == 0)
 			{
+				handler = s_handler_mode;
 				maki_in_mode(serv, user, remaining, FALSE);
 			}
 			else if (strncmp(type, "INVITE", 6) == 0)
 			{
+				handler = s_handler_invite;
 				maki_in_invite(serv, user, remaining, FALSE);
 			}
 			else if (strncmp(type, "TOPIC", 5) == 0)
 			{
+				handler = s_handler_topic;
 				maki_in_topic(serv, user, remaining, FALSE);
 			}
+			else if (strncmp(type, "AWAY", 4) == 0)
+			{
+				handler = s_handler_away;
+				maki_in_away(serv, user, remaining);
+			}
+			else if (strncmp(type, "CAP", 3) == 0)
+			{
+				handler = s_handler_cap;
+				maki_in_cap(serv, remaining);
+			}
+			else if (strncmp(type, "BATCH", 5) == 0)
+			{
+				handler = s_handler_batch;
+				maki_in_batch(serv, remaining);
+			}
+			else if (strncmp(type, "ACCOUNT", 7) == 0)
+			{
+				handler = s_handler_account;
+				maki_in_account(serv, user, remaining);
+			}
+			else if (strncmp(type, "AUTHENTICATE", 12) == 0)
+			{
+				handler = s_handler_authenticate;
+				maki_in_authenticate(serv, remaining);
+			}
 			else
 			{
 				maki_debug("WARN: Unhandled message type '%s'\n", type);
 			}
 		}
 
-		maki_server_remove_user(serv, maki_user_nick(user));
+		maki_server_remove_user(serv, user);
 
 		g_strfreev(parts);
 		g_strfreev(from);
 	}
+	else if (strncmp(message, "AUTHENTICATE ", 13) == 0)
+	{
+		handler = s_handler_authenticate;
+		maki_in_authenticate(serv, message + 13);
+	}
+
+	maki_stats_record(handler, g_get_monotonic_time() - start);
+}
+
+/* This function receives and handles all messages from sashimi. */
+void maki_in_callback (const gchar* message, gpointer data)
+{
+	makiServer* serv = data;
+
+	/* Check for valid UTF-8, because strange crashes can occur otherwise. */
+	if (!g_utf8_validate(message, -1, NULL))
+	{
+		gchar* tmp;
+
+		/* If the message is not in UTF-8 we will just assume that it is in ISO-8859-1. */
+		if ((tmp = g_convert_with_fallback(message, -1, "UTF-8", "ISO-8859-1", NULL, NULL, NULL, NULL)) == NULL)
+		{
+			return;
+		}
+
+		maki_in_callback(tmp, serv);
+		g_free(tmp);
+		return;
+	}
+
+	/* Extra check to avoid string operations when verbose is disabled. */
+	if (opt_verbose)
+	{
+		gchar* time_str;
+
+		if ((time_str = i_get_current_time_string("%Y-%m-%d %H:%M:%S")) != NULL)
+		{
+			maki_debug("IN: [%s/%s] %s\n", time_str, maki_server_name(serv), message);
+			g_free(time_str);
+		}
+		else
+		{
+			maki_debug("IN: [%s] %s\n", maki_server_name(serv), message);
+		}
+	}
+
+	if (message[0] == '@')
+	{
+		GHashTable* tags;
+		const gchar* value;
+		const gchar* batch;
+		gchar* tmp;
+		gchar* end;
+
+		if ((end = strchr(message, ' ')) == NULL)
+		{
+			return;
+		}
+
+		tmp = g_strndup(message + 1, end - message - 1);
+		tags = maki_in_tags(tmp);
+		g_free(tmp);
+
+		/* With server-time, signals carry the time the server received the message. */
+		if ((value = g_hash_table_lookup(tags, "time")) != NULL)
+		{
+			GTimeVal timeval;
+
+			if (g_time_val_from_iso8601(value, &timeval))
+			{
+				maki_dbus_set_timestamp(timeval.tv_sec);
+			}
+		}
+
+		batch = g_hash_table_lookup(tags, "batch");
+
+		if (batch != NULL && opt_verbose)
+		{
+			gchar* type;
+
+			type = maki_server_batch_type(serv, batch);
+			maki_debug("BATCH: [%s] %s (%s)\n", maki_server_name(serv), batch, (type != NULL) ? type : "unknown");
+			g_free(type);
+		}
+
+		while (*end == ' ')
+		{
+			end++;
+		}
+
+		maki_in_message(serv, end, batch);
+
+		maki_dbus_set_timestamp(0);
+		g_hash_table_destroy(tags);
+	}
+	else
+	{
+		maki_in_message(serv, message, NULL);
+	}
+}
+
+/* Returns the names of the handlers, indexed like their histograms in makiStats. */
+gchar const* const* maki_in_handlers (void)
+{
+	return maki_in_handler_names;
 }
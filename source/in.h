@@ -32,4 +32,6 @@
 
 void maki_in_callback (const gchar*, gpointer);
 
+gchar const* const* maki_in_handlers (void);
+
 #endif
@@ -37,14 +37,37 @@
 
 #include "instance.h"
 
+#include "config_store.h"
 #include "dbus.h"
+#include "event.h"
+#include "log.h"
 #include "plugin.h"
+#include "rcu.h"
+#include "stats.h"
 
 struct maki_instance
 {
 	makiNetwork* network;
 
 	GKeyFile* key_file;
+	makiConfigStore* config_store;
+
+	makiEventBus* events;
+
+	struct
+	{
+		makiLogs* logs;
+		makiEventConsumer* consumer;
+	}
+	log;
+
+	struct
+	{
+		/* Publishes makiInstanceConfig. */
+		makiRcu* rcu;
+		guint64 generation;
+	}
+	config;
 
 	GHashTable* servers;
 	GHashTable* directories;
@@ -53,10 +76,23 @@ struct maki_instance
 	struct
 	{
 		guint64 id;
-		GSList* list;
+
+		/* Maps ids to makiInstanceDCCSend, the queue keeps them in the order they were added. */
+		GHashTable* table;
+		GQueue* queue;
+
+		guint progress_source;
+
+		makiDCCScheduler* scheduler;
+		makiDCCPorts* ports;
+		/* Threads the transfers run on. */
+		makiDCCPool* pool;
 	}
 	dcc;
 
+	/* Writes the statistics to stats/file periodically. */
+	guint stats_source;
+
 	GMainContext* main_context;
 	GMainLoop* main_loop;
 	GThread* thread;
@@ -71,6 +107,18 @@ struct maki_instance
 	mutex;
 };
 
+typedef struct
+{
+	guint64 id;
+	makiDCCSend* dcc;
+	GList* link;
+
+	/* Last progress and speed sent with dcc_progress. */
+	guint64 progress;
+	guint64 speed;
+}
+makiInstanceDCCSend;
+
 static
 void
 maki_instance_load_plugins (makiInstance* inst)
@@ -125,29 +173,158 @@ static
 makiDCCSend*
 maki_instance_get_dcc_send (makiInstance* inst, guint64 id)
 {
-	GSList* list;
+	makiInstanceDCCSend* entry;
+
+	if ((entry = g_hash_table_lookup(inst->dcc.table, &id)) == NULL)
+	{
+		return NULL;
+	}
+
+	return entry->dcc;
+}
+
+static
+gboolean
+maki_instance_dcc_progress (gpointer data)
+{
+	GList* link;
+	GArray* ids;
+	GArray* progresses;
+	GArray* speeds;
+	GArray* rates;
+	GArray* etas;
+	makiInstance* inst = data;
+
+	ids = g_array_new(FALSE, FALSE, sizeof(guint64));
+	progresses = g_array_new(FALSE, FALSE, sizeof(guint64));
+	speeds = g_array_new(FALSE, FALSE, sizeof(guint64));
+	rates = g_array_new(FALSE, FALSE, sizeof(guint64));
+	etas = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+	g_mutex_lock(inst->mutex.dcc);
 
-	for (list = inst->dcc.list; list != NULL; list = list->next)
+	for (link = inst->dcc.queue->head; link != NULL; link = link->next)
 	{
-		makiDCCSend* dcc = list->data;
+		guint64 progress;
+		guint64 speed;
+		guint64 rate;
+		gint64 eta;
+		makiInstanceDCCSend* entry = link->data;
+
+		progress = maki_dcc_send_progress(entry->dcc);
+		speed = maki_dcc_send_speed(entry->dcc);
 
-		if (maki_dcc_send_id(dcc) == id)
+		/* Stalled transfers are still reported while their speed decays. */
+		if (progress == entry->progress && speed == entry->speed)
 		{
-			return dcc;
+			continue;
 		}
+
+		entry->progress = progress;
+		entry->speed = speed;
+		rate = maki_dcc_send_rate(entry->dcc);
+		eta = maki_dcc_send_eta(entry->dcc);
+
+		g_array_append_val(ids, entry->id);
+		g_array_append_val(progresses, progress);
+		g_array_append_val(speeds, speed);
+		g_array_append_val(rates, rate);
+		g_array_append_val(etas, eta);
 	}
 
-	return NULL;
+	g_mutex_unlock(inst->mutex.dcc);
+
+	if (ids->len > 0)
+	{
+		maki_dbus_emit_dcc_progress(ids, progresses, speeds, rates, etas);
+	}
+
+	g_array_free(ids, TRUE);
+	g_array_free(progresses, TRUE);
+	g_array_free(speeds, TRUE);
+	g_array_free(rates, TRUE);
+	g_array_free(etas, TRUE);
+
+	return TRUE;
+}
+
+static
+gboolean
+maki_instance_stats_dump (gpointer data)
+{
+	gchar* path;
+	makiInstance* inst = data;
+
+	path = maki_instance_config_get_string(inst, "stats", "file");
+
+	if (path != NULL && path[0] != '\0')
+	{
+		maki_stats_dump(inst, path);
+	}
+
+	g_free(path);
+
+	return TRUE;
+}
+
+static
+void
+maki_instance_config_snapshot_free (gpointer data)
+{
+	makiInstanceConfig* config = data;
+
+	g_free(config->logging.format);
+	g_free(config->directories.logs);
+	g_free(config->dbus.queue_policy);
+	g_free(config);
 }
 
+/* Must be called with the config lock held. */
 static
 void
 maki_instance_config_save (makiInstance* inst)
 {
 	gchar* path;
+	makiInstanceConfig* config;
+
+	config = g_new(makiInstanceConfig, 1);
+	config->generation = ++inst->config.generation;
+	config->dcc.max_active = g_key_file_get_integer(inst->key_file, "dcc", "max_active", NULL);
+	config->dcc.port_first = g_key_file_get_integer(inst->key_file, "dcc", "port_first", NULL);
+	config->dcc.port_last = g_key_file_get_integer(inst->key_file, "dcc", "port_last", NULL);
+	config->dcc.rate_limit = g_key_file_get_integer(inst->key_file, "dcc", "rate_limit", NULL);
+	config->dcc.speed_average = g_key_file_get_integer(inst->key_file, "dcc", "speed_average", NULL);
+	config->dcc.speed_window = g_key_file_get_integer(inst->key_file, "dcc", "speed_window", NULL);
+	config->dcc.stall_timeout = g_key_file_get_integer(inst->key_file, "dcc", "stall_timeout", NULL);
+	config->dcc.transfer_rate_limit = g_key_file_get_integer(inst->key_file, "dcc", "transfer_rate_limit", NULL);
+	config->dbus.broadcast = g_key_file_get_boolean(inst->key_file, "dbus", "broadcast", NULL);
+	config->dbus.queue_limit = g_key_file_get_integer(inst->key_file, "dbus", "queue_limit", NULL);
+	config->dbus.queue_policy = g_key_file_get_string(inst->key_file, "dbus", "queue_policy", NULL);
+	config->directories.logs = g_key_file_get_string(inst->key_file, "directories", "logs", NULL);
+	config->logging.enabled = g_key_file_get_boolean(inst->key_file, "logging", "enabled", NULL);
+	config->logging.format = g_key_file_get_string(inst->key_file, "logging", "format", NULL);
+	config->reconnect.retries = g_key_file_get_integer(inst->key_file, "reconnect", "retries", NULL);
+	config->reconnect.timeout = g_key_file_get_integer(inst->key_file, "reconnect", "timeout", NULL);
+
+	if (config->dbus.queue_policy == NULL)
+	{
+		config->dbus.queue_policy = g_strdup("");
+	}
+
+	if (config->directories.logs == NULL)
+	{
+		config->directories.logs = g_strdup("");
+	}
+
+	if (config->logging.format == NULL)
+	{
+		config->logging.format = g_strdup("");
+	}
+
+	maki_rcu_publish(inst->config.rcu, config);
 
 	path = g_build_filename(g_hash_table_lookup(inst->directories, "config"), "maki", NULL);
-	i_key_file_to_file(inst->key_file, path, NULL, NULL);
+	maki_config_store_save(inst->config_store, inst->key_file, inst->mutex.config, path);
 	g_free(path);
 }
 
@@ -170,6 +347,11 @@ maki_instance_config_set_defaults (makiInstance* inst)
 		g_key_file_set_boolean(inst->key_file, "dcc", "accept_send", FALSE);
 	}
 
+	if (!g_key_file_has_key(inst->key_file, "dcc", "max_active", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "max_active", 0);
+	}
+
 	if (!g_key_file_has_key(inst->key_file, "dcc", "port_first", NULL))
 	{
 		g_key_file_set_integer(inst->key_file, "dcc", "port_first", 1024);
@@ -180,6 +362,56 @@ maki_instance_config_set_defaults (makiInstance* inst)
 		g_key_file_set_integer(inst->key_file, "dcc", "port_last", 65535);
 	}
 
+	if (!g_key_file_has_key(inst->key_file, "dcc", "rate_limit", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "rate_limit", 0);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dcc", "speed_average", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "speed_average", 10);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dcc", "speed_window", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "speed_window", 1);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dcc", "stall_timeout", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "stall_timeout", 120);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dcc", "transfer_rate_limit", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "transfer_rate_limit", 0);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dcc", "threads", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dcc", "threads", 2);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dcc", "turbo", NULL))
+	{
+		g_key_file_set_boolean(inst->key_file, "dcc", "turbo", FALSE);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dbus", "broadcast", NULL))
+	{
+		g_key_file_set_boolean(inst->key_file, "dbus", "broadcast", TRUE);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dbus", "queue_limit", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "dbus", "queue_limit", 4096);
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "dbus", "queue_policy", NULL))
+	{
+		g_key_file_set_string(inst->key_file, "dbus", "queue_policy", "drop");
+	}
+
 	if (!g_key_file_has_key(inst->key_file, "directories", "downloads", NULL))
 	{
 		gchar* value;
@@ -223,6 +455,16 @@ maki_instance_config_set_defaults (makiInstance* inst)
 		g_key_file_set_integer(inst->key_file, "reconnect", "timeout", 10);
 	}
 
+	if (!g_key_file_has_key(inst->key_file, "stats", "file", NULL))
+	{
+		g_key_file_set_string(inst->key_file, "stats", "file", "");
+	}
+
+	if (!g_key_file_has_key(inst->key_file, "stats", "interval", NULL))
+	{
+		g_key_file_set_integer(inst->key_file, "stats", "interval", 60);
+	}
+
 	if (!g_key_file_has_key(inst->key_file, "plugins", "sleep", NULL))
 	{
 		g_key_file_set_boolean(inst->key_file, "plugins", "sleep", TRUE);
@@ -282,22 +524,42 @@ maki_instance_new (void)
 	g_hash_table_insert(inst->directories, g_strdup("config"), config_dir);
 	g_hash_table_insert(inst->directories, g_strdup("servers"), servers_dir);
 
+	g_mutex_init(inst->mutex.config);
+	g_mutex_init(inst->mutex.dcc);
+	g_mutex_init(inst->mutex.instance);
+	g_mutex_init(inst->mutex.servers);
+
+	inst->config_store = maki_config_store_new();
+	inst->events = maki_event_bus_new();
+	inst->config.rcu = maki_rcu_new(NULL, maki_instance_config_snapshot_free);
+	inst->config.generation = 0;
+
 	config_file = g_build_filename(config_dir, "maki", NULL);
 	g_key_file_load_from_file(inst->key_file, config_file, G_KEY_FILE_NONE, NULL);
 	g_free(config_file);
 
 	maki_instance_config_set_defaults(inst);
 
-	inst->dcc.id = 0;
-	inst->dcc.list = NULL;
+	inst->log.logs = maki_logs_new(inst);
+	inst->log.consumer = maki_event_bus_add_consumer(inst->events, "log", MAKI_EVENT_MASK(MAKI_EVENT_LOG) | MAKI_EVENT_MASK(MAKI_EVENT_LOG_CLOSE), maki_logs_consume, inst->log.logs);
 
-	g_mutex_init(inst->mutex.config);
-	g_mutex_init(inst->mutex.dcc);
-	g_mutex_init(inst->mutex.instance);
-	g_mutex_init(inst->mutex.servers);
+	inst->dcc.id = 0;
+	inst->dcc.table = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+	inst->dcc.queue = g_queue_new();
+	inst->dcc.progress_source = 0;
+	inst->dcc.scheduler = maki_dcc_scheduler_new(inst);
+	inst->dcc.ports = maki_dcc_ports_new(inst);
+	inst->dcc.pool = maki_dcc_pool_new(MAX(g_key_file_get_integer(inst->key_file, "dcc", "threads", NULL), 1));
 
 	inst->network = maki_network_new(inst);
 
+	inst->stats_source = 0;
+
+	if (g_key_file_get_integer(inst->key_file, "stats", "interval", NULL) > 0)
+	{
+		inst->stats_source = i_timeout_add_seconds(g_key_file_get_integer(inst->key_file, "stats", "interval", NULL), maki_instance_stats_dump, inst, NULL);
+	}
+
 	inst->thread = g_thread_new("makiInstance", maki_instance_thread, inst);
 
 	return inst;
@@ -306,20 +568,36 @@ maki_instance_new (void)
 void
 maki_instance_free (makiInstance* inst)
 {
-	GSList* list;
+	GList* link;
+
+	if (inst->stats_source != 0)
+	{
+		i_source_remove(inst->stats_source, NULL);
+	}
 
 	g_hash_table_destroy(inst->plugins);
 	g_hash_table_destroy(inst->servers);
 
-	for (list = inst->dcc.list; list != NULL; list = list->next)
+	if (inst->dcc.progress_source != 0)
 	{
-		makiDCCSend* dcc = list->data;
+		i_source_remove(inst->dcc.progress_source, NULL);
+	}
 
-		maki_dbus_emit_dcc_send(maki_dcc_send_id(dcc), "", "", "", 0, 0, 0, 0);
-		maki_dcc_send_free(dcc);
+	for (link = inst->dcc.queue->head; link != NULL; link = link->next)
+	{
+		makiInstanceDCCSend* entry = link->data;
+
+		maki_dbus_emit_dcc_send(entry->id, "", "", "", 0, 0, 0, 0);
+		maki_dcc_send_free(entry->dcc);
 	}
 
-	g_slist_free(inst->dcc.list);
+	g_queue_free(inst->dcc.queue);
+	g_hash_table_destroy(inst->dcc.table);
+
+	/* Waits for the transfers to be freed on their threads. */
+	maki_dcc_pool_free(inst->dcc.pool);
+	maki_dcc_ports_free(inst->dcc.ports);
+	maki_dcc_scheduler_free(inst->dcc.scheduler);
 
 	maki_network_free(inst->network);
 
@@ -329,7 +607,16 @@ maki_instance_free (makiInstance* inst)
 	g_main_loop_unref(inst->main_loop);
 	g_main_context_unref(inst->main_context);
 
+	/* Writes all pending log messages. */
+	maki_event_bus_remove_consumer(inst->events, inst->log.consumer);
+	maki_logs_free(inst->log.logs);
+	maki_event_bus_free(inst->events);
+
+	/* Writes all pending configuration changes. */
+	maki_config_store_free(inst->config_store);
+
 	g_key_file_free(inst->key_file);
+	maki_rcu_free(inst->config.rcu);
 
 	g_hash_table_destroy(inst->directories);
 
@@ -428,6 +715,57 @@ maki_instance_config_exists (makiInstance* inst, gchar const* group, gchar const
 	return ret;
 }
 
+/* Returns a reference to the current configuration snapshot.
+ * It must be dropped with maki_instance_config_snapshot_unref(). */
+makiInstanceConfig const*
+maki_instance_config_snapshot (makiInstance* inst)
+{
+	return maki_rcu_get(inst->config.rcu);
+}
+
+void
+maki_instance_config_snapshot_unref (makiInstance* inst, makiInstanceConfig const* config)
+{
+	maki_rcu_unref(inst->config.rcu, (gpointer)config);
+}
+
+makiLogs*
+maki_instance_logs (makiInstance* inst)
+{
+	return inst->log.logs;
+}
+
+/* Returns the bus that carries log messages and signals to their consumers. */
+makiEventBus*
+maki_instance_events (makiInstance* inst)
+{
+	return inst->events;
+}
+
+makiConfigStore*
+maki_instance_config_store (makiInstance* inst)
+{
+	return inst->config_store;
+}
+
+makiDCCPool*
+maki_instance_dcc_pool (makiInstance* inst)
+{
+	return inst->dcc.pool;
+}
+
+makiDCCPorts*
+maki_instance_dcc_ports (makiInstance* inst)
+{
+	return inst->dcc.ports;
+}
+
+makiDCCScheduler*
+maki_instance_dcc_scheduler (makiInstance* inst)
+{
+	return inst->dcc.scheduler;
+}
+
 GMainContext*
 maki_instance_main_context (makiInstance* inst)
 {
@@ -484,6 +822,27 @@ maki_instance_get_server (makiInstance* inst, gchar const* name)
 	return ret;
 }
 
+/* Returns the case mapping of the named server, rfc1459 if there is none.
+ * The server cannot be freed while it is in the table, so no reference is needed.
+ * Must not be called on a server's thread, since removing a server joins it with the lock held. */
+iCaseMapping
+maki_instance_server_case_mapping (makiInstance* inst, gchar const* name)
+{
+	makiServer* serv;
+	iCaseMapping ret = I_CASE_MAPPING_RFC1459;
+
+	g_mutex_lock(inst->mutex.servers);
+
+	if ((serv = g_hash_table_lookup(inst->servers, name)) != NULL)
+	{
+		ret = maki_server_case_mapping(serv);
+	}
+
+	g_mutex_unlock(inst->mutex.servers);
+
+	return ret;
+}
+
 gboolean
 maki_instance_remove_server (makiInstance* inst, gchar const* name)
 {
@@ -561,8 +920,26 @@ maki_instance_get_dcc_send_id (makiInstance* inst)
 void
 maki_instance_add_dcc_send (makiInstance* inst, makiDCCSend* dcc)
 {
+	makiInstanceDCCSend* entry;
+
+	entry = g_new(makiInstanceDCCSend, 1);
+	entry->id = maki_dcc_send_id(dcc);
+	entry->dcc = dcc;
+	entry->progress = maki_dcc_send_progress(dcc);
+	entry->speed = 0;
+
 	g_mutex_lock(inst->mutex.dcc);
-	inst->dcc.list = g_slist_prepend(inst->dcc.list, dcc);
+
+	g_queue_push_tail(inst->dcc.queue, entry);
+	entry->link = inst->dcc.queue->tail;
+	g_hash_table_insert(inst->dcc.table, &entry->id, entry);
+
+	/* Progress is sampled on the default main context, from the state each transfer shares under its lock. */
+	if (inst->dcc.progress_source == 0)
+	{
+		inst->dcc.progress_source = i_timeout_add(250, maki_instance_dcc_progress, inst, NULL);
+	}
+
 	g_mutex_unlock(inst->mutex.dcc);
 }
 
@@ -604,15 +981,15 @@ gboolean
 maki_instance_resume_accept_dcc_send (makiInstance* inst, gchar* file_name, guint16 port, goffset position, guint32 token, gboolean is_incoming)
 {
 	gboolean ret = FALSE;
-	GSList* list;
+	GList* link;
 
 	g_mutex_lock(inst->mutex.dcc);
 
-	for (list = inst->dcc.list; list != NULL; list = list->next)
+	for (link = inst->dcc.queue->head; link != NULL; link = link->next)
 	{
-		makiDCCSend* dcc = list->data;
+		makiInstanceDCCSend* entry = link->data;
 
-		if (maki_dcc_send_resume_accept(dcc, file_name, port, position, token, is_incoming))
+		if (maki_dcc_send_resume_accept(entry->dcc, file_name, port, position, token, is_incoming))
 		{
 			ret = TRUE;
 			break;
@@ -627,21 +1004,29 @@ maki_instance_resume_accept_dcc_send (makiInstance* inst, gchar* file_name, guin
 gboolean
 maki_instance_remove_dcc_send (makiInstance* inst, guint64 id)
 {
-	makiDCCSend* dcc;
+	makiInstanceDCCSend* entry;
 
 	g_mutex_lock(inst->mutex.dcc);
 
-	if ((dcc = maki_instance_get_dcc_send(inst, id)) != NULL)
+	if ((entry = g_hash_table_lookup(inst->dcc.table, &id)) != NULL)
 	{
-		inst->dcc.list = g_slist_remove(inst->dcc.list, dcc);
+		g_queue_delete_link(inst->dcc.queue, entry->link);
 
-		maki_dbus_emit_dcc_send(maki_dcc_send_id(dcc), "", "", "", 0, 0, 0, 0);
-		maki_dcc_send_free(dcc);
+		maki_dbus_emit_dcc_send(entry->id, "", "", "", 0, 0, 0, 0);
+		maki_dcc_send_free(entry->dcc);
+
+		g_hash_table_remove(inst->dcc.table, &id);
+	}
+
+	if (g_queue_is_empty(inst->dcc.queue) && inst->dcc.progress_source != 0)
+	{
+		i_source_remove(inst->dcc.progress_source, NULL);
+		inst->dcc.progress_source = 0;
 	}
 
 	g_mutex_unlock(inst->mutex.dcc);
 
-	return (dcc != NULL);
+	return (entry != NULL);
 }
 
 guint
@@ -650,7 +1035,7 @@ maki_instance_dcc_sends_count (makiInstance* inst)
 	guint ret;
 
 	g_mutex_lock(inst->mutex.dcc);
-	ret = g_slist_length(inst->dcc.list);
+	ret = g_queue_get_length(inst->dcc.queue);
 	g_mutex_unlock(inst->mutex.dcc);
 
 	return ret;
@@ -666,14 +1051,34 @@ maki_instance_dcc_send_get (makiInstance* inst, guint64 id, gchar const* key)
 
 	if ((dcc = maki_instance_get_dcc_send(inst, id)) != NULL)
 	{
-		if (strcmp(key, "directory") == 0)
+		if (strcmp(key, "checksum") == 0)
+		{
+			value = maki_dcc_send_checksum(dcc);
+		}
+		else if (strcmp(key, "directory") == 0)
 		{
 			value = g_path_get_dirname(maki_dcc_send_path(dcc));
 		}
+		else if (strcmp(key, "eta") == 0)
+		{
+			value = g_strdup_printf("%" G_GINT64_FORMAT, maki_dcc_send_eta(dcc));
+		}
 		else if (strcmp(key, "path") == 0)
 		{
 			value = g_strdup(maki_dcc_send_path(dcc));
 		}
+		else if (strcmp(key, "priority") == 0)
+		{
+			value = g_strdup_printf("%d", maki_dcc_send_priority(dcc));
+		}
+		else if (strcmp(key, "rate") == 0)
+		{
+			value = g_strdup_printf("%" G_GUINT64_FORMAT, maki_dcc_send_rate(dcc));
+		}
+		else if (strcmp(key, "speed") == 0)
+		{
+			value = g_strdup_printf("%" G_GUINT64_FORMAT, maki_dcc_send_speed(dcc));
+		}
 	}
 
 	g_mutex_unlock(inst->mutex.dcc);
@@ -710,6 +1115,11 @@ maki_instance_dcc_send_set (makiInstance* inst, guint64 id, gchar const* key, gc
 		{
 			ret = maki_dcc_send_set_path(dcc, value);
 		}
+		else if (strcmp(key, "priority") == 0)
+		{
+			maki_dcc_send_set_priority(dcc, g_ascii_strtoll(value, NULL, 10));
+			ret = TRUE;
+		}
 	}
 
 	g_mutex_unlock(inst->mutex.dcc);
@@ -717,22 +1127,40 @@ maki_instance_dcc_send_set (makiInstance* inst, guint64 id, gchar const* key, gc
 	return ret;
 }
 
+/* Allocates all columns while holding the lock, so they always match the number of transfers. */
 void
 maki_instance_dcc_sends_xxx (makiInstance* inst, GArray** ids, gchar*** servers, gchar*** froms, gchar*** filenames, GArray** sizes, GArray** progresses, GArray** speeds, GArray** statuses)
 {
 	guint i;
-	GSList* list;
+	guint len;
+	GList* link;
 
 	g_mutex_lock(inst->mutex.dcc);
 
-	for (list = inst->dcc.list, i = 0; list != NULL; list = list->next, i++)
+	len = g_queue_get_length(inst->dcc.queue);
+
+	*ids = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
+	*servers = g_new(gchar*, len + 1);
+	*froms = g_new(gchar*, len + 1);
+	*filenames = g_new(gchar*, len + 1);
+	*sizes = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
+	*progresses = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
+	*speeds = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
+	*statuses = g_array_sized_new(FALSE, FALSE, sizeof(guint64), len);
+
+	(*servers)[len] = NULL;
+	(*froms)[len] = NULL;
+	(*filenames)[len] = NULL;
+
+	for (link = inst->dcc.queue->head, i = 0; link != NULL; link = link->next, i++)
 	{
 		guint64 id;
 		guint64 size;
 		guint64 progress;
 		guint64 speed;
 		guint64 status;
-		makiDCCSend* dcc = list->data;
+		makiInstanceDCCSend* entry = link->data;
+		makiDCCSend* dcc = entry->dcc;
 
 		id = maki_dcc_send_id(dcc);
 		size = maki_dcc_send_size(dcc);
@@ -34,10 +34,66 @@ typedef struct maki_instance makiInstance;
 
 #include <glib.h>
 
+#include "config_store.h"
+#include "dcc_pool.h"
+#include "dcc_ports.h"
+#include "dcc_scheduler.h"
 #include "dcc_send.h"
+#include "event.h"
+#include "log.h"
 #include "network.h"
 #include "server.h"
 
+/* An immutable snapshot of frequently used configuration values.
+ * A new snapshot with a higher generation is published whenever the configuration changes. */
+struct maki_instance_config
+{
+	guint64 generation;
+
+	struct
+	{
+		gint max_active;
+		gint port_first;
+		gint port_last;
+		gint rate_limit;
+		gint speed_average;
+		gint speed_window;
+		gint stall_timeout;
+		gint transfer_rate_limit;
+	}
+	dcc;
+
+	struct
+	{
+		gboolean broadcast;
+		gint queue_limit;
+		gchar* queue_policy;
+	}
+	dbus;
+
+	struct
+	{
+		gchar* logs;
+	}
+	directories;
+
+	struct
+	{
+		gboolean enabled;
+		gchar* format;
+	}
+	logging;
+
+	struct
+	{
+		gint retries;
+		gint timeout;
+	}
+	reconnect;
+};
+
+typedef struct maki_instance_config makiInstanceConfig;
+
 makiInstance* maki_instance_get_default (void);
 
 makiInstance* maki_instance_new (void);
@@ -52,12 +108,21 @@ void maki_instance_config_set_string (makiInstance*, gchar const*, gchar const*,
 gchar** maki_instance_config_get_keys (makiInstance*, gchar const*);
 gboolean maki_instance_config_exists (makiInstance*, gchar const*, gchar const*);
 
+makiInstanceConfig const* maki_instance_config_snapshot (makiInstance*);
+void maki_instance_config_snapshot_unref (makiInstance*, makiInstanceConfig const*);
+makiConfigStore* maki_instance_config_store (makiInstance*);
+makiDCCPool* maki_instance_dcc_pool (makiInstance*);
+makiDCCPorts* maki_instance_dcc_ports (makiInstance*);
+makiDCCScheduler* maki_instance_dcc_scheduler (makiInstance*);
+makiEventBus* maki_instance_events (makiInstance*);
+makiLogs* maki_instance_logs (makiInstance*);
 GMainContext* maki_instance_main_context (makiInstance*);
 makiNetwork* maki_instance_network (makiInstance*);
 gchar const* maki_instance_directory (makiInstance*, gchar const*);
 
 void maki_instance_add_server (makiInstance*, gchar const*, makiServer*);
 makiServer* maki_instance_get_server (makiInstance*, gchar const*);
+iCaseMapping maki_instance_server_case_mapping (makiInstance*, gchar const*);
 gboolean maki_instance_remove_server (makiInstance*, gchar const*);
 gboolean maki_instance_rename_server (makiInstance*, gchar const*, gchar const*);
 guint maki_instance_servers_count (makiInstance*);
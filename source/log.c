@@ -30,6 +30,8 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+#include <string.h>
+
 #include <ilib.h>
 
 #include "log.h"
@@ -42,6 +44,19 @@ struct maki_log
 	GDataOutputStream* stream;
 };
 
+/* Open logs, only used by the log consumer's thread. */
+struct maki_logs
+{
+	makiInstance* instance;
+
+	/* Maps server names to hash tables that map file names to makiLog. */
+	GHashTable* servers;
+
+	/* Maps server names to the guint64 number of bytes written, read by other threads. */
+	GHashTable* written;
+	GMutex mutex[1];
+};
+
 makiLog* maki_log_new (makiInstance* inst, const gchar* server, const gchar* name)
 {
 	makiLog* log = NULL;
@@ -50,11 +65,12 @@ makiLog* maki_log_new (makiInstance* inst, const gchar* server, const gchar* nam
 	GFileOutputStream* file_output;
 	gchar* filename;
 	gchar* path;
-	gchar* logs_dir;
+	makiInstanceConfig const* config;
 
-	logs_dir = maki_instance_config_get_string(inst, "directories", "logs");
+	config = maki_instance_config_snapshot(inst);
 	filename = g_strconcat(name, ".txt", NULL);
-	path = g_build_filename(logs_dir, server, filename, NULL);
+	path = g_build_filename(config->directories.logs, server, filename, NULL);
+	maki_instance_config_snapshot_unref(inst, config);
 
 	file = g_file_new_for_path(path);
 
@@ -62,7 +78,6 @@ makiLog* maki_log_new (makiInstance* inst, const gchar* server, const gchar* nam
 	g_file_make_directory_with_parents(dir, NULL, NULL);
 	g_object_unref(dir);
 
-	g_free(logs_dir);
 	g_free(filename);
 	g_free(path);
 
@@ -91,19 +106,129 @@ void maki_log_free (gpointer data)
 	g_free(log);
 }
 
-void maki_log_write (makiLog* log, const gchar* message)
+/* time is the real time of the message in microseconds.
+ * Returns the number of bytes written. */
+gsize maki_log_write (makiLog* log, gint64 time, const gchar* message)
 {
 	gchar* time_str;
+	GDateTime* dt;
+	gsize length = 0;
+
+	dt = g_date_time_new_from_unix_local(time / G_USEC_PER_SEC);
 
-	if ((time_str = i_get_current_time_string("%Y-%m-%d %H:%M:%S")) != NULL)
+	if ((time_str = g_date_time_format(dt, "%Y-%m-%d %H:%M:%S")) != NULL)
 	{
 		g_data_output_stream_put_string(log->stream, time_str, NULL, NULL);
 		g_data_output_stream_put_string(log->stream, " ", NULL, NULL);
+		length += strlen(time_str) + 1;
 		g_free(time_str);
 	}
 
+	g_date_time_unref(dt);
+
 	g_data_output_stream_put_string(log->stream, message, NULL, NULL);
 	g_data_output_stream_put_string(log->stream, "\n", NULL, NULL);
+	length += strlen(message) + 1;
 
 	g_output_stream_flush(G_OUTPUT_STREAM(log->stream), NULL, NULL);
+
+	return length;
+}
+
+makiLogs* maki_logs_new (makiInstance* inst)
+{
+	makiLogs* logs;
+
+	logs = g_new(makiLogs, 1);
+	logs->instance = inst;
+	logs->servers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+	logs->written = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	g_mutex_init(logs->mutex);
+
+	return logs;
+}
+
+void maki_logs_free (makiLogs* logs)
+{
+	g_hash_table_destroy(logs->servers);
+	g_hash_table_destroy(logs->written);
+	g_mutex_clear(logs->mutex);
+	g_free(logs);
+}
+
+/* Returns the number of bytes written to the server's logs since startup. */
+guint64 maki_logs_written (makiLogs* logs, const gchar* server)
+{
+	guint64* written;
+	guint64 ret = 0;
+
+	g_mutex_lock(logs->mutex);
+
+	if ((written = g_hash_table_lookup(logs->written, server)) != NULL)
+	{
+		ret = *written;
+	}
+
+	g_mutex_unlock(logs->mutex);
+
+	return ret;
+}
+
+/* Handles MAKI_EVENT_LOG and MAKI_EVENT_LOG_CLOSE.
+ * event->target is the log's file name relative to the server's directory. */
+void maki_logs_consume (makiEvent const* event, gpointer data)
+{
+	makiLogs* logs = data;
+	GHashTable* files;
+	makiLog* log;
+	gchar* key;
+	gsize length;
+	guint64* written;
+
+	if (event->type == MAKI_EVENT_LOG_CLOSE)
+	{
+		g_hash_table_remove(logs->servers, event->server);
+		return;
+	}
+
+	if ((files = g_hash_table_lookup(logs->servers, event->server)) == NULL)
+	{
+		files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, maki_log_free);
+		g_hash_table_insert(logs->servers, g_strdup(event->server), files);
+	}
+
+	/* Names are folded with the server's case mapping, which might only be known after connecting. */
+	key = i_case_mapping_fold(event->case_mapping, event->target);
+
+	if ((log = g_hash_table_lookup(files, key)) == NULL)
+	{
+		if ((log = maki_log_new(logs->instance, event->server, event->target)) == NULL)
+		{
+			g_free(key);
+			return;
+		}
+
+		g_hash_table_insert(files, key, log);
+	}
+	else
+	{
+		g_free(key);
+	}
+
+	length = maki_log_write(log, event->time, event->message);
+
+	g_mutex_lock(logs->mutex);
+
+	if ((written = g_hash_table_lookup(logs->written, event->server)) == NULL)
+	{
+		written = g_new(guint64, 1);
+		*written = 0;
+
+		g_hash_table_insert(logs->written, g_strdup(event->server), written);
+	}
+
+	*written += length;
+
+	g_mutex_unlock(logs->mutex);
 }
@@ -29,16 +29,26 @@
 #define H_LOG
 
 struct maki_log;
+struct maki_logs;
 
 typedef struct maki_log makiLog;
+typedef struct maki_logs makiLogs;
 
 #include <glib.h>
 
+#include "event.h"
 #include "instance.h"
 
 makiLog* maki_log_new (makiInstance*, const gchar*, const gchar*);
 void maki_log_free (gpointer);
 
-void maki_log_write (makiLog*, const gchar*);
+gsize maki_log_write (makiLog*, gint64, const gchar*);
+
+makiLogs* maki_logs_new (makiInstance*);
+void maki_logs_free (makiLogs*);
+
+guint64 maki_logs_written (makiLogs*, const gchar*);
+
+void maki_logs_consume (makiEvent const*, gpointer);
 
 #endif
@@ -97,6 +97,22 @@ void maki_ensure_string_array (gchar*** string_array)
 	}
 }
 
+GVariantBuilder*
+maki_variant_builder_array_int64 (GArray* array)
+{
+	GVariantBuilder* builder;
+	guint i;
+
+	builder = g_variant_builder_new(G_VARIANT_TYPE("ax"));
+
+	for (i = 0; i < array->len; i++)
+	{
+		g_variant_builder_add(builder, "x", g_array_index(array, gint64, i));
+	}
+
+	return builder;
+}
+
 GVariantBuilder*
 maki_variant_builder_array_uint64 (GArray* array)
 {
@@ -44,6 +44,7 @@ void maki_debug (const gchar*, ...) G_GNUC_PRINTF(1, 2);
 void maki_ensure_string (gchar**);
 void maki_ensure_string_array (gchar***);
 
+GVariantBuilder* maki_variant_builder_array_int64 (GArray*);
 GVariantBuilder* maki_variant_builder_array_uint64 (GArray*);
 
 #endif
@@ -68,12 +68,14 @@ void maki_out_nick (makiServer* serv, const gchar* nick)
 	maki_server_send_printf(serv, "NICK %s", nick);
 }
 
-void maki_out_nickserv (makiServer* serv)
+/* Returns TRUE if an IDENTIFY was sent. */
+gboolean maki_out_nickserv (makiServer* serv)
 {
+	gboolean ret = FALSE;
 	gchar* initial_nick;
 	gchar* nickserv_password;
 
-	g_return_if_fail(serv != NULL);
+	g_return_val_if_fail(serv != NULL, FALSE);
 
 	initial_nick = maki_server_config_get_string(serv, "server", "nick");
 	nickserv_password = maki_server_config_get_string(serv, "server", "nickserv");
@@ -90,11 +92,18 @@ void maki_out_nickserv (makiServer* serv)
 			maki_out_nick(serv, initial_nick);
 		}
 
-		maki_server_send_printf(serv, "PRIVMSG NickServ :IDENTIFY %s", nickserv_password);
+		/* Already identified via SASL. */
+		if (maki_user_account(maki_server_user(serv)) == NULL)
+		{
+			maki_server_send_printf(serv, "PRIVMSG NickServ :IDENTIFY %s", nickserv_password);
+			ret = TRUE;
+		}
 	}
 
 	g_free(initial_nick);
 	g_free(nickserv_password);
+
+	return ret;
 }
 
 static void maki_out_privmsg_internal (makiServer* serv, const gchar* target, const gchar* message, gboolean queue)
@@ -109,6 +118,12 @@ static void maki_out_privmsg_internal (makiServer* serv, const gchar* target, co
 	maki_server_queue(serv, buffer, queue);
 	g_free(buffer);
 
+	/* With echo-message, the message is handled once the server sends it back. */
+	if (maki_server_cap_enabled(serv, "echo-message"))
+	{
+		return;
+	}
+
 	maki_server_log(serv, target, "<%s> %s", maki_user_nick(maki_server_user(serv)), message);
 	maki_dbus_emit_message(maki_server_name(serv), maki_user_from(maki_server_user(serv)), target, message);
 }
@@ -35,7 +35,7 @@
 void maki_out_away (makiServer*, const gchar*);
 void maki_out_join (makiServer*, const gchar*, const gchar*);
 void maki_out_nick (makiServer*, const gchar*);
-void maki_out_nickserv (makiServer*);
+gboolean maki_out_nickserv (makiServer*);
 void maki_out_privmsg (makiServer*, const gchar*, const gchar*, gboolean);
 
 #endif
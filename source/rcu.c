@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "rcu.h"
+
+/* Publishes immutable values to lock-free readers.
+ * Readers announce the epoch they started in and then load the current value atomically.
+ * Replaced values are tagged with the epoch they were replaced in and only freed
+ * once no reader that started in that epoch or earlier is left.
+ * All makiRcu share one epoch domain, so a thread may hold values of several of them at once. */
+struct maki_rcu
+{
+	gpointer current;
+	GDestroyNotify free_func;
+};
+
+/* A thread's read-side state, only written by the thread itself. */
+struct maki_rcu_reader
+{
+	/* Epoch the outermost read started in, 0 while the thread reads nothing. */
+	guint epoch;
+	/* Number of values the thread currently holds. */
+	guint nesting;
+};
+
+struct maki_rcu_retired
+{
+	gpointer data;
+	GDestroyNotify free_func;
+	guint epoch;
+};
+
+typedef struct maki_rcu_reader makiRcuReader;
+typedef struct maki_rcu_retired makiRcuRetired;
+
+static void maki_rcu_reader_free (gpointer);
+
+/* Starts at 1, because 0 marks idle readers. */
+static guint maki_rcu_epoch = 1;
+
+/* Protects the readers list and the retired values. */
+static GMutex maki_rcu_mutex;
+static GSList* maki_rcu_readers = NULL;
+static GQueue maki_rcu_retired = G_QUEUE_INIT;
+
+static GPrivate maki_rcu_reader_private = G_PRIVATE_INIT(maki_rcu_reader_free);
+
+static
+void
+maki_rcu_reader_free (gpointer data)
+{
+	g_mutex_lock(&maki_rcu_mutex);
+	maki_rcu_readers = g_slist_remove(maki_rcu_readers, data);
+	g_mutex_unlock(&maki_rcu_mutex);
+
+	g_free(data);
+}
+
+/* Registers the thread on its first read, later reads find the state without locking. */
+static
+makiRcuReader*
+maki_rcu_reader_get (void)
+{
+	makiRcuReader* reader;
+
+	if (G_LIKELY((reader = g_private_get(&maki_rcu_reader_private)) != NULL))
+	{
+		return reader;
+	}
+
+	reader = g_new(makiRcuReader, 1);
+	reader->epoch = 0;
+	reader->nesting = 0;
+
+	g_mutex_lock(&maki_rcu_mutex);
+	maki_rcu_readers = g_slist_prepend(maki_rcu_readers, reader);
+	g_mutex_unlock(&maki_rcu_mutex);
+
+	g_private_set(&maki_rcu_reader_private, reader);
+
+	return reader;
+}
+
+/* Must be called with the lock held.
+ * Frees all replaced values that no reader can hold anymore. */
+static
+void
+maki_rcu_reclaim (void)
+{
+	GSList* list;
+	guint oldest = G_MAXUINT;
+	makiRcuRetired* retired;
+
+	for (list = maki_rcu_readers; list != NULL; list = list->next)
+	{
+		makiRcuReader* reader = list->data;
+		guint epoch;
+
+		epoch = g_atomic_int_get(&reader->epoch);
+
+		if (epoch != 0 && epoch < oldest)
+		{
+			oldest = epoch;
+		}
+	}
+
+	/* Values are retired in epoch order. */
+	while ((retired = g_queue_peek_head(&maki_rcu_retired)) != NULL && retired->epoch < oldest)
+	{
+		g_queue_pop_head(&maki_rcu_retired);
+		retired->free_func(retired->data);
+		g_free(retired);
+	}
+}
+
+/* Must be called with the lock held. */
+static
+void
+maki_rcu_retire (gpointer data, GDestroyNotify free_func)
+{
+	makiRcuRetired* retired;
+
+	if (data != NULL)
+	{
+		retired = g_new(makiRcuRetired, 1);
+		retired->data = data;
+		retired->free_func = free_func;
+		retired->epoch = g_atomic_int_get(&maki_rcu_epoch);
+
+		g_queue_push_tail(&maki_rcu_retired, retired);
+	}
+
+	/* Readers starting from now on can only see values published after data was replaced. */
+	g_atomic_int_inc(&maki_rcu_epoch);
+
+	maki_rcu_reclaim();
+}
+
+makiRcu*
+maki_rcu_new (gpointer data, GDestroyNotify free_func)
+{
+	makiRcu* rcu;
+
+	rcu = g_new(makiRcu, 1);
+	rcu->current = data;
+	rcu->free_func = free_func;
+
+	return rcu;
+}
+
+/* The current value is freed once no reader holds it anymore. */
+void
+maki_rcu_free (makiRcu* rcu)
+{
+	g_return_if_fail(rcu != NULL);
+
+	g_mutex_lock(&maki_rcu_mutex);
+	maki_rcu_retire(rcu->current, rcu->free_func);
+	g_mutex_unlock(&maki_rcu_mutex);
+
+	g_free(rcu);
+}
+
+/* Returns the current value without locking.
+ * It stays valid until the thread calls maki_rcu_unref(), which every call has to be paired with. */
+gpointer
+maki_rcu_get (makiRcu* rcu)
+{
+	makiRcuReader* reader;
+
+	g_return_val_if_fail(rcu != NULL, NULL);
+
+	reader = maki_rcu_reader_get();
+
+	if (reader->nesting++ == 0)
+	{
+		/* Has to be visible before the value is loaded, the atomic operations are full barriers. */
+		g_atomic_int_set(&reader->epoch, g_atomic_int_get(&maki_rcu_epoch));
+	}
+
+	return g_atomic_pointer_get(&rcu->current);
+}
+
+/* Ends a read started by maki_rcu_get() on the same thread. */
+void
+maki_rcu_unref (makiRcu* rcu, gpointer data)
+{
+	makiRcuReader* reader;
+
+	g_return_if_fail(rcu != NULL);
+
+	reader = maki_rcu_reader_get();
+
+	g_return_if_fail(reader->nesting > 0);
+
+	if (--reader->nesting == 0)
+	{
+		g_atomic_int_set(&reader->epoch, 0);
+	}
+}
+
+/* Replaced values are freed by a later publish, once no reader holds them anymore. */
+void
+maki_rcu_publish (makiRcu* rcu, gpointer data)
+{
+	gpointer current;
+
+	g_return_if_fail(rcu != NULL);
+
+	g_mutex_lock(&maki_rcu_mutex);
+
+	current = rcu->current;
+	g_atomic_pointer_set(&rcu->current, data);
+	maki_rcu_retire(current, rcu->free_func);
+
+	g_mutex_unlock(&maki_rcu_mutex);
+}
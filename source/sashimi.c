@@ -50,6 +50,17 @@ enum
 	s_last
 };
 
+/* Number of queue waits kept for sashimi_stats. */
+#define SASHIMI_WAITS 256
+
+typedef struct
+{
+	gchar* line;
+	/* Monotonic time the line was queued at. */
+	gint64 time;
+}
+sashimiMessage;
+
 struct sashimi_connection
 {
 	GSocketConnection* connection;
@@ -67,8 +78,43 @@ struct sashimi_connection
 
 	GMainContext* main_context;
 
+	/* Holds sashimiMessage. */
 	GQueue* queue;
 
+	/* Counters for sashimi_stats, they survive reconnects. */
+	struct
+	{
+		guint64 lines_in;
+		guint64 bytes_in;
+		guint64 lines_out;
+		guint64 bytes_out;
+
+		/* Map upper case commands to guint64 counts. */
+		GHashTable* commands_in;
+		GHashTable* commands_out;
+
+		/* Ring of the most recent queue waits in microseconds. */
+		gint64 waits[SASHIMI_WAITS];
+		guint64 waits_count;
+	}
+	stats;
+
+	/* The last PING we sent, its answer gives the lag. */
+	struct
+	{
+		gint64 time;
+		gboolean pending;
+		gint64 lag;
+	}
+	ping;
+
+	struct
+	{
+		gchar* database;
+		gchar* certificate;
+	}
+	tls;
+
 	GCancellable* cancellables[c_last];
 	guint sources[s_last];
 
@@ -96,6 +142,89 @@ struct sashimi_connection
 	GMutex mutex[1];
 };
 
+static
+void
+sashimi_message_free (sashimiMessage* message)
+{
+	g_free(message->line);
+	g_free(message);
+}
+
+/* Returns the line's command, skipping tags and the prefix, and stores its length in length.
+ * Returns NULL if the line has no command. */
+static
+gchar const*
+sashimi_command (gchar const* line, gsize* length)
+{
+	gchar const* end;
+
+	if (line[0] == '@' && (line = strchr(line, ' ')) == NULL)
+	{
+		return NULL;
+	}
+
+	while (*line == ' ')
+	{
+		line++;
+	}
+
+	if (line[0] == ':' && (line = strchr(line, ' ')) == NULL)
+	{
+		return NULL;
+	}
+
+	while (*line == ' ')
+	{
+		line++;
+	}
+
+	if ((end = strchr(line, ' ')) == NULL)
+	{
+		end = line + strlen(line);
+	}
+
+	if (end == line)
+	{
+		return NULL;
+	}
+
+	*length = end - line;
+
+	return line;
+}
+
+/* Counts the line's command. */
+static
+void
+sashimi_count_command (GHashTable* commands, gchar const* line)
+{
+	gchar const* start;
+	gchar* command;
+	gsize length;
+	guint64* count;
+
+	if ((start = sashimi_command(line, &length)) == NULL)
+	{
+		return;
+	}
+
+	command = g_ascii_strup(start, length);
+
+	if ((count = g_hash_table_lookup(commands, command)) == NULL)
+	{
+		count = g_new(guint64, 1);
+		*count = 0;
+
+		g_hash_table_insert(commands, command, count);
+	}
+	else
+	{
+		g_free(command);
+	}
+
+	(*count)++;
+}
+
 static
 void
 sashimi_close (sashimiConnection* conn)
@@ -165,6 +294,10 @@ sashimi_real_send (sashimiConnection* conn, gchar const* message)
 	{
 		g_output_stream_flush(G_OUTPUT_STREAM(conn->stream.output), NULL, NULL);
 		g_printerr("OUT: %s", tmp);
+
+		conn->stats.lines_out++;
+		conn->stats.bytes_out += strlen(tmp);
+		sashimi_count_command(conn->stats.commands_out, message);
 	}
 
 	g_free(tmp);
@@ -180,6 +313,36 @@ sashimi_real_send (sashimiConnection* conn, gchar const* message)
 	return TRUE;
 }
 
+/* Must be called with the connection lock held. */
+static
+void
+sashimi_enqueue (sashimiConnection* conn, gchar const* line)
+{
+	sashimiMessage* message;
+
+	message = g_new(sashimiMessage, 1);
+	message->line = g_strdup(line);
+	message->time = g_get_monotonic_time();
+
+	g_queue_push_tail(conn->queue, message);
+}
+
+/* Sends a queued message and remembers how long it waited. */
+static
+gboolean
+sashimi_real_send_queued (sashimiConnection* conn, sashimiMessage* message)
+{
+	if (!sashimi_real_send(conn, message->line))
+	{
+		return FALSE;
+	}
+
+	conn->stats.waits[conn->stats.waits_count % SASHIMI_WAITS] = g_get_monotonic_time() - message->time;
+	conn->stats.waits_count++;
+
+	return TRUE;
+}
+
 static
 guint
 sashimi_timeout_add_seconds (sashimiConnection* conn, guint32 interval, GSourceFunc func)
@@ -195,19 +358,39 @@ sashimi_on_read (GObject* object, GAsyncResult* result, gpointer data)
 	sashimiConnection* conn = data;
 	GError* error = NULL;
 	gchar* buffer;
+	gsize length;
 
 	g_mutex_lock(conn->mutex);
 
-	if ((buffer = g_data_input_stream_read_line_finish(stream, result, NULL, &error)) != NULL)
+	if ((buffer = g_data_input_stream_read_line_finish(stream, result, &length, &error)) != NULL)
 	{
 		GTimeVal timeval;
 
 		g_get_current_time(&timeval);
 		conn->last_activity = timeval.tv_sec;
 
+		/* Include the newline. */
+		conn->stats.lines_in++;
+		conn->stats.bytes_in += length + 1;
+
 		/* Remove whitespace at the end of the string. */
 		g_strchomp(buffer);
 
+		if (conn->ping.pending)
+		{
+			gchar const* command;
+			gsize command_length;
+
+			/* A PONG anywhere else in the line might just be part of a message. */
+			if ((command = sashimi_command(buffer, &command_length)) != NULL && command_length == 4 && g_ascii_strncasecmp(command, "PONG", 4) == 0)
+			{
+				conn->ping.lag = g_get_monotonic_time() - conn->ping.time;
+				conn->ping.pending = FALSE;
+			}
+		}
+
+		sashimi_count_command(conn->stats.commands_in, buffer);
+
 		/* Handle PING internally. */
 		if (strncmp(buffer, "PING ", 5) == 0)
 		{
@@ -275,13 +458,22 @@ sashimi_ping (gpointer data)
 
 	g_get_current_time(&timeval);
 
-	/* If we did not hear anything from the server, send a PING. */
-	if (conn->timeout > 0 && (gulong)(timeval.tv_sec - conn->last_activity) > conn->timeout)
+	/* If we did not hear anything from the server, send a PING.
+	 * Busy connections get one every timeout seconds as well, to measure the lag. */
+	if (conn->timeout > 0
+	    && ((gulong)(timeval.tv_sec - conn->last_activity) > conn->timeout
+	        || (!conn->ping.pending && g_get_monotonic_time() - conn->ping.time > (gint64)conn->timeout * G_USEC_PER_SEC)))
 	{
 		gchar* ping;
 
 		ping = g_strdup_printf("PING :%ld", timeval.tv_sec);
-		sashimi_real_send(conn, ping);
+
+		if (sashimi_real_send(conn, ping))
+		{
+			conn->ping.time = g_get_monotonic_time();
+			conn->ping.pending = TRUE;
+		}
+
 		g_free(ping);
 
 		conn->last_activity = timeval.tv_sec;
@@ -302,14 +494,14 @@ sashimi_queue_runner (gpointer data)
 
 	if (!g_queue_is_empty(conn->queue))
 	{
-		gchar* message;
+		sashimiMessage* message;
 
 		message = g_queue_peek_head(conn->queue);
 
-		if (sashimi_real_send(conn, message))
+		if (sashimi_real_send_queued(conn, message))
 		{
 			g_queue_pop_head(conn->queue);
-			g_free(message);
+			sashimi_message_free(message);
 		}
 	}
 
@@ -356,6 +548,9 @@ sashimi_on_connect (GObject* object, GAsyncResult* result, gpointer data)
 	g_get_current_time(&timeval);
 	conn->last_activity = timeval.tv_sec;
 
+	conn->ping.time = g_get_monotonic_time();
+	conn->ping.pending = FALSE;
+
 	g_data_input_stream_read_line_async(conn->stream.input, G_PRIORITY_DEFAULT, conn->cancellables[c_read], sashimi_on_read, conn);
 
 	conn->sources[s_ping] = sashimi_timeout_add_seconds(conn, 1, sashimi_ping);
@@ -385,22 +580,43 @@ disconnect:
 
 static
 void
-sashimi_ssl_db_handler (GSocketClient* client, GSocketClientEvent event, GSocketConnectable* connectable, GIOStream* connection, gpointer user_data)
+sashimi_tls_handler (GSocketClient* client, GSocketClientEvent event, GSocketConnectable* connectable, GIOStream* connection, gpointer user_data)
 {
-	GTlsClientConnection *c;
-	GTlsDatabase *db;
-	gchar const* anchors;
+	sashimiConnection* conn = user_data;
 
 	if (event != G_SOCKET_CLIENT_TLS_HANDSHAKING)
 	{
 		return;
 	}
 
-	c = (GTlsClientConnection*) connection;
-	anchors = (gchar const*) user_data;
-	db = g_tls_file_database_new(anchors, NULL);
+	if (conn->tls.database != NULL)
+	{
+		GTlsDatabase* db;
 
-	g_tls_connection_set_database(G_TLS_CONNECTION(c), db);
+		if ((db = g_tls_file_database_new(conn->tls.database, NULL)) != NULL)
+		{
+			g_tls_connection_set_database(G_TLS_CONNECTION(connection), db);
+			g_object_unref(db);
+		}
+	}
+
+	/* The client certificate is used for SASL EXTERNAL. */
+	if (conn->tls.certificate != NULL)
+	{
+		GTlsCertificate* certificate;
+		GError* error = NULL;
+
+		if ((certificate = g_tls_certificate_new_from_file(conn->tls.certificate, &error)) != NULL)
+		{
+			g_tls_connection_set_certificate(G_TLS_CONNECTION(connection), certificate);
+			g_object_unref(certificate);
+		}
+		else
+		{
+			g_printerr("CERTIFICATE_ERROR: %s\n", error->message);
+			g_error_free(error);
+		}
+	}
 }
 
 sashimiConnection*
@@ -420,6 +636,21 @@ sashimi_new (GMainContext* main_context)
 
 	conn->queue = g_queue_new();
 
+	conn->stats.lines_in = 0;
+	conn->stats.bytes_in = 0;
+	conn->stats.lines_out = 0;
+	conn->stats.bytes_out = 0;
+	conn->stats.commands_in = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	conn->stats.commands_out = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	conn->stats.waits_count = 0;
+
+	conn->ping.time = 0;
+	conn->ping.pending = FALSE;
+	conn->ping.lag = 0;
+
+	conn->tls.database = NULL;
+	conn->tls.certificate = NULL;
+
 	conn->connection = NULL;
 	conn->stream.input = NULL;
 	conn->stream.output = NULL;
@@ -465,11 +696,17 @@ sashimi_free (sashimiConnection* conn)
 	/* Clean up the queue. */
 	while (!g_queue_is_empty(conn->queue))
 	{
-		g_free(g_queue_pop_head(conn->queue));
+		sashimi_message_free(g_queue_pop_head(conn->queue));
 	}
 
 	g_queue_free(conn->queue);
 
+	g_hash_table_destroy(conn->stats.commands_in);
+	g_hash_table_destroy(conn->stats.commands_out);
+
+	g_free(conn->tls.database);
+	g_free(conn->tls.certificate);
+
 	if (conn->main_context != NULL)
 	{
 		g_main_context_unref(conn->main_context);
@@ -488,6 +725,19 @@ sashimi_timeout (sashimiConnection* conn, guint timeout)
 	g_mutex_unlock(conn->mutex);
 }
 
+/* Sets the client certificate presented during the TLS handshake.
+ * The file has to contain both the certificate and its private key. */
+void
+sashimi_tls_certificate (sashimiConnection* conn, gchar const* certificate)
+{
+	g_return_if_fail(conn != NULL);
+
+	g_mutex_lock(conn->mutex);
+	g_free(conn->tls.certificate);
+	conn->tls.certificate = (certificate != NULL && certificate[0] != '\0') ? g_strdup(certificate) : NULL;
+	g_mutex_unlock(conn->mutex);
+}
+
 void
 sashimi_connect_callback (sashimiConnection* conn, void (*callback) (gpointer), gpointer data)
 {
@@ -543,9 +793,12 @@ sashimi_connect (sashimiConnection* conn, gchar const* address, guint port, gboo
 
 	if (ssl)
 	{
-		if (ssl_db != NULL && strlen(ssl_db) > 0)
+		g_free(conn->tls.database);
+		conn->tls.database = (ssl_db != NULL && strlen(ssl_db) > 0) ? g_strdup(ssl_db) : NULL;
+
+		if (conn->tls.database != NULL || conn->tls.certificate != NULL)
 		{
-			g_signal_connect(client, "event", G_CALLBACK(sashimi_ssl_db_handler), (gchar*)ssl_db);
+			g_signal_connect(client, "event", G_CALLBACK(sashimi_tls_handler), conn);
 		}
 
 		g_socket_client_set_tls(client, TRUE);
@@ -584,13 +837,15 @@ sashimi_disconnect (sashimiConnection* conn)
 	/* Try to flush queue. */
 	while (!g_queue_is_empty(conn->queue))
 	{
-		gchar* message;
+		sashimiMessage* message;
 
 		message = g_queue_pop_head(conn->queue);
-		sashimi_real_send(conn, message);
-		g_free(message);
+		sashimi_real_send_queued(conn, message);
+		sashimi_message_free(message);
 	}
 
+	conn->ping.pending = FALSE;
+
 	sashimi_cancel(conn, FALSE);
 	sashimi_close(conn);
 
@@ -624,7 +879,7 @@ sashimi_queue (sashimiConnection* conn, gchar const* message)
 	g_return_val_if_fail(message != NULL, FALSE);
 
 	g_mutex_lock(conn->mutex);
-	g_queue_push_tail(conn->queue, g_strdup(message));
+	sashimi_enqueue(conn, message);
 	g_mutex_unlock(conn->mutex);
 
 	return TRUE;
@@ -646,10 +901,71 @@ sashimi_send_or_queue (sashimiConnection* conn, gchar const* message)
 	}
 	else
 	{
-		g_queue_push_tail(conn->queue, g_strdup(message));
+		sashimi_enqueue(conn, message);
 	}
 
 	g_mutex_unlock(conn->mutex);
 
 	return ret;
 }
+
+static
+void
+sashimi_stats_copy (gpointer key, gpointer value, gpointer data)
+{
+	GHashTable* commands = data;
+	guint64* count;
+
+	count = g_new(guint64, 1);
+	*count = *((guint64*)value);
+
+	g_hash_table_insert(commands, g_strdup(key), count);
+}
+
+/* Fills stats with copies of the counters, free them with sashimi_stats_clear. */
+void
+sashimi_stats (sashimiConnection* conn, sashimiStats* stats)
+{
+	guint i;
+	guint count;
+
+	g_return_if_fail(conn != NULL);
+	g_return_if_fail(stats != NULL);
+
+	stats->commands_in = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	stats->commands_out = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	g_mutex_lock(conn->mutex);
+
+	stats->lines_in = conn->stats.lines_in;
+	stats->bytes_in = conn->stats.bytes_in;
+	stats->lines_out = conn->stats.lines_out;
+	stats->bytes_out = conn->stats.bytes_out;
+
+	g_hash_table_foreach(conn->stats.commands_in, sashimi_stats_copy, stats->commands_in);
+	g_hash_table_foreach(conn->stats.commands_out, sashimi_stats_copy, stats->commands_out);
+
+	stats->queue = g_queue_get_length(conn->queue);
+
+	count = MIN(conn->stats.waits_count, SASHIMI_WAITS);
+	stats->waits = g_array_sized_new(FALSE, FALSE, sizeof(gint64), count);
+
+	for (i = 0; i < count; i++)
+	{
+		g_array_append_val(stats->waits, conn->stats.waits[i]);
+	}
+
+	stats->lag = conn->ping.lag;
+
+	g_mutex_unlock(conn->mutex);
+}
+
+void
+sashimi_stats_clear (sashimiStats* stats)
+{
+	g_return_if_fail(stats != NULL);
+
+	g_hash_table_destroy(stats->commands_in);
+	g_hash_table_destroy(stats->commands_out);
+	g_array_free(stats->waits, TRUE);
+}
@@ -29,15 +29,38 @@
 #define H_SASHIMI
 
 struct sashimi_connection;
+struct sashimi_stats;
 
 typedef struct sashimi_connection sashimiConnection;
+typedef struct sashimi_stats sashimiStats;
 
 #include <glib.h>
 
+struct sashimi_stats
+{
+	guint64 lines_in;
+	guint64 bytes_in;
+	guint64 lines_out;
+	guint64 bytes_out;
+
+	/* Map upper case commands to guint64 counts. */
+	GHashTable* commands_in;
+	GHashTable* commands_out;
+
+	/* Number of queued lines. */
+	guint queue;
+	/* Microseconds the most recently sent queued lines waited, as gint64. */
+	GArray* waits;
+
+	/* Round trip time of the last answered PING in microseconds, 0 if none was answered. */
+	gint64 lag;
+};
+
 sashimiConnection* sashimi_new (GMainContext*);
 void sashimi_free (sashimiConnection*);
 
 void sashimi_timeout (sashimiConnection*, guint);
+void sashimi_tls_certificate (sashimiConnection*, gchar const*);
 
 void sashimi_connect_callback (sashimiConnection*, void (*) (gpointer), gpointer);
 void sashimi_read_callback (sashimiConnection* conn, void (*) (const gchar*, gpointer), gpointer);
@@ -50,4 +73,7 @@ gboolean sashimi_send (sashimiConnection*, const gchar*);
 gboolean sashimi_queue (sashimiConnection*, const gchar*);
 gboolean sashimi_send_or_queue (sashimiConnection*, const gchar*);
 
+void sashimi_stats (sashimiConnection*, sashimiStats*);
+void sashimi_stats_clear (sashimiStats*);
+
 #endif
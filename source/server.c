@@ -37,12 +37,13 @@
 #include "server.h"
 
 #include "dbus.h"
+#include "event.h"
 #include "in.h"
 #include "instance.h"
-#include "log.h"
 #include "maki.h"
 #include "misc.h"
 #include "out.h"
+#include "rcu.h"
 
 enum makiServerStatus
 {
@@ -75,6 +76,36 @@ struct makiServerIdleOperation
 
 typedef struct makiServerIdleOperation makiServerIdleOperation;
 
+/* The away tracker runs every MAKI_SERVER_AWAY_INTERVAL seconds and may request about MAKI_SERVER_AWAY_BUDGET WHO replies each time.
+ * Channels are considered fresh for MAKI_SERVER_AWAY_FRESH seconds, or MAKI_SERVER_AWAY_FRESH_ACTIVE seconds if a client used them recently. */
+#define MAKI_SERVER_AWAY_INTERVAL 5
+#define MAKI_SERVER_AWAY_BUDGET 250
+#define MAKI_SERVER_AWAY_FRESH 600
+#define MAKI_SERVER_AWAY_FRESH_ACTIVE 120
+#define MAKI_SERVER_AWAY_ACTIVE 600
+#define MAKI_SERVER_AWAY_TIMEOUT 120
+
+struct makiServerAwayCandidate
+{
+	gchar const* name;
+	makiChannel* channel;
+	gboolean active;
+	gint64 updated;
+};
+
+typedef struct makiServerAwayCandidate makiServerAwayCandidate;
+
+/* An open IRCv3 batch.
+ * nicks maps targets to the nicks collected for them while the batch is open. */
+struct makiServerBatch
+{
+	gchar* type;
+	gchar* parameters;
+	GHashTable* nicks;
+};
+
+typedef struct makiServerBatch makiServerBatch;
+
 struct maki_server
 {
 	makiInstance* instance;
@@ -85,7 +116,8 @@ struct maki_server
 	sashimiConnection* connection;
 	GHashTable* channels;
 	GHashTable* users;
-	GHashTable* logs;
+	/* An iCaseMapping, changed with all locks held but read atomically, so that it can be read with any of them held. */
+	gint case_mapping;
 
 	makiUser* user;
 
@@ -106,17 +138,46 @@ struct maki_server
 
 	struct
 	{
-		gchar* chanmodes;
-		gchar* chantypes;
+		gboolean notify;
+	}
+	away;
 
-		struct
-		{
-			gchar* modes;
-			gchar* prefixes;
-		}
-		prefix;
+	/* IRCv3 capabilities, mapping names to their values (or ""). */
+	struct
+	{
+		GHashTable* available;
+		GHashTable* enabled;
 	}
-	support;
+	caps;
+
+	/* Open IRCv3 batches, mapping references to makiServerBatch. */
+	GHashTable* batches;
+
+	/* Monotonic times in microseconds. */
+	struct
+	{
+		gint64 connect;
+		gint64 time_to_joined;
+		gint64 time_to_all_joined;
+
+		/* Reconnects after unexpected disconnects. */
+		guint64 reconnects;
+
+		/* Autojoin channels that have not been answered yet. */
+		GHashTable* autojoin;
+	}
+	metrics;
+
+	/* Publishes makiSupport, see maki_server_support. */
+	makiRcu* support;
+
+	struct
+	{
+		/* Publishes makiServerConfig. */
+		makiRcu* rcu;
+		guint64 generation;
+	}
+	config;
 
 	GMainContext* main_context;
 	GMainLoop* main_loop;
@@ -139,51 +200,72 @@ static void maki_server_internal_log (makiServer*, const gchar*, const gchar*, .
 static gboolean maki_server_internal_sendf_valist (makiServer*, gchar const*, va_list) G_GNUC_PRINTF(2, 0);
 static gboolean maki_server_internal_sendf (makiServer*, gchar const*, ...) G_GNUC_PRINTF(2, 3);
 
+static
+void
+maki_server_batch_nicks_free (gpointer data)
+{
+	g_string_free(data, TRUE);
+}
+
+static
+void
+maki_server_batch_free (gpointer data)
+{
+	makiServerBatch* batch = data;
+
+	g_free(batch->type);
+	g_free(batch->parameters);
+	g_hash_table_destroy(batch->nicks);
+	g_free(batch);
+}
+
+static
+gint
+maki_server_reconnect_retries (makiServer* serv)
+{
+	gint retries;
+	makiInstanceConfig const* config;
+
+	config = maki_instance_config_snapshot(serv->instance);
+	retries = config->reconnect.retries;
+	maki_instance_config_snapshot_unref(serv->instance, config);
+
+	return retries;
+}
+
 static
 void
 maki_server_internal_log_valist (makiServer* serv, const gchar* name, const gchar* format, va_list args)
 {
-	gchar* file;
+	gchar* file = NULL;
 	gchar* file_tmp;
-	gchar* file_format;
-	gchar* tmp;
-	makiLog* log;
+	makiInstanceConfig const* config;
+	makiEvent* event;
 
-	if (!maki_instance_config_get_boolean(serv->instance, "logging", "enabled"))
+	config = maki_instance_config_snapshot(serv->instance);
+
+	if (config->logging.enabled)
 	{
-		return;
-	}
+		file_tmp = i_strreplace(config->logging.format, "$n", name, 0);
+		file = i_get_current_time_string(file_tmp);
 
-	file_format = maki_instance_config_get_string(serv->instance, "logging", "format");
-	file_tmp = i_strreplace(file_format, "$n", name, 0);
-	file = i_get_current_time_string(file_tmp);
+		g_free(file_tmp);
+	}
 
-	g_free(file_format);
-	g_free(file_tmp);
+	maki_instance_config_snapshot_unref(serv->instance, config);
 
 	if (file == NULL)
 	{
 		return;
 	}
 
-	if ((log = g_hash_table_lookup(serv->logs, file)) == NULL)
-	{
-		if ((log = maki_log_new(serv->instance, serv->name, file)) == NULL)
-		{
-			g_free(file);
-			return;
-		}
+	/* The log consumer does the writing. */
+	event = maki_event_new(MAKI_EVENT_LOG, serv->name, file);
+	event->case_mapping = maki_server_case_mapping(serv);
+	event->message = g_strdup_vprintf(format, args);
+	maki_event_bus_publish(maki_instance_events(serv->instance), event);
 
-		g_hash_table_insert(serv->logs, file, log);
-	}
-	else
-	{
-		g_free(file);
-	}
-
-	tmp = g_strdup_vprintf(format, args);
-	maki_log_write(log, tmp);
-	g_free(tmp);
+	g_free(file);
 }
 
 static
@@ -244,33 +326,102 @@ maki_server_internal_add_user (makiServer* serv, gchar const* nick)
 	return ret;
 }
 
+/* Drops a reference obtained from maki_server_internal_add_user().
+ * The user may no longer be in the table if it collided with another one when the casemapping changed. */
 static
 gboolean
-maki_server_internal_remove_user (makiServer* serv, gchar const* nick)
+maki_server_internal_remove_user (makiServer* serv, makiUser* user)
 {
-	makiUser* user;
 	gboolean ret = FALSE;
 
-	if ((user = g_hash_table_lookup(serv->users, nick)) != NULL)
+	if (maki_user_ref_count(user) == 1 && g_hash_table_lookup(serv->users, maki_user_nick(user)) == user)
+	{
+		ret = g_hash_table_remove(serv->users, maki_user_nick(user));
+	}
+
+	maki_user_unref(user);
+
+	return ret;
+}
+
+/* Moves all entries into a new hash table using the given casemapping.
+ * Entries that become equal under the new casemapping are stolen into duplicates, mapped to the surviving value.
+ * If duplicates is NULL, they are dropped instead. */
+static
+GHashTable*
+maki_server_internal_rehash (GHashTable* table, iCaseMapping case_mapping, GDestroyNotify value_destroy_func, GHashTable* duplicates)
+{
+	GHashTable* ret;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	ret = g_hash_table_new_full(i_case_mapping_hash_func(case_mapping), i_case_mapping_equal_func(case_mapping), g_free, value_destroy_func);
+
+	g_hash_table_iter_init(&iter, table);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
 	{
-		if (maki_user_ref_count(user) == 1)
+		gpointer survivor;
+
+		g_hash_table_iter_steal(&iter);
+
+		if ((survivor = g_hash_table_lookup(ret, key)) != NULL)
 		{
-			ret = g_hash_table_remove(serv->users, nick);
+			g_free(key);
+
+			if (duplicates != NULL)
+			{
+				g_hash_table_insert(duplicates, value, survivor);
+			}
+
+			continue;
 		}
 
-		maki_user_unref(user);
+		g_hash_table_insert(ret, key, value);
 	}
 
+	g_hash_table_destroy(table);
+
 	return ret;
 }
 
+static
+gint
+maki_server_away_compare (gconstpointer a, gconstpointer b)
+{
+	makiServerAwayCandidate const* candidate_a = a;
+	makiServerAwayCandidate const* candidate_b = b;
+
+	if (candidate_a->active != candidate_b->active)
+	{
+		return (candidate_a->active) ? -1 : 1;
+	}
+
+	if (candidate_a->updated != candidate_b->updated)
+	{
+		return (candidate_a->updated < candidate_b->updated) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Keeps the away state of channel users up to date.
+ * With away-notify, a single WHO after joining is enough.
+ * Otherwise, stale channels are refreshed in order of priority, spreading the WHO replies over time. */
 static
 gboolean
 maki_server_away (gpointer data)
 {
 	makiServer* serv = data;
+	GArray* candidates;
 	GHashTableIter iter;
 	gpointer key, value;
+	gint64 now;
+	guint budget = MAKI_SERVER_AWAY_BUDGET;
+	guint i;
+
+	now = g_get_monotonic_time();
+	candidates = g_array_new(FALSE, FALSE, sizeof(makiServerAwayCandidate));
 
 	g_mutex_lock(serv->mutex.server);
 
@@ -278,26 +429,94 @@ maki_server_away (gpointer data)
 
 	while (g_hash_table_iter_next(&iter, &key, &value))
 	{
-		gchar const* chan_name = key;
 		makiChannel* chan = value;
+		makiServerAwayCandidate candidate;
+		gint64 requested;
+		gint64 last_active;
+
+		if (!maki_channel_joined(chan))
+		{
+			continue;
+		}
+
+		if ((requested = maki_channel_away_requested(chan)) != 0)
+		{
+			if (now - requested < MAKI_SERVER_AWAY_TIMEOUT * G_USEC_PER_SEC)
+			{
+				continue;
+			}
+
+			/* The reply got lost. */
+			maki_channel_set_away_requested(chan, 0);
+		}
+
+		last_active = maki_channel_last_active(chan);
+
+		candidate.name = key;
+		candidate.channel = chan;
+		/* A channel no client has used yet is not active, even shortly after startup. */
+		candidate.active = (last_active != 0 && now - last_active < MAKI_SERVER_AWAY_ACTIVE * G_USEC_PER_SEC);
+		candidate.updated = maki_channel_away_updated(chan);
 
-		if (maki_channel_joined(chan) && maki_channel_users_count(chan) <= 100)
+		if (candidate.updated != 0)
 		{
-			maki_server_internal_sendf(serv, "WHO %s", chan_name);
+			gint64 fresh;
+
+			if (serv->away.notify)
+			{
+				continue;
+			}
+
+			fresh = (candidate.active) ? MAKI_SERVER_AWAY_FRESH_ACTIVE : MAKI_SERVER_AWAY_FRESH;
+
+			if (now - candidate.updated < fresh * G_USEC_PER_SEC)
+			{
+				continue;
+			}
 		}
+
+		g_array_append_val(candidates, candidate);
+	}
+
+	g_array_sort(candidates, maki_server_away_compare);
+
+	for (i = 0; i < candidates->len && budget > 0; i++)
+	{
+		makiServerAwayCandidate* candidate = &g_array_index(candidates, makiServerAwayCandidate, i);
+		guint users;
+
+		users = maki_channel_users_count(candidate->channel);
+
+		/* Large channels exceed the budget on their own, so only send them first. */
+		if (i > 0 && users > budget)
+		{
+			break;
+		}
+
+		maki_server_internal_sendf(serv, "WHO %s", candidate->name);
+		maki_channel_set_away_requested(candidate->channel, now);
+
+		budget -= MIN(users, budget);
 	}
 
 	g_mutex_unlock(serv->mutex.server);
 
+	g_array_free(candidates, TRUE);
+
 	return TRUE;
 }
 
+/* The server whose thread is running, if any. */
+static GPrivate maki_server_current_private = G_PRIVATE_INIT(NULL);
+
 static
 gpointer
 maki_server_thread (gpointer data)
 {
 	makiServer* serv = data;
 
+	g_private_set(&maki_server_current_private, serv);
+
 	g_main_context_push_thread_default(serv->main_context);
 	g_main_loop_run(serv->main_loop);
 
@@ -319,7 +538,11 @@ maki_server_on_disconnect (gpointer data)
 	/* Prevent maki_server_reconnect() from running twice. */
 	if (serv->reconnect.source == 0)
 	{
-		serv->reconnect.source = i_timeout_add_seconds(maki_instance_config_get_integer(serv->instance, "reconnect", "timeout"), maki_server_timeout_reconnect, serv, serv->main_context);
+		makiInstanceConfig const* config;
+
+		config = maki_instance_config_snapshot(serv->instance);
+		serv->reconnect.source = i_timeout_add_seconds(config->reconnect.timeout, maki_server_timeout_reconnect, serv, serv->main_context);
+		maki_instance_config_snapshot_unref(serv->instance, config);
 	}
 
 	g_mutex_unlock(serv->mutex.server);
@@ -413,6 +636,9 @@ maki_server_on_connect (gpointer data)
 	gchar* nick;
 	makiServer* serv = data;
 
+	/* The new server might announce a different CASEMAPPING, until then RFC 1459 applies. */
+	maki_server_set_case_mapping(serv, I_CASE_MAPPING_RFC1459);
+
 	g_mutex_lock(serv->mutex.server);
 
 	if (serv->reconnect.source != 0)
@@ -425,9 +651,15 @@ maki_server_on_connect (gpointer data)
 	user = g_key_file_get_string(serv->key_file, "server", "user", NULL);
 	name = g_key_file_get_string(serv->key_file, "server", "name", NULL);
 
-	maki_server_internal_remove_user(serv, maki_user_nick(serv->user));
+	maki_server_internal_remove_user(serv, serv->user);
 	serv->user = maki_server_internal_add_user(serv, nick);
 
+	g_hash_table_remove_all(serv->caps.available);
+	g_hash_table_remove_all(serv->caps.enabled);
+	g_hash_table_remove_all(serv->batches);
+
+	/* Registration is suspended until CAP END is sent. Servers without capability negotiation simply ignore this. */
+	maki_server_internal_sendf(serv, "CAP LS 302");
 	maki_server_internal_sendf(serv, "NICK %s", nick);
 	maki_server_internal_sendf(serv, "USER %s 0 * :%s", user, name);
 
@@ -445,7 +677,8 @@ maki_server_on_connect (gpointer data)
 		i_source_remove(serv->sources.away, serv->main_context);
 	}
 
-	serv->sources.away = i_timeout_add_seconds(60, maki_server_away, serv, serv->main_context);
+	serv->away.notify = FALSE;
+	serv->sources.away = i_timeout_add_seconds(MAKI_SERVER_AWAY_INTERVAL, maki_server_away, serv, serv->main_context);
 
 	g_mutex_unlock(serv->mutex.server);
 }
@@ -459,6 +692,7 @@ maki_server_internal_connect (makiServer* serv)
 	gboolean ssl;
 	gchar* address;
 	gchar* ssl_db;
+	gchar* ssl_certificate;
 	gint port;
 
 	maki_network_update(net);
@@ -473,10 +707,22 @@ maki_server_internal_connect (makiServer* serv)
 	port = g_key_file_get_integer(serv->key_file, "server", "port", NULL);
 	ssl = g_key_file_get_boolean(serv->key_file, "server", "ssl", NULL);
 	ssl_db = g_key_file_get_string(serv->key_file, "server", "ssl_db", NULL);
+	ssl_certificate = g_key_file_get_string(serv->key_file, "server", "ssl_certificate", NULL);
+
+	serv->metrics.connect = g_get_monotonic_time();
+	serv->metrics.time_to_joined = 0;
+	serv->metrics.time_to_all_joined = 0;
+	g_hash_table_remove_all(serv->metrics.autojoin);
+
+	/* The new server might announce a different ISUPPORT. */
+	maki_rcu_publish(serv->support, maki_support_new(NULL, NULL));
 
+	sashimi_tls_certificate(serv->connection, ssl_certificate);
 	ret = sashimi_connect(serv->connection, address, port, ssl, ssl_db);
 
 	g_free(address);
+	g_free(ssl_db);
+	g_free(ssl_certificate);
 
 	return ret;
 }
@@ -513,6 +759,7 @@ maki_server_timeout_reconnect (gpointer data)
 	if (ret)
 	{
 		serv->reconnect.retries--;
+		serv->metrics.reconnects++;
 
 		if (maki_server_internal_connect(serv))
 		{
@@ -562,14 +809,55 @@ maki_server_on_network_changed (GNetworkMonitor* network_monitor, gboolean avail
 	g_free(address);
 }
 
+static
+void
+maki_server_config_snapshot_free (gpointer data)
+{
+	makiServerConfig* config = data;
+	guint i;
+
+	for (i = 0; config->ignores.specs[i] != NULL; i++)
+	{
+		g_pattern_spec_free(config->ignores.specs[i]);
+	}
+
+	g_free(config->ignores.specs);
+	g_strfreev(config->ignores.patterns);
+	g_free(config);
+}
+
+/* Must be called with the config lock held. */
 static
 void
 maki_server_config_save (makiServer* serv)
 {
 	gchar* path;
+	guint i;
+	guint length;
+	makiServerConfig* config;
+
+	config = g_new(makiServerConfig, 1);
+	config->generation = ++serv->config.generation;
+
+	if ((config->ignores.patterns = g_key_file_get_string_list(serv->key_file, "server", "ignores", NULL, NULL)) == NULL)
+	{
+		config->ignores.patterns = g_new0(gchar*, 1);
+	}
+
+	length = g_strv_length(config->ignores.patterns);
+	config->ignores.specs = g_new(GPatternSpec*, length + 1);
+
+	for (i = 0; i < length; i++)
+	{
+		config->ignores.specs[i] = g_pattern_spec_new(config->ignores.patterns[i]);
+	}
+
+	config->ignores.specs[length] = NULL;
+
+	maki_rcu_publish(serv->config.rcu, config);
 
 	path = g_build_filename(maki_instance_directory(serv->instance, "servers"), serv->name, NULL);
-	i_key_file_to_file(serv->key_file, path, NULL, NULL);
+	maki_config_store_save(maki_instance_config_store(serv->instance), serv->key_file, serv->mutex.config, path);
 	g_free(path);
 }
 
@@ -597,6 +885,11 @@ maki_server_config_set_defaults (makiServer* serv)
 		g_key_file_set_string(serv->key_file, "server", "ssl_db", "");
 	}
 
+	if (!g_key_file_has_key(serv->key_file, "server", "ssl_certificate", NULL))
+	{
+		g_key_file_set_string(serv->key_file, "server", "ssl_certificate", "");
+	}
+
 	if (!g_key_file_has_key(serv->key_file, "server", "nick", NULL))
 	{
 		g_key_file_set_string(serv->key_file, "server", "nick", g_get_user_name());
@@ -622,6 +915,21 @@ maki_server_config_set_defaults (makiServer* serv)
 		g_key_file_set_boolean(serv->key_file, "server", "nickserv_ghost", FALSE);
 	}
 
+	if (!g_key_file_has_key(serv->key_file, "server", "sasl", NULL))
+	{
+		g_key_file_set_string(serv->key_file, "server", "sasl", "");
+	}
+
+	if (!g_key_file_has_key(serv->key_file, "server", "sasl_user", NULL))
+	{
+		g_key_file_set_string(serv->key_file, "server", "sasl_user", "");
+	}
+
+	if (!g_key_file_has_key(serv->key_file, "server", "sasl_password", NULL))
+	{
+		g_key_file_set_string(serv->key_file, "server", "sasl_password", "");
+	}
+
 	maki_server_config_save(serv);
 
 	/*
@@ -649,14 +957,32 @@ maki_server_new (gchar const* name)
 	serv->status = MAKI_SERVER_STATUS_DISCONNECTED;
 	serv->logged_in = FALSE;
 	serv->reconnect.source = 0;
-	serv->reconnect.retries = maki_instance_config_get_integer(serv->instance, "reconnect" ,"retries");
+	serv->reconnect.retries = maki_server_reconnect_retries(serv);
 	serv->sources.away = 0;
+	serv->away.notify = FALSE;
+	serv->caps.available = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	serv->caps.enabled = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	serv->batches = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, maki_server_batch_free);
+	serv->metrics.connect = 0;
+	serv->metrics.time_to_joined = 0;
+	serv->metrics.time_to_all_joined = 0;
+	serv->metrics.reconnects = 0;
 	serv->main_context = g_main_context_new();
 	serv->main_loop = g_main_loop_new(serv->main_context, FALSE);
 	serv->connection = sashimi_new(serv->main_context);
-	serv->channels = g_hash_table_new_full(i_ascii_str_case_hash, i_ascii_str_case_equal, g_free, maki_channel_free);
-	serv->users = g_hash_table_new_full(i_ascii_str_case_hash, i_ascii_str_case_equal, g_free, NULL);
-	serv->logs = g_hash_table_new_full(i_ascii_str_case_hash, i_ascii_str_case_equal, g_free, maki_log_free);
+	/* rfc1459 is the default if the server does not announce CASEMAPPING. */
+	serv->case_mapping = I_CASE_MAPPING_RFC1459;
+	serv->channels = g_hash_table_new_full(i_case_mapping_hash_func(serv->case_mapping), i_case_mapping_equal_func(serv->case_mapping), g_free, maki_channel_free);
+	serv->users = g_hash_table_new_full(i_case_mapping_hash_func(serv->case_mapping), i_case_mapping_equal_func(serv->case_mapping), g_free, NULL);
+	serv->metrics.autojoin = g_hash_table_new_full(i_case_mapping_hash_func(serv->case_mapping), i_case_mapping_equal_func(serv->case_mapping), g_free, NULL);
+
+	g_mutex_init(serv->mutex.channels);
+	g_mutex_init(serv->mutex.config);
+	g_mutex_init(serv->mutex.server);
+	g_mutex_init(serv->mutex.users);
+
+	serv->config.rcu = maki_rcu_new(NULL, maki_server_config_snapshot_free);
+	serv->config.generation = 0;
 
 	path = g_build_filename(maki_instance_directory(serv->instance, "servers"), name, NULL);
 	g_key_file_load_from_file(serv->key_file, path, G_KEY_FILE_NONE, NULL);
@@ -668,20 +994,12 @@ maki_server_new (gchar const* name)
 	serv->user = maki_server_internal_add_user(serv, nick);
 	g_free(nick);
 
-	serv->support.chanmodes = NULL;
-	serv->support.chantypes = g_strdup("#&");
-	serv->support.prefix.modes = g_strdup("ov");
-	serv->support.prefix.prefixes = g_strdup("@+");
+	serv->support = maki_rcu_new(maki_support_new(NULL, NULL), maki_support_free);
 
 	serv->ref_count = 1;
 
 	sashimi_timeout(serv->connection, 60);
 
-	g_mutex_init(serv->mutex.channels);
-	g_mutex_init(serv->mutex.config);
-	g_mutex_init(serv->mutex.server);
-	g_mutex_init(serv->mutex.users);
-
 	groups = g_key_file_get_groups(serv->key_file, NULL);
 
 	for (group = groups; *group != NULL; group++)
@@ -736,18 +1054,22 @@ maki_server_unref (gpointer data)
 		g_main_loop_unref(serv->main_loop);
 		g_main_context_unref(serv->main_context);
 
-		maki_server_internal_remove_user(serv, maki_user_nick(serv->user));
+		maki_server_internal_remove_user(serv, serv->user);
 
+		maki_config_store_remove(maki_instance_config_store(serv->instance), serv->key_file, TRUE);
 		g_key_file_free(serv->key_file);
 
-		g_free(serv->support.prefix.prefixes);
-		g_free(serv->support.prefix.modes);
-		g_free(serv->support.chantypes);
-		g_free(serv->support.chanmodes);
-		g_hash_table_destroy(serv->logs);
+		maki_rcu_free(serv->support);
+		maki_rcu_free(serv->config.rcu);
+		g_hash_table_destroy(serv->metrics.autojoin);
 		g_hash_table_destroy(serv->channels);
 		g_hash_table_destroy(serv->users);
+		g_hash_table_destroy(serv->batches);
+		g_hash_table_destroy(serv->caps.enabled);
+		g_hash_table_destroy(serv->caps.available);
 		sashimi_free(serv->connection);
+
+		maki_event_bus_publish(maki_instance_events(serv->instance), maki_event_new(MAKI_EVENT_LOG_CLOSE, serv->name, NULL));
 		g_free(serv->name);
 
 		g_mutex_clear(serv->mutex.channels);
@@ -759,6 +1081,24 @@ maki_server_unref (gpointer data)
 	}
 }
 
+/* Returns a reference to the current configuration snapshot.
+ * It must be dropped with maki_server_config_snapshot_unref(). */
+makiServerConfig const*
+maki_server_config_snapshot (makiServer* serv)
+{
+	g_return_val_if_fail(serv != NULL, NULL);
+
+	return maki_rcu_get(serv->config.rcu);
+}
+
+void
+maki_server_config_snapshot_unref (makiServer* serv, makiServerConfig const* config)
+{
+	g_return_if_fail(serv != NULL);
+
+	maki_rcu_unref(serv->config.rcu, (gpointer)config);
+}
+
 gboolean
 maki_server_config_get_boolean (makiServer* serv, gchar const* group, gchar const* key)
 {
@@ -1035,69 +1375,455 @@ maki_server_user (makiServer* serv)
 	return ret;
 }
 
-gchar const*
-maki_server_support (makiServer* serv, makiServerSupport support)
+/* Returns a reference to the current ISUPPORT table.
+ * Tables are never modified. The reference must be dropped with maki_server_support_unref(). */
+makiSupport*
+maki_server_support (makiServer* serv)
+{
+	g_return_val_if_fail(serv != NULL, NULL);
+
+	return maki_rcu_get(serv->support);
+}
+
+void
+maki_server_support_unref (makiServer* serv, makiSupport* support)
+{
+	g_return_if_fail(serv != NULL);
+
+	maki_rcu_unref(serv->support, support);
+}
+
+void
+maki_server_update_support (makiServer* serv, gchar** tokens)
 {
-	gchar const* ret = NULL;
+	makiSupport* support;
 
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(tokens != NULL);
+
+	/* The server lock keeps concurrent updates from losing tokens. */
+	g_mutex_lock(serv->mutex.server);
+	support = maki_rcu_get(serv->support);
+	maki_rcu_publish(serv->support, maki_support_new(support, tokens));
+	maki_rcu_unref(serv->support, support);
+	g_mutex_unlock(serv->mutex.server);
+}
+
+void
+maki_server_set_away_notify (makiServer* serv, gboolean notify)
+{
+	g_return_if_fail(serv != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+	serv->away.notify = notify;
+	g_mutex_unlock(serv->mutex.server);
+}
+
+GMainContext*
+maki_server_main_context (makiServer* serv)
+{
 	g_return_val_if_fail(serv != NULL, NULL);
 
+	return serv->main_context;
+}
+
+/* Remembers a channel that is part of the current autojoin. */
+void
+maki_server_metrics_autojoin (makiServer* serv, gchar const* channel)
+{
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(channel != NULL);
+
 	g_mutex_lock(serv->mutex.server);
+	g_hash_table_insert(serv->metrics.autojoin, g_strdup(channel), GINT_TO_POINTER(TRUE));
+	g_mutex_unlock(serv->mutex.server);
+}
 
-	switch (support)
+/* Must be called with the server lock held. */
+static
+void
+maki_server_internal_metrics_autojoin_done (makiServer* serv, gchar const* channel)
+{
+	if (!g_hash_table_remove(serv->metrics.autojoin, channel))
 	{
-		case MAKI_SERVER_SUPPORT_CHANMODES:
-			ret = serv->support.chanmodes;
-			break;
-		case MAKI_SERVER_SUPPORT_CHANTYPES:
-			ret = serv->support.chantypes;
-			break;
-		case MAKI_SERVER_SUPPORT_PREFIX_MODES:
-			ret = serv->support.prefix.modes;
-			break;
-		case MAKI_SERVER_SUPPORT_PREFIX_PREFIXES:
-			ret = serv->support.prefix.prefixes;
-			break;
-		default:
-			g_warn_if_reached();
+		return;
+	}
+
+	if (g_hash_table_size(serv->metrics.autojoin) == 0 && serv->metrics.connect != 0)
+	{
+		serv->metrics.time_to_all_joined = g_get_monotonic_time() - serv->metrics.connect;
+		maki_debug("METRIC: [%s] time to all joined: %" G_GINT64_FORMAT " ms\n", serv->name, serv->metrics.time_to_all_joined / 1000);
 	}
+}
 
+void
+maki_server_metrics_joined (makiServer* serv, gchar const* channel)
+{
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(channel != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+
+	if (serv->metrics.time_to_joined == 0 && serv->metrics.connect != 0)
+	{
+		serv->metrics.time_to_joined = g_get_monotonic_time() - serv->metrics.connect;
+		maki_debug("METRIC: [%s] time to joined: %" G_GINT64_FORMAT " ms\n", serv->name, serv->metrics.time_to_joined / 1000);
+	}
+
+	maki_server_internal_metrics_autojoin_done(serv, channel);
+
+	g_mutex_unlock(serv->mutex.server);
+}
+
+/* Failed joins still count towards autojoin being finished. */
+void
+maki_server_metrics_join_failed (makiServer* serv, gchar const* channel)
+{
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(channel != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+	maki_server_internal_metrics_autojoin_done(serv, channel);
+	g_mutex_unlock(serv->mutex.server);
+}
+
+gint64
+maki_server_metrics_time_to_joined (makiServer* serv)
+{
+	gint64 ret;
+
+	g_return_val_if_fail(serv != NULL, 0);
+
+	g_mutex_lock(serv->mutex.server);
+	ret = serv->metrics.time_to_joined;
+	g_mutex_unlock(serv->mutex.server);
+
+	return ret;
+}
+
+gint64
+maki_server_metrics_time_to_all_joined (makiServer* serv)
+{
+	gint64 ret;
+
+	g_return_val_if_fail(serv != NULL, 0);
+
+	g_mutex_lock(serv->mutex.server);
+	ret = serv->metrics.time_to_all_joined;
 	g_mutex_unlock(serv->mutex.server);
 
 	return ret;
 }
 
+guint64
+maki_server_metrics_reconnects (makiServer* serv)
+{
+	guint64 ret;
+
+	g_return_val_if_fail(serv != NULL, 0);
+
+	g_mutex_lock(serv->mutex.server);
+	ret = serv->metrics.reconnects;
+	g_mutex_unlock(serv->mutex.server);
+
+	return ret;
+}
+
+/* Fills stats with the connection's traffic counters, free them with sashimi_stats_clear. */
 void
-maki_server_set_support (makiServer* serv, makiServerSupport support, gchar const* value)
+maki_server_metrics_connection (makiServer* serv, sashimiStats* stats)
 {
 	g_return_if_fail(serv != NULL);
-	g_return_if_fail(value != NULL);
+
+	sashimi_stats(serv->connection, stats);
+}
+
+gboolean
+maki_server_cap_available (makiServer* serv, gchar const* name)
+{
+	gboolean ret;
+
+	g_return_val_if_fail(serv != NULL, FALSE);
+	g_return_val_if_fail(name != NULL, FALSE);
 
 	g_mutex_lock(serv->mutex.server);
+	ret = g_hash_table_contains(serv->caps.available, name);
+	g_mutex_unlock(serv->mutex.server);
 
-	switch (support)
+	return ret;
+}
+
+gchar*
+maki_server_cap_value (makiServer* serv, gchar const* name)
+{
+	gchar* ret;
+
+	g_return_val_if_fail(serv != NULL, NULL);
+	g_return_val_if_fail(name != NULL, NULL);
+
+	g_mutex_lock(serv->mutex.server);
+	ret = g_strdup(g_hash_table_lookup(serv->caps.available, name));
+	g_mutex_unlock(serv->mutex.server);
+
+	return ret;
+}
+
+void
+maki_server_cap_set_available (makiServer* serv, gchar const* name, gchar const* value)
+{
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(name != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+	g_hash_table_insert(serv->caps.available, g_strdup(name), g_strdup((value != NULL) ? value : ""));
+	g_mutex_unlock(serv->mutex.server);
+}
+
+void
+maki_server_cap_remove (makiServer* serv, gchar const* name)
+{
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(name != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+	g_hash_table_remove(serv->caps.available, name);
+	g_hash_table_remove(serv->caps.enabled, name);
+	g_mutex_unlock(serv->mutex.server);
+}
+
+gboolean
+maki_server_cap_enabled (makiServer* serv, gchar const* name)
+{
+	gboolean ret;
+
+	g_return_val_if_fail(serv != NULL, FALSE);
+	g_return_val_if_fail(name != NULL, FALSE);
+
+	g_mutex_lock(serv->mutex.server);
+	ret = g_hash_table_contains(serv->caps.enabled, name);
+	g_mutex_unlock(serv->mutex.server);
+
+	return ret;
+}
+
+void
+maki_server_cap_set_enabled (makiServer* serv, gchar const* name, gboolean enabled)
+{
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(name != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+
+	if (enabled)
 	{
-		case MAKI_SERVER_SUPPORT_CHANMODES:
-			g_free(serv->support.chanmodes);
-			serv->support.chanmodes = g_strdup(value);
-			break;
-		case MAKI_SERVER_SUPPORT_CHANTYPES:
-			g_free(serv->support.chantypes);
-			serv->support.chantypes = g_strdup(value);
-			break;
-		case MAKI_SERVER_SUPPORT_PREFIX_MODES:
-			g_free(serv->support.prefix.modes);
-			serv->support.prefix.modes = g_strdup(value);
-			break;
-		case MAKI_SERVER_SUPPORT_PREFIX_PREFIXES:
-			g_free(serv->support.prefix.prefixes);
-			serv->support.prefix.prefixes = g_strdup(value);
-			break;
-		default:
-			g_warn_if_reached();
+		g_hash_table_insert(serv->caps.enabled, g_strdup(name), NULL);
+	}
+	else
+	{
+		g_hash_table_remove(serv->caps.enabled, name);
+	}
+
+	g_mutex_unlock(serv->mutex.server);
+}
+
+/* parameters may be NULL. */
+void
+maki_server_batch_start (makiServer* serv, gchar const* reference, gchar const* type, gchar const* parameters)
+{
+	makiServerBatch* batch;
+
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(reference != NULL);
+	g_return_if_fail(type != NULL);
+
+	batch = g_new(makiServerBatch, 1);
+	batch->type = g_strdup(type);
+	batch->parameters = g_strdup((parameters != NULL) ? parameters : "");
+	batch->nicks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, maki_server_batch_nicks_free);
+
+	g_mutex_lock(serv->mutex.server);
+	g_hash_table_insert(serv->batches, g_strdup(reference), batch);
+	g_mutex_unlock(serv->mutex.server);
+}
+
+/* Closes the batch and returns its collected nicks, mapping targets to comma-separated lists.
+ * Returns NULL if the batch is unknown. type and parameters are set if non-NULL. */
+GHashTable*
+maki_server_batch_end (makiServer* serv, gchar const* reference, gchar** type, gchar** parameters)
+{
+	GHashTable* ret = NULL;
+	GHashTableIter iter;
+	gpointer key, value;
+	makiServerBatch* batch;
+
+	g_return_val_if_fail(serv != NULL, NULL);
+	g_return_val_if_fail(reference != NULL, NULL);
+
+	g_mutex_lock(serv->mutex.server);
+
+	if ((batch = g_hash_table_lookup(serv->batches, reference)) != NULL)
+	{
+		ret = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+		g_hash_table_iter_init(&iter, batch->nicks);
+
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			g_hash_table_insert(ret, g_strdup(key), g_strdup(((GString*)value)->str));
+		}
+
+		if (type != NULL)
+		{
+			*type = g_strdup(batch->type);
+		}
+
+		if (parameters != NULL)
+		{
+			*parameters = g_strdup(batch->parameters);
+		}
+
+		g_hash_table_remove(serv->batches, reference);
+	}
+
+	g_mutex_unlock(serv->mutex.server);
+
+	return ret;
+}
+
+gchar*
+maki_server_batch_type (makiServer* serv, gchar const* reference)
+{
+	gchar* ret = NULL;
+	makiServerBatch* batch;
+
+	g_return_val_if_fail(serv != NULL, NULL);
+	g_return_val_if_fail(reference != NULL, NULL);
+
+	g_mutex_lock(serv->mutex.server);
+
+	if ((batch = g_hash_table_lookup(serv->batches, reference)) != NULL)
+	{
+		ret = g_strdup(batch->type);
 	}
 
 	g_mutex_unlock(serv->mutex.server);
+
+	return ret;
+}
+
+/* Remembers nick for target until the batch ends. */
+void
+maki_server_batch_add_nick (makiServer* serv, gchar const* reference, gchar const* target, gchar const* nick)
+{
+	GString* nicks;
+	makiServerBatch* batch;
+
+	g_return_if_fail(serv != NULL);
+	g_return_if_fail(reference != NULL);
+	g_return_if_fail(target != NULL);
+	g_return_if_fail(nick != NULL);
+
+	g_mutex_lock(serv->mutex.server);
+
+	if ((batch = g_hash_table_lookup(serv->batches, reference)) != NULL)
+	{
+		if ((nicks = g_hash_table_lookup(batch->nicks, target)) == NULL)
+		{
+			nicks = g_string_new(NULL);
+			g_hash_table_insert(batch->nicks, g_strdup(target), nicks);
+		}
+		else
+		{
+			g_string_append(nicks, ", ");
+		}
+
+		g_string_append(nicks, nick);
+	}
+
+	g_mutex_unlock(serv->mutex.server);
+}
+
+/* Returns the server that owns the calling thread, NULL on all other threads.
+ * The server stays valid while its thread runs, no reference is needed. */
+makiServer*
+maki_server_current (void)
+{
+	return g_private_get(&maki_server_current_private);
+}
+
+iCaseMapping
+maki_server_case_mapping (makiServer* serv)
+{
+	g_return_val_if_fail(serv != NULL, I_CASE_MAPPING_RFC1459);
+
+	return g_atomic_int_get(&serv->case_mapping);
+}
+
+/* Users and channels that become equal under the new casemapping are merged. */
+void
+maki_server_set_case_mapping (makiServer* serv, iCaseMapping case_mapping)
+{
+	GHashTable* merged_users;
+	GHashTable* merged_channels;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_return_if_fail(serv != NULL);
+
+	merged_users = g_hash_table_new(g_direct_hash, g_direct_equal);
+	merged_channels = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	g_mutex_lock(serv->mutex.channels);
+	g_mutex_lock(serv->mutex.server);
+	g_mutex_lock(serv->mutex.users);
+
+	if (serv->case_mapping == case_mapping)
+	{
+		goto end;
+	}
+
+	g_atomic_int_set(&serv->case_mapping, case_mapping);
+	serv->users = maki_server_internal_rehash(serv->users, case_mapping, NULL, merged_users);
+
+	/* Users that collided are no longer in the table, their remaining holders drop them using maki_server_remove_user(). */
+	if ((value = g_hash_table_lookup(merged_users, serv->user)) != NULL)
+	{
+		maki_user_unref(serv->user);
+		serv->user = maki_user_ref(value);
+	}
+
+	g_hash_table_iter_init(&iter, serv->channels);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		maki_channel_set_case_mapping(value, case_mapping, merged_users);
+	}
+
+	serv->channels = maki_server_internal_rehash(serv->channels, case_mapping, maki_channel_free, merged_channels);
+
+	g_hash_table_iter_init(&iter, merged_channels);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		maki_channel_merge(value, key);
+	}
+
+	serv->metrics.autojoin = maki_server_internal_rehash(serv->metrics.autojoin, case_mapping, NULL, NULL);
+
+end:
+	g_mutex_unlock(serv->mutex.users);
+	g_mutex_unlock(serv->mutex.server);
+	g_mutex_unlock(serv->mutex.channels);
+
+	/* Freeing a channel takes the locks again. */
+	g_hash_table_iter_init(&iter, merged_channels);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		maki_channel_free(key);
+	}
+
+	g_hash_table_destroy(merged_channels);
+	g_hash_table_destroy(merged_users);
 }
 
 makiUser*
@@ -1131,15 +1857,15 @@ maki_server_get_user (makiServer* serv, gchar const* nick)
 }
 
 gboolean
-maki_server_remove_user (makiServer* serv, gchar const* nick)
+maki_server_remove_user (makiServer* serv, makiUser* user)
 {
 	gboolean ret = FALSE;
 
 	g_return_val_if_fail(serv != NULL, FALSE);
-	g_return_val_if_fail(nick != NULL, FALSE);
+	g_return_val_if_fail(user != NULL, FALSE);
 
 	g_mutex_lock(serv->mutex.users);
-	ret = maki_server_internal_remove_user(serv, nick);
+	ret = maki_server_internal_remove_user(serv, user);
 	g_mutex_unlock(serv->mutex.users);
 
 	return ret;
@@ -1262,11 +1988,10 @@ maki_server_log (makiServer* serv, const gchar* name, const gchar* format, ...)
 	g_return_if_fail(name != NULL);
 	g_return_if_fail(format != NULL);
 
-	g_mutex_lock(serv->mutex.server);
+	/* Does not need the lock, writing happens on the log consumer's thread. */
 	va_start(args, format);
 	maki_server_internal_log_valist(serv, name, format, args);
 	va_end(args);
-	g_mutex_unlock(serv->mutex.server);
 }
 
 gboolean
@@ -1343,7 +2068,7 @@ maki_server_connect (makiServer* serv)
 		op->u.connect.server = serv;
 
 		serv->status = MAKI_SERVER_STATUS_CONNECTING;
-		serv->reconnect.retries = maki_instance_config_get_integer(serv->instance, "reconnect", "retries");
+		serv->reconnect.retries = maki_server_reconnect_retries(serv);
 
 		i_idle_add(maki_server_idle_connect, op, serv->main_context);
 		ret = TRUE;
@@ -36,27 +36,39 @@ struct maki_server;
 
 typedef struct maki_server makiServer;
 
-enum makiServerSupport
-{
-	MAKI_SERVER_SUPPORT_CHANMODES,
-	MAKI_SERVER_SUPPORT_CHANTYPES,
-	MAKI_SERVER_SUPPORT_PREFIX_MODES,
-	MAKI_SERVER_SUPPORT_PREFIX_PREFIXES
-};
-
-typedef enum makiServerSupport makiServerSupport;
-
 #include <glib.h>
 
+#include <ilib.h>
+
 #include "channel.h"
 #include "log.h"
 #include "sashimi.h"
+#include "support.h"
 #include "user.h"
 
+/* An immutable snapshot of frequently used configuration values.
+ * A new snapshot with a higher generation is published whenever the configuration changes. */
+struct maki_server_config
+{
+	guint64 generation;
+
+	struct
+	{
+		/* Both are NULL-terminated. */
+		gchar** patterns;
+		GPatternSpec** specs;
+	}
+	ignores;
+};
+
+typedef struct maki_server_config makiServerConfig;
+
 makiServer* maki_server_new (gchar const*);
 makiServer* maki_server_ref (makiServer*);
 void maki_server_unref (gpointer);
 
+makiServerConfig const* maki_server_config_snapshot (makiServer*);
+void maki_server_config_snapshot_unref (makiServer*, makiServerConfig const*);
 gboolean maki_server_config_get_boolean (makiServer*, gchar const*, gchar const*);
 void maki_server_config_set_boolean (makiServer*, gchar const*, gchar const*, gboolean);
 gint maki_server_config_get_integer (makiServer*, gchar const*, gchar const*);
@@ -78,12 +90,42 @@ gboolean maki_server_logged_in (makiServer*);
 void maki_server_set_logged_in (makiServer*, gboolean);
 makiUser* maki_server_user (makiServer*);
 
-gchar const* maki_server_support (makiServer*, makiServerSupport);
-void maki_server_set_support (makiServer*, makiServerSupport, gchar const*);
+makiSupport* maki_server_support (makiServer*);
+void maki_server_support_unref (makiServer*, makiSupport*);
+void maki_server_update_support (makiServer*, gchar**);
+
+void maki_server_set_away_notify (makiServer*, gboolean);
+
+GMainContext* maki_server_main_context (makiServer*);
+
+void maki_server_metrics_autojoin (makiServer*, gchar const*);
+void maki_server_metrics_joined (makiServer*, gchar const*);
+void maki_server_metrics_join_failed (makiServer*, gchar const*);
+gint64 maki_server_metrics_time_to_joined (makiServer*);
+gint64 maki_server_metrics_time_to_all_joined (makiServer*);
+guint64 maki_server_metrics_reconnects (makiServer*);
+void maki_server_metrics_connection (makiServer*, sashimiStats*);
+
+gboolean maki_server_cap_available (makiServer*, gchar const*);
+gchar* maki_server_cap_value (makiServer*, gchar const*);
+void maki_server_cap_set_available (makiServer*, gchar const*, gchar const*);
+void maki_server_cap_remove (makiServer*, gchar const*);
+gboolean maki_server_cap_enabled (makiServer*, gchar const*);
+void maki_server_cap_set_enabled (makiServer*, gchar const*, gboolean);
+
+void maki_server_batch_start (makiServer*, gchar const*, gchar const*, gchar const*);
+GHashTable* maki_server_batch_end (makiServer*, gchar const*, gchar**, gchar**);
+gchar* maki_server_batch_type (makiServer*, gchar const*);
+void maki_server_batch_add_nick (makiServer*, gchar const*, gchar const*, gchar const*);
+
+makiServer* maki_server_current (void);
+
+iCaseMapping maki_server_case_mapping (makiServer*);
+void maki_server_set_case_mapping (makiServer*, iCaseMapping);
 
 makiUser* maki_server_add_user (makiServer*, gchar const*);
 makiUser* maki_server_get_user (makiServer*, gchar const*);
-gboolean maki_server_remove_user (makiServer*, gchar const*);
+gboolean maki_server_remove_user (makiServer*, makiUser*);
 gboolean maki_server_rename_user (makiServer*, gchar const*, gchar const*);
 
 void maki_server_add_channel (makiServer*, gchar const*, makiChannel*);
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <ilib.h>
+
+#include "stats.h"
+
+#include "dbus_server.h"
+#include "in.h"
+#include "log.h"
+#include "sashimi.h"
+#include "server.h"
+
+/* Histograms of one thread. Only the owning thread writes to them, so the atomic increments are uncontended.
+ * They outlive their threads, so that the counts of removed servers are kept. */
+typedef struct
+{
+	gint counts[MAKI_STATS_HISTOGRAMS][MAKI_STATS_BUCKETS];
+}
+makiStatsThread;
+
+static GPrivate maki_stats_thread = G_PRIVATE_INIT(NULL);
+
+static GMutex maki_stats_mutex;
+static GSList* maki_stats_threads = NULL;
+
+static
+makiStatsThread*
+maki_stats_thread_get (void)
+{
+	makiStatsThread* thread;
+
+	if (G_UNLIKELY((thread = g_private_get(&maki_stats_thread)) == NULL))
+	{
+		thread = g_new0(makiStatsThread, 1);
+		g_private_set(&maki_stats_thread, thread);
+
+		g_mutex_lock(&maki_stats_mutex);
+		maki_stats_threads = g_slist_prepend(maki_stats_threads, thread);
+		g_mutex_unlock(&maki_stats_mutex);
+	}
+
+	return thread;
+}
+
+/* Records a duration in microseconds. */
+void
+maki_stats_record (guint histogram, gint64 duration)
+{
+	guint bucket = 0;
+	makiStatsThread* thread;
+
+	g_return_if_fail(histogram < MAKI_STATS_HISTOGRAMS);
+
+	thread = maki_stats_thread_get();
+
+	while (bucket < MAKI_STATS_BUCKETS - 1 && duration >= (G_GINT64_CONSTANT(1) << bucket))
+	{
+		bucket++;
+	}
+
+	g_atomic_int_inc(&(thread->counts[histogram][bucket]));
+}
+
+/* Merges the histogram of all threads into counts, which has MAKI_STATS_BUCKETS elements. */
+void
+maki_stats_histogram (guint histogram, guint64* counts)
+{
+	guint i;
+	GSList* link;
+
+	g_return_if_fail(histogram < MAKI_STATS_HISTOGRAMS);
+	g_return_if_fail(counts != NULL);
+
+	for (i = 0; i < MAKI_STATS_BUCKETS; i++)
+	{
+		counts[i] = 0;
+	}
+
+	g_mutex_lock(&maki_stats_mutex);
+
+	for (link = maki_stats_threads; link != NULL; link = link->next)
+	{
+		makiStatsThread* thread = link->data;
+
+		for (i = 0; i < MAKI_STATS_BUCKETS; i++)
+		{
+			counts[i] += (guint)g_atomic_int_get(&(thread->counts[histogram][i]));
+		}
+	}
+
+	g_mutex_unlock(&maki_stats_mutex);
+}
+
+static
+gint
+maki_stats_compare (gconstpointer a, gconstpointer b)
+{
+	gint64 const* x = a;
+	gint64 const* y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* waits has to be sorted. */
+static
+guint64
+maki_stats_percentile (GArray* waits, guint percentile)
+{
+	guint index;
+
+	if (waits->len == 0)
+	{
+		return 0;
+	}
+
+	index = (waits->len * percentile + 99) / 100;
+
+	return g_array_index(waits, gint64, MAX(index, 1) - 1);
+}
+
+static
+GVariant*
+maki_stats_commands (GHashTable* commands)
+{
+	GHashTableIter iter;
+	GVariantBuilder builder;
+	gpointer key, value;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+	g_hash_table_iter_init(&iter, commands);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		g_variant_builder_add(&builder, "{st}", key, *((guint64*)value));
+	}
+
+	return g_variant_builder_end(&builder);
+}
+
+/* Returns a floating (a{sa{st}}a{sa{st}}a{sa{st}}a{sat}a{sa{st}}) holding the counters, inbound and outbound commands of each server,
+ * the latency histograms of the handlers and the emit counters of each signal sent by the D-Bus server. */
+GVariant*
+maki_stats_collect (makiInstance* inst)
+{
+	guint i;
+	gchar const* const* handlers;
+	GHashTableIter iter;
+	GVariantBuilder servers;
+	GVariantBuilder commands_in;
+	GVariantBuilder commands_out;
+	GVariantBuilder histograms;
+	gpointer key, value;
+
+	g_return_val_if_fail(inst != NULL, NULL);
+
+	g_variant_builder_init(&servers, G_VARIANT_TYPE("a{sa{st}}"));
+	g_variant_builder_init(&commands_in, G_VARIANT_TYPE("a{sa{st}}"));
+	g_variant_builder_init(&commands_out, G_VARIANT_TYPE("a{sa{st}}"));
+	g_variant_builder_init(&histograms, G_VARIANT_TYPE("a{sat}"));
+
+	maki_instance_servers_iter(inst, &iter);
+
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		GVariantBuilder counters;
+		sashimiStats stats;
+		makiServer* serv = value;
+		gchar const* name = maki_server_name(serv);
+
+		maki_server_metrics_connection(serv, &stats);
+		g_array_sort(stats.waits, maki_stats_compare);
+
+		g_variant_builder_init(&counters, G_VARIANT_TYPE("a{st}"));
+		g_variant_builder_add(&counters, "{st}", "bytes_in", stats.bytes_in);
+		g_variant_builder_add(&counters, "{st}", "bytes_out", stats.bytes_out);
+		g_variant_builder_add(&counters, "{st}", "lag", (guint64)stats.lag);
+		g_variant_builder_add(&counters, "{st}", "lines_in", stats.lines_in);
+		g_variant_builder_add(&counters, "{st}", "lines_out", stats.lines_out);
+		g_variant_builder_add(&counters, "{st}", "log_bytes", maki_logs_written(maki_instance_logs(inst), name));
+		g_variant_builder_add(&counters, "{st}", "queue", (guint64)stats.queue);
+		g_variant_builder_add(&counters, "{st}", "queue_wait_p50", maki_stats_percentile(stats.waits, 50));
+		g_variant_builder_add(&counters, "{st}", "queue_wait_p90", maki_stats_percentile(stats.waits, 90));
+		g_variant_builder_add(&counters, "{st}", "queue_wait_p99", maki_stats_percentile(stats.waits, 99));
+		g_variant_builder_add(&counters, "{st}", "reconnects", maki_server_metrics_reconnects(serv));
+		g_variant_builder_add(&counters, "{st}", "time_to_all_joined", (guint64)maki_server_metrics_time_to_all_joined(serv));
+		g_variant_builder_add(&counters, "{st}", "time_to_joined", (guint64)maki_server_metrics_time_to_joined(serv));
+
+		g_variant_builder_add(&servers, "{s@a{st}}", name, g_variant_builder_end(&counters));
+		g_variant_builder_add(&commands_in, "{s@a{st}}", name, maki_stats_commands(stats.commands_in));
+		g_variant_builder_add(&commands_out, "{s@a{st}}", name, maki_stats_commands(stats.commands_out));
+
+		sashimi_stats_clear(&stats);
+	}
+
+	handlers = maki_in_handlers();
+
+	for (i = 0; handlers[i] != NULL; i++)
+	{
+		guint64 counts[MAKI_STATS_BUCKETS];
+
+		maki_stats_histogram(i, counts);
+		g_variant_builder_add(&histograms, "{s@at}", handlers[i], g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, counts, MAKI_STATS_BUCKETS, sizeof(guint64)));
+	}
+
+	return g_variant_new("(a{sa{st}}a{sa{st}}a{sa{st}}a{sat}@a{sa{st}})", &servers, &commands_in, &commands_out, &histograms, maki_dbus_server_signal_stats(dbus_server));
+}
+
+/* Adds one group per server, named after the prefix and the server. */
+static
+void
+maki_stats_dump_servers (GKeyFile* key_file, gchar const* prefix, GVariant* servers)
+{
+	GVariantIter iter;
+	gchar const* name;
+	GVariant* counters;
+
+	g_variant_iter_init(&iter, servers);
+
+	while (g_variant_iter_loop(&iter, "{&s@a{st}}", &name, &counters))
+	{
+		GVariantIter counter_iter;
+		gchar const* key;
+		guint64 value;
+		gchar* group;
+
+		group = g_strconcat(prefix, " ", name, NULL);
+		g_variant_iter_init(&counter_iter, counters);
+
+		while (g_variant_iter_next(&counter_iter, "{&st}", &key, &value))
+		{
+			g_key_file_set_uint64(key_file, group, key, value);
+		}
+
+		g_free(group);
+	}
+}
+
+/* Writes the statistics to path as a key file. */
+gboolean
+maki_stats_dump (makiInstance* inst, gchar const* path)
+{
+	gboolean ret;
+	GKeyFile* key_file;
+	GVariant* stats;
+	GVariant* child;
+	GVariantIter iter;
+	gchar const* name;
+	GVariant* histogram;
+
+	g_return_val_if_fail(inst != NULL, FALSE);
+	g_return_val_if_fail(path != NULL, FALSE);
+
+	stats = g_variant_ref_sink(maki_stats_collect(inst));
+	key_file = g_key_file_new();
+
+	child = g_variant_get_child_value(stats, 0);
+	maki_stats_dump_servers(key_file, "server", child);
+	g_variant_unref(child);
+
+	child = g_variant_get_child_value(stats, 1);
+	maki_stats_dump_servers(key_file, "commands_in", child);
+	g_variant_unref(child);
+
+	child = g_variant_get_child_value(stats, 2);
+	maki_stats_dump_servers(key_file, "commands_out", child);
+	g_variant_unref(child);
+
+	child = g_variant_get_child_value(stats, 3);
+	g_variant_iter_init(&iter, child);
+
+	while (g_variant_iter_loop(&iter, "{&s@at}", &name, &histogram))
+	{
+		guint i;
+		gsize length;
+		guint64 const* counts;
+		gchar** list;
+
+		counts = g_variant_get_fixed_array(histogram, &length, sizeof(guint64));
+		list = g_new(gchar*, length + 1);
+
+		for (i = 0; i < length; i++)
+		{
+			list[i] = g_strdup_printf("%" G_GUINT64_FORMAT, counts[i]);
+		}
+
+		list[length] = NULL;
+
+		g_key_file_set_string_list(key_file, "handlers", name, (gchar const* const*)list, length);
+		g_strfreev(list);
+	}
+
+	g_variant_unref(child);
+
+	child = g_variant_get_child_value(stats, 4);
+	maki_stats_dump_servers(key_file, "signal", child);
+	g_variant_unref(child);
+
+	ret = i_key_file_to_file(key_file, path, NULL, NULL);
+
+	g_key_file_free(key_file);
+	g_variant_unref(stats);
+
+	return ret;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "support.h"
+
+/* Tables are never modified once they have been built.
+ * Servers publish a new table atomically whenever ISUPPORT changes,
+ * so classifying modes and targets only needs a table lookup. */
+struct maki_support
+{
+	/* Maps token names to their values, "" if a token has no value. */
+	GHashTable* tokens;
+
+	gchar* chanmodes;
+	gchar* chantypes;
+
+	struct
+	{
+		gchar* modes;
+		gchar* prefixes;
+		gint length;
+	}
+	prefix;
+
+	/* Lookup tables indexed by character. */
+	guchar modes[256];
+	gint8 mode_ranks[256];
+	gint8 prefix_ranks[256];
+	guchar is_chantype[256];
+};
+
+/* Values may contain \xHH escapes. */
+static
+gchar*
+maki_support_unescape (gchar const* value)
+{
+	gchar* ret;
+	gchar* p;
+
+	ret = g_new(gchar, strlen(value) + 1);
+
+	for (p = ret; *value != '\0'; value++)
+	{
+		if (value[0] == '\\' && value[1] == 'x' && g_ascii_isxdigit(value[2]) && g_ascii_isxdigit(value[3]))
+		{
+			*p++ = (g_ascii_xdigit_value(value[2]) << 4) | g_ascii_xdigit_value(value[3]);
+			value += 3;
+		}
+		else
+		{
+			*p++ = *value;
+		}
+	}
+
+	*p = '\0';
+
+	return ret;
+}
+
+static
+void
+maki_support_parse_prefix (makiSupport* support, gchar const* value)
+{
+	gchar const* paren;
+
+	/* (modes)prefixes */
+	if (value[0] == '(' && (paren = strchr(value, ')')) != NULL)
+	{
+		support->prefix.modes = g_strndup(value + 1, paren - value - 1);
+		support->prefix.prefixes = g_strdup(paren + 1);
+	}
+	else if (value[0] == '\0')
+	{
+		support->prefix.modes = g_strdup("");
+		support->prefix.prefixes = g_strdup("");
+	}
+	else
+	{
+		support->prefix.modes = g_strdup("ov");
+		support->prefix.prefixes = g_strdup("@+");
+	}
+}
+
+static
+void
+maki_support_build (makiSupport* support)
+{
+	gchar const* value;
+	guint type;
+	gint i;
+
+	value = g_hash_table_lookup(support->tokens, "CHANMODES");
+	support->chanmodes = g_strdup((value != NULL) ? value : "");
+
+	value = g_hash_table_lookup(support->tokens, "CHANTYPES");
+	support->chantypes = g_strdup((value != NULL) ? value : "#&");
+
+	value = g_hash_table_lookup(support->tokens, "PREFIX");
+	maki_support_parse_prefix(support, (value != NULL) ? value : "(ov)@+");
+
+	support->prefix.length = MIN(strlen(support->prefix.modes), strlen(support->prefix.prefixes));
+	support->prefix.length = MIN(support->prefix.length, G_MAXINT8);
+	support->prefix.prefixes[support->prefix.length] = '\0';
+	support->prefix.modes[support->prefix.length] = '\0';
+
+	memset(support->modes, MAKI_SUPPORT_MODE_NONE, sizeof(support->modes));
+	memset(support->mode_ranks, -1, sizeof(support->mode_ranks));
+	memset(support->prefix_ranks, -1, sizeof(support->prefix_ranks));
+	memset(support->is_chantype, FALSE, sizeof(support->is_chantype));
+
+	/* CHANMODES=A,B,C,D */
+	for (value = support->chanmodes, type = 0; *value != '\0' && type < 4; value++)
+	{
+		if (*value == ',')
+		{
+			type++;
+			continue;
+		}
+
+		support->modes[(guchar)*value] = MAKI_SUPPORT_MODE_A + type;
+	}
+
+	for (i = 0; i < support->prefix.length; i++)
+	{
+		support->modes[(guchar)support->prefix.modes[i]] = MAKI_SUPPORT_MODE_PREFIX;
+		support->mode_ranks[(guchar)support->prefix.modes[i]] = i;
+		support->prefix_ranks[(guchar)support->prefix.prefixes[i]] = i;
+	}
+
+	for (value = support->chantypes; *value != '\0'; value++)
+	{
+		support->is_chantype[(guchar)*value] = TRUE;
+	}
+}
+
+/* Creates a new table from base, applying the given ISUPPORT tokens.
+ * Tokens of the form -NAME remove a previously announced token. */
+makiSupport*
+maki_support_new (makiSupport const* base, gchar** tokens)
+{
+	makiSupport* support;
+
+	support = g_new(makiSupport, 1);
+	support->tokens = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (base != NULL)
+	{
+		GHashTableIter iter;
+		gpointer key, value;
+
+		g_hash_table_iter_init(&iter, base->tokens);
+
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			g_hash_table_insert(support->tokens, g_strdup(key), g_strdup(value));
+		}
+	}
+
+	if (tokens != NULL)
+	{
+		guint i;
+
+		for (i = 0; tokens[i] != NULL; i++)
+		{
+			gchar* equals;
+
+			if (tokens[i][0] == '\0')
+			{
+				continue;
+			}
+
+			if (tokens[i][0] == '-')
+			{
+				g_hash_table_remove(support->tokens, tokens[i] + 1);
+				continue;
+			}
+
+			if ((equals = strchr(tokens[i], '=')) != NULL)
+			{
+				g_hash_table_insert(support->tokens, g_strndup(tokens[i], equals - tokens[i]), maki_support_unescape(equals + 1));
+			}
+			else
+			{
+				g_hash_table_insert(support->tokens, g_strdup(tokens[i]), g_strdup(""));
+			}
+		}
+	}
+
+	maki_support_build(support);
+
+	return support;
+}
+
+void
+maki_support_free (gpointer data)
+{
+	makiSupport* support = data;
+
+	g_free(support->prefix.prefixes);
+	g_free(support->prefix.modes);
+	g_free(support->chantypes);
+	g_free(support->chanmodes);
+	g_hash_table_destroy(support->tokens);
+
+	g_free(support);
+}
+
+/* Returns the value of the given token, "" if it has none and NULL if it was not announced. */
+gchar const*
+maki_support_get (makiSupport const* support, gchar const* name)
+{
+	g_return_val_if_fail(support != NULL, NULL);
+	g_return_val_if_fail(name != NULL, NULL);
+
+	return g_hash_table_lookup(support->tokens, name);
+}
+
+void
+maki_support_tokens (makiSupport const* support, gchar*** names, gchar*** values)
+{
+	GList* keys;
+	GList* l;
+	guint i;
+	guint length;
+
+	g_return_if_fail(support != NULL);
+
+	keys = g_list_sort(g_hash_table_get_keys(support->tokens), (GCompareFunc)strcmp);
+	length = g_hash_table_size(support->tokens);
+
+	*names = g_new(gchar*, length + 1);
+	*values = g_new(gchar*, length + 1);
+
+	for (l = keys, i = 0; l != NULL; l = l->next, i++)
+	{
+		(*names)[i] = g_strdup(l->data);
+		(*values)[i] = g_strdup(g_hash_table_lookup(support->tokens, l->data));
+	}
+
+	(*names)[i] = NULL;
+	(*values)[i] = NULL;
+
+	g_list_free(keys);
+}
+
+gchar const*
+maki_support_chanmodes (makiSupport const* support)
+{
+	return support->chanmodes;
+}
+
+gchar const*
+maki_support_chantypes (makiSupport const* support)
+{
+	return support->chantypes;
+}
+
+gchar const*
+maki_support_prefix_modes (makiSupport const* support)
+{
+	return support->prefix.modes;
+}
+
+gchar const*
+maki_support_prefix_prefixes (makiSupport const* support)
+{
+	return support->prefix.prefixes;
+}
+
+makiSupportMode
+maki_support_mode (makiSupport const* support, gchar mode)
+{
+	return support->modes[(guchar)mode];
+}
+
+gboolean
+maki_support_mode_has_parameter (makiSupport const* support, gchar sign, gchar mode)
+{
+	switch ((makiSupportMode)support->modes[(guchar)mode])
+	{
+		case MAKI_SUPPORT_MODE_A:
+		case MAKI_SUPPORT_MODE_B:
+		case MAKI_SUPPORT_MODE_PREFIX:
+			return TRUE;
+		case MAKI_SUPPORT_MODE_C:
+			return (sign == '+');
+		case MAKI_SUPPORT_MODE_D:
+		case MAKI_SUPPORT_MODE_NONE:
+		default:
+			return FALSE;
+	}
+}
+
+/* Returns the rank of a prefix mode like o, -1 if it is none. */
+gint
+maki_support_mode_rank (makiSupport const* support, gchar mode)
+{
+	return support->mode_ranks[(guchar)mode];
+}
+
+/* Returns the rank of a prefix like @, -1 if it is none. */
+gint
+maki_support_prefix_rank (makiSupport const* support, gchar prefix)
+{
+	return support->prefix_ranks[(guchar)prefix];
+}
+
+gchar
+maki_support_prefix (makiSupport const* support, gint rank)
+{
+	if (rank < 0 || rank >= support->prefix.length)
+	{
+		return '\0';
+	}
+
+	return support->prefix.prefixes[rank];
+}
+
+gboolean
+maki_support_is_channel (makiSupport const* support, gchar const* target)
+{
+	return support->is_chantype[(guchar)target[0]];
+}
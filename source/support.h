@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef H_SUPPORT
+#define H_SUPPORT
+
+struct maki_support;
+
+typedef struct maki_support makiSupport;
+
+enum makiSupportMode
+{
+	MAKI_SUPPORT_MODE_NONE,
+	/* Modes that add or remove an address to or from a list. */
+	MAKI_SUPPORT_MODE_A,
+	/* Modes that always have a parameter. */
+	MAKI_SUPPORT_MODE_B,
+	/* Modes that only have a parameter when set. */
+	MAKI_SUPPORT_MODE_C,
+	/* Modes that never have a parameter. */
+	MAKI_SUPPORT_MODE_D,
+	/* Modes that give a channel prefix to a nick. */
+	MAKI_SUPPORT_MODE_PREFIX
+};
+
+typedef enum makiSupportMode makiSupportMode;
+
+#include <glib.h>
+
+makiSupport* maki_support_new (makiSupport const*, gchar**);
+void maki_support_free (gpointer);
+
+gchar const* maki_support_get (makiSupport const*, gchar const*);
+void maki_support_tokens (makiSupport const*, gchar***, gchar***);
+
+gchar const* maki_support_chanmodes (makiSupport const*);
+gchar const* maki_support_chantypes (makiSupport const*);
+gchar const* maki_support_prefix_modes (makiSupport const*);
+gchar const* maki_support_prefix_prefixes (makiSupport const*);
+
+makiSupportMode maki_support_mode (makiSupport const*, gchar);
+gboolean maki_support_mode_has_parameter (makiSupport const*, gchar, gchar);
+gint maki_support_mode_rank (makiSupport const*, gchar);
+gint maki_support_prefix_rank (makiSupport const*, gchar);
+gchar maki_support_prefix (makiSupport const*, gint);
+gboolean maki_support_is_channel (makiSupport const*, gchar const*);
+
+#endif
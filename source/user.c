@@ -43,6 +43,7 @@ struct maki_user
 	gchar* host;
 	gboolean away;
 	gchar* away_message;
+	gchar* account;
 
 	guint ref_count;
 };
@@ -75,6 +76,7 @@ maki_user_new (gchar const* nick)
 	user->host = NULL;
 	user->away = FALSE;
 	user->away_message = NULL;
+	user->account = NULL;
 
 	user->ref_count = 1;
 
@@ -105,6 +107,7 @@ maki_user_unref (gpointer value)
 		g_free(user->user);
 		g_free(user->host);
 		g_free(user->away_message);
+		g_free(user->account);
 		g_free(user);
 	}
 }
@@ -175,3 +178,17 @@ maki_user_set_away_message (makiUser* user, gchar const* away_message)
 	g_free(user->away_message);
 	user->away_message = g_strdup(away_message);
 }
+
+gchar const*
+maki_user_account (makiUser* user)
+{
+	return user->account;
+}
+
+/* Account names are known with account-notify and extended-join. "*" means that the user is not logged in. */
+void
+maki_user_set_account (makiUser* user, gchar const* account)
+{
+	g_free(user->account);
+	user->account = (account != NULL && g_strcmp0(account, "*") != 0) ? g_strdup(account) : NULL;
+}
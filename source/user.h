@@ -51,5 +51,7 @@ gboolean maki_user_away (makiUser*);
 void maki_user_set_away (makiUser*, gboolean);
 gchar const* maki_user_away_message (makiUser*);
 void maki_user_set_away_message (makiUser*, gchar const*);
+gchar const* maki_user_account (makiUser*);
+void maki_user_set_account (makiUser*, gchar const*);
 
 #endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Compares the casemapping hash and equal functions against the ones they replaced,
+ * g_ascii_strdown() plus g_str_hash() and g_ascii_strcasecmp().
+ *
+ * Usage: case-benchmark [nicks] [rounds]
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ilib.h"
+
+static
+gboolean
+old_str_case_equal (gconstpointer v1, gconstpointer v2)
+{
+	return (g_ascii_strcasecmp(v1, v2) == 0);
+}
+
+static
+guint
+old_str_case_hash (gconstpointer key)
+{
+	guint ret;
+	gchar* tmp;
+
+	tmp = g_ascii_strdown(key, -1);
+	ret = g_str_hash(tmp);
+	g_free(tmp);
+
+	return ret;
+}
+
+/* Nicks of typical lengths, using all characters the casemappings fold. */
+static
+gchar**
+nicks_new (GRand* rand, guint count, gboolean upper)
+{
+	gchar const* chars = "abcdefghijklmnopqrstuvwxyz0123456789[]\\^_-`{}|~";
+	gchar** ret;
+	guint i;
+
+	ret = g_new(gchar*, count + 1);
+
+	for (i = 0; i < count; i++)
+	{
+		guint j;
+		guint length;
+
+		length = g_rand_int_range(rand, 3, 17);
+		ret[i] = g_malloc(length + 1);
+
+		for (j = 0; j < length; j++)
+		{
+			ret[i][j] = chars[g_rand_int_range(rand, 0, strlen(chars))];
+
+			if (upper && g_rand_boolean(rand))
+			{
+				ret[i][j] = g_ascii_toupper(ret[i][j]);
+			}
+		}
+
+		ret[i][length] = '\0';
+	}
+
+	ret[count] = NULL;
+
+	return ret;
+}
+
+static
+void
+benchmark (gchar const* name, GHashFunc hash_func, GEqualFunc equal_func, gchar** nicks, gchar** lookups, guint rounds)
+{
+	GHashTable* table;
+	gint64 start;
+	gint64 duration;
+	guint found = 0;
+	guint i;
+	guint j;
+	guint count;
+
+	count = g_strv_length(nicks);
+	table = g_hash_table_new(hash_func, equal_func);
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < count; i++)
+	{
+		g_hash_table_insert(table, nicks[i], nicks[i]);
+	}
+
+	duration = g_get_monotonic_time() - start;
+	g_print("%-20s insert %8.1f ns/op\n", name, (gdouble)duration * 1000.0 / count);
+
+	start = g_get_monotonic_time();
+
+	for (j = 0; j < rounds; j++)
+	{
+		for (i = 0; lookups[i] != NULL; i++)
+		{
+			if (g_hash_table_lookup(table, lookups[i]) != NULL)
+			{
+				found++;
+			}
+		}
+	}
+
+	duration = g_get_monotonic_time() - start;
+	g_print("%-20s lookup %8.1f ns/op (%u found)\n", name, (gdouble)duration * 1000.0 / ((gdouble)rounds * count), found / rounds);
+
+	start = g_get_monotonic_time();
+	found = 0;
+
+	for (j = 0; j < rounds; j++)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (equal_func(nicks[i], lookups[i]))
+			{
+				found++;
+			}
+		}
+	}
+
+	duration = g_get_monotonic_time() - start;
+	g_print("%-20s equal  %8.1f ns/op (%u equal)\n", name, (gdouble)duration * 1000.0 / ((gdouble)rounds * count), found / rounds);
+
+	g_hash_table_destroy(table);
+}
+
+int
+main (int argc, char** argv)
+{
+	GRand* rand;
+	gchar** nicks;
+	gchar** lookups;
+	guint count = 10000;
+	guint rounds = 100;
+	guint i;
+
+	if (argc > 1)
+	{
+		count = strtoul(argv[1], NULL, 10);
+	}
+
+	if (argc > 2)
+	{
+		rounds = strtoul(argv[2], NULL, 10);
+	}
+
+	if (count == 0 || rounds == 0)
+	{
+		g_printerr("Usage: %s [nicks] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	rand = g_rand_new_with_seed(42);
+	nicks = nicks_new(rand, count, FALSE);
+
+	/* Half of the lookups differ from the stored nicks only by case, the other half are unrelated. */
+	lookups = nicks_new(rand, count, TRUE);
+
+	for (i = 0; i < count; i += 2)
+	{
+		guint j;
+
+		g_free(lookups[i]);
+		lookups[i] = g_strdup(nicks[i]);
+
+		for (j = 0; lookups[i][j] != '\0'; j++)
+		{
+			lookups[i][j] = g_ascii_toupper(lookups[i][j]);
+		}
+	}
+
+	benchmark("old", old_str_case_hash, old_str_case_equal, nicks, lookups, rounds);
+	benchmark("ascii", i_ascii_str_case_hash, i_ascii_str_case_equal, nicks, lookups, rounds);
+	benchmark("rfc1459", i_rfc1459_str_case_hash, i_rfc1459_str_case_equal, nicks, lookups, rounds);
+	benchmark("strict-rfc1459", i_strict_rfc1459_str_case_hash, i_strict_rfc1459_str_case_equal, nicks, lookups, rounds);
+
+	g_strfreev(lookups);
+	g_strfreev(nicks);
+	g_rand_free(rand);
+
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2008-2012 Michael Kuhn
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measures the throughput and CPU time of the ways outgoing DCC transfers read their file,
+ * sending it to a receiver on the loopback interface:
+ * read, the old path reading 1 KiB at a time and writing it through a buffered channel,
+ * sendfile, sending chunks straight from the file like maki_dcc_send_out_send(),
+ * and mmap, its fallback writing from 8 MiB mappings.
+ *
+ * Usage: dcc-benchmark file [megabytes]
+ * The file is created with the given size (default 1024) if it does not exist.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+enum
+{
+	s_read_buffer = 1024,
+	s_chunk = 1024 * 1024,
+	s_map = 8 * 1024 * 1024
+};
+
+struct benchmark_receiver
+{
+	gint fd;
+	goffset received;
+	gdouble cpu;
+};
+
+typedef struct benchmark_receiver BenchmarkReceiver;
+
+typedef gboolean (*BenchmarkSendFunc) (gint, gint, goffset);
+
+static
+gdouble
+benchmark_cpu (void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_THREAD, &usage);
+
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+static
+gpointer
+benchmark_receive (gpointer data)
+{
+	BenchmarkReceiver* receiver = data;
+	gchar* buffer;
+	gssize bytes_read;
+	gdouble start;
+
+	buffer = g_malloc(s_chunk);
+	start = benchmark_cpu();
+
+	while ((bytes_read = read(receiver->fd, buffer, s_chunk)) > 0)
+	{
+		receiver->received += bytes_read;
+	}
+
+	receiver->cpu = benchmark_cpu() - start;
+
+	g_free(buffer);
+
+	return NULL;
+}
+
+static
+gboolean
+benchmark_send_read (gint fd, gint file_fd, goffset size)
+{
+	GIOChannel* channel;
+	gchar buffer[s_read_buffer];
+	gboolean ret = TRUE;
+	gssize bytes_read;
+
+	channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+
+	while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0)
+	{
+		gsize bytes_written;
+
+		if (g_io_channel_write_chars(channel, buffer, bytes_read, &bytes_written, NULL) != G_IO_STATUS_NORMAL
+		    || g_io_channel_flush(channel, NULL) != G_IO_STATUS_NORMAL)
+		{
+			ret = FALSE;
+			break;
+		}
+	}
+
+	g_io_channel_unref(channel);
+
+	return (ret && bytes_read == 0);
+}
+
+static
+gboolean
+benchmark_send_sendfile (gint fd, gint file_fd, goffset size)
+{
+#ifdef HAVE_SENDFILE
+	off_t offset = 0;
+
+	while (offset < size)
+	{
+		if (sendfile(fd, file_fd, &offset, MIN(s_chunk, size - offset)) <= 0)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+static
+gboolean
+benchmark_send_mmap (gint fd, gint file_fd, goffset size)
+{
+	goffset offset;
+
+	for (offset = 0; offset < size; offset += s_map)
+	{
+		gsize length;
+		gsize written = 0;
+		gchar* data;
+
+		length = MIN(s_map, size - offset);
+
+		if ((data = mmap(NULL, length, PROT_READ, MAP_SHARED, file_fd, offset)) == MAP_FAILED)
+		{
+			return FALSE;
+		}
+
+		while (written < length)
+		{
+			gssize bytes_written;
+
+			if ((bytes_written = write(fd, data + written, MIN(s_chunk, length - written))) < 0)
+			{
+				munmap(data, length);
+				return FALSE;
+			}
+
+			written += bytes_written;
+		}
+
+		munmap(data, length);
+	}
+
+	return TRUE;
+}
+
+/* Connects a socket pair over the loopback interface, like a DCC transfer between two local clients. */
+static
+gboolean
+benchmark_connect (gint* sender, gint* receiver)
+{
+	gint listener;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		return FALSE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0
+	    || listen(listener, 1) != 0
+	    || getsockname(listener, (struct sockaddr*)&addr, &addrlen) != 0
+	    || (*sender = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		close(listener);
+		return FALSE;
+	}
+
+	if (connect(*sender, (struct sockaddr*)&addr, sizeof(addr)) != 0
+	    || (*receiver = accept(listener, NULL, NULL)) < 0)
+	{
+		close(*sender);
+		close(listener);
+		return FALSE;
+	}
+
+	close(listener);
+
+	return TRUE;
+}
+
+static
+void
+benchmark (gchar const* name, BenchmarkSendFunc send_func, gchar const* path, goffset size)
+{
+	BenchmarkReceiver receiver;
+	GThread* thread;
+	gint sender;
+	gint file_fd;
+	gint64 start;
+	gdouble duration;
+	gdouble cpu;
+	gdouble gigabytes;
+	gboolean ret;
+
+	if ((file_fd = open(path, O_RDONLY)) < 0)
+	{
+		g_printerr("%s: %s\n", path, g_strerror(errno));
+		return;
+	}
+
+	/* Every path starts with the file in the page cache. */
+	posix_fadvise(file_fd, 0, size, POSIX_FADV_WILLNEED);
+
+	if (!benchmark_connect(&sender, &(receiver.fd)))
+	{
+		g_printerr("%s: %s\n", name, g_strerror(errno));
+		close(file_fd);
+		return;
+	}
+
+	receiver.received = 0;
+	receiver.cpu = 0;
+	thread = g_thread_new("receiver", benchmark_receive, &receiver);
+
+	start = g_get_monotonic_time();
+	cpu = benchmark_cpu();
+
+	ret = send_func(sender, file_fd, size);
+
+	cpu = benchmark_cpu() - cpu;
+	close(sender);
+
+	g_thread_join(thread);
+	duration = (g_get_monotonic_time() - start) / 1000000.0;
+
+	close(receiver.fd);
+	close(file_fd);
+
+	if (!ret || receiver.received != size)
+	{
+		g_printerr("%-10s failed after %" G_GINT64_FORMAT " bytes\n", name, (gint64)receiver.received);
+		return;
+	}
+
+	gigabytes = (gdouble)size / (1024 * 1024 * 1024);
+
+	g_print("%-10s %8.1f MiB/s, sender %6.3f s CPU/GiB, receiver %6.3f s CPU/GiB\n", name, size / duration / (1024 * 1024), cpu / gigabytes, receiver.cpu / gigabytes);
+}
+
+static
+gboolean
+benchmark_create (gchar const* path, goffset size)
+{
+	gint fd;
+	gchar* buffer;
+	goffset written = 0;
+	gboolean ret = TRUE;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+	{
+		return (errno == EEXIST);
+	}
+
+	buffer = g_malloc(s_chunk);
+	memset(buffer, 'x', s_chunk);
+
+	while (written < size)
+	{
+		gssize bytes_written;
+
+		if ((bytes_written = write(fd, buffer, MIN(s_chunk, size - written))) < 0)
+		{
+			ret = FALSE;
+			break;
+		}
+
+		written += bytes_written;
+	}
+
+	g_free(buffer);
+	close(fd);
+
+	return ret;
+}
+
+int
+main (int argc, char** argv)
+{
+	struct stat stbuf;
+	goffset size = 1024;
+
+	if (argc < 2)
+	{
+		g_printerr("Usage: %s file [megabytes]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 2)
+	{
+		size = g_ascii_strtoll(argv[2], NULL, 10);
+	}
+
+	if (!benchmark_create(argv[1], size * 1024 * 1024) || stat(argv[1], &stbuf) != 0 || stbuf.st_size == 0)
+	{
+		g_printerr("%s: %s\n", argv[1], g_strerror(errno));
+		return 1;
+	}
+
+	benchmark("read", benchmark_send_read, argv[1], stbuf.st_size);
+#ifdef HAVE_SENDFILE
+	benchmark("sendfile", benchmark_send_sendfile, argv[1], stbuf.st_size);
+#endif
+	benchmark("mmap", benchmark_send_mmap, argv[1], stbuf.st_size);
+
+	return 0;
+}